@@ -18,6 +18,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -109,9 +110,11 @@ int openMusicFile(const std::string& strFilename,
 	stream::file content(strFilename, false);
 	gm::MusicManager::handler_t pMusicType;
 	if (strType.empty()) {
-		// Need to autodetect the file format.
-		for (const auto& i : gm::MusicManager::formats()) {
-			gm::MusicType::Certainty cert = i->isInstance(content);
+		// Need to autodetect the file format.  List every match, as a definite
+		// one may be skipped below if its supplemental files are missing.
+		for (const auto& m : gm::detectFormat(content, strFilename, true)) {
+			const auto& i = m.type;
+			gm::MusicType::Certainty cert = m.certainty;
 			switch (cert) {
 
 				case gm::MusicType::Certainty::DefinitelyNo:
@@ -121,51 +124,50 @@ int openMusicFile(const std::string& strFilename,
 				case gm::MusicType::Certainty::Unsure:
 					std::cout << "File could be: " << i->friendlyName()
 						<< " [" << i->code() << "]" << std::endl;
-					// If we haven't found a match already, use this one
-					if (!pMusicType) pMusicType = i;
 					break;
 
 				case gm::MusicType::Certainty::PossiblyYes:
 					std::cout << "File is likely to be: " << i->friendlyName()
 						<< " [" << i->code() << "]" << std::endl;
-					// Take this one as it's better than an uncertain match
-					pMusicType = i;
 					break;
 
 				case gm::MusicType::Certainty::DefinitelyYes:
 					std::cout << "File is definitely: " << i->friendlyName()
 						<< " [" << i->code() << "]" << std::endl;
-					pMusicType = i;
-					// Don't bother checking any other formats if we got a 100% match
-					goto finishTesting;
+					break;
 			}
-			if (cert != gm::MusicType::Certainty::DefinitelyNo) {
-				// We got a possible match, see if it requires any suppdata
-				auto suppList = i->getRequiredSupps(content, strFilename);
-				if (suppList.size() > 0) {
-					// It has suppdata, see if it's present
-					std::cout << "  * This format requires supplemental files..."
-						<< std::endl;
-					bool bSuppOK = true;
-					for (const auto& s : suppList) {
-						try {
-							stream::file test_presence(s.second, false);
-						} catch (const stream::open_error&) {
-							bSuppOK = false;
-							std::cout << "  * Could not find/open " << s.second
-								<< ", format is probably not " << i->code() << std::endl;
-							break;
-						}
-					}
-					if (bSuppOK) {
-						// All supp files opened ok
-						std::cout << "  * All supp files present, archive is likely "
-							<< i->code() << std::endl;
-						// Set this as the most likely format
-						pMusicType = i;
+			if (cert == gm::MusicType::Certainty::DefinitelyNo) continue;
+
+			// We got a possible match, see if it requires any suppdata
+			bool bSuppOK = true;
+			auto suppList = i->getRequiredSupps(content, strFilename);
+			if (suppList.size() > 0) {
+				// It has suppdata, see if it's present
+				std::cout << "  * This format requires supplemental files..."
+					<< std::endl;
+				for (const auto& s : suppList) {
+					try {
+						stream::file test_presence(s.second, false);
+					} catch (const stream::open_error&) {
+						bSuppOK = false;
+						std::cout << "  * Could not find/open " << s.second
+							<< ", format is probably not " << i->code() << std::endl;
+						break;
 					}
 				}
+				if (bSuppOK) {
+					// All supp files opened ok
+					std::cout << "  * All supp files present, archive is likely "
+						<< i->code() << std::endl;
+				}
 			}
+			if (!bSuppOK) continue;
+
+			// Matches are sorted best first, so keep the first usable one
+			if (!pMusicType) pMusicType = i;
+
+			// Don't bother checking any other formats if we got a 100% match
+			if (cert == gm::MusicType::Certainty::DefinitelyYes) goto finishTesting;
 		}
 finishTesting:
 		if (!pMusicType) {
@@ -441,6 +443,12 @@ int play(std::shared_ptr<gm::Music> music,
 				}
 			}
 
+			// Print anything the audio thread has found wrong with the song
+			std::string warning;
+			while (playback.getWarning(&warning)) {
+				std::cerr << "\n" << warning << std::endl;
+			}
+
 			if (audiblePos != lastAudiblePos) {
 				// The position being played out of the speakers has just changed
 				long pattern = -1;
@@ -500,10 +508,14 @@ int play(std::shared_ptr<gm::Music> music,
  *
  * @param extraTime
  *   Number of seconds to linger after song finishes, to let notes fade out.
+ *
+ * @param threads
+ *   Number of threads to split the song across.  0 or 1 renders on a single
+ *   thread and shows progress as it goes.
  */
 int render(stream::output& wav, std::shared_ptr<gm::Music> music,
 	std::shared_ptr<gm::PatchBank> bankMIDI, unsigned int loopCount,
-	unsigned int extraTime)
+	unsigned int extraTime, unsigned int threads)
 {
 	if (loopCount == 0) {
 		std::cerr << "Can't loop forever when writing to .wav or you will run out "
@@ -511,56 +523,29 @@ int render(stream::output& wav, std::shared_ptr<gm::Music> music,
 		return RET_BADARGS;
 	}
 
-	unsigned int numChannels = NUM_CHANNELS;
-	unsigned int bitDepth = 16;
-	unsigned int sampleRate = 48000;
-	gm::Playback playback(sampleRate, numChannels, bitDepth);
-	playback.setBankMIDI(bankMIDI);
-	playback.setSong(music);
-	playback.setLoopCount(loopCount);
-
-	// Make room for the header, will rewrite later
-#define WAVE_FMT_SIZE (2+2+4+4+2+2)
-#define WAVE_HEADER_SIZE (4+4+4+4+4+WAVE_FMT_SIZE+4+4)
-	wav
-		<< "RIFF"
-		<< u32le(0) // overwritten later
-		<< "WAVEfmt "
-		<< u32le(WAVE_FMT_SIZE)
-		<< u16le(1) // PCM
-		<< u16le(numChannels)
-		<< u32le(sampleRate)
-		<< u32le(sampleRate * numChannels * bitDepth / 8)
-		<< u16le(numChannels * bitDepth / 8)
-		<< u16le(bitDepth)
-		<< "data"
-		<< u32le(0) // overwritten later
-	;
-
-	const unsigned long lenBuffer = FRAMES_TO_BUFFER * NUM_CHANNELS;
-	std::vector<int16_t> output(lenBuffer);
-	const unsigned long lenBufferBytes = lenBuffer * 2;
-
-	std::cout << "Writing WAV at " << sampleRate << "Hz, " << bitDepth << "-bit, "
-		<< (numChannels == 1 ? "mono" : "stereo")
+	std::cout << "Writing WAV at " << gm::RENDER_SAMPLE_RATE << "Hz, 16-bit, "
+		<< (NUM_CHANNELS == 1 ? "mono" : "stereo")
 		<< "\nExtra time: " << extraTime << " seconds, loop: ";
 	if (loopCount == 1) std::cout << "off"; else std::cout << loopCount - 1;
 	std::cout << std::endl;
 
-	gm::Playback::Position pos, lastPos;
+	std::vector<std::string> warnings;
+	if (threads > 1) {
+		std::cout << "Rendering on " << threads << " threads..." << std::flush;
+		gm::renderWAVParallel(wav, music, bankMIDI, loopCount, extraTime,
+			threads, 1, &warnings);
+		std::cout << " done" << std::endl;
+		for (const auto& w : warnings) std::cerr << w << std::endl;
+		return RET_OK;
+	}
+
+	gm::Playback::Position lastPos;
 	lastPos.end = true;
-	pos.end = false;
 	unsigned int numOrders = music->patternOrder.size();
-	while (!pos.end) {
-		memset(output.data(), 0, lenBufferBytes);
-		playback.mix(output.data(), lenBuffer, &pos);
+	gm::renderWAV(wav, music, bankMIDI, loopCount, extraTime,
+		[&](const gm::Playback::Position& pos) {
+			if (lastPos == pos) return;
 
-		// Make sure samples are little-endian
-		for (unsigned int i = 0; i < lenBuffer; i++) output[i] = htole16(output[i]);
-
-		wav.write((uint8_t *)output.data(), lenBuffer * sizeof(int16_t));
-
-		if (pos != lastPos) {
 			long pattern = -1;
 			if (pos.order < numOrders) {
 				pattern = music->patternOrder[pos.order];
@@ -582,33 +567,106 @@ int render(stream::output& wav, std::shared_ptr<gm::Music> music,
 				<< " Progress: " << progress
 				<< "%    \r" << std::flush;
 			lastPos = pos;
-		}
-	}
-
-	if (extraTime) {
-		unsigned long extraSamples = extraTime * sampleRate * numChannels;
-		while (extraSamples >= lenBuffer) {
-			memset(output.data(), 0, lenBufferBytes);
-			playback.mix(output.data(), lenBuffer, &pos);
-			extraSamples -= lenBuffer;
+		},
+		&warnings
+	);
+	std::cout << "\n";
+	for (const auto& w : warnings) std::cerr << w << std::endl;
 
-			// Make sure samples are little-endian
-			for (unsigned int i = 0; i < lenBuffer; i++) output[i] = htole16(output[i]);
+	return RET_OK;
+}
 
-			wav.write((uint8_t *)output.data(), lenBuffer * sizeof(int16_t));
-		}
+/// Render every song in a list file to .wav, on multiple threads.
+/**
+ * @param listFilename
+ *   Filename of the list.  Each line is of the form infile=outfile.wav.
+ *   Blank lines and lines starting with '#' are ignored.
+ *
+ * @param type
+ *   File type of every input song, empty string for autodetect.
+ *
+ * @param bankMIDI
+ *   Patch bank to use for MIDI notes, shared between all songs.
+ *
+ * @param loopCount
+ *   Number of times to play each song.  1=once, 2=twice (loop once).
+ *
+ * @param extraTime
+ *   Number of seconds to linger after each song finishes.
+ *
+ * @param threads
+ *   Number of songs to render at once, 0 for one per CPU core.
+ */
+int renderList(const std::string& listFilename, const std::string& type,
+	std::shared_ptr<const gm::PatchBank> bankMIDI, unsigned int loopCount,
+	unsigned int extraTime, unsigned int threads)
+{
+	if (loopCount == 0) {
+		std::cerr << "Can't loop forever when writing to .wav or you will run out "
+			"of disk space!" << std::endl;
+		return RET_BADARGS;
 	}
-	std::cout << "\n";
 
-	stream::pos lenTotal = wav.tellp();
+	std::ifstream list(listFilename);
+	if (!list) {
+		std::cerr << "Error opening " << listFilename << std::endl;
+		return RET_SHOWSTOPPER;
+	}
 
-	wav.seekp(4, stream::start);
-	wav << u32le(lenTotal - 8);
-	wav.seekp(WAVE_HEADER_SIZE - 4, stream::start);
-	wav << u32le(lenTotal - WAVE_HEADER_SIZE);
-	wav.flush();
+	std::vector<gm::RenderJob> jobs;
+	std::string line;
+	while (std::getline(list, line)) {
+		if (line.empty() || (line[0] == '#')) continue;
+		gm::RenderJob job;
+		if (!split(line, '=', &job.inputFilename, &job.outputFilename)) {
+			std::cerr << "Invalid line in " << listFilename << ", expected "
+				"infile=outfile.wav: " << line << std::endl;
+			return RET_BADARGS;
+		}
+		job.inputType = type;
+		job.loopCount = loopCount;
+		job.extraTime = extraTime;
+		job.bankMIDI = bankMIDI;
+		jobs.push_back(job);
+	}
 
-	return RET_OK;
+	std::cout << "Rendering " << jobs.size() << " songs" << std::endl;
+	unsigned int numDone = 0, numFailed = 0;
+	unsigned long long msAudioTotal = 0;
+	auto start = std::chrono::steady_clock::now();
+	gm::renderBatch(jobs, threads,
+		[&](unsigned int index, const gm::RenderResult& result) {
+			numDone++;
+			auto& job = jobs[index];
+			std::cout << "[" << numDone << "/" << jobs.size() << "] "
+				<< job.inputFilename << " -> " << job.outputFilename << ": ";
+			if (result.success) {
+				msAudioTotal += result.msAudio;
+				std::cout << std::fixed << std::setprecision(1)
+					<< result.msAudio / 1000.0 << "s of audio in "
+					<< result.msElapsed / 1000.0 << "s ("
+					<< (double)result.msAudio / std::max(result.msElapsed, 1UL)
+					<< "x realtime)" << std::endl;
+			} else {
+				numFailed++;
+				std::cout << "failed: " << result.error << std::endl;
+			}
+			for (const auto& w : result.warnings) {
+				std::cerr << "  " << job.inputFilename << ": " << w << std::endl;
+			}
+		}
+	);
+	unsigned long msElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+
+	std::cout << std::fixed << std::setprecision(1)
+		<< "Rendered " << numDone - numFailed << " songs (" << numFailed
+		<< " failed), " << msAudioTotal / 1000.0 << "s of audio in "
+		<< msElapsed / 1000.0 << "s ("
+		<< (double)msAudioTotal / std::max(msElapsed, 1UL)
+		<< "x realtime)" << std::endl;
+
+	return numFailed ? RET_NONCRITICAL_FAILURE : RET_OK;
 }
 
 /// Convert the track info struct into human-readable text
@@ -735,6 +793,12 @@ int main(int iArgC, char *cArgV[])
 		("midibank,b", po::value<std::string>(),
 			"patch bank to use for MIDI instruments with --play and --wav "
 			"[default=none, MIDI is silent]")
+		("batch", po::value<std::string>(),
+			"instead of opening <infile>, render every song listed in the given "
+			"file to .wav, one infile=outfile.wav per line")
+		("threads,j", po::value<int>(),
+			"number of songs to render at once with --batch [default=one per CPU "
+			"core], or threads to split one song across with --wav [default=1]")
 	;
 
 	po::options_description poHidden("Hidden parameters");
@@ -761,6 +825,8 @@ int main(int iArgC, char *cArgV[])
 	int userLoop = 1; // repeat once by default
 	int extraTime = 2; // two seconds extra by default
 	std::shared_ptr<gm::PatchBank> bankMIDI; // instruments to use for MIDI notes
+	std::string strBatch; // list of songs to render with --batch
+	int numThreads = 0; // threads for --batch and --wav, 0 = default
 	try {
 		po::parsed_options pa = po::parse_command_line(iArgC, cArgV, poComplete);
 
@@ -890,6 +956,13 @@ int main(int iArgC, char *cArgV[])
 					return RET_BADARGS;
 				}
 				bankMIDI = pInst->patches;
+			} else if (i->string_key.compare("batch") == 0) {
+				strBatch = i->value[0];
+			} else if (
+				(i->string_key.compare("j") == 0) ||
+				(i->string_key.compare("threads") == 0)
+			) {
+				numThreads = strtoul(i->value[0].c_str(), NULL, 10);
 			}
 		}
 
@@ -898,6 +971,16 @@ int main(int iArgC, char *cArgV[])
 			return RET_BADARGS;
 		}
 
+		if (!strBatch.empty()) {
+			if (!strFilename.empty()) {
+				std::cerr << "Error: --batch cannot be used with a filename."
+					<< std::endl;
+				return RET_BADARGS;
+			}
+			return renderList(strBatch, strType, bankMIDI, userLoop+1, extraTime,
+				numThreads);
+		}
+
 		if (strFilename.empty()) {
 			std::cerr << "Error: no filename given.  Use --help for help." << std::endl;
 			return RET_BADARGS;
@@ -1461,7 +1544,8 @@ int main(int iArgC, char *cArgV[])
 				try {
 					stream::output_file wav(wavFilename, true);
 					std::cout << "Creating " << wavFilename << "\n";
-					int ret = render(wav, pMusic, bankMIDI, userLoop+1, extraTime);
+					int ret = render(wav, pMusic, bankMIDI, userLoop+1, extraTime,
+						numThreads);
 					if (ret != RET_OK) return ret;
 				} catch (stream::open_error& e) {
 					std::cerr << "Error opening " << wavFilename << ": " << e.what()
@@ -78,9 +78,11 @@ Additional information is available from the Camoto homepage
 }
 
 // These are all in the camoto::gamemusic namespace
+#include <camoto/gamemusic/autodetect.hpp>
 #include <camoto/gamemusic/eventconverter-midi.hpp>
 #include <camoto/gamemusic/eventconverter-opl.hpp>
 #include <camoto/gamemusic/events.hpp>
+#include <camoto/gamemusic/events-compact.hpp>
 #include <camoto/gamemusic/exceptions.hpp>
 #include <camoto/gamemusic/manager.hpp>
 #include <camoto/gamemusic/music.hpp>
@@ -91,6 +93,7 @@ Additional information is available from the Camoto homepage
 #include <camoto/gamemusic/patch-pcm.hpp>
 #include <camoto/gamemusic/patchbank.hpp>
 #include <camoto/gamemusic/playback.hpp>
+#include <camoto/gamemusic/render.hpp>
 #include <camoto/gamemusic/tempo.hpp>
 #include <camoto/gamemusic/util-opl.hpp>
 #include <camoto/gamemusic/util-pcm.hpp>
@@ -0,0 +1,76 @@
+/**
+ * @file  camoto/gamemusic/autodetect.hpp
+ * @brief Work out which format a music file is in.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_GAMEMUSIC_AUTODETECT_HPP_
+#define _CAMOTO_GAMEMUSIC_AUTODETECT_HPP_
+
+#include <string>
+#include <vector>
+#include <camoto/stream.hpp>
+#include <camoto/gamemusic/manager.hpp>
+#include <camoto/gamemusic/musictype.hpp>
+
+namespace camoto {
+namespace gamemusic {
+
+/// Largest file detectFormat() will copy into memory before probing it.
+const stream::len DETECT_MAX_CACHED = 4 * 1024 * 1024;
+
+/// A format a file could be in, as returned by detectFormat().
+struct CAMOTO_GAMEMUSIC_API FormatMatch
+{
+	/// Handler for the format.
+	MusicManager::handler_t type;
+
+	/// How likely the file is to be in this format.  Never DefinitelyNo.
+	MusicType::Certainty certainty;
+};
+
+/// Work out which formats a file could be in.
+/**
+ * Files up to DETECT_MAX_CACHED bytes long are read into memory in one go,
+ * and every format's isInstance() is run against that copy, so the many
+ * small seeks and reads made by each probe never reach the underlying file.
+ * Larger files are probed directly.
+ *
+ * Formats listing the file's extension in MusicType::fileExtensions() are
+ * tried first, as the file is most likely to be in one of those.
+ *
+ * @param content
+ *   File to examine.  Its seek position is undefined afterwards.
+ *
+ * @param filename
+ *   Name of the file, used only for its extension.  May be empty.
+ *
+ * @param all
+ *   false to stop at the first DefinitelyYes match, which is enough to open
+ *   the file.  true to probe every format, to list all the possibilities.
+ *
+ * @return Possible formats, most certain first.  Formats that are equally
+ *   certain are listed with extension matches first, then in
+ *   MusicManager::formats() order.  Empty if no format recognised the file.
+ */
+std::vector<FormatMatch> CAMOTO_GAMEMUSIC_API detectFormat(
+	stream::input& content, const std::string& filename, bool all = false);
+
+} // namespace gamemusic
+} // namespace camoto
+
+#endif // _CAMOTO_GAMEMUSIC_AUTODETECT_HPP_
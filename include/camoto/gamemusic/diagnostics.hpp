@@ -0,0 +1,84 @@
+/**
+ * @file  camoto/gamemusic/diagnostics.hpp
+ * @brief Collect warnings raised during playback without blocking.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_GAMEMUSIC_DIAGNOSTICS_HPP_
+#define _CAMOTO_GAMEMUSIC_DIAGNOSTICS_HPP_
+
+#include <atomic>
+#include <string>
+#include <camoto/gamemusic/spsc-queue.hpp>
+
+#ifndef CAMOTO_GAMEMUSIC_API
+#define CAMOTO_GAMEMUSIC_API
+#endif
+
+namespace camoto {
+namespace gamemusic {
+
+/// Warnings raised on the audio thread, to be printed by another thread.
+/**
+ * Adding a warning never blocks, allocates memory or does any I/O, so it is
+ * safe from a realtime audio callback.  Warnings are kept in a fixed-size
+ * queue, and any that arrive while it is full are counted and dropped.
+ *
+ * Only one thread may add warnings, and only one thread may read them.
+ */
+class CAMOTO_GAMEMUSIC_API Diagnostics
+{
+	public:
+		/// Longest warning that can be stored, including the terminating null.
+		static const unsigned int MAX_LENGTH = 128;
+
+		Diagnostics();
+
+		/// Add a warning, formatted as for printf().
+		/**
+		 * Warnings longer than MAX_LENGTH are cut short.
+		 */
+		void warning(const char *format, ...)
+#ifdef __GNUC__
+			__attribute__((format(printf, 2, 3)))
+#endif
+		;
+
+		/// Get the oldest warning that hasn't been read yet.
+		/**
+		 * @param message
+		 *   On return, set to the warning text.
+		 *
+		 * @return true if a warning was returned, false if there are none.
+		 */
+		bool getWarning(std::string *message);
+
+		/// Get the number of warnings dropped because the queue was full.
+		unsigned long getDropped() const;
+
+	private:
+		struct Message {
+			char text[MAX_LENGTH];
+		};
+		SPSCQueue<Message, 32> queue;
+		std::atomic<unsigned long> dropped;
+};
+
+} // namespace gamemusic
+} // namespace camoto
+
+#endif // _CAMOTO_GAMEMUSIC_DIAGNOSTICS_HPP_
@@ -23,6 +23,7 @@
 
 #include <camoto/error.hpp>
 #include <camoto/enum-ops.hpp>
+#include <camoto/gamemusic/diagnostics.hpp>
 #include <camoto/gamemusic/events.hpp>
 #include <camoto/gamemusic/eventhandler.hpp>
 #include <camoto/gamemusic/musictype.hpp>
@@ -149,6 +150,121 @@ class CAMOTO_GAMEMUSIC_API OPLWriterCallback
 		 *   bytes are actioned, i.e. as if DelayIsPreData is always set.
 		 */
 		virtual void writeNextPair(const OPLEvent *oplEvent) = 0;
+
+		/// Handle a run of OPL register/value pairs.
+		/**
+		 * This is called instead of writeNextPair() when several pairs are ready
+		 * at once, such as all the writes needed to start a note.  The default
+		 * implementation passes each one to writeNextPair() in turn, but
+		 * callbacks can override it to process the whole run in one go.
+		 *
+		 * @param oplEvents
+		 *   Array of reg/val pairs, in order.  Each one has its own delay, as
+		 *   for writeNextPair().
+		 *
+		 * @param count
+		 *   Number of entries in \a oplEvents.
+		 *
+		 * @throw stream:error
+		 *   The data could not be processed for some reason.
+		 */
+		virtual void writeBatch(const OPLEvent *oplEvents, size_t count);
+};
+
+/// Maximum number of OPL pairs EventConverter_OPL will queue before passing
+/// them on to the callback.
+const unsigned int OPL_BATCH_SIZE = 256;
+
+/// Hands out OPL channels to MIDI tracks as notes start and stop.
+/**
+ * MIDI tracks are not tied to a particular OPL channel, so one is picked each
+ * time a note starts.  Idle channels are reused in the order their notes were
+ * released, giving each note as long as possible to fade out before its
+ * channel is taken over.  If every channel is busy, the channel playing the
+ * oldest note is stolen for the new one.
+ *
+ * All operations take constant time, and no memory is allocated except when
+ * a track index higher than any seen before (or passed to reserveTracks()) is
+ * used.
+ */
+class CAMOTO_GAMEMUSIC_API OPLVoiceAllocator
+{
+	public:
+		/// Maximum number of channels that can be handed out (two OPL2 chips).
+		static const unsigned int MAX_VOICES = 9 * OPL_NUM_CHIPS;
+
+		OPLVoiceAllocator();
+
+		/// Change the number of channels available.
+		/**
+		 * New channels are handed out before any that have been used.  If the
+		 * number is reduced, notes on the removed channels are forgotten about.
+		 *
+		 * @param count
+		 *   Number of channels, 0 to MAX_VOICES inclusive.  Channels 0 to 8 are
+		 *   on the first OPL chip, 9 to 17 on the second.
+		 */
+		void setVoiceCount(unsigned int count);
+
+		/// Get the number of channels available.
+		unsigned int getVoiceCount() const;
+
+		/// Make room for notes on the given number of tracks.
+		/**
+		 * Calling this up front means noteOn() will never allocate memory for
+		 * track indices below \a count.
+		 */
+		void reserveTracks(unsigned int count);
+
+		/// Get the channel playing a note on the given track.
+		/**
+		 * @param track
+		 *   Track index.
+		 *
+		 * @return Channel number, or -1 if the track has no note playing.
+		 */
+		int find(unsigned int track) const;
+
+		/// Get a channel for a new note on the given track.
+		/**
+		 * If the track already has a note playing, its channel is reused.
+		 *
+		 * @param track
+		 *   Track index.
+		 *
+		 * @param stolen
+		 *   Optional.  On return, the index of the track whose note was cut off
+		 *   to free up the channel, or -1 if the channel was idle.
+		 *
+		 * @return Channel number, or -1 if there are no channels at all.
+		 */
+		int noteOn(unsigned int track, int *stolen = NULL);
+
+		/// Release the channel used by the note on the given track.
+		/**
+		 * @param track
+		 *   Track index.  Nothing happens if it has no note playing.
+		 */
+		void noteOff(unsigned int track);
+
+	private:
+		/// List of channels, oldest first.
+		struct List {
+			int head;
+			int tail;
+		};
+
+		unsigned int voiceCount;       ///< Number of channels in use
+		int voiceTrack[MAX_VOICES];    ///< Track playing on each channel, or -1
+		int voicePrev[MAX_VOICES];     ///< Previous channel in the same list
+		int voiceNext[MAX_VOICES];     ///< Next channel in the same list
+		List idle;                     ///< Channels with no note, last released at end
+		List busy;                     ///< Channels with a note, newest at end
+		std::vector<int> trackVoice;   ///< Channel for each track, or -1
+
+		void unlink(List *list, int voice);
+		void append(List *list, int voice);
+		void prepend(List *list, int voice);
 };
 
 /// Immediate conversion between incoming events and OPL data.
@@ -165,6 +281,12 @@ class CAMOTO_GAMEMUSIC_API OPLWriterCallback
  *
  * @note This class does no optimisation of the OPL data.  Multiple redundant
  *   writes will occur.  The OPLEncoder class does however perform optimisation.
+ *
+ * @note OPL data is queued and passed to OPLWriterCallback::writeBatch() in
+ *   runs, once OPL_BATCH_SIZE pairs are waiting, at the end of
+ *   handleAllEvents(), or when flush() is called.  When calling the event
+ *   handlers directly, call flush() before relying on the data having been
+ *   written.
  */
 class CAMOTO_GAMEMUSIC_API EventConverter_OPL: virtual public EventHandler
 {
@@ -205,6 +327,56 @@ class CAMOTO_GAMEMUSIC_API EventConverter_OPL: virtual public EventHandler
 		 */
 		void setBankMIDI(std::shared_ptr<const PatchBank> bankMIDI);
 
+		/// Send warnings somewhere other than stderr.
+		/**
+		 * @param diag
+		 *   Where to add warnings about events that can't be played, or NULL to
+		 *   print them to stderr.  The caller must keep it alive while this
+		 *   object is alive.
+		 */
+		void setDiagnostics(Diagnostics *diag);
+
+		/// Pass any queued OPL data on to the callback.
+		/**
+		 * @throw stream:error
+		 *   The callback could not process the data.
+		 */
+		void flush();
+
+		/// Everything needed to continue conversion from a given point.
+		struct State {
+			unsigned long cachedDelay; ///< Delay to add on to next reg write
+			bool oplSet[2][256];       ///< Has this register been set yet?
+			uint8_t oplState[2][256];  ///< Current register values
+			bool modeOPL3;             ///< Is OPL3/dual OPL2 mode on?
+			bool modeRhythm;           ///< Is rhythm mode enabled?
+
+			/// OPL channels assigned to MIDI tracks
+			OPLVoiceAllocator voices;
+		};
+
+		/// Save the current conversion state.
+		/**
+		 * The register values in the saved state can be written to a fresh OPL
+		 * chip to bring it up to the same point in the song.
+		 *
+		 * @param state
+		 *   On return, a copy of the current state.
+		 */
+		void saveState(State *state) const;
+
+		/// Continue conversion from a previously saved state.
+		/**
+		 * Nothing is written to the callback, only the internal state is changed,
+		 * and any OPL data still queued is discarded.  The registers in the OPL
+		 * chip must be updated separately.
+		 *
+		 * @param state
+		 *   State previously populated by saveState(), from this or another
+		 *   instance converting the same song.
+		 */
+		void restoreState(const State& state);
+
 		// EventHandler overrides
 		virtual void endOfTrack(unsigned long delay);
 		virtual void endOfPattern(unsigned long delay);
@@ -228,6 +400,7 @@ class CAMOTO_GAMEMUSIC_API EventConverter_OPL: virtual public EventHandler
 		double fnumConversion;      ///< Conversion value to use in Hz -> fnum calc
 		OPLWriteFlags flags;        ///< One or more OPLWriteFlags
 		std::shared_ptr<const PatchBank> bankMIDI; ///< Optional patch bank for MIDI notes
+		Diagnostics *diag;          ///< Where to send warnings, NULL for stderr
 
 		unsigned long cachedDelay;  ///< Delay to add on to next reg write
 		bool oplSet[2][256];        ///< Has this register been set yet?
@@ -235,11 +408,22 @@ class CAMOTO_GAMEMUSIC_API EventConverter_OPL: virtual public EventHandler
 		bool modeOPL3;              ///< Is OPL3/dual OPL2 mode on?
 		bool modeRhythm;            ///< Is rhythm mode enabled?
 
-		/// Mapping between track indices and OPL channels
-		typedef std::map<unsigned int, int> MIDIChannelMap;
-		/// Mapping between track indices and OPL channels
-		MIDIChannelMap midiChannelMap;
-		/// Update oplState then call handleNextPair()
+		OPLVoiceAllocator voices;   ///< OPL channels assigned to MIDI tracks
+
+		/// OPL data waiting to be passed to the callback
+		std::vector<OPLEvent> queue;
+
+		/// Report a problem with an event, formatted as for printf().
+		void warning(const char *format, ...)
+#ifdef __GNUC__
+			__attribute__((format(printf, 2, 3)))
+#endif
+		;
+
+		/// Add an OPL pair to the queue, flushing it if it is full.
+		void queuePair(const OPLEvent& oplev);
+
+		/// Update oplState then queue the pair for the callback
 		/**
 		 * @param chipIndex
 		 *   0 or 1 for which OPL chip to use.
@@ -294,7 +478,7 @@ class CAMOTO_GAMEMUSIC_API EventConverter_OPL: virtual public EventHandler
 		 *
 		 * @param chipIndex
 		 *   On return, set to the index of the OPL chip to use.  Can be
-		 *   OPL_INVALID_CHIP if there are not enough channels available.
+		 *   OPL_INVALID_CHIP if a MIDI track has no channel assigned.
 		 *
 		 * @param mod
 		 *   On return, set to true if this instrument uses the modulator operator.
@@ -305,9 +489,9 @@ class CAMOTO_GAMEMUSIC_API EventConverter_OPL: virtual public EventHandler
 		void getOPLChannel(const TrackInfo& ti, unsigned int trackIndex,
 			unsigned int *oplChannel, unsigned int *chipIndex, bool *mod, bool *car);
 
-		/// Unmap a channel when no more events are active, freeing it up for later
-		/// use.
-		void clearOPLChannel(unsigned int trackIndex);
+		/// Update the number of channels available for MIDI tracks after the OPL
+		/// mode has changed.
+		void updateVoiceCount();
 };
 
 } // namespace gamemusic
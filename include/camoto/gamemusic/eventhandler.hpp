@@ -148,6 +148,8 @@ class CAMOTO_GAMEMUSIC_API EventHandler
 			unsigned long long us;
 		};
 
+		EventHandler();
+
 		/// Callback when handleAllEvents() has reached the end of the track.
 		/**
 		 * Not called when EventOrder::Pattern_Row_Track is in use.
@@ -335,6 +337,82 @@ class CAMOTO_GAMEMUSIC_API EventHandler
 		Tempo tempo;
 
 		std::map<const void *, unsigned int> loopEvents;
+
+		/// Next unprocessed event in one track, used when merging tracks.
+		struct MergeCursor
+		{
+			Track::const_iterator next; ///< Next event to process
+			Track::const_iterator end;  ///< End of the track
+			unsigned long absTime;      ///< Time of next event since pattern start
+			unsigned int trackIndex;    ///< Index of the track being processed
+			bool noteOff;               ///< true if next event is a NoteOffEvent
+		};
+
+		/// Everything needed to continue handleAllEvents() from part way through.
+		/**
+		 * This holds iterators into the song, so it becomes invalid if the song
+		 * is modified.
+		 */
+		struct ResumePoint
+		{
+			EventOrder eventOrder;
+			Position pos;
+			bool isGotoPending;
+			const void *pendingGotoPtr;
+			GotoEvent pendingGoto;
+			Tempo tempo;
+			std::map<const void *, unsigned int> loopEvents;
+			std::vector<MergeCursor> mergeHeap;
+			unsigned long mergeTime;
+		};
+
+		/// Save the current processing state.
+		/**
+		 * This function can only be called from within a handleEvent() function,
+		 * while processing with Pattern_Row_Track or Order_Row_Track.  Processing
+		 * can later be continued with the event following the current one by
+		 * passing the saved state to resumeAllEvents().
+		 *
+		 * @param rp
+		 *   Structure to hold the state.
+		 */
+		void saveResumePoint(ResumePoint *rp) const;
+
+		/// Continue processing from a state saved by saveResumePoint().
+		/**
+		 * @param rp
+		 *   Saved state.  The song must not have been modified since this was
+		 *   saved.
+		 *
+		 * @copydetails handleAllEvents
+		 */
+		Position resumeAllEvents(const ResumePoint& rp, const Music& music,
+			unsigned int targetLoopCount);
+
+	private:
+		/// Heap of track cursors, kept here so it is only allocated once.
+		std::vector<MergeCursor> mergeHeap;
+
+		/// Time of the last merged event, since the start of the pattern.
+		unsigned long mergeTime;
+
+		/// Position being updated while merging, NULL when not merging.
+		Position *mergePos;
+
+		/// Order events are being processed in by handleAllEvents().
+		EventOrder eventOrder;
+
+		/// Process events from the given position until the end of the song.
+		/**
+		 * @param resume
+		 *   true to continue merging the current pattern from the state in
+		 *   mergeHeap, false to start at the beginning of the pattern in  pos.
+		 */
+		Position processAllEvents(const Music& music,
+			unsigned int targetLoopCount, Position pos, bool resume);
+
+		/// Process the remaining events in mergeHeap.
+		bool processMergedEvents(const Music& music, Position *pos);
 };
 
 /// Callback used for passing tempo-change events outside the EventHandler.
@@ -0,0 +1,181 @@
+/**
+ * @file  camoto/gamemusic/events-compact.hpp
+ * @brief Compact value-type storage for song events.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_GAMEMUSIC_EVENTS_COMPACT_HPP_
+#define _CAMOTO_GAMEMUSIC_EVENTS_COMPACT_HPP_
+
+#include <camoto/gamemusic/events.hpp>
+
+namespace camoto {
+namespace gamemusic {
+
+/// Any of the standard events, stored by value.
+/**
+ * This holds the same information as the Event-derived structures, but in a
+ * tagged union that can be stored directly in a vector.  This avoids a heap
+ * allocation and reference count for every event, which makes it better
+ * suited for holding long songs in memory.
+ *
+ * Only the standard types themselves can be stored.  Events derived from
+ * them, such as those used internally when splitting tracks, carry extra
+ * fields so compactEvent() refuses them.
+ */
+struct CAMOTO_GAMEMUSIC_API CompactEvent
+{
+	/// Which of the standard events this is.
+	enum class Type: uint8_t {
+		Tempo,         ///< TempoEvent, stored in \ref tempo
+		NoteOn,        ///< NoteOnEvent, stored in \ref noteOn
+		NoteOff,       ///< NoteOffEvent, no data
+		Effect,        ///< EffectEvent, stored in \ref effect
+		Goto,          ///< GotoEvent, stored in \ref jump
+		Configuration, ///< ConfigurationEvent, stored in \ref config
+	};
+
+	/// Fields from Tempo, which can't go in a union as it has a constructor.
+	struct TempoData {
+		unsigned int beatsPerBar;
+		unsigned int beatLength;
+		unsigned int ticksPerBeat;
+		unsigned int framesPerTick;
+		double usPerTick;
+	};
+
+	/// Fields from NoteOnEvent.
+	struct NoteOnData {
+		unsigned int instrument;
+		unsigned int milliHertz;
+		int velocity;
+	};
+
+	/// Fields from EffectEvent.
+	struct EffectData {
+		EffectEvent::Type type;
+		unsigned int data;
+	};
+
+	/// Fields from GotoEvent.
+	struct GotoData {
+		GotoEvent::Type type;
+		unsigned int repeat;
+		unsigned int targetOrder;
+		unsigned int targetRow;
+	};
+
+	/// Fields from ConfigurationEvent.
+	struct ConfigurationData {
+		ConfigurationEvent::Type configType;
+		int value;
+	};
+
+	/// Type of event, which controls which union member is valid.
+	Type type;
+
+	union {
+		TempoData tempo;
+		NoteOnData noteOn;
+		EffectData effect;
+		GotoData jump;
+		ConfigurationData config;
+	};
+
+	/// Helper function (for debugging) to return all the data as a string.
+	/**
+	 * @return Same string as the equivalent Event::getContent().
+	 */
+	std::string getContent() const;
+
+	/// Call the handleEvent() function in an EventHandler class.
+	/**
+	 * This works the same way as Event::processEvent() but selects the
+	 * handler function with a switch rather than a virtual call.  The
+	 * handler is passed a temporary event, so the address of the event passed
+	 * to handleEvent() is only valid during that call and cannot be used to
+	 * identify the same event later on (e.g. for counting GotoEvent repeats.)
+	 *
+	 * @return Value returned by EventHandler::handleEvent().
+	 */
+	bool processEvent(unsigned long delay, unsigned int trackIndex,
+		unsigned int patternIndex, EventHandler *handler) const;
+};
+
+/// A CompactEvent with the number of ticks to wait before it is actioned.
+struct CAMOTO_GAMEMUSIC_API CompactTrackEvent
+{
+	unsigned long delay;
+	CompactEvent event;
+};
+
+/// Vector of events stored by value, the compact form of a Track.
+typedef std::vector<CompactTrackEvent> CompactTrack;
+
+/// Vector of compact tracks, the compact form of a Pattern.
+typedef std::vector<CompactTrack> CompactPattern;
+
+/// Store an event in compact form.
+/**
+ * @param ev
+ *   Event to copy.
+ *
+ * @return Compact copy of the event.
+ *
+ * @throw format_limitation
+ *   The event is not exactly one of the standard event types.  Types derived
+ *   from them are refused, as the fields they add would be lost.
+ */
+CompactEvent CAMOTO_GAMEMUSIC_API compactEvent(const Event& ev);
+
+/// Convert a compact event back into a standard event.
+/**
+ * @param ev
+ *   Event to copy.
+ *
+ * @return Newly allocated event of the type given by CompactEvent::type.
+ */
+std::shared_ptr<Event> CAMOTO_GAMEMUSIC_API expandEvent(const CompactEvent& ev);
+
+/// Store every event in a track in compact form.
+/**
+ * @throw format_limitation
+ *   An event in the track could not be converted.  See compactEvent().
+ */
+CompactTrack CAMOTO_GAMEMUSIC_API compactTrack(const Track& track);
+
+/// Convert a compact track back into a standard track.
+/**
+ * The events are allocated together in one block per track rather than one
+ * at a time, and the block is freed once none of its events are in use.
+ */
+Track CAMOTO_GAMEMUSIC_API expandTrack(const CompactTrack& track);
+
+/// Store every track in a pattern in compact form.
+/**
+ * @throw format_limitation
+ *   An event in the pattern could not be converted.  See compactEvent().
+ */
+CompactPattern CAMOTO_GAMEMUSIC_API compactPattern(const Pattern& pattern);
+
+/// Convert a compact pattern back into a standard pattern.
+Pattern CAMOTO_GAMEMUSIC_API expandPattern(const CompactPattern& pattern);
+
+} // namespace gamemusic
+} // namespace camoto
+
+#endif // _CAMOTO_GAMEMUSIC_EVENTS_COMPACT_HPP_
@@ -37,6 +37,69 @@ namespace camoto {
 /// Namespace for this library
 namespace gamemusic {
 
+/// Overview of a song, returned by MusicType::probe().
+struct CAMOTO_GAMEMUSIC_API MusicSummary
+{
+	/// Value used for any count or length that can't be found cheaply.
+	static const unsigned long Unknown = (unsigned long)-1;
+
+	/// Metadata such as the title, as for Music::attributes().
+	std::vector<Attribute> attributes;
+
+	/// Track layout, as for Music::trackInfo.  Empty if Unknown.
+	std::vector<TrackInfo> trackInfo;
+
+	unsigned long patternCount;    ///< Number of patterns
+	unsigned long orderCount;      ///< Number of entries in the order list
+	unsigned long instrumentCount; ///< Number of patches, or Unknown
+	unsigned long eventCount;      ///< Number of events, or Unknown
+
+	/// Length of the song played once, in milliseconds, or Unknown.
+	unsigned long msLength;
+};
+
+/// Song that is decoded a little at a time, as it is played.
+/**
+ * Returned by MusicType::openStream().  Formats that can only be decoded in
+ * one go return a stream with the whole song already decoded.
+ *
+ * @see Playback::setStream()
+ */
+class CAMOTO_GAMEMUSIC_API MusicStream
+{
+	public:
+		virtual ~MusicStream();
+
+		/// Get the song decoded so far.
+		/**
+		 * The same instance is returned each time, with patterns and order list
+		 * entries appended to it by decodePattern().  Metadata stored after the
+		 * song data, such as tags, is only filled in once decoding has finished.
+		 */
+		virtual std::shared_ptr<const Music> music() const = 0;
+
+		/// Decode another pattern and append it to the song.
+		/**
+		 * @return true if a pattern was added, false if the whole song has
+		 *   already been decoded.
+		 *
+		 * @throw stream::error
+		 *   The song data could not be read or decoded.
+		 */
+		virtual bool decodePattern() = 0;
+
+		/// Free the events in patterns that have already been played.
+		/**
+		 * The patterns stay in the song so that order numbers do not change, but
+		 * they will be silent if played again.  Streams holding a complete song
+		 * may ignore this.
+		 *
+		 * @param order
+		 *   Index of the first order to keep.
+		 */
+		virtual void discardPatterns(unsigned int order) = 0;
+};
+
 /// Interface to a particular music format.
 class MusicType
 {
@@ -59,6 +122,7 @@ class MusicType
 		enum class WriteFlags {
 			Default          = 0x00,  ///< No special treatment
 			IntegerNotesOnly = 0x01,  ///< Disable pitchbends
+			NoTruncate       = 0x02,  ///< Output can't be truncated, e.g. a pipe
 		};
 
 		/// Available capability flags, returned by caps().
@@ -160,6 +224,64 @@ class MusicType
 		virtual std::unique_ptr<Music> read(stream::input& content,
 			SuppData& suppData) const = 0;
 
+		/// Get an overview of a song without decoding all of it.
+		/**
+		 * This is intended for listing many songs at once.  Formats that store
+		 * the details in their headers read only those, and formats that store
+		 * a simple list of register writes count them without building any
+		 * events or patches.  Anything that can't be found this way is set to
+		 * MusicSummary::Unknown.
+		 *
+		 * The default implementation calls read() and examines the result, so
+		 * it is no faster but never returns Unknown.
+		 *
+		 * @pre Recommended that isInstance() has returned > DefinitelyNo.
+		 *
+		 * @param content
+		 *   The music file to examine.
+		 *
+		 * @param suppData
+		 *   Any supplemental data required by this format (see getRequiredSupps()).
+		 *
+		 * @return Summary of the song.  eventCount counts the format's own
+		 *   events, such as register writes, so it is only comparable between
+		 *   songs in the same format.
+		 *
+		 * @throw stream::error
+		 *   I/O error reading from input stream (e.g. file truncated)
+		 */
+		virtual MusicSummary probe(stream::input& content,
+			SuppData& suppData) const;
+
+		/// Open a song to be decoded as it is played.
+		/**
+		 * Register captures such as DRO and IMF files can be very long, and
+		 * read() has to turn the whole file into events before any of it can be
+		 * played.  A stream only decodes as far as is needed, so playback can
+		 * start straight away, and memory use does not grow with the length of
+		 * the song.
+		 *
+		 * The default implementation calls read(), so the stream holds the
+		 * whole song from the start.
+		 *
+		 * @pre Recommended that isInstance() has returned > DefinitelyNo.
+		 *
+		 * @param content
+		 *   The music file to read.  The stream keeps it open until the stream
+		 *   is destroyed.
+		 *
+		 * @param suppData
+		 *   Any supplemental data required by this format (see getRequiredSupps()).
+		 *   This is only used during this call.
+		 *
+		 * @return The song, ready to pass to Playback::setStream().
+		 *
+		 * @throw stream::error
+		 *   I/O error reading from input stream (e.g. file truncated)
+		 */
+		virtual std::unique_ptr<MusicStream> openStream(
+			std::unique_ptr<stream::input> content, SuppData& suppData) const;
+
 		/// Write a song in this file format.
 		/**
 		 * This function writes out the necessary signatures and headers to create
@@ -186,7 +308,10 @@ class MusicType
 		 *   failure mode, so the error message should be presented to the user as
 		 *   it will indicate what they are required to do to remedy the problem.
 		 *
-		 * @post The stream will be truncated to the correct size.
+		 * @post The stream will be truncated to the correct size, unless
+		 *   WriteFlags::NoTruncate is given.  Formats that write the whole file
+		 *   in one go without seeking then make no calls to the stream other
+		 *   than write(), so they can be used on a pipe with this flag.
 		 */
 		virtual void write(stream::output& output, SuppData& suppData,
 			const Music& music, WriteFlags flags) const = 0;
@@ -21,13 +21,176 @@
 #ifndef _CAMOTO_GAMEMUSIC_PATCH_PCM_HPP_
 #define _CAMOTO_GAMEMUSIC_PATCH_PCM_HPP_
 
+#include <initializer_list>
+#include <memory>
 #include <vector>
+#include <camoto/stream.hpp>
 #include <camoto/gamemusic/patch.hpp>
 #include <stdint.h>
 
 namespace camoto {
 namespace gamemusic {
 
+struct PCMPatch;
+
+/// Raw bytes of a PCM sample, which may be shared with other patches.
+/**
+ * This behaves like a std::vector<uint8_t>, but copying it does not copy the
+ * bytes.  The copies refer to the same buffer until one of them is changed
+ * through a non-const function, at which point that copy takes its own private
+ * copy of the bytes first.  The buffer can also be some other block of memory
+ * that is never written to, such as a memory-mapped file, in which case the
+ * first change copies the bytes out of it.
+ *
+ * Pointers and references obtained from the non-const functions are only
+ * valid until the object is next copied or changed.
+ */
+class CAMOTO_GAMEMUSIC_API PCMData
+{
+	public:
+		/// Create an empty buffer.
+		PCMData();
+
+		/// Take over the contents of a vector, without copying the bytes.
+		PCMData(std::vector<uint8_t> bytes);
+
+		/// Create a buffer holding the given bytes.
+		PCMData(std::initializer_list<uint8_t> bytes);
+
+		/// Refer to part of a block of memory that will not change.
+		/**
+		 * @param buffer
+		 *   Memory to refer to.  It is kept alive (and its deleter is not called)
+		 *   until this object and all its copies have been changed or destroyed.
+		 *   It must not be modified during this time.
+		 *
+		 * @param offset
+		 *   Offset of the first byte to use, relative to \a buffer.
+		 *
+		 * @param length
+		 *   Number of bytes to use.
+		 */
+		PCMData(std::shared_ptr<const uint8_t> buffer, std::size_t offset,
+			std::size_t length);
+
+		/// Replace the contents with bytes read from a stream.
+		/**
+		 * This avoids filling a new buffer with zeroes only to overwrite them.
+		 *
+		 * @param content
+		 *   Stream to read from, at the current read position.
+		 *
+		 * @param length
+		 *   Number of bytes to read.
+		 *
+		 * @throw stream::incomplete_read
+		 *   The stream ended before \a length bytes could be read.
+		 */
+		void read(stream::input& content, std::size_t length);
+
+		/// Get part of the buffer, sharing the bytes rather than copying them.
+		/**
+		 * @param offset
+		 *   Index of the first byte to include.
+		 *
+		 * @param length
+		 *   Number of bytes to include.  offset + length must not be larger than
+		 *   size().
+		 */
+		PCMData slice(std::size_t offset, std::size_t length) const;
+
+		std::size_t size() const;
+		bool empty() const;
+		void resize(std::size_t length);
+		void clear();
+
+		const uint8_t *data() const;
+		uint8_t *data();
+
+		const uint8_t& operator[] (std::size_t i) const;
+		uint8_t& operator[] (std::size_t i);
+
+		const uint8_t *begin() const;
+		const uint8_t *end() const;
+		uint8_t *begin();
+		uint8_t *end();
+
+	private:
+		/// First byte, also keeping whatever holds the memory alive.
+		std::shared_ptr<const uint8_t> bytes;
+
+		/// Number of bytes in use from \ref bytes.
+		std::size_t length;
+
+		/// True if the memory was allocated by this class and can be written.
+		bool owned;
+
+		/// Take a private copy of the bytes if they are shared or read-only.
+		void detach();
+};
+
+/// PCM sample data decoded into the format used for playback.
+/**
+ * The samples are signed 16-bit in host byte order, regardless of the format
+ * of the original patch.  Each pass through the note is stored with GUARD
+ * extra samples either side, holding whatever would be heard before and after
+ * it, so that an interpolation filter can read a few samples past either end
+ * without any checks.
+ *
+ * The first pass (from sample 0 up to the end or loop end) is preceded by
+ * silence, and followed by the start of the loop or more silence if the
+ * sample doesn't loop.  Looping samples have a second copy of just the loop,
+ * preceded by the end of the loop and followed by its start, which is used
+ * for every pass after the first.
+ *
+ * Instances are immutable once created, so they can be shared between
+ * threads.  Use PCMPatch::getDecoded() to obtain one.
+ */
+struct CAMOTO_GAMEMUSIC_API PCMDecoded
+{
+	/// Number of extra samples stored either side of each pass.
+	static const unsigned int GUARD = 4;
+
+	/// Decode the sample data from a patch.
+	/**
+	 * @param patch
+	 *   Patch to decode.  Unsupported bit depths produce an empty sample.
+	 */
+	PCMDecoded(const PCMPatch& patch);
+
+	// The pointers below point into the buffer, so this can't be copied
+	PCMDecoded(const PCMDecoded&) = delete;
+	PCMDecoded& operator=(const PCMDecoded&) = delete;
+
+	/// Is this still an accurate copy of the given patch?
+	/**
+	 * This checks the format, loop points and data buffer but not the contents
+	 * of the data itself.
+	 */
+	bool matches(const PCMPatch& patch) const;
+
+	/// Sample 0 of the first pass through the note.
+	const int16_t *first;
+
+	/// The sample at loopStart in the copy of the loop, or NULL if no loop.
+	const int16_t *loop;
+
+	unsigned long end;       ///< Index of last sample in the first pass + 1
+	unsigned long loopStart; ///< Index of first sample in the loop
+	unsigned long loopLen;   ///< Number of samples in the loop, 0 if no loop
+
+	private:
+		/// Both passes, including the guard samples.
+		std::vector<int16_t> buffer;
+
+		// Patch settings the data was decoded from, for matches()
+		const uint8_t *srcData;
+		std::size_t srcSize;
+		unsigned int srcBitDepth;
+		unsigned long srcLoopStart;
+		unsigned long srcLoopEnd;
+};
+
 /// Descendent of Patch for storing PCM instruments.
 struct CAMOTO_GAMEMUSIC_API PCMPatch: public Patch
 {
@@ -38,8 +201,8 @@ struct CAMOTO_GAMEMUSIC_API PCMPatch: public Patch
 	unsigned int bitDepth;    ///< Sample size in bits (8/16)
 	unsigned int numChannels; ///< Channel count (1=mono, 2=stereo)
 
-	unsigned long loopStart;  ///< Beginning of loop (offset of first sample)
-	unsigned long loopEnd;    ///< End of loop, 0=no loop (offset of last sample+1)
+	unsigned long loopStart;  ///< Beginning of loop (index of first sample)
+	unsigned long loopEnd;    ///< End of loop, 0=no loop (index of last sample+1)
 
 	/// Actual sample data.
 	/**
@@ -48,8 +211,34 @@ struct CAMOTO_GAMEMUSIC_API PCMPatch: public Patch
 	 * in host-byte order.  Since most PCM data is little-endian, 16-bit PCM data
 	 * will need to be converted to host-byte order when it is loaded into this
 	 * buffer.
+	 *
+	 * Copies of the patch share the same bytes until one of them is changed.
+	 * Code that only reads the data should do so through a const reference,
+	 * so that the bytes are not copied unnecessarily.
 	 */
-	std::vector<uint8_t> data;
+	PCMData data;
+
+	/// Get the sample data decoded for playback.
+	/**
+	 * The data is decoded on the first call and kept with the patch, so it is
+	 * shared by everything playing the patch, including other songs using the
+	 * same patch bank.  It is decoded again if the format, loop points or data
+	 * buffer change.  This function is thread-safe.
+	 *
+	 * @note Changes made to the contents of \ref data without resizing it are
+	 *   not detected.  Call clearDecoded() after doing this.
+	 *
+	 * @return The decoded data, which remains valid even if the patch is later
+	 *   changed or destroyed.
+	 */
+	std::shared_ptr<const PCMDecoded> getDecoded() const;
+
+	/// Discard the data decoded by getDecoded().
+	void clearDecoded();
+
+	private:
+		/// Cached result of getDecoded().
+		mutable std::shared_ptr<const PCMDecoded> decoded;
 };
 
 } // namespace gamemusic
@@ -21,7 +21,10 @@
 #ifndef _CAMOTO_GAMEMUSIC_PLAYBACK_HPP_
 #define _CAMOTO_GAMEMUSIC_PLAYBACK_HPP_
 
+#include <camoto/gamemusic/diagnostics.hpp>
+#include <camoto/gamemusic/events-compact.hpp>
 #include <camoto/gamemusic/music.hpp>
+#include <camoto/gamemusic/spsc-queue.hpp>
 #include <camoto/gamemusic/synth-opl.hpp>
 #include <camoto/gamemusic/synth-pcm.hpp>
 #include <camoto/gamemusic/eventconverter-opl.hpp>
@@ -29,7 +32,29 @@
 namespace camoto {
 namespace gamemusic {
 
+class EventHandler_Playback_Seek;
+class MusicStream;
+
 /// Helper class to assist with song playback.
+/**
+ * Instances do not share any mutable state, so separate Playback objects can
+ * render songs on separate threads at the same time.  The Music and PatchBank
+ * objects passed in are only read, so they can also be shared between
+ * threads, as long as no thread modifies them during playback.  A single
+ * Playback object must only be used by one thread at a time.
+ *
+ * The exception is the queue*() functions, which can be called from one other
+ * thread (such as a user interface) while mix() is running on the audio
+ * thread.  These add the change to a lock-free queue, which is applied by the
+ * audio thread the next time mix() or mixFrame() starts a new block, so the
+ * audio thread never has to wait.
+ *
+ * Once setSong() has returned, mix() never allocates memory, locks or prints
+ * anything, so it can be called from a realtime audio callback.  All buffers
+ * are sized up front, and warnings about the song are kept for getWarning()
+ * instead of being printed.  This includes changes made with the queue*()
+ * functions, as anything they need is allocated by the thread queueing them.
+ */
 class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 {
 	public:
@@ -75,12 +100,58 @@ class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 
 				// OPLWriterCallback
 				virtual void writeNextPair(const OPLEvent *oplEvent);
+				virtual void writeBatch(const OPLEvent *oplEvents, size_t count);
 
 			protected:
 				Playback *playback;
 				bool midi;
 		};
 
+		/// Everything needed to continue playback from a given point.
+		/**
+		 * This is used to play different parts of a song at the same time with
+		 * different Playback instances.  The fields should be treated as
+		 * private.
+		 *
+		 * @see saveSnapshot(), restoreSnapshot()
+		 */
+		struct CAMOTO_GAMEMUSIC_API Snapshot
+		{
+			std::shared_ptr<const Music> music;
+			bool end;
+			unsigned int loop;
+			unsigned int order;
+			unsigned int pattern;
+			unsigned int row;
+			unsigned int frame;
+			unsigned int nextRow;
+			unsigned int nextOrder;
+			bool loadNextOrder;
+			Tempo tempo;
+			double sampleFraction;
+			std::vector<unsigned int> gotoCounts;
+			EventConverter_OPL::State opl;
+			EventConverter_OPL::State oplMIDI;
+			SynthPCM::State pcm;
+			SynthPCM::State pcmMIDI;
+		};
+
+		/// Constructor.
+		/**
+		 * @param sampleRate
+		 *   Output sample rate in Hertz, e.g. 44100.
+		 *
+		 * @param channels
+		 *   Number of output channels, e.g. 2 for stereo.
+		 *
+		 * @param bits
+		 *   Bits per output sample.  16 for 16-bit integer output, or 32 for
+		 *   32-bit integer or floating point output.  This controls which of the
+		 *   mix() functions can be used.
+		 *
+		 * @throw format_limitation
+		 *   The requested bit depth is not supported.
+		 */
 		Playback(unsigned long sampleRate, unsigned int channels,
 			unsigned int bits);
 		~Playback();
@@ -94,15 +165,69 @@ class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 		 */
 		void setBankMIDI(std::shared_ptr<const PatchBank> bankMIDI);
 
+		/// Set how PCM samples are resampled to the output rate.
+		/**
+		 * @param mode
+		 *   Interpolation method to use.  The default is
+		 *   SynthPCM::Interpolation::Linear.
+		 */
+		void setInterpolation(SynthPCM::Interpolation mode);
+
 		/// Set the song to play.
 		/**
 		 * This also resets playback to the start of the song.
 		 *
+		 * The events are copied into compact form (see CompactEvent) so they
+		 * can be played without a virtual call per event.  Changes made to the
+		 * song afterwards are not heard until songChanged() is called.
+		 *
 		 * @param music
 		 *   The song to play.
+		 *
+		 * @throw format_limitation
+		 *   The song contains an event that can't be played, as it isn't one
+		 *   of the standard event types.
 		 */
 		void setSong(std::shared_ptr<const Music> music);
 
+		/// Set a song to play while it is still being decoded.
+		/**
+		 * Only the first couple of patterns are decoded here.  Later ones are
+		 * decoded as playback approaches them, so a long song can start playing
+		 * straight away.  When the loop count is 1, the patterns that have
+		 * already been played are discarded so memory use stays bounded.
+		 * Seeking back to a discarded order plays silence.
+		 *
+		 * The decoding is done by mix(), so unlike setSong() this can allocate
+		 * memory on the audio thread.  It is best suited to rendering or to
+		 * players without hard realtime requirements.  getLength() and seeking
+		 * by time only cover the patterns decoded so far.
+		 *
+		 * This also resets playback to the start of the song.
+		 *
+		 * @param stream
+		 *   The song to play, from MusicType::openStream().
+		 *
+		 * @throw stream::error
+		 *   The first patterns could not be decoded.
+		 */
+		void setStream(std::shared_ptr<MusicStream> stream);
+
+		/// Notify that the song passed to setSong() has been modified.
+		/**
+		 * This discards any information cached about the song, such as the index
+		 * used for seeking and the compact copy of its events, so that it is
+		 * recalculated from the new events.  It
+		 * must be called after changing the song's events or order list, but
+		 * playback continues from the same position.
+		 *
+		 * Any PCM patches added to the song's patch bank are decoded here, and
+		 * notes using them are not played until this has been called.  This
+		 * allocates memory, so it must not be called while another thread is
+		 * calling mix().
+		 */
+		void songChanged();
+
 		/// Set the number of times the song should loop.
 		/**
 		 * @param count
@@ -111,6 +236,35 @@ class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 		 */
 		void setLoopCount(unsigned int count);
 
+		/// Silence a track, or make it audible again.
+		/**
+		 * Notes already playing on the track are switched off when it is muted,
+		 * and any new notes are ignored until it is unmuted.  Other events such
+		 * as instrument changes are still processed, so the track sounds correct
+		 * once unmuted.  All tracks are unmuted by setSong().
+		 *
+		 * @param track
+		 *   Index of the track to change.  Out of range indices are ignored.
+		 *
+		 * @param mute
+		 *   true to silence the track, false to play it again.
+		 */
+		void setTrackMute(unsigned int track, bool mute);
+
+		/// Play the song faster or slower than its own tempo.
+		/**
+		 * This affects the audio only.  Song times used by getLength() and
+		 * seekByTime() are unchanged.
+		 *
+		 * @param scale
+		 *   Speed multiplier.  1.0 is normal speed, 2.0 is twice as fast.
+		 *
+		 * @throw stream::error
+		 *   The scale was zero or negative, or would make the current tempo too
+		 *   fast to play.
+		 */
+		void setTempoScale(double scale);
+
 		/// Get the length of the song, in milliseconds.
 		/**
 		 * @return The length of the song in milliseconds.
@@ -139,12 +293,49 @@ class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 		 */
 		unsigned long seekByTime(unsigned long ms);
 
-		/// Synthesize and mix audio into the given buffer.
+		/// @name Changes that can be made from another thread.
 		/**
+		 * These queue a call to the function of the same name, which is made by
+		 * the thread calling mix() or mixFrame() before it starts the next block.
+		 * Only one thread may queue changes.  Each returns false if the queue is
+		 * full, in which case the change has not been made.
+		 *
+		 * queueSong() allocates the new song's voices and converters, and
+		 * queueSeekByTime() finds the new position, on the calling thread, so
+		 * the audio thread only has to swap them in.  The calling thread keeps
+		 * its own seek index for this, built by the first queueSeekByTime()
+		 * after the song or loop count changes.  queueSeekByTime() fails if the
+		 * song was started with setStream(), as it is still being decoded.
+		 *
+		 * Anything the audio thread replaces, such as the previous song, is left
+		 * in the queue and released on the calling thread when its slot is
+		 * reused.
+		 *
+		 * A queued change that can't be made, such as a tempo scale that is too
+		 * fast for the current tempo, is skipped and reported by getWarning().
+		 *
+		 * setSong(), setStream(), setLoopCount() and songChanged() must not be
+		 * called while another thread is queueing changes.
+		 */
+		///@{
+		bool queueSeekByOrder(unsigned int destOrder);
+		bool queueSeekByTime(unsigned long ms);
+		bool queueLoopCount(unsigned int count);
+		bool queueSong(std::shared_ptr<const Music> music);
+		bool queueTrackMute(unsigned int track, bool mute);
+		bool queueTempoScale(double scale);
+		///@}
+
+		/// Synthesize audio and add it to the given buffer.
+		/**
+		 * All the synthesizers are summed on an internal 32-bit mix bus, which is
+		 * only clipped and converted to the output format here.
+		 *
 		 * @param output
-		 *   Input and output buffer.  Synthesized audio is mixed into this buffer
-		 *   and combined with whatever audio is already in it.  Make sure you zero
-		 *   the buffer with memset() before the first call!
+		 *   Input and output buffer.  Synthesized audio is added to whatever
+		 *   audio is already in this buffer, clipping the result to the 16-bit
+		 *   range.  Make sure you zero the buffer with memset() before the first
+		 *   call!
 		 *
 		 * @param samples
 		 *   Size of output, in samples.  One sample is one int16_t, and two
@@ -153,12 +344,101 @@ class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 		 * @param pos
 		 *   Pointer to a structure that on return, will receive the playback
 		 *   position of the data just placed in the buffer.
+		 *
+		 * @pre The object was constructed with 16 bits per sample.
 		 */
 		void mix(int16_t *output, unsigned long samples, Position *pos);
 
+		/// Synthesize audio and add it to the given 32-bit buffer.
+		/**
+		 * This is the same as the 16-bit mix() but produces signed 32-bit
+		 * samples, clipped to the 32-bit range.
+		 *
+		 * @pre The object was constructed with 32 bits per sample.
+		 */
+		void mix(int32_t *output, unsigned long samples, Position *pos);
+
+		/// Synthesize audio and add it to the given floating point buffer.
+		/**
+		 * This is the same as the 16-bit mix() but produces floating point
+		 * samples, where -1.0 to 1.0 is full scale.  The output is not clipped,
+		 * so it is left to the caller to deal with any louder samples.
+		 *
+		 * @pre The object was constructed with 32 bits per sample.
+		 */
+		void mix(float *output, unsigned long samples, Position *pos);
+
+		/// Generate the next block of audio.
+		/**
+		 * This is the same as mix() except that the amount of audio generated is
+		 * exactly one block, so that playback stops on a row boundary.  A block
+		 * runs from one row with events up to the next (or the end of the
+		 * pattern), up to a limit of around 50 milliseconds.  If part of a block
+		 * has already been returned by mix(), only the rest of that block is
+		 * generated.
+		 *
+		 * @param output
+		 *   The block is appended to the end of this vector, as 16-bit samples.
+		 *   If NULL, the song is advanced by one block without running the
+		 *   synthesizers, which is much faster but leaves notes silent and their
+		 *   envelopes where they were.
+		 *
+		 * @param pos
+		 *   Pointer to a structure that on return, will receive the playback
+		 *   position of the following block.
+		 *
+		 * @return Number of samples in the block, whether they were generated or
+		 *   not.
+		 *
+		 * @pre The object was constructed with 16 bits per sample.
+		 */
+		unsigned long mixFrame(std::vector<int16_t> *output, Position *pos);
+
+		/// Save the playback state at the start of the next block.
+		/**
+		 * @param snapshot
+		 *   On return, contains the position in the song, tempo, loop counters,
+		 *   OPL register values and the PCM notes that are playing.
+		 *
+		 * @note PCM notes carry on from exactly the same place after
+		 *   restoreSnapshot(), including when the audio leading up to the
+		 *   snapshot was skipped with mixFrame().  The OPL chips themselves are
+		 *   not saved though, so OPL notes will start again from the beginning
+		 *   of their envelope.  To reduce the audible effect, restore an earlier
+		 *   snapshot and discard the audio until the desired point.
+		 */
+		void saveSnapshot(Snapshot *snapshot) const;
+
+		/// Continue playback from a previously saved point.
+		/**
+		 * The synthesizers are reset, the OPL registers are loaded from the
+		 * snapshot and the PCM notes are picked up where they were.  Any audio remaining from the current block is discarded.
+		 *
+		 * @param snapshot
+		 *   Snapshot populated by saveSnapshot(), from this or another instance.
+		 *   It must have been taken while playing the same song as passed to
+		 *   setSong() for this instance, with the same MIDI bank.
+		 */
+		void restoreSnapshot(const Snapshot& snapshot);
+
 		/// Switch all playing notes off.  Notes will still linger as they fade out.
 		void allNotesOff();
 
+		/// Get the oldest warning raised during playback.
+		/**
+		 * Problems such as notes that can't be played are not printed, as that
+		 * isn't safe on an audio thread.  Instead they are queued up to be
+		 * collected with this function, which should be called regularly from
+		 * a different thread to the one calling mix().  Warnings that arrive
+		 * while the queue is full are dropped.
+		 *
+		 * @param message
+		 *   On return, set to the warning text.
+		 *
+		 * @return true if a warning was returned, false if there are none left.
+		 */
+		bool getWarning(std::string *message);
+
 	protected:
 		unsigned long outputSampleRate; ///< in Hertz, e.g. 44100
 		unsigned int outputChannels;    ///< e.g. 2 for stereo
@@ -167,7 +447,17 @@ class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 		std::shared_ptr<const Music> music;
 		unsigned int loopCount; ///< 0=loop forever, 1=no loop, 2=loop once, etc.
 
-		std::map<const void *, unsigned int> loopEvents;
+		/// The song's patterns in compact form, which is what nextFrame() plays.
+		std::vector<CompactPattern> events;
+
+		/// Every GotoEvent in the song, sorted by address.
+		std::vector<const GotoEvent *> gotoEvents;
+
+		/// Number of times each entry in gotoEvents has jumped this loop.
+		std::vector<unsigned int> gotoCounts;
+
+		/// Returned by gotoCount() for a jump that isn't in gotoEvents.
+		unsigned int spareGotoCount;
 
 		// TempoCallback
 		virtual void tempoChange(const Tempo& tempo);
@@ -183,17 +473,121 @@ class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 		unsigned int frame;
 		unsigned int nextRow;
 		unsigned int nextOrder;
+		bool loadNextOrder; ///< Has the order number changed?
 		Tempo tempo;
 
-		unsigned int samplesPerFrame;
+		/// Position of a single track within the current pattern.
+		struct TrackCursor {
+			unsigned long event; ///< Index of the next event to process
+			unsigned long tick;  ///< Row of the event before this one
+		};
+
+		/// One cursor per track, so each row only looks at new events.
+		/**
+		 * These are indices too, and are rebuilt from the start of the pattern
+		 * whenever the pattern changes or playback moves backwards within it.
+		 */
+		std::vector<TrackCursor> cursors;
+		unsigned int cursorPattern; ///< Pattern the cursors are positioned in
+		unsigned int cursorRow;     ///< Earliest row the cursors can process
 
-		/// A single frame of audio, copied into the output buffer as needed
-		std::vector<int16_t> frameBuffer;
+		/// Exact length of one frame at the current tempo, in sample frames.
+		double samplesPerFrame;
+
+		/// Fraction of a sample frame left over at the end of the last block.
+		/**
+		 * This is carried into the next block so that rounding each block to a
+		 * whole number of samples does not make the song drift out of time.
+		 */
+		double sampleFraction;
+
+		/// Part of a block of audio, copied into the output buffer as needed
+		/**
+		 * This is the mix bus, where all the synthesizers are added together at
+		 * 16-bit scale.  The extra bits provide headroom so that nothing is
+		 * clipped until the final conversion in mix().
+		 *
+		 * Its capacity is fixed by the constructor, so blocks longer than that
+		 * are synthesized one chunk at a time by nextChunk().
+		 */
+		std::vector<int32_t> frameBuffer;
 		unsigned int frameBufferPos;
 
+		unsigned long blockLength; ///< Number of samples in the whole block
+		unsigned long blockPos;    ///< Samples in the block before frameBuffer
+		bool blockSynth;           ///< Should the block be synthesized?
+
+		Position blockStart;      ///< Playback position at the start of the block
+		unsigned int blockFrame;  ///< Frame within the row the block starts at
+		unsigned long blockFrames; ///< Number of frames in the block
+		double blockFraction;     ///< sampleFraction at the start of the block
+
 		/// Optional patch bank for MIDI notes
 		std::shared_ptr<const PatchBank> bankMIDI;
 
+		/// Multiplier applied to the song's tempo, see setTempoScale().
+		double tempoScale;
+
+		/// Nonzero for each track that has been muted with setTrackMute().
+		std::vector<uint8_t> trackMuted;
+
+		/// Everything setSong() allocates, so queueSong() can do it in advance.
+		struct SongState {
+			std::shared_ptr<const Music> music;
+			std::shared_ptr<MusicStream> stream;
+			std::vector<CompactPattern> events;
+			std::vector<const GotoEvent *> gotoEvents;
+			std::vector<unsigned int> gotoCounts;
+			std::vector<uint8_t> trackMuted;
+			std::vector<TrackCursor> cursors;
+			std::shared_ptr<EventConverter_OPL> oplConverter;
+			std::shared_ptr<EventConverter_OPL> oplConvMIDI;
+			std::shared_ptr<EventHandler_Playback_Seek> seekIndex;
+			SynthPCM::Setup pcm;
+			SynthPCM::Setup pcmMIDI;
+		};
+
+		/// What the thread calling the queue*() functions knows about the song.
+		/**
+		 * This is only touched by that thread, and by setSong() etc. before
+		 * it starts.  It follows the song and loop count as they will be once
+		 * everything queued has been applied.
+		 */
+		struct QueueState {
+			std::shared_ptr<const Music> music;
+			unsigned int loopCount;
+			bool streaming;
+			std::shared_ptr<EventHandler_Playback_Seek> seekIndex;
+		};
+		QueueState queued;
+
+		/// A change queued by another thread, see queueSeekByOrder() etc.
+		struct Command {
+			enum class Type {
+				SeekByOrder, ///< seekByOrder(value)
+				SeekByTime,  ///< seekByTime(), to seekPos found in advance
+				LoopCount,   ///< setLoopCount(value)
+				Song,        ///< setSong(), with song prepared in advance
+				TrackMute,   ///< setTrackMute(value, mute)
+				TempoScale,  ///< setTempoScale(scale)
+			};
+			Type type;
+			unsigned long value;
+			bool mute;
+			double scale;
+			EventHandler::Position seekPos;
+			Tempo seekTempo;
+
+			/// New song, swapped with the old one when it is applied.
+			std::shared_ptr<SongState> song;
+
+			/// Seek index replaced by the change, freed when the slot is reused.
+			std::shared_ptr<EventHandler_Playback_Seek> oldSeekIndex;
+		};
+
+		/// Changes waiting to be applied by processCommands().
+		SPSCQueue<Command, 64> commands;
+
 		SynthPCM pcm;
 		SynthPCM pcmMIDI;
 		SynthOPL opl;
@@ -203,8 +597,154 @@ class CAMOTO_GAMEMUSIC_API Playback: virtual public SynthPCMCallback
 		std::shared_ptr<EventConverter_OPL> oplConverter;
 		std::shared_ptr<EventConverter_OPL> oplConvMIDI;
 
-		/// Populate frameBuffer with the next frame
-		void nextFrame();
+		/// Song being decoded as it plays, or NULL if it was fully loaded.
+		std::shared_ptr<MusicStream> stream;
+
+		/// Checkpoints for seeking quickly, created when first needed
+		std::shared_ptr<EventHandler_Playback_Seek> seekIndex;
+
+		/// Warnings waiting to be collected by getWarning().
+		Diagnostics diag;
+
+		/// Queue a change, for the queue*() functions.
+		bool queueCommand(const Command& cmd);
+
+		/// Allocate everything needed to play a song, without touching playback.
+		/**
+		 * This only reads bankMIDI, so it is safe to call on a different thread
+		 * to the one calling mix().
+		 *
+		 * @param music
+		 *   Song to prepare.
+		 *
+		 * @param state
+		 *   On return, ready to pass to applySong().
+		 */
+		void prepareSong(std::shared_ptr<const Music> music, SongState *state);
+
+		/// Start playing a song set up by prepareSong(), without allocating.
+		/**
+		 * @param state
+		 *   New song.  It is swapped with the song being replaced, so the old
+		 *   one is freed when this is destroyed.
+		 */
+		void applySong(SongState& state);
+
+		/// Move to a position found by EventHandler_Playback_Seek::seekTo().
+		void seekToPosition(const EventHandler::Position& pos,
+			const Tempo& newTempo);
+
+		/// Apply any changes queued by another thread.
+		/**
+		 * This is called at the start of each block, before nextFrame().
+		 */
+		void processCommands();
+
+		/// Switch off any note playing on a single track.
+		void trackNoteOff(unsigned int trackIndex);
+
+		/// Number of output samples per song tick at the current tempo.
+		/**
+		 * @param scale
+		 *   Tempo scale to use, as for setTempoScale().
+		 */
+		double calcSamplesPerTick(double scale) const;
+
+		/// Recalculate samplesPerFrame after a change in tempo or tempoScale.
+		void updateSamplesPerFrame();
+
+		/// Populate frameBuffer with the next block of audio.
+		/**
+		 * Events are processed at the start of the block, and the block then
+		 * continues until the next row with any events on it, so that rows with
+		 * nothing happening are synthesized in one go.
+		 *
+		 * @param synthesize
+		 *   true to generate audio, false to leave frameBuffer silent and only
+		 *   process the events.
+		 */
+		void nextFrame(bool synthesize = true);
+
+		/// Populate frameBuffer with the next chunk of the current block.
+		/**
+		 * @return true if a chunk was generated, false if the block has been
+		 *   used up and nextFrame() must be called.
+		 */
+		bool nextChunk();
+
+		/// Run the synthesizers over frameBuffer, if this block is audible.
+		void synthesizeChunk();
+
+		/// Throw away the rest of the current block.
+		void discardBlock();
+
+		/// Decode more of the stream if playback is getting close to its end.
+		void streamAhead();
+
+		/// Add compact copies of any patterns appended to the song to \ref events.
+		void compactNewPatterns();
+
+		/// Rebuild gotoEvents from the song, and reset all the counts.
+		void indexGotoEvents();
+
+		/// Get the loop counter for a GotoEvent in the song.
+		unsigned int *gotoCount(const GotoEvent *jump);
+
+		/// Find the song's own copy of a GotoEvent in \ref events.
+		/**
+		 * The loop counters are kept against the song's events rather than the
+		 * compact copies, so that they match between Playback instances for
+		 * saveSnapshot() and restoreSnapshot().
+		 *
+		 * @param trackIndex
+		 *   Track in the current pattern.
+		 *
+		 * @param eventIndex
+		 *   Index of the event in the track.
+		 *
+		 * @return The event, or NULL if the song no longer has a GotoEvent there
+		 *   because it was changed without calling songChanged().
+		 */
+		const GotoEvent *songGotoEvent(unsigned int trackIndex,
+			unsigned long eventIndex) const;
+
+		/// Add the mix bus to the output buffer, generating frames as needed.
+		/**
+		 * @param add
+		 *   Function to convert the mix bus samples to the output format and add
+		 *   them to the output buffer.
+		 */
+		template <class T>
+		void mixBus(T *output, unsigned long samples, Position *pos,
+			void (*add)(T *, const int32_t *, unsigned long));
+
+		/// Get the position of the next sample to come out of frameBuffer.
+		/**
+		 * @param pos
+		 *   On return, the position of the row that the next sample belongs to.
+		 *   Once the whole block has been used, this is the position of the row
+		 *   that will start the next block.
+		 */
+		void getPosition(Position *pos) const;
+
+		/// Get the seek index, building it first if needed.
+		EventHandler_Playback_Seek *getSeekIndex();
+
+		/// Move the track cursors to the current row, rewinding if needed.
+		void seekCursors();
+
+		/// Count how many rows after the current one have no events.
+		/**
+		 * @param maxRows
+		 *   Stop counting at this many rows.
+		 *
+		 * @return Number of rows that can be synthesized along with the current
+		 *   one.  This stops at the end of the pattern, and is zero if a jump
+		 *   takes effect at the end of the current row.
+		 *
+		 * @pre The cursors have just processed the current row.
+		 */
+		unsigned int emptyRowsAhead(unsigned int maxRows);
 };
 
 } // namespace gamemusic
@@ -0,0 +1,255 @@
+/**
+ * @file  camoto/gamemusic/render.hpp
+ * @brief Functions for rendering songs to .wav files.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_GAMEMUSIC_RENDER_HPP_
+#define _CAMOTO_GAMEMUSIC_RENDER_HPP_
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <camoto/stream.hpp>
+#include <camoto/gamemusic/manager.hpp>
+#include <camoto/gamemusic/playback.hpp>
+
+namespace camoto {
+namespace gamemusic {
+
+/// Sample rate used when rendering to .wav, in Hertz.
+const unsigned long RENDER_SAMPLE_RATE = 48000;
+
+/// Callback used to report progress while rendering.
+/**
+ * The parameter is the playback position of the audio just written.
+ */
+typedef std::function<void(const Playback::Position&)> RenderProgressCallback;
+
+/// Render a song to a 16-bit stereo .wav file.
+/**
+ * @param wav
+ *   Output stream to write the .wav data to.  The stream must be seekable as
+ *   the header is updated once the length is known.
+ *
+ * @param music
+ *   Song to render.
+ *
+ * @param bankMIDI
+ *   Patch bank to use for MIDI notes, or NULL to leave MIDI tracks silent.
+ *
+ * @param loopCount
+ *   Number of times to play the song.  1=once, 2=twice (loop once).  0
+ *   (loop forever) is not allowed.
+ *
+ * @param extraTime
+ *   Number of seconds to linger after song finishes, to let notes fade out.
+ *
+ * @param progress
+ *   Optional function called after each block of audio is written.
+ *
+ * @param warnings
+ *   Optional list to append any warnings raised while playing the song to,
+ *   such as notes dropped for lack of a MIDI patch.  Nothing is printed.
+ *
+ * @return Length of the audio written, in milliseconds.
+ *
+ * @throw format_limitation
+ *   loopCount was 0.
+ *
+ * @throw stream::error
+ *   The song could not be played, or the output could not be written.
+ */
+unsigned long CAMOTO_GAMEMUSIC_API renderWAV(stream::output& wav,
+	std::shared_ptr<const Music> music,
+	std::shared_ptr<const PatchBank> bankMIDI, unsigned int loopCount,
+	unsigned int extraTime, RenderProgressCallback progress = nullptr,
+	std::vector<std::string> *warnings = NULL);
+
+/// Render a song to a 16-bit stereo .wav file, using multiple threads.
+/**
+ * The song is played through once without generating any audio, to find the
+ * start of each order.  It is then cut into segments at these points, which
+ * are rendered on separate threads and joined back together.  Orders longer
+ * than a few seconds, such as in single-pattern songs, are also cut part way
+ * through.  Each segment is kept in memory until it has been written, so
+ * threads wait rather than render too far ahead of the output, keeping the
+ * memory used independent of the length of the song.
+ *
+ * The OPL registers, tempo, loop counters and PCM notes are carried across
+ * to each segment, but the OPL chips themselves are not, so OPL notes that
+ * are still sounding across a join would restart their envelopes.  To avoid
+ * this, each segment starts rendering \a overlapOrders orders (or pieces of
+ * a long order) early and discards that audio.  Songs where an OPL note lasts
+ * longer than this may sound slightly different at the joins compared to
+ * renderWAV().
+ *
+ * Unlike renderWAV(), the length of the output is not rounded up to a whole
+ * block of audio.
+ *
+ * @param wav
+ *   Output stream to write the .wav data to.  The stream must be seekable as
+ *   the header is updated once the length is known.
+ *
+ * @param music
+ *   Song to render.
+ *
+ * @param bankMIDI
+ *   Patch bank to use for MIDI notes, or NULL to leave MIDI tracks silent.
+ *
+ * @param loopCount
+ *   Number of times to play the song.  1=once, 2=twice (loop once).  0
+ *   (loop forever) is not allowed.
+ *
+ * @param extraTime
+ *   Number of seconds to linger after song finishes, to let notes fade out.
+ *
+ * @param threads
+ *   Number of threads to use, or 0 to use one per CPU core.
+ *
+ * @param overlapOrders
+ *   Number of orders to render before the start of each segment, to let any
+ *   OPL notes settle.
+ *
+ * @param warnings
+ *   Optional list to append any warnings raised while playing the song to,
+ *   as for renderWAV().  They are listed in song order regardless of which
+ *   thread raised them.
+ *
+ * @return Length of the audio written, in milliseconds.
+ *
+ * @throw format_limitation
+ *   loopCount was 0.
+ *
+ * @throw stream::error
+ *   The song could not be played, or the output could not be written.
+ */
+unsigned long CAMOTO_GAMEMUSIC_API renderWAVParallel(stream::output& wav,
+	std::shared_ptr<const Music> music,
+	std::shared_ptr<const PatchBank> bankMIDI, unsigned int loopCount,
+	unsigned int extraTime, unsigned int threads = 0,
+	unsigned int overlapOrders = 1, std::vector<std::string> *warnings = NULL);
+
+/// One song to render with renderBatch().
+struct CAMOTO_GAMEMUSIC_API RenderJob
+{
+	/// Filename of the song to render.
+	std::string inputFilename;
+
+	/// Format code of the song (see MusicType::code()), or empty to autodetect.
+	std::string inputType;
+
+	/// Filename of the .wav file to create.
+	std::string outputFilename;
+
+	/// Number of times to play the song, as for renderWAV().
+	unsigned int loopCount;
+
+	/// Number of seconds to linger at the end, as for renderWAV().
+	unsigned int extraTime;
+
+	/// Patch bank to use for MIDI notes, or NULL to leave MIDI tracks silent.
+	/**
+	 * The bank is only read, so the same one can be shared between all jobs.
+	 */
+	std::shared_ptr<const PatchBank> bankMIDI;
+};
+
+/// Outcome of a single RenderJob.
+struct CAMOTO_GAMEMUSIC_API RenderResult
+{
+	/// True if the .wav file was written successfully.
+	bool success;
+
+	/// Reason for failure, if \ref success is false.
+	std::string error;
+
+	/// Length of the audio written, in milliseconds.
+	unsigned long msAudio;
+
+	/// Time taken to open and render the song, in milliseconds.
+	unsigned long msElapsed;
+
+	/// Warnings raised while playing the song, as for renderWAV().
+	std::vector<std::string> warnings;
+};
+
+/// Callback used to report each job as it finishes.
+/**
+ * @param jobIndex
+ *   Index of the job in the list passed to renderBatch().
+ *
+ * @param result
+ *   Outcome of the job.
+ */
+typedef std::function<void(unsigned int jobIndex, const RenderResult& result)>
+	RenderJobCallback;
+
+/// Open a song from a file, autodetecting the format if needed.
+/**
+ * Any supplemental files needed by the format are opened from the same
+ * location as the song.
+ *
+ * @param filename
+ *   Filename of the song.
+ *
+ * @param type
+ *   Format code of the song, or empty to autodetect.  When autodetecting, the
+ *   most certain match is used, and formats whose supplemental files are
+ *   missing are skipped.
+ *
+ * @return The song.
+ *
+ * @throw format_limitation
+ *   The format could not be autodetected, or the type code is unknown.
+ *
+ * @throw stream::error
+ *   The file, or a supplemental file, could not be opened or read.
+ */
+std::shared_ptr<Music> CAMOTO_GAMEMUSIC_API openMusic(
+	const std::string& filename, const std::string& type);
+
+/// Render a list of songs to .wav files, using multiple threads.
+/**
+ * Each job is opened and rendered on its own, with its own Playback
+ * instance, so jobs can run on any thread.  Threads take the next unstarted
+ * job as soon as they finish their current one, so a few long songs do not
+ * hold up the rest of the list.
+ *
+ * A failure in one job does not stop the others.  The reason is reported in
+ * the result for that job.
+ *
+ * @param jobs
+ *   Songs to render.
+ *
+ * @param threads
+ *   Number of threads to use, or 0 to use one per CPU core.
+ *
+ * @param done
+ *   Optional function called as each job finishes.  It is called from the
+ *   thread that rendered the job, but never from two threads at once.
+ *
+ * @return One result per job, in the same order as \a jobs.
+ */
+std::vector<RenderResult> CAMOTO_GAMEMUSIC_API renderBatch(
+	const std::vector<RenderJob>& jobs, unsigned int threads = 0,
+	RenderJobCallback done = nullptr);
+
+} // namespace gamemusic
+} // namespace camoto
+
+#endif // _CAMOTO_GAMEMUSIC_RENDER_HPP_
@@ -0,0 +1,113 @@
+/**
+ * @file  camoto/gamemusic/spsc-queue.hpp
+ * @brief Lock-free queue for passing items from one thread to another.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_GAMEMUSIC_SPSC_QUEUE_HPP_
+#define _CAMOTO_GAMEMUSIC_SPSC_QUEUE_HPP_
+
+#include <atomic>
+
+namespace camoto {
+namespace gamemusic {
+
+/// Fixed-size ring buffer with one producer thread and one consumer thread.
+/**
+ * Neither side ever blocks or allocates memory, so the consumer can safely be
+ * a realtime audio callback.  Only one thread may call push(), and only one
+ * (possibly different) thread may call front() and pop().
+ *
+ * Items stay in their slot after pop() until push() overwrites them on a later
+ * lap of the ring.  The consumer can use this to hand objects back to the
+ * producer's thread to be destroyed there, by swapping them into the slot
+ * before calling pop().
+ *
+ * @tparam T
+ *   Item type.  Must be default constructible and assignable.
+ *
+ * @tparam N
+ *   Number of slots, which must be a power of two.  One slot is always left
+ *   empty, so at most N-1 items can be queued.
+ */
+template <class T, unsigned int N>
+class SPSCQueue
+{
+	static_assert((N >= 2) && ((N & (N - 1)) == 0),
+		"Queue size must be a power of two");
+
+	public:
+		SPSCQueue()
+			:	head(0),
+				tail(0)
+		{
+		}
+
+		/// Add an item to the back of the queue.
+		/**
+		 * @param item
+		 *   Item to add.  It is copied into the next free slot.
+		 *
+		 * @return true if the item was added, false if the queue was full.
+		 */
+		bool push(const T& item)
+		{
+			unsigned int t = this->tail.load(std::memory_order_relaxed);
+			unsigned int next = (t + 1) & (N - 1);
+			if (next == this->head.load(std::memory_order_acquire)) return false;
+			this->slots[t] = item;
+			this->tail.store(next, std::memory_order_release);
+			return true;
+		}
+
+		/// Get the item at the front of the queue.
+		/**
+		 * @return The item, which may be modified until pop() is called, or NULL
+		 *   if the queue is empty.
+		 */
+		T *front()
+		{
+			unsigned int h = this->head.load(std::memory_order_relaxed);
+			if (h == this->tail.load(std::memory_order_acquire)) return NULL;
+			return &this->slots[h];
+		}
+
+		/// Remove the item at the front of the queue.
+		/**
+		 * @pre front() has returned an item since the last call to pop().
+		 */
+		void pop()
+		{
+			unsigned int h = this->head.load(std::memory_order_relaxed);
+			this->head.store((h + 1) & (N - 1), std::memory_order_release);
+			return;
+		}
+
+	private:
+		T slots[N];
+
+		/// Next slot to read, only written by the consumer.
+		alignas(64) std::atomic<unsigned int> head;
+
+		/// Next slot to write, only written by the producer.
+		alignas(64) std::atomic<unsigned int> tail;
+};
+
+} // namespace gamemusic
+} // namespace camoto
+
+#endif // _CAMOTO_GAMEMUSIC_SPSC_QUEUE_HPP_
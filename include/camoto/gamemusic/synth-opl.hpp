@@ -21,6 +21,7 @@
 #ifndef _CAMOTO_GAMEMUSIC_SYNTH_OPL_HPP_
 #define _CAMOTO_GAMEMUSIC_SYNTH_OPL_HPP_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef CAMOTO_GAMEMUSIC_API
@@ -30,7 +31,16 @@
 namespace camoto {
 namespace gamemusic {
 
+struct OPLEvent;
+
 /// Interface to an OPL/FM/Adlib synthesizer.
+/**
+ * Each instance holds its own chip state.  The only data shared between
+ * instances are lookup tables that are created once, the first time any
+ * instance is reset, and never change after that.  Separate instances can
+ * therefore be used on separate threads at the same time without locking,
+ * although a single instance must only be used by one thread at a time.
+ */
 class CAMOTO_GAMEMUSIC_API SynthOPL
 {
 	public:
@@ -40,9 +50,23 @@ class CAMOTO_GAMEMUSIC_API SynthOPL
 		void reset();
 		void write(unsigned int chip, unsigned int reg, unsigned int val);
 
+		/// Write a run of OPL register/value pairs.
+		/**
+		 * The pairs are all applied straight away, in order.  Their delays are
+		 * ignored, and entries without OPLEvent::Regs set are skipped.
+		 */
+		void writeBatch(const OPLEvent *oplEvents, size_t count);
+
 		/// Synthesize and mix audio into the given buffer.
 		void mix(int16_t *output, unsigned long len);
 
+		/// Synthesize audio and add it to a 32-bit mix bus.
+		/**
+		 * The samples are at 16-bit scale but are not clipped, so the caller
+		 * should clip them once all sources have been added.
+		 */
+		void mix(int32_t *output, unsigned long len);
+
 	protected:
 		unsigned long outputSampleRate; ///< in Hertz, e.g. 44100
 
@@ -35,6 +35,14 @@ class CAMOTO_GAMEMUSIC_API SynthPCMCallback: virtual public TempoCallback
 class CAMOTO_GAMEMUSIC_API SynthPCM: virtual public EventHandler
 {
 	public:
+		/// Method used to calculate output samples between input samples.
+		enum class Interpolation {
+			Nearest, ///< Closest input sample, fastest but aliases badly
+			Linear,  ///< Straight line between the two closest input samples
+			Cubic,   ///< Catmull-Rom spline through the four closest samples
+			Sinc,    ///< 8-tap windowed sinc filter, slowest but cleanest
+		};
+
 		/// Constructor
 		/**
 		 * @param sampleRate
@@ -64,16 +72,108 @@ class CAMOTO_GAMEMUSIC_API SynthPCM: virtual public EventHandler
 		 *   instruments will be played.
 		 *   Entries 0 to 127 inclusive are for GM instruments, entries 128 to 255
 		 *   are for percussion (128=note 0, 129=note 1, etc.)
+		 *
+		 * @post Any notes playing are stopped, and the PCM patches in the bank
+		 *   are decoded ready for playback.
 		 */
 		void setBankMIDI(std::shared_ptr<const PatchBank> bankMIDI);
 
+		/// Set how samples are resampled to the output rate.
+		/**
+		 * This takes effect from the next call to mix(), including for notes
+		 * that are already playing.  The default is Interpolation::Linear.
+		 *
+		 * @param mode
+		 *   Interpolation method to use.
+		 */
+		void setInterpolation(Interpolation mode);
+
+		/// One note being played.
+		struct Sample {
+			unsigned long track;      ///< Source track (for finding note again)
+			unsigned long sampleRate; ///< Playback sample rate for this note
+			const PCMPatch *patch;    ///< Not owned, kept alive by the patch bank
+			const PCMDecoded *pcm;    ///< Not owned, kept alive by decoded
+			uint64_t pos; ///< Position in patch, in samples as 32.32 fixed point
+			bool looped;  ///< Has the note gone back to the loop start yet?
+			unsigned int vol; // 0..255
+		};
+
+		/// Everything needed to continue the notes playing at a given point.
+		struct State {
+			std::vector<Sample> voices; ///< Notes playing, in voice pool order
+		};
+
+		/// Everything reset() has to allocate, see prepare().
+		struct Setup {
+			std::vector<TrackInfo> trackInfo;
+			std::shared_ptr<const PatchBank> patches;
+			std::shared_ptr<const PatchBank> bankMIDI;
+			std::vector<std::shared_ptr<const PCMDecoded>> decoded;
+			std::vector<std::shared_ptr<const PCMDecoded>> decodedMIDI;
+			std::vector<Sample> voices;
+			std::vector<int> trackVoice;
+		};
+
 		/// Reset the synthesiser to initial state.
 		/**
+		 * Voices are allocated here for every track, and the PCM patches are
+		 * decoded, so that playing notes afterwards does not allocate memory.
+		 *
+		 * The patches are referenced without being copied, so they must not be
+		 * changed until reset() is called again.  New patches may be added to
+		 * the end of the bank, see updatePatches().
+		 *
 		 * @post Object is in same state as it is just following the constructor.
 		 */
 		void reset(const std::vector<TrackInfo>& trackInfo,
 			std::shared_ptr<const PatchBank> patches);
 
+		/// Allocate the voices and decode the patches for a later reset().
+		/**
+		 * This does not touch any synthesiser, so it can be run on a different
+		 * thread to the one that will call reset(Setup&).
+		 *
+		 * @param trackInfo
+		 *   Tracks in the song.
+		 *
+		 * @param patches
+		 *   Song's patch bank.
+		 *
+		 * @param bankMIDI
+		 *   Bank to play MIDI notes with, as for setBankMIDI().  May be NULL.
+		 *
+		 * @param setup
+		 *   On return, ready to pass to reset(Setup&).
+		 */
+		static void prepare(const std::vector<TrackInfo>& trackInfo,
+			std::shared_ptr<const PatchBank> patches,
+			std::shared_ptr<const PatchBank> bankMIDI, Setup *setup);
+
+		/// Reset the synthesiser to initial state without allocating memory.
+		/**
+		 * @param setup
+		 *   Populated by prepare().  It is swapped with the synthesiser's old
+		 *   state, so whichever thread destroys it afterwards is the one that
+		 *   frees the old voices and patches.
+		 *
+		 * @post Object is in same state as it is just following the constructor.
+		 */
+		void reset(Setup& setup);
+
+		/// Decode any patches added to the banks since reset().
+		/**
+		 * Notes using a PCM patch that was added to the song's bank (or the MIDI
+		 * bank) after reset() are not played until this has been called, as
+		 * decoding them while mixing would allocate memory on the audio thread.
+		 * Patches that were already decoded are left as they are, so notes
+		 * currently playing are not affected.
+		 *
+		 * This allocates memory, so it must not be called from a realtime
+		 * thread while mix() is running.
+		 */
+		void updatePatches();
+
 		/// Synthesize and mix one frame of audio into the given buffer.
 		/**
 		 * @post Any active effects that change on each frame are updated to then
@@ -81,6 +181,48 @@ class CAMOTO_GAMEMUSIC_API SynthPCM: virtual public EventHandler
 		 */
 		void mix(int16_t *output, unsigned long len);
 
+		/// Synthesize one frame of audio and add it to a 32-bit mix bus.
+		/**
+		 * This is the same as the 16-bit mix() except that each note is added
+		 * to the buffer linearly, without any clipping.  The samples are at
+		 * 16-bit scale, and the caller is expected to clip them once all sources
+		 * have been added.
+		 *
+		 * @post Any active effects that change on each frame are updated to then
+		 *   next frame.
+		 */
+		void mix(int32_t *output, unsigned long len);
+
+		/// Move every note on as if mix() had been called, without any output.
+		/**
+		 * This is much quicker than mixing into a buffer that is thrown away,
+		 * and leaves each note at exactly the same position.
+		 *
+		 * @param len
+		 *   Number of samples to skip, as for mix().
+		 */
+		void skip(unsigned long len);
+
+		/// Save the notes currently playing.
+		/**
+		 * @param state
+		 *   On return, a copy of every voice in use.
+		 */
+		void saveState(State *state) const;
+
+		/// Continue playing notes from a previously saved state.
+		/**
+		 * Any notes currently playing are replaced by those in the state.
+		 *
+		 * @param state
+		 *   State previously populated by saveState(), from this or another
+		 *   instance playing the same song.
+		 *
+		 * @pre reset() has been called with the same tracks and patches as the
+		 *   instance the state was saved from.
+		 */
+		void restoreState(const State& state);
+
 		// EventHandler overrides
 		virtual void endOfTrack(unsigned long delay);
 		virtual void endOfPattern(unsigned long delay);
@@ -103,18 +245,79 @@ class CAMOTO_GAMEMUSIC_API SynthPCM: virtual public EventHandler
 		std::vector<TrackInfo> trackInfo;    ///< Track to channel assignments
 		std::shared_ptr<const PatchBank> patches;  ///< Patch bank
 		std::shared_ptr<const PatchBank> bankMIDI; ///< Optional patch bank for MIDI notes
+		Interpolation interpolation;         ///< Resampling method
 
-		struct Sample {
-			unsigned long track;      ///< Source track (for finding note again)
-			unsigned long sampleRate; ///< Playback sample rate for this note
-			std::shared_ptr<PCMPatch> patch;
-			unsigned long pos; ///< Number of samples played at outputSampleRate
-			unsigned int vol; // 0..255
-		};
-		std::vector<Sample> activeSamples;
+		/// Decoded samples for each patch in the bank, NULL for non-PCM patches
+		std::vector<std::shared_ptr<const PCMDecoded>> decoded;
+
+		/// Decoded samples for each patch in bankMIDI
+		std::vector<std::shared_ptr<const PCMDecoded>> decodedMIDI;
+
+		/// Voice pool, one per track.  Only the first numVoices are playing.
+		std::vector<Sample> voices;
+
+		/// Number of notes currently playing.
+		unsigned int numVoices;
+
+		/// Index into voices of the note playing on each track, or -1 if none.
+		std::vector<int> trackVoice;
+
+		/// Audio for a single note, before it is mixed into the output
+		/**
+		 * This is allocated once by the constructor, and mix() renders each note
+		 * in pieces that fit, so that mixing never allocates memory.
+		 */
+		std::vector<int16_t> voiceBuffer;
+
+		/// Generate the next block of audio for a single note into voiceBuffer.
+		/**
+		 * @param sample
+		 *   Note to generate.  Its position is advanced.
+		 *
+		 * @param len
+		 *   Maximum number of samples to generate (stereo, so twice the number
+		 *   of frames.)
+		 *
+		 * @param complete
+		 *   On return, set to true if the note has finished and should be
+		 *   removed from the voice pool.
+		 *
+		 * @return Number of samples placed in voiceBuffer.
+		 *
+		 * @pre \a len is no larger than voiceBuffer.
+		 */
+		unsigned long renderVoice(Sample& sample, unsigned long len,
+			bool *complete);
 
 		/// Switch all notes off on the given track.
 		void noteOff(unsigned int trackIndex);
+
+		/// Stop a voice, moving the last playing voice into its slot.
+		void removeVoice(unsigned int v);
+
+		/// Decode all the PCM patches in a bank ready for playback.
+		/**
+		 * @param bank
+		 *   Bank to decode, may be NULL.
+		 *
+		 * @param decoded
+		 *   Set to the decoded data for each patch in the bank.
+		 */
+		static void decodePatches(std::shared_ptr<const PatchBank> bank,
+			std::vector<std::shared_ptr<const PCMDecoded>> *decoded);
+
+		/// Decode any PCM patches in a bank that don't have decoded data yet.
+		/**
+		 * @param bank
+		 *   Bank to decode, may be NULL.
+		 *
+		 * @param decoded
+		 *   Grown to the size of the bank if needed, with the decoded data
+		 *   filled in for each PCM patch that had none.  Existing entries are
+		 *   kept.
+		 */
+		static void decodeNewPatches(std::shared_ptr<const PatchBank> bank,
+			std::vector<std::shared_ptr<const PCMDecoded>> *decoded);
 };
 
 } // namespace gamemusic
@@ -22,6 +22,11 @@
 #define _CAMOTO_GAMEMUSIC_UTIL_PCM_HPP_
 
 #include <cassert>
+#include <stdint.h>
+
+#ifndef CAMOTO_GAMEMUSIC_API
+#define CAMOTO_GAMEMUSIC_API
+#endif
 
 namespace camoto {
 namespace gamemusic {
@@ -58,6 +63,64 @@ inline long pcm_mix_s16(long a, long b)
 	return -32768 + m;
 }
 
+/// Mix a block of PCM samples into another.
+/**
+ * This produces exactly the same result as calling pcm_mix_s16() on each
+ * sample, but processes multiple samples at once using SSE2, AVX2 or NEON
+ * instructions where the CPU supports them.  The best implementation is
+ * chosen at runtime on the first call.
+ *
+ * @param dest
+ *   Samples to mix into.  On return, each sample is the mix of the original
+ *   value and the matching sample in \a src.
+ *
+ * @param src
+ *   Samples to mix in.  May not overlap \a dest.
+ *
+ * @param len
+ *   Number of samples to mix.  For stereo data this is twice the number of
+ *   sample frames.
+ */
+void CAMOTO_GAMEMUSIC_API pcm_mix_s16_block(int16_t *dest, const int16_t *src,
+	unsigned long len);
+
+/// Add a block of 32-bit mix bus samples into 16-bit output.
+/**
+ * The mix bus holds samples at 16-bit scale, but with extra headroom so that
+ * many sources can be summed without clipping.  Each sample in \a src is
+ * added to the matching sample in \a dest and the result is clipped to the
+ * 16-bit range.
+ *
+ * @param dest
+ *   16-bit samples to add to.
+ *
+ * @param src
+ *   Mix bus samples to add in.
+ *
+ * @param len
+ *   Number of samples to add.  For stereo data this is twice the number of
+ *   sample frames.
+ */
+void CAMOTO_GAMEMUSIC_API pcm_add_bus_s16_block(int16_t *dest,
+	const int32_t *src, unsigned long len);
+
+/// Add a block of 32-bit mix bus samples into 32-bit output.
+/**
+ * Same as pcm_add_bus_s16_block() but the mix bus samples are scaled up to
+ * the full 32-bit range before being added, and clipped to that range.
+ */
+void CAMOTO_GAMEMUSIC_API pcm_add_bus_s32_block(int32_t *dest,
+	const int32_t *src, unsigned long len);
+
+/// Add a block of 32-bit mix bus samples into floating point output.
+/**
+ * Same as pcm_add_bus_s16_block() but the mix bus samples are scaled to
+ * -1.0..1.0 before being added.  No clipping is done, so samples louder than
+ * full scale are passed through as values outside this range.
+ */
+void CAMOTO_GAMEMUSIC_API pcm_add_bus_f32_block(float *dest,
+	const int32_t *src, unsigned long len);
+
 } // namespace gamemusic
 } // namespace camoto
 
@@ -0,0 +1,85 @@
+/**
+ * @file  autodetect.cpp
+ * @brief Work out which format a music file is in.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <ctype.h>
+#include <camoto/stream_string.hpp>
+#include <camoto/gamemusic/autodetect.hpp>
+
+using namespace camoto;
+using namespace camoto::gamemusic;
+
+/// Get the lowercase extension of a filename, without the dot.
+static std::string lowerExtension(const std::string& filename)
+{
+	auto dot = filename.find_last_of("./\\");
+	if ((dot == std::string::npos) || (filename[dot] != '.')) return {};
+	std::string ext = filename.substr(dot + 1);
+	for (auto& c : ext) c = tolower(c);
+	return ext;
+}
+
+/// Does this format list the given (lowercase) extension?
+static bool hasExtension(const MusicType& type, const std::string& ext)
+{
+	if (ext.empty()) return false;
+	for (auto e : type.fileExtensions()) {
+		for (auto& c : e) c = tolower(c);
+		if (e == ext) return true;
+	}
+	return false;
+}
+
+std::vector<FormatMatch> camoto::gamemusic::detectFormat(
+	stream::input& content, const std::string& filename, bool all)
+{
+	// Copy small files into memory so the probes don't hit the real file
+	stream::string cache;
+	stream::input *probe = &content;
+	stream::len lenContent = content.size();
+	if (lenContent <= DETECT_MAX_CACHED) {
+		cache.data.resize(lenContent);
+		content.seekg(0, stream::start);
+		content.read(&cache.data[0], lenContent);
+		probe = &cache;
+	}
+
+	auto formats = MusicManager::formats();
+	std::string ext = lowerExtension(filename);
+	std::stable_partition(formats.begin(), formats.end(),
+		[&ext](const MusicManager::handler_t& i) {
+			return hasExtension(*i, ext);
+		}
+	);
+
+	std::vector<FormatMatch> matches;
+	for (const auto& i : formats) {
+		auto cert = i->isInstance(*probe);
+		if (cert == MusicType::Certainty::DefinitelyNo) continue;
+		matches.push_back({i, cert});
+		if (!all && (cert == MusicType::Certainty::DefinitelyYes)) break;
+	}
+	std::stable_sort(matches.begin(), matches.end(),
+		[](const FormatMatch& a, const FormatMatch& b) {
+			return a.certainty > b.certainty;
+		}
+	);
+	return matches;
+}
@@ -1326,11 +1326,7 @@ void Chip::Setup( Bit32u rate ) {
 	}
 }
 
-static bool doneTables = false;
-void InitTables( void ) {
-	if ( doneTables )
-		return;
-	doneTables = true;
+static void CreateTables( void ) {
 #if ( DBOPL_WAVE == WAVE_HANDLER ) || ( DBOPL_WAVE == WAVE_TABLELOG )
 	//Exponential volume table, same as the real adlib
 	for ( int i = 0; i < 256; i++ ) {
@@ -1503,6 +1499,14 @@ void Handler::Generate( MixerChannel* chan, Bitu samples ) {
 	}
 }
 
+//The tables are shared by every chip and never change once created.  A
+//function-local static is initialised exactly once, with any other threads
+//waiting until it is done, so several chips can be set up at the same time.
+void InitTables( void ) {
+	static const bool doneTables = ( CreateTables(), true );
+	(void)doneTables;
+}
+
 void Handler::Init( Bitu rate ) {
 	InitTables();
 	chip.Setup( rate );
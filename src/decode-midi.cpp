@@ -27,6 +27,7 @@
 #include <camoto/gamemusic/util-midi.hpp>
 #include "patch-adlib.hpp"
 #include "decode-midi.hpp"
+#include "patch-index.hpp"
 #include "track-split.hpp"
 
 using namespace camoto;
@@ -91,6 +92,7 @@ class MIDIDecoder
 		PatchBank patches;             ///< Cached patches populated by getPatchBank()
 		MIDIFlags midiFlags;           ///< Flags supplied in constructor
 		Tempo curTempo;                   ///< Last set song tempo
+		PatchIndex patchIndex;            ///< Patches already in the song
 
 		/// For each of the percussion notes, which instrument are we using?
 		uint8_t percMap[MIDI_NOTES];
@@ -129,6 +131,92 @@ std::unique_ptr<Music> camoto::gamemusic::midiDecode(stream::input& input,
 	return decoder.decode(input);
 }
 
+void camoto::gamemusic::midiScan(stream::input& content, MIDIFlags flags,
+	const Tempo& initialTempo, MusicSummary *summary)
+{
+	Tempo tempo = initialTempo;
+	double usTotal = 0;
+	unsigned long messages = 0;
+	uint8_t lastEvent = 0;
+	try {
+		bool eof = false;
+		do {
+			uint32_t delay;
+			content >> u28midi(delay);
+			usTotal += delay * tempo.usPerTick;
+
+			// Same running status handling as MIDIDecoder::decode()
+			uint8_t event, evdata;
+			content >> u8(event);
+			if (event & 0x80) {
+				if ((event & 0xF0) != 0xF0) lastEvent = event;
+				content >> u8(evdata);
+			} else {
+				evdata = event;
+				event = lastEvent;
+			}
+			if (flags & MIDIFlags::ShortAftertouch) {
+				if ((event & 0xF0) == 0xA0) event = 0xD0 | (event & 0x0F);
+			}
+			messages++;
+
+			switch (event & 0xF0) {
+				case 0x80: // Note off
+				case 0x90: // Note on
+				case 0xA0: // Polyphonic key pressure
+				case 0xB0: // Controller
+				case 0xE0: // Pitch bend
+					content.seekg(1, stream::cur); // second data byte
+					break;
+				case 0xC0: // Instrument change
+				case 0xD0: // Channel pressure
+					break;
+				case 0xF0:
+					switch (event) {
+						case 0xF0: // Sysex
+							while ((evdata & 0x80) == 0) content >> u8(evdata);
+							break;
+						case 0xF1: // MIDI Time Code Quarter Frame
+						case 0xF3: // Song select
+							content.seekg(1, stream::cur);
+							break;
+						case 0xF2: // Song position pointer
+							content.seekg(2, stream::cur);
+							break;
+						case 0xFC: // Stop
+							eof = true;
+							break;
+						case 0xFF: { // Meta-event
+							uint32_t len;
+							content >> u28midi(len);
+							if (evdata == 0x2F) { // end of track
+								eof = true;
+							} else if ((evdata == 0x51) && (len == 3)) { // set tempo
+								uint8_t n[3];
+								content.read(n, 3);
+								tempo.usPerQuarterNote((n[0] << 16) | (n[1] << 8) | n[2]);
+							} else {
+								content.seekg(len, stream::cur);
+							}
+							break;
+						}
+					}
+					break;
+			}
+		} while (!eof);
+	} catch (const stream::incomplete_read&) {
+		// reached eof
+	}
+
+	summary->trackInfo.clear();
+	summary->patternCount = 1;
+	summary->orderCount = 1;
+	summary->instrumentCount = MusicSummary::Unknown;
+	summary->eventCount = messages;
+	summary->msLength = usTotal / 1000;
+	return;
+}
+
 
 MIDIDecoder::MIDIDecoder(MIDIFlags midiFlags, const Tempo& initialTempo)
 	:	totalDelay(0),
@@ -679,26 +767,10 @@ std::unique_ptr<Music> MIDIDecoder::decode(stream::input& content)
 void MIDIDecoder::setInstrument(PatchBank& patches, unsigned int midiChannel,
 	unsigned int midiPatch)
 {
-	bool found = false;
-	int n = 0;
-	for (auto& i : patches) {
-		auto p = std::dynamic_pointer_cast<MIDIPatch>(i);
-		if (!p) continue;
-		if (p->percussion) continue;
-		if (p->midiPatch == midiPatch) {
-			this->currentInstrument[midiChannel] = n;
-			found = true;
-			break;
-		}
-		n++;
-	}
-	if (!found) {
-		// Have to allocate a new instrument
-		auto newPatch = std::make_shared<MIDIPatch>();
-		newPatch->percussion = false;
-		newPatch->midiPatch = midiPatch;
-		this->currentInstrument[midiChannel] = patches.size();
-		patches.push_back(newPatch);
-	}
+	auto newPatch = std::make_shared<MIDIPatch>();
+	newPatch->percussion = false;
+	newPatch->midiPatch = midiPatch;
+	this->currentInstrument[midiChannel] =
+		this->patchIndex.findOrAdd(patches, newPatch);
 	return;
 }
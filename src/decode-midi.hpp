@@ -22,6 +22,7 @@
 #define _CAMOTO_GAMEMUSIC_DECODE_MIDI_HPP_
 
 #include <camoto/gamemusic/music.hpp>
+#include <camoto/gamemusic/musictype.hpp>
 #include <camoto/gamemusic/eventconverter-midi.hpp>
 #include <camoto/stream.hpp>
 
@@ -56,6 +57,30 @@ namespace gamemusic {
 std::unique_ptr<Music> CAMOTO_GAMEMUSIC_API midiDecode(stream::input& input,
 	MIDIFlags flags, const Tempo& initialTempo);
 
+/// Count the messages in caller-supplied SMF MIDI data, and find its length.
+/**
+ * This reads the same data as midiDecode() but skips creating any events or
+ * patches, for use in MusicType::probe().
+ *
+ * @param input
+ *   Data stream containing the MIDI data, read until EOF or an end-of-track
+ *   event as for midiDecode().
+ *
+ * @param flags
+ *   One or more flags, as for midiDecode().
+ *
+ * @param initialTempo
+ *   Initial tempo of the song.
+ *
+ * @param summary
+ *   On return, eventCount is set to the number of MIDI messages (including
+ *   meta-events) and msLength to the total of all the delays.  The song is
+ *   treated as a single pattern with an unknown number of instruments and an
+ *   unknown track layout.
+ */
+void CAMOTO_GAMEMUSIC_API midiScan(stream::input& input, MIDIFlags flags,
+	const Tempo& initialTempo, MusicSummary *summary);
+
 } // namespace gamemusic
 } // namespace camoto
 
@@ -19,6 +19,7 @@
  */
 
 #define _USE_MATH_DEFINES
+#include <algorithm>
 #include <math.h>
 #include <iostream>
 #include <camoto/util.hpp> // make_unique
@@ -29,90 +30,8 @@
 using namespace camoto;
 using namespace camoto::gamemusic;
 
-class OPLDecoder
-{
-	public:
-		/// Set decoding parameters.
-		/**
-		 * @param cb
-		 *   Callback class used to read the actual OPL data bytes from the file.
-		 *
-		 * @param delayType
-		 *   Where the delay is actioned - before its associated data pair is sent
-		 *   to the OPL chip, or after.
-		 *
-		 * @param fnumConversion
-		 *   Conversion constant to use when converting OPL frequency numbers into
-		 *   Hertz.  Can be one of OPL_FNUM_* or a raw value.
-		 *
-		 * @param initialTempo
-		 *   Initial tempo of the song.
-		 */
-		OPLDecoder(OPLReaderCallback *cb, DelayType delayType,
-			double fnumConversion, const Tempo& initialTempo);
-
-		~OPLDecoder();
-
-		/// Read the input data and set events and instruments accordingly.
-		/**
-		 * This function will call the callback's readNextPair() function repeatedly
-		 * until it returns false.  It will populate the events and instruments in
-		 * the supplied Music instance.
-		 *
-		 * @throw stream:error
-		 *   If the input data could not be read or converted for some reason.
-		 */
-		std::unique_ptr<Music> decode();
-
-	private:
-		OPLReaderCallback *cb;     ///< Callback to use to get more OPL data
-		DelayType delayType;       ///< Location of the delay
-		double fnumConversion;     ///< Conversion value to use in fnum -> Hz calc
-		Tempo initialTempo;        ///< Initial tempo to set
-
-		unsigned long lastDelay[OPL_TRACK_COUNT];   ///< Delay ticks accrued since last event
-		uint8_t oplState[OPL_NUM_CHIPS][256];  ///< Current register values
-		//std::shared_ptr<PatchBank> patches;      ///< Patch storage
-
-		std::shared_ptr<OPLPatch> getCurrentPatch(int chipIndex, int oplChannel);
-
-		/// Add the given patch to the patchbank.
-		/**
-		 * @param patches
-		 *   Patchbank to search and possibly append to.
-		 *
-		 * @param curPatch
-		 *   Patch to search for and possibly add if it is not already in the
-		 *   patchbank.
-		 *
-		 * @return Index of this instrument in the patchbank.
-		 */
-		int savePatch(PatchBank& patches, std::shared_ptr<OPLPatch> curPatch);
-
-		void createNoteOn(Track& trackEvents, PatchBank& patches,
-			unsigned long *lastDelay, unsigned int chipIndex, unsigned int oplChannel,
-			OPLPatch::Rhythm rhythm, unsigned int b0val);
-
-		/// Switch off the note currently playing on the channel.
-		/**
-		 * This also backtracks the most recent events on the channel, and if there
-		 * were any effects with zero delay before the note-off then those events
-		 * are removed, since they will never be heard.
-		 */
-		void createNoteOff(unsigned int track, Track& trackEvents);
-
-		void createOrUpdatePitchbend(Track& trackEvents,
-			unsigned long *lastDelay, unsigned int a0val, unsigned int b0val);
-
-		/// Remove all the effects of the given type up until the last delay.
-		/**
-		 * This is used when generating a volume event, to remove any preceding
-		 * volume changes that wouldn't be heard because there are no delays
-		 * between those events and the one about to be produced.
-		 */
-		void removePrecedingEffects(unsigned int track, Track& trackEvents,
-			EffectEvent::Type type);
-};
+/// Number of bytes of song data OPLReaderCallback_Buffer reads at a time
+const unsigned int OPL_READ_CHUNK = 65536;
 
 /// Convert a chip index and OPL channel into a track index
 constexpr unsigned int TRACK_INDEX_MELODIC(unsigned int chipIndex, unsigned int oplChannel)
@@ -131,31 +50,114 @@ constexpr unsigned int TRACK_INDEX_PERC(unsigned int rhythm)
 std::unique_ptr<Music> camoto::gamemusic::oplDecode(OPLReaderCallback *cb,
 	DelayType delayType, double fnumConversion, const Tempo& initialTempo)
 {
-	OPLDecoder decoder(cb, delayType, fnumConversion, initialTempo);
-	return decoder.decode();
+	auto music = std::make_unique<Music>();
+	OPLStreamDecoder decoder(cb, delayType, fnumConversion, initialTempo,
+		music.get(), 0);
+	while (decoder.decodePattern());
+	return std::move(music);
 }
 
+void camoto::gamemusic::oplScan(OPLReaderCallback *cb,
+	const Tempo& initialTempo, MusicSummary *summary)
+{
+	Tempo tempo = initialTempo;
+	double usTotal = 0;
+	unsigned long pairs = 0;
+	OPLEvent oplev;
+	bool more;
+	do {
+		oplev.valid = 0;
+		oplev.delay = 0;
+		oplev.tempo = tempo;
+		more = cb->readNextPair(&oplev);
+		// Any new tempo applies to the delay in the same event
+		if (oplev.valid & OPLEvent::Tempo) tempo = oplev.tempo;
+		if (oplev.valid & OPLEvent::Delay) usTotal += oplev.delay * tempo.usPerTick;
+		if (more && (oplev.valid & OPLEvent::Regs)) pairs++;
+	} while (more);
+
+	summary->trackInfo.clear();
+	summary->patternCount = 1;
+	summary->orderCount = 1;
+	summary->instrumentCount = MusicSummary::Unknown;
+	summary->eventCount = pairs;
+	summary->msLength = usTotal / 1000;
+	return;
+}
 
-OPLDecoder::OPLDecoder(OPLReaderCallback *cb, DelayType delayType,
-	double fnumConversion, const Tempo& initialTempo)
-	:	cb(cb),
-		delayType(delayType),
-		fnumConversion(fnumConversion),
-		initialTempo(initialTempo)
+OPLReaderCallback_Buffer::OPLReaderCallback_Buffer(stream::input& content)
+	:	content(content),
+		offData(0),
+		lenLeft(0),
+		pos(NULL),
+		end(NULL)
 {
 }
 
-OPLDecoder::~OPLDecoder()
+void OPLReaderCallback_Buffer::load(stream::len lenData)
 {
+	this->offData = this->content.tellg();
+	stream::len lenAvailable = this->content.size() - this->offData;
+	if (lenData > lenAvailable) lenData = lenAvailable;
+	this->lenLeft = lenData;
+	this->data.clear();
+	this->pos = this->end = this->data.data();
+	this->fill(0);
+	return;
 }
 
-std::unique_ptr<Music> OPLDecoder::decode()
+bool OPLReaderCallback_Buffer::fill(unsigned int lenNeeded)
+{
+	// Move the bytes not yet decoded to the start of the buffer
+	std::size_t lenKeep = this->end - this->pos;
+	std::size_t offPos = this->pos - this->data.data();
+	if (lenKeep && offPos) memmove(this->data.data(), this->pos, lenKeep);
+	this->offData += offPos;
+
+	stream::len lenRead = std::min(this->lenLeft, (stream::len)OPL_READ_CHUNK);
+	this->data.resize(lenKeep + lenRead);
+	if (lenRead) {
+		this->content.seekg(this->offData + lenKeep, stream::start);
+		stream::len lenGot = this->content.try_read(this->data.data() + lenKeep,
+			lenRead);
+		this->data.resize(lenKeep + lenGot);
+		// A short read means the file is shorter than it claimed
+		this->lenLeft = (lenGot < lenRead) ? 0 : this->lenLeft - lenGot;
+	}
+	this->pos = this->data.data();
+	this->end = this->pos + this->data.size();
+	return (unsigned long)(this->end - this->pos) >= lenNeeded;
+}
+
+void OPLReaderCallback_Buffer::seekPastData()
+{
+	this->content.seekg(this->offData + (this->pos - this->data.data()),
+		stream::start);
+	return;
+}
+
+
+OPLStreamDecoder::OPLStreamDecoder(OPLReaderCallback *cb, DelayType delayType,
+	double fnumConversion, const Tempo& initialTempo, Music *music,
+	unsigned long ticksPerPattern)
+	:	cb(cb),
+		delayType(delayType),
+		fnumConversion(fnumConversion),
+		music(music),
+		ticksPerPattern(ticksPerPattern),
+		lastTempo(initialTempo),
+		opl3(false),
+		totalDelay(0),
+		patternStart(0),
+		pending(false),
+		endOfData(false),
+		finished(false)
 {
-	auto music = std::make_unique<Music>();
 	music->patches = std::make_shared<PatchBank>();
 
-	music->initialTempo = this->initialTempo;
+	music->initialTempo = initialTempo;
 	music->loopDest = -1; // no loop
+	music->ticksPerTrack = ticksPerPattern;
 
 	for (unsigned int c = 0; c < OPL_TRACK_COUNT; c++) {
 		music->trackInfo.emplace_back();
@@ -173,396 +175,447 @@ std::unique_ptr<Music> OPLDecoder::decode()
 		}
 	}
 
-	music->patterns.emplace_back();
-	auto& pattern = music->patterns.back();
-	for (unsigned int track = 0; track < OPL_TRACK_COUNT; track++) {
-		pattern.emplace_back();
-	}
-	music->patternOrder.push_back(0);
-
 	// Initialise all OPL registers to zero
-	memset(oplState, 0, sizeof(oplState));
+	memset(this->oplState, 0, sizeof(this->oplState));
 	for (unsigned int t = 0; t < OPL_TRACK_COUNT; t++) this->lastDelay[t] = 0;
 
-	unsigned long totalDelay = 0;
+	this->oplev.tempo = this->lastTempo;
+	this->events.resize(OPL_TRACK_COUNT);
+}
 
-	Tempo lastTempo = this->initialTempo;
-	OPLEvent oplev;
-	oplev.tempo = lastTempo;
-	bool opl3 = false;
-	for (;;) {
-		oplev.valid = 0;
-		if (!this->cb->readNextPair(&oplev)) {
-			// No more events
-			if (oplev.valid & OPLEvent::Delay) {
-				// oplev.delay still has a final trailing delay
-				totalDelay += oplev.delay;
-				for (unsigned int t = 0; t < OPL_TRACK_COUNT; t++) {
-					this->lastDelay[t] += oplev.delay;
+OPLStreamDecoder::~OPLStreamDecoder()
+{
+}
+
+bool OPLStreamDecoder::decodePattern()
+{
+	if (this->finished) return false;
+
+	if (!this->music->patterns.empty()) {
+		// Delays are relative to the start of the new pattern
+		this->patternStart += this->ticksPerPattern;
+		for (unsigned int t = 0; t < OPL_TRACK_COUNT; t++) {
+			this->lastDelay[t] = this->totalDelay - this->patternStart;
+		}
+	}
+
+	// Build the pattern in compact form first, so events that are merged or
+	// removed before the pattern is finished are never allocated, and the
+	// rest can be allocated together once each track is complete.
+	for (auto& track : this->events) track.clear();
+	this->decodeEvents(this->events);
+
+	this->music->patternOrder.push_back(this->music->patterns.size());
+	this->music->patterns.emplace_back();
+	auto& pattern = this->music->patterns.back();
+	pattern.reserve(OPL_TRACK_COUNT);
+	for (auto& track : this->events) pattern.push_back(expandTrack(track));
+	return true;
+}
+
+void OPLStreamDecoder::decodeEvents(CompactPattern& pattern)
+{
+	// True if the song so far extends past the end of this pattern
+	auto patternFull = [this]() {
+		return this->ticksPerPattern
+			&& (this->totalDelay >= this->patternStart + this->ticksPerPattern);
+	};
+
+	auto& oplev = this->oplev;
+	while (!this->endOfData) {
+		if (!this->pending) {
+			oplev.valid = 0;
+			if (!this->cb->readNextPair(&oplev)) {
+				// No more events
+				if (oplev.valid & OPLEvent::Delay) {
+					// oplev.delay still has a final trailing delay
+					this->totalDelay += oplev.delay;
+					for (unsigned int t = 0; t < OPL_TRACK_COUNT; t++) {
+						this->lastDelay[t] += oplev.delay;
+					}
 				}
+				this->endOfData = true;
+				break;
 			}
-			break;
+
+			if ((oplev.valid & OPLEvent::Delay) && (oplev.delay > 0)) {
+				if (this->delayType == DelayType::DelayIsPreData) {
+					this->totalDelay += oplev.delay;
+					for (unsigned int t = 0; t < OPL_TRACK_COUNT; t++) {
+						this->lastDelay[t] += oplev.delay;
+					}
+				}
+			}
+		}
+
+		if (patternFull()) {
+			// This pair belongs in a later pattern, so hang on to it until then
+			this->pending = true;
+			return;
 		}
+		this->pending = false;
+
+		this->processPair(pattern);
+
+		/// @todo If the instrument settings have changed, generate a patch change event?
+		// Will have to combine with previous patch change event if there has been no delay.
 
 		if ((oplev.valid & OPLEvent::Delay) && (oplev.delay > 0)) {
-			totalDelay += oplev.delay;
-			if (this->delayType == DelayType::DelayIsPreData) {
+			if (this->delayType == DelayType::DelayIsPostData) {
+				this->totalDelay += oplev.delay;
 				for (unsigned int t = 0; t < OPL_TRACK_COUNT; t++) {
 					this->lastDelay[t] += oplev.delay;
 				}
 			}
 		}
+		if (patternFull()) return;
+	} // while (all events)
 
-		if ((oplev.valid & OPLEvent::Tempo) && (oplev.tempo != lastTempo)) {
-			auto& trackEvents = pattern.at(0);
+	if (this->ticksPerPattern) {
+		// Any trailing delay that runs past this pattern becomes empty patterns
+		this->finished =
+			this->totalDelay <= this->patternStart + this->ticksPerPattern;
+		return;
+	}
+
+	// Put dummy events if necessary to preserve trailing delays
+	for (unsigned int track = 0; track < OPL_TRACK_COUNT; track++) {
+		auto& trackEvents = pattern.at(track);
+		if (this->lastDelay[track] && trackEvents.size()) {
 			trackEvents.emplace_back();
 			auto& te = trackEvents.back();
-			te.delay = this->lastDelay[0];
-			this->lastDelay[0] = 0;
-			auto ev = std::make_shared<TempoEvent>();
-			ev->tempo = oplev.tempo;
-			te.event = std::move(ev);
-			lastTempo = oplev.tempo;
+			te.delay = this->lastDelay[track];
+			this->lastDelay[track] = 0;
+			te.event.type = CompactEvent::Type::Configuration;
+			te.event.config.configType = ConfigurationEvent::Type::EmptyEvent;
+			te.event.config.value = 0;
 		}
+	}
 
-		if (oplev.valid & OPLEvent::Regs) {
-			assert(oplev.chipIndex < 2);
-			// Update the current state with the new value
-			uint8_t oldval = oplState[oplev.chipIndex][oplev.reg];
-			oplState[oplev.chipIndex][oplev.reg] = oplev.val;
-#define bitsChanged(b) ((oplev.val ^ oldval) & b)
+	this->music->ticksPerTrack = this->totalDelay;
+	this->finished = true;
+	return;
+}
 
-			unsigned int oplChannel = oplev.reg & 0x0F; // Only for regs 0xA0, 0xB0 and 0xC0!
-			//uint8_t channel = 1 + oplChannel + 14 * oplev.chipIndex;
+void OPLStreamDecoder::discardPatterns(unsigned int order)
+{
+	for (unsigned int i = 0; i < order; i++) {
+		for (auto& track : this->music->patterns.at(this->music->patternOrder.at(i))) {
+			Track().swap(track);
+		}
+	}
+	return;
+}
 
-			// Figure out what track to map this event to
-#define OPL_IS_RHYTHM_ON (this->oplState[0][0xBD] & 0x20)
-			bool noteon = false;
-			unsigned int track = -1;
-			if (oplev.reg == 0xBD) {
-				// handled below, could map to multiple channels at the same time
-			} else if (oplev.reg < 0x20) {
-				track = 0;
-			} else if ((oplev.reg < 0xA0) || (oplev.reg >= 0xE0)) {
-				// Convert operator index into channel
-				unsigned int oplOpIndex = oplev.reg & 0x1F;
-				unsigned int rhythm = 99;
-				if (OPL_IS_RHYTHM_ON && (oplev.chipIndex == 0)) {
-					switch (oplOpIndex) {
-						case 13: rhythm = 0; break; // hi-hat
-						case 17: rhythm = 1; break; // top cymbal
-						case 14: rhythm = 2; break; // tom-tom
-						case 16: rhythm = 3; break; // snare
-						case 12:
-						case 15: rhythm = 4; break; // bass drum
-						default: break; // normal instrument
-					}
-				}
-				if (rhythm == 99) {
-					unsigned int oplChannel = OPL2_OFF2CHANNEL(oplOpIndex); /// @todo: This only works for OPL2
-					track = TRACK_INDEX_MELODIC(oplev.chipIndex, oplChannel);
-					noteon = oplState[oplev.chipIndex][0xB0 | oplChannel] & OPLBIT_KEYON;
-				} else {
-					track = TRACK_INDEX_PERC(rhythm);
-					noteon = this->oplState[0][0xBD] & (1 << rhythm);
-				}
+void OPLStreamDecoder::processPair(CompactPattern& pattern)
+{
+	auto& oplev = this->oplev;
+	if ((oplev.valid & OPLEvent::Tempo) && (oplev.tempo != this->lastTempo)) {
+		auto& trackEvents = pattern.at(0);
+		trackEvents.emplace_back();
+		auto& te = trackEvents.back();
+		te.delay = this->lastDelay[0];
+		this->lastDelay[0] = 0;
+		TempoEvent ev;
+		ev.tempo = oplev.tempo;
+		te.event = compactEvent(ev);
+		this->lastTempo = oplev.tempo;
+	}
 
-			} else { // A0, B0, C0
-				assert(oplev.reg < 0xE0);
-				unsigned int oplChannel = oplev.reg & 0x0F;
-				if (oplChannel > 8) {
-					std::cout << "decode-opl: Invalid OPL channel " << oplChannel
-						<< "\n";
+	if (oplev.valid & OPLEvent::Regs) {
+		assert(oplev.chipIndex < 2);
+		// Update the current state with the new value
+		uint8_t oldval = oplState[oplev.chipIndex][oplev.reg];
+		oplState[oplev.chipIndex][oplev.reg] = oplev.val;
+#define bitsChanged(b) ((oplev.val ^ oldval) & b)
 
-					if (this->delayType == DelayType::DelayIsPostData) {
-						for (unsigned int t = 0; t < OPL_TRACK_COUNT; t++) {
-							this->lastDelay[t] += oplev.delay;
-						}
-					}
-					// Update the current state with the new value
-					oplState[oplev.chipIndex][oplev.reg] = oplev.val;
-					continue;
-				}
+		unsigned int oplChannel = oplev.reg & 0x0F; // Only for regs 0xA0, 0xB0 and 0xC0!
+		//uint8_t channel = 1 + oplChannel + 14 * oplev.chipIndex;
 
-				if ((OPL_IS_RHYTHM_ON) && (oplev.chipIndex == 0) && (oplChannel > 5)) {
-					// Melodic event on channels used by percussive mode
-					noteon = false;
-					track = -1;
-				} else {
-					// Normal channel (or rhythm mode bass drum)
-					track = TRACK_INDEX_MELODIC(oplev.chipIndex, oplChannel);
-					noteon = oplState[oplev.chipIndex][0xB0 | oplChannel] & OPLBIT_KEYON;
+		// Figure out what track to map this event to
+#define OPL_IS_RHYTHM_ON (this->oplState[0][0xBD] & 0x20)
+		bool noteon = false;
+		unsigned int track = -1;
+		if (oplev.reg == 0xBD) {
+			// handled below, could map to multiple channels at the same time
+		} else if (oplev.reg < 0x20) {
+			track = 0;
+		} else if ((oplev.reg < 0xA0) || (oplev.reg >= 0xE0)) {
+			// Convert operator index into channel
+			unsigned int oplOpIndex = oplev.reg & 0x1F;
+			unsigned int rhythm = 99;
+			if (OPL_IS_RHYTHM_ON && (oplev.chipIndex == 0)) {
+				switch (oplOpIndex) {
+					case 13: rhythm = 0; break; // hi-hat
+					case 17: rhythm = 1; break; // top cymbal
+					case 14: rhythm = 2; break; // tom-tom
+					case 16: rhythm = 3; break; // snare
+					case 12:
+					case 15: rhythm = 4; break; // bass drum
+					default: break; // normal instrument
 				}
 			}
-			assert((track == (unsigned int)-1) || (track < pattern.size()));
-
-			unsigned int regClass = oplev.reg & 0xF0;
-			if (oplev.reg == 0xBD) regClass = 0xBD;
-			switch (regClass) {
-				case 0x00:
-					if (oplev.reg == 0x01) {
-						if (bitsChanged(0x20)) {
-							auto& trackEvents = pattern.at(0);
-							trackEvents.emplace_back();
-							auto& te = trackEvents.back();
-							te.delay = this->lastDelay[track];
-							this->lastDelay[track] = 0;
-							auto ev = std::make_shared<ConfigurationEvent>();
-							ev->configType = ConfigurationEvent::Type::EnableWaveSel;
-							ev->value = (oplev.val & 0x20) ? 1 : 0;
-							te.event = std::move(ev);
-						}
-					} else if (oplev.reg == 0x05) {
-						if (bitsChanged(0x01)) {
-							unsigned int newState = (oplev.val & 0x01) ? 1 : 0;
-							if (
-								((opl3) && (newState == 0))
-								|| ((!opl3) && (newState == 1))
-							) {
-								auto& trackEvents = pattern.at(0);
-								trackEvents.emplace_back();
-								auto& te = trackEvents.back();
-								te.delay = this->lastDelay[track];
-								this->lastDelay[track] = 0;
-								auto ev = std::make_shared<ConfigurationEvent>();
-								ev->configType = ConfigurationEvent::Type::EnableOPL3;
-								ev->value = newState;
-								te.event = std::move(ev);
-								opl3 = newState == 1;
-							}
-						}
-					}
-					break;
-
-				case 0x20:
-				case 0x30:
-					if (noteon) {
-#warning Changing the CHAR_MULT value during playback needs to be implemented
-						std::cout << "Warning: Changing the CHAR_MULT value during playback is not yet implemented, event discarded.\n";
-					}
-					break;
+			if (rhythm == 99) {
+				unsigned int oplChannel = OPL2_OFF2CHANNEL(oplOpIndex); /// @todo: This only works for OPL2
+				track = TRACK_INDEX_MELODIC(oplev.chipIndex, oplChannel);
+				noteon = oplState[oplev.chipIndex][0xB0 | oplChannel] & OPLBIT_KEYON;
+			} else {
+				track = TRACK_INDEX_PERC(rhythm);
+				noteon = this->oplState[0][0xBD] & (1 << rhythm);
+			}
 
-				case 0x40:
-				case 0x50:
-					if (noteon && bitsChanged(0x3F)) {
-						// Volume change
-						auto& trackEvents = pattern.at(track);
+		} else { // A0, B0, C0
+			assert(oplev.reg < 0xE0);
+			unsigned int oplChannel = oplev.reg & 0x0F;
+			if (oplChannel > 8) {
+				std::cout << "decode-opl: Invalid OPL channel " << oplChannel
+					<< "\n";
 
-						// Remove any volume events before this one, where there is no
-						// delay between them and us.
-						this->removePrecedingEffects(track, trackEvents, EffectEvent::Type::Volume);
+				// Update the current state with the new value
+				oplState[oplev.chipIndex][oplev.reg] = oplev.val;
+				return;
+			}
 
+			if ((OPL_IS_RHYTHM_ON) && (oplev.chipIndex == 0) && (oplChannel > 5)) {
+				// Melodic event on channels used by percussive mode
+				noteon = false;
+				track = -1;
+			} else {
+				// Normal channel (or rhythm mode bass drum)
+				track = TRACK_INDEX_MELODIC(oplev.chipIndex, oplChannel);
+				noteon = oplState[oplev.chipIndex][0xB0 | oplChannel] & OPLBIT_KEYON;
+			}
+		}
+		assert((track == (unsigned int)-1) || (track < pattern.size()));
+
+		unsigned int regClass = oplev.reg & 0xF0;
+		if (oplev.reg == 0xBD) regClass = 0xBD;
+		switch (regClass) {
+			case 0x00:
+				if (oplev.reg == 0x01) {
+					if (bitsChanged(0x20)) {
+						auto& trackEvents = pattern.at(0);
 						trackEvents.emplace_back();
 						auto& te = trackEvents.back();
 						te.delay = this->lastDelay[track];
 						this->lastDelay[track] = 0;
-						auto ev = std::make_shared<EffectEvent>();
-						ev->type = EffectEvent::Type::Volume;
-						ev->data = log_volume_to_lin_velocity(0x3F - (oplev.val & 0x3F), 0x3F);
-						te.event = std::move(ev);
+						te.event.type = CompactEvent::Type::Configuration;
+						te.event.config.configType = ConfigurationEvent::Type::EnableWaveSel;
+						te.event.config.value = (oplev.val & 0x20) ? 1 : 0;
 					}
-					break;
-
-				case 0x80:
-				case 0x90:
-					if (noteon && bitsChanged(0xF0)) {
-						if ((oplev.val >> 4) == 0x0F) {
-							// Sustain rate changed to immediate off, note will now become
-							// silent immediately.
-							auto& trackEvents = pattern.at(track);
+				} else if (oplev.reg == 0x05) {
+					if (bitsChanged(0x01)) {
+						unsigned int newState = (oplev.val & 0x01) ? 1 : 0;
+						if (
+							((this->opl3) && (newState == 0))
+							|| ((!this->opl3) && (newState == 1))
+						) {
+							auto& trackEvents = pattern.at(0);
 							trackEvents.emplace_back();
 							auto& te = trackEvents.back();
 							te.delay = this->lastDelay[track];
 							this->lastDelay[track] = 0;
-							auto ev = std::make_shared<EffectEvent>();
-							ev->type = EffectEvent::Type::Volume;
-							ev->data = 0;
-							te.event = std::move(ev);
+							te.event.type = CompactEvent::Type::Configuration;
+							te.event.config.configType = ConfigurationEvent::Type::EnableOPL3;
+							te.event.config.value = newState;
+							this->opl3 = newState == 1;
 						}
 					}
-					break;
+				}
+				break;
 
-				case 0xA0: {
-					if (noteon && bitsChanged(0xFF)) {
-						// The pitch has changed while a note was playing
-						this->createOrUpdatePitchbend(pattern.at(track),
-							&this->lastDelay[track], oplev.val,
-							oplState[oplev.chipIndex][0xB0 | oplChannel]);
-					}
-					break;
+			case 0x20:
+			case 0x30:
+				if (noteon) {
+#warning Changing the CHAR_MULT value during playback needs to be implemented
+					std::cout << "Warning: Changing the CHAR_MULT value during playback is not yet implemented, event discarded.\n";
 				}
+				break;
 
-				case 0xBD:
-					if (oplev.val & 0x20) { // can't use OPL_IS_RHYTHM_ON as that is obsolete here
-						if (bitsChanged(0x20)) {
-							// Rhythm was off, now it's on
-							track = 0;
-							auto& trackEvents = pattern.at(track);
-							trackEvents.emplace_back();
-							auto& te = trackEvents.back();
-							te.delay = this->lastDelay[track];
-							this->lastDelay[track] = 0;
-							auto ev = std::make_shared<ConfigurationEvent>();
-							ev->configType = ConfigurationEvent::Type::EnableRhythm;
-							ev->value = 1;
-							te.event = std::move(ev);
-						}
-						for (int rhythm = 0; rhythm < 5; rhythm++) {
-							int keyonBit = 1 << rhythm;
-							// If rhythm mode has just been enabled and this instrument's
-							// keyon bit is set, OR rhythm mode was always on and this
-							// instrument's keyon bit has changed, write out a note-on or
-							// note-off event as appropriate.
-							if ((bitsChanged(0x20) && (oplev.val & keyonBit)) || bitsChanged(keyonBit)) {
-								// Hi-hat is playing or about to play
-								switch (rhythm) {
-									case 0: oplChannel = 7; break; // mod
-									case 1: oplChannel = 8; break; // car
-									case 2: oplChannel = 8; break; // mod
-									case 3: oplChannel = 7; break; // car
-									case 4: oplChannel = 6; break; // both
-								}
-
-								track = 9 + rhythm;
-								noteon = this->oplState[0][0xBD] & keyonBit;
-
-								if (oplev.val & keyonBit) {
-									this->createNoteOn(pattern.at(track), *music->patches,
-										&this->lastDelay[track], oplev.chipIndex, oplChannel,
-										(OPLPatch::Rhythm)(rhythm + 1),
-										oplState[oplev.chipIndex][0xB0 | oplChannel]);
-								} else {
-									this->createNoteOff(track, pattern.at(track));
-								}
-							}
-						}
-					} else if (bitsChanged(0x20)) { // Rhythm mode just got disabled
-						// Turn off any currently playing rhythm instruments
-						for (int rhythm = 0; rhythm < 5; rhythm++) {
-							track = 9 + rhythm;
-							noteon = this->oplState[0][0xBD] & (1 << rhythm);
-							if (noteon) {
-								this->createNoteOff(track, pattern.at(track));
-							}
-						}
-						// Rhythm was on, now it's off
-						track = 0;
-						auto& trackEvents = pattern.at(track);
-						trackEvents.emplace_back();
-						auto& te = trackEvents.back();
-						te.delay = this->lastDelay[track];
-						this->lastDelay[track] = 0;
-						auto ev = std::make_shared<ConfigurationEvent>();
-						ev->configType = ConfigurationEvent::Type::EnableRhythm;
-						ev->value = 0;
-						te.event = std::move(ev);
-					}
-					if (bitsChanged(0x80)) {
-						track = 0;
+			case 0x40:
+			case 0x50:
+				if (noteon && bitsChanged(0x3F)) {
+					// Volume change
+					auto& trackEvents = pattern.at(track);
+
+					// Remove any volume events before this one, where there is no
+					// delay between them and us.
+					this->removePrecedingEffects(track, trackEvents, EffectEvent::Type::Volume);
+
+					trackEvents.emplace_back();
+					auto& te = trackEvents.back();
+					te.delay = this->lastDelay[track];
+					this->lastDelay[track] = 0;
+					te.event.type = CompactEvent::Type::Effect;
+					te.event.effect.type = EffectEvent::Type::Volume;
+					te.event.effect.data = log_volume_to_lin_velocity(0x3F - (oplev.val & 0x3F), 0x3F);
+				}
+				break;
+
+			case 0x80:
+			case 0x90:
+				if (noteon && bitsChanged(0xF0)) {
+					if ((oplev.val >> 4) == 0x0F) {
+						// Sustain rate changed to immediate off, note will now become
+						// silent immediately.
 						auto& trackEvents = pattern.at(track);
 						trackEvents.emplace_back();
 						auto& te = trackEvents.back();
 						te.delay = this->lastDelay[track];
 						this->lastDelay[track] = 0;
-						auto ev = std::make_shared<ConfigurationEvent>();
-						ev->configType = ConfigurationEvent::Type::EnableDeepTremolo;
-						ev->value = (oplev.val & 0x80) ? 1 : 0; // bit0 is enable/disable
-						if (oplev.chipIndex) ev->value |= 2;    // bit1 is chip index
-						te.event = std::move(ev);
+						te.event.type = CompactEvent::Type::Effect;
+						te.event.effect.type = EffectEvent::Type::Volume;
+						te.event.effect.data = 0;
 					}
-					if (bitsChanged(0x40)) {
+				}
+				break;
+
+			case 0xA0: {
+				if (noteon && bitsChanged(0xFF)) {
+					// The pitch has changed while a note was playing
+					this->createOrUpdatePitchbend(pattern.at(track),
+						&this->lastDelay[track], oplev.val,
+						oplState[oplev.chipIndex][0xB0 | oplChannel]);
+				}
+				break;
+			}
+
+			case 0xBD:
+				if (oplev.val & 0x20) { // can't use OPL_IS_RHYTHM_ON as that is obsolete here
+					if (bitsChanged(0x20)) {
+						// Rhythm was off, now it's on
 						track = 0;
 						auto& trackEvents = pattern.at(track);
 						trackEvents.emplace_back();
 						auto& te = trackEvents.back();
 						te.delay = this->lastDelay[track];
 						this->lastDelay[track] = 0;
-						auto ev = std::make_shared<ConfigurationEvent>();
-						ev->configType = ConfigurationEvent::Type::EnableDeepVibrato;
-						ev->value = (oplev.val & 0x40) ? 1 : 0; // bit0 is enable/disable
-						if (oplev.chipIndex) ev->value |= 2;    // bit1 is chip index
-						te.event = std::move(ev);
+						te.event.type = CompactEvent::Type::Configuration;
+						te.event.config.configType = ConfigurationEvent::Type::EnableRhythm;
+						te.event.config.value = 1;
 					}
-					break;
+					for (int rhythm = 0; rhythm < 5; rhythm++) {
+						int keyonBit = 1 << rhythm;
+						// If rhythm mode has just been enabled and this instrument's
+						// keyon bit is set, OR rhythm mode was always on and this
+						// instrument's keyon bit has changed, write out a note-on or
+						// note-off event as appropriate.
+						if ((bitsChanged(0x20) && (oplev.val & keyonBit)) || bitsChanged(keyonBit)) {
+							// Hi-hat is playing or about to play
+							switch (rhythm) {
+								case 0: oplChannel = 7; break; // mod
+								case 1: oplChannel = 8; break; // car
+								case 2: oplChannel = 8; break; // mod
+								case 3: oplChannel = 7; break; // car
+								case 4: oplChannel = 6; break; // both
+							}
 
-				case 0xB0:
-					if (oplChannel > 8) {
-						std::cerr << "decode-opl: Bad OPL note-on register/channel 0x" << std::hex
-							<< (int)oplev.reg << std::endl;
-						break;
-					}
+							track = 9 + rhythm;
+							noteon = this->oplState[0][0xBD] & keyonBit;
 
-					if (OPL_IS_RHYTHM_ON && (oplev.chipIndex == 0) && (oplChannel > 5)) {
-						if (noteon && bitsChanged(0x1F)) {
-							// Rhythm-mode instrument (incl. bass drum) has changed pitch
-							this->createOrUpdatePitchbend(pattern.at(track),
-								&this->lastDelay[track],
-								oplState[oplev.chipIndex][0xA0 | oplChannel], oplev.val);
-						}
-					} else { // normal instrument
-						if (bitsChanged(OPLBIT_KEYON)) {
-							if (oplev.val & OPLBIT_KEYON) {
-								// Note is now on
-								this->createNoteOn(pattern.at(track), *music->patches,
+							if (oplev.val & keyonBit) {
+								this->createNoteOn(pattern.at(track), *this->music->patches,
 									&this->lastDelay[track], oplev.chipIndex, oplChannel,
-									OPLPatch::Rhythm::Melodic, oplev.val);
+									(OPLPatch::Rhythm)(rhythm + 1),
+									oplState[oplev.chipIndex][0xB0 | oplChannel]);
 							} else {
-								// Note is now off
 								this->createNoteOff(track, pattern.at(track));
 							}
-						} else if (noteon && bitsChanged(0x1F)) {
-							// The note is already on and the pitch has changed.
-							this->createOrUpdatePitchbend(pattern.at(track), &this->lastDelay[track],
-								oplState[oplev.chipIndex][0xA0 | oplChannel], oplev.val);
 						}
 					}
-					break;
-
-				case 0xE0:
-				case 0xF0:
-					if (noteon) {
-#warning Changing the WAVE value during playback needs to be implemented
-						std::cout << "Warning: Changing the WAVE value during playback is not yet implemented, event discarded.\n";
+				} else if (bitsChanged(0x20)) { // Rhythm mode just got disabled
+					// Turn off any currently playing rhythm instruments
+					for (int rhythm = 0; rhythm < 5; rhythm++) {
+						track = 9 + rhythm;
+						noteon = this->oplState[0][0xBD] & (1 << rhythm);
+						if (noteon) {
+							this->createNoteOff(track, pattern.at(track));
+						}
 					}
-					break;
-
-			} // switch (OPL reg)
-		} // if (OPLEvent::Regs)
-
-		/// @todo If the instrument settings have changed, generate a patch change event?
-		// Will have to combine with previous patch change event if there has been no delay.
-
-		if ((oplev.valid & OPLEvent::Delay) && (oplev.delay > 0)) {
-			if (this->delayType == DelayType::DelayIsPostData) {
-				for (unsigned int t = 0; t < OPL_TRACK_COUNT; t++) {
-					this->lastDelay[t] += oplev.delay;
+					// Rhythm was on, now it's off
+					track = 0;
+					auto& trackEvents = pattern.at(track);
+					trackEvents.emplace_back();
+					auto& te = trackEvents.back();
+					te.delay = this->lastDelay[track];
+					this->lastDelay[track] = 0;
+					te.event.type = CompactEvent::Type::Configuration;
+					te.event.config.configType = ConfigurationEvent::Type::EnableRhythm;
+					te.event.config.value = 0;
 				}
-			}
-		}
+				if (bitsChanged(0x80)) {
+					track = 0;
+					auto& trackEvents = pattern.at(track);
+					trackEvents.emplace_back();
+					auto& te = trackEvents.back();
+					te.delay = this->lastDelay[track];
+					this->lastDelay[track] = 0;
+					te.event.type = CompactEvent::Type::Configuration;
+					te.event.config.configType = ConfigurationEvent::Type::EnableDeepTremolo;
+					te.event.config.value = (oplev.val & 0x80) ? 1 : 0; // bit0 is enable/disable
+					if (oplev.chipIndex) te.event.config.value |= 2;    // bit1 is chip index
+				}
+				if (bitsChanged(0x40)) {
+					track = 0;
+					auto& trackEvents = pattern.at(track);
+					trackEvents.emplace_back();
+					auto& te = trackEvents.back();
+					te.delay = this->lastDelay[track];
+					this->lastDelay[track] = 0;
+					te.event.type = CompactEvent::Type::Configuration;
+					te.event.config.configType = ConfigurationEvent::Type::EnableDeepVibrato;
+					te.event.config.value = (oplev.val & 0x40) ? 1 : 0; // bit0 is enable/disable
+					if (oplev.chipIndex) te.event.config.value |= 2;    // bit1 is chip index
+				}
+				break;
 
-	} // while (all events)
+			case 0xB0:
+				if (oplChannel > 8) {
+					std::cerr << "decode-opl: Bad OPL note-on register/channel 0x" << std::hex
+						<< (int)oplev.reg << std::endl;
+					break;
+				}
 
-	// Put dummy events if necessary to preserve trailing delays
-	for (unsigned int track = 0; track < OPL_TRACK_COUNT; track++) {
-		auto& trackEvents = pattern.at(track);
-		if (this->lastDelay[track] && trackEvents.size()) {
-			trackEvents.emplace_back();
-			auto& te = trackEvents.back();
-			te.delay = this->lastDelay[track];
-			this->lastDelay[track] = 0;
-			auto ev = std::make_shared<ConfigurationEvent>();
-			ev->configType = ConfigurationEvent::Type::EmptyEvent;
-			ev->value = 0;
-			te.event = std::move(ev);
-		}
-	}
+				if (OPL_IS_RHYTHM_ON && (oplev.chipIndex == 0) && (oplChannel > 5)) {
+					if (noteon && bitsChanged(0x1F)) {
+						// Rhythm-mode instrument (incl. bass drum) has changed pitch
+						this->createOrUpdatePitchbend(pattern.at(track),
+							&this->lastDelay[track],
+							oplState[oplev.chipIndex][0xA0 | oplChannel], oplev.val);
+					}
+				} else { // normal instrument
+					if (bitsChanged(OPLBIT_KEYON)) {
+						if (oplev.val & OPLBIT_KEYON) {
+							// Note is now on
+							this->createNoteOn(pattern.at(track), *this->music->patches,
+								&this->lastDelay[track], oplev.chipIndex, oplChannel,
+								OPLPatch::Rhythm::Melodic, oplev.val);
+						} else {
+							// Note is now off
+							this->createNoteOff(track, pattern.at(track));
+						}
+					} else if (noteon && bitsChanged(0x1F)) {
+						// The note is already on and the pitch has changed.
+						this->createOrUpdatePitchbend(pattern.at(track), &this->lastDelay[track],
+							oplState[oplev.chipIndex][0xA0 | oplChannel], oplev.val);
+					}
+				}
+				break;
 
-	music->ticksPerTrack = totalDelay;
+			case 0xE0:
+			case 0xF0:
+				if (noteon) {
+#warning Changing the WAVE value during playback needs to be implemented
+					std::cout << "Warning: Changing the WAVE value during playback is not yet implemented, event discarded.\n";
+				}
+				break;
 
-	return std::move(music);
+		} // switch (OPL reg)
+	} // if (OPLEvent::Regs)
+	return;
 }
 
-std::shared_ptr<OPLPatch> OPLDecoder::getCurrentPatch(int chipIndex, int oplChannel)
+std::shared_ptr<OPLPatch> OPLStreamDecoder::getCurrentPatch(int chipIndex, int oplChannel)
 {
 	auto curPatch = std::make_shared<OPLPatch>();
 
@@ -592,27 +645,12 @@ std::shared_ptr<OPLPatch> OPLDecoder::getCurrentPatch(int chipIndex, int oplChan
 	return curPatch;
 }
 
-int OPLDecoder::savePatch(PatchBank& patches, std::shared_ptr<OPLPatch> curPatch)
+int OPLStreamDecoder::savePatch(PatchBank& patches, std::shared_ptr<OPLPatch> curPatch)
 {
-	// See if the patch has already been saved
-	unsigned int j = 0;
-	for (auto& p : patches) {
-		auto oplPatch = dynamic_cast<OPLPatch*>(p.get());
-		if (
-			(oplPatch)
-			&& (*oplPatch == *curPatch)
-			&& (oplPatch->rhythm == curPatch->rhythm)
-		) return j; // patch already saved
-		j++;
-	}
-
-	// Save the patch
-	unsigned int numPatches = patches.size();
-	patches.push_back(curPatch);
-	return numPatches;
+	return this->patchIndex.findOrAdd(patches, curPatch);
 }
 
-void OPLDecoder::createNoteOn(Track& trackEvents, PatchBank& patches,
+void OPLStreamDecoder::createNoteOn(CompactTrack& trackEvents, PatchBank& patches,
 	unsigned long *lastDelay, unsigned int chipIndex, unsigned int oplChannel,
 	OPLPatch::Rhythm rhythm, unsigned int b0val)
 {
@@ -620,45 +658,45 @@ void OPLDecoder::createNoteOn(Track& trackEvents, PatchBank& patches,
 	auto& te = trackEvents.back();
 	te.delay = *lastDelay;
 	*lastDelay = 0;
-	auto ev = std::make_shared<NoteOnEvent>();
+	te.event.type = CompactEvent::Type::NoteOn;
 
 	auto curPatch = this->getCurrentPatch(chipIndex, oplChannel);
 	curPatch->rhythm = rhythm;
 
 	/// Make sure the patch has been added to the patchbank
-	ev->instrument = this->savePatch(patches, curPatch);
+	te.event.noteOn.instrument = this->savePatch(patches, curPatch);
 
 	// Get the OPL frequency number for this channel
 	int fnum = ((b0val & 0x03) << 8) | this->oplState[chipIndex][0xA0 | oplChannel];
 	int block = (b0val >> 2) & 0x07;
 
-	ev->milliHertz = fnumToMilliHertz(fnum, block, this->fnumConversion);
+	te.event.noteOn.milliHertz = fnumToMilliHertz(fnum, block, this->fnumConversion);
 
 	// Ignore velocity for modulator-only rhythm instruments
 	if (oplModOnly(rhythm)) {
-		ev->velocity = DefaultVelocity;
+		te.event.noteOn.velocity = DefaultVelocity;
 	} else {
 		unsigned int curVol = 0x3F &
 			this->oplState[chipIndex][BASE_SCAL_LEVL | OPLOFFSET_CAR(oplChannel)];
-		ev->velocity = log_volume_to_lin_velocity(63 - curVol, 63);
+		te.event.noteOn.velocity = log_volume_to_lin_velocity(63 - curVol, 63);
 	}
 
-	te.event = std::move(ev);
 	return;
 }
 
-void OPLDecoder::createNoteOff(unsigned int track, Track& trackEvents)
+void OPLStreamDecoder::createNoteOff(unsigned int track,
+	CompactTrack& trackEvents)
 {
 	// Create the note-off event
 	trackEvents.emplace_back();
 	auto& te = trackEvents.back();
 	te.delay = this->lastDelay[track];
 	this->lastDelay[track] = 0;
-	te.event = std::make_shared<NoteOffEvent>();
+	te.event.type = CompactEvent::Type::NoteOff;
 	return;
 }
 
-void OPLDecoder::createOrUpdatePitchbend(Track& trackEvents,
+void OPLStreamDecoder::createOrUpdatePitchbend(CompactTrack& trackEvents,
 	unsigned long *lastDelay, unsigned int a0val, unsigned int b0val)
 {
 	// Get the OPL frequency number for this channel
@@ -678,16 +716,18 @@ void OPLDecoder::createOrUpdatePitchbend(Track& trackEvents,
 		// This will only check the previous event, if there's something else
 		// (like an instrument effect) in between the two pitch events then
 		// they won't be combined into a single pitchbend event.
-		for (Track::reverse_iterator
+		for (CompactTrack::reverse_iterator
 			i = trackEvents.rbegin(); i != trackEvents.rend(); i++
 		) {
-			const TrackEvent& te = *i;
+			CompactTrackEvent& te = *i;
 			if (te.delay != 0) break; // no more events at this time
-			auto pbev = dynamic_cast<EffectEvent *>(i->event.get());
-			if (pbev && (pbev->type == EffectEvent::Type::PitchbendNote)) {
+			if (
+				(te.event.type == CompactEvent::Type::Effect)
+				&& (te.event.effect.type == EffectEvent::Type::PitchbendNote)
+			) {
 				// There is an existing pitchbend event at the same time, so edit
 				// that one.
-				pbev->data = freq;
+				te.event.effect.data = freq;
 				addNew = false;
 				break;
 			}
@@ -700,23 +740,24 @@ void OPLDecoder::createOrUpdatePitchbend(Track& trackEvents,
 		auto& te = trackEvents.back();
 		te.delay = *lastDelay;
 		*lastDelay = 0;
-		auto ev = std::make_shared<EffectEvent>();
-		ev->type = EffectEvent::Type::PitchbendNote;
-		ev->data = freq;
-		te.event = std::move(ev);
+		te.event.type = CompactEvent::Type::Effect;
+		te.event.effect.type = EffectEvent::Type::PitchbendNote;
+		te.event.effect.data = freq;
 	}
 	return;
 }
 
-void OPLDecoder::removePrecedingEffects(unsigned int track, Track& trackEvents,
-	EffectEvent::Type type)
+void OPLStreamDecoder::removePrecedingEffects(unsigned int track,
+	CompactTrack& trackEvents, EffectEvent::Type type)
 {
-	while (this->lastDelay[track] == 0) {
+	while ((this->lastDelay[track] == 0) && !trackEvents.empty()) {
 		// No delay since the last event, remove it if it's one that won't have
 		// affected the song.
 		auto& lastEvent = trackEvents.back();
-		auto effect = std::dynamic_pointer_cast<EffectEvent>(lastEvent.event);
-		if (effect && (effect->type == type)) {
+		if (
+			(lastEvent.event.type == CompactEvent::Type::Effect)
+			&& (lastEvent.event.effect.type == type)
+		) {
 			// Remove this event
 			this->lastDelay[track] = lastEvent.delay;
 			trackEvents.pop_back();
@@ -727,3 +768,42 @@ void OPLDecoder::removePrecedingEffects(unsigned int track, Track& trackEvents,
 	}
 	return;
 }
+
+/// Number of ticks in each streamed pattern, for about a second per pattern.
+static unsigned long streamPatternTicks(const Tempo& tempo)
+{
+	return std::max(1.0, US_PER_SEC / tempo.usPerTick);
+}
+
+OPLMusicStream::OPLMusicStream(std::unique_ptr<stream::input> content,
+	std::unique_ptr<OPLReaderCallback> cb, DelayType delayType,
+	double fnumConversion, const Tempo& initialTempo, FinishCallback finish)
+	:	content(std::move(content)),
+		cb(std::move(cb)),
+		song(std::make_shared<Music>()),
+		decoder(this->cb.get(), delayType, fnumConversion, initialTempo,
+			this->song.get(), streamPatternTicks(initialTempo)),
+		finish(finish)
+{
+}
+
+std::shared_ptr<const Music> OPLMusicStream::music() const
+{
+	return this->song;
+}
+
+bool OPLMusicStream::decodePattern()
+{
+	if (this->decoder.decodePattern()) return true;
+	if (this->finish) {
+		this->finish(*this->content, this->song.get());
+		this->finish = nullptr;
+	}
+	return false;
+}
+
+void OPLMusicStream::discardPatterns(unsigned int order)
+{
+	this->decoder.discardPatterns(order);
+	return;
+}
@@ -21,9 +21,15 @@
 #ifndef _CAMOTO_GAMEMUSIC_DECODE_OPL_HPP_
 #define _CAMOTO_GAMEMUSIC_DECODE_OPL_HPP_
 
+#include <functional>
+#include <vector>
+#include <camoto/gamemusic/events-compact.hpp>
 #include <camoto/gamemusic/music.hpp>
+#include <camoto/gamemusic/musictype.hpp>
 #include <camoto/gamemusic/eventconverter-opl.hpp>
+#include <camoto/gamemusic/patch-opl.hpp>
 #include <camoto/stream.hpp>
+#include "patch-index.hpp"
 
 namespace camoto {
 namespace gamemusic {
@@ -31,6 +37,8 @@ namespace gamemusic {
 /// Callback class used to supply OPL data to oplDecode().
 class OPLReaderCallback {
 	public:
+		virtual ~OPLReaderCallback() {}
+
 		/// Read the next reg/val pair from the source data.
 		/**
 		 * @param oplEvent
@@ -50,6 +58,62 @@ class OPLReaderCallback {
 		virtual bool readNextPair(OPLEvent *oplEvent) = 0;
 };
 
+/// OPLReaderCallback that reads the song data into memory in large chunks.
+/**
+ * The song data is read from the file a chunk at a time, so readNextPair()
+ * can decode it straight from memory instead of making a stream call for
+ * every byte, without having to hold a long song in memory all at once.
+ * Implementations should check there are enough bytes left between \a pos and
+ * \a end once per event, rather than once per byte, and call fill() if not.
+ */
+class OPLReaderCallback_Buffer: virtual public OPLReaderCallback
+{
+	public:
+		OPLReaderCallback_Buffer(stream::input& content);
+
+		/// Move the input file's seek pointer to just after the decoded data.
+		/**
+		 * Call this after decoding has finished, to read anything following the
+		 * song data such as tags.
+		 */
+		void seekPastData();
+
+	protected:
+		/// Start reading the song data.
+		/**
+		 * This must be called before the first call to readNextPair(), usually
+		 * once the constructor has finished reading the file header.  The first
+		 * chunk of data is read into memory.
+		 *
+		 * @param lenData
+		 *   Length of the song data in bytes, starting from the current seek
+		 *   position in \a content.  If this runs past the end of the file, only
+		 *   the data up until EOF is used.
+		 */
+		void load(stream::len lenData);
+
+		/// Read the next chunk of song data into memory.
+		/**
+		 * Any bytes between \a pos and \a end are kept, so an event split
+		 * across two chunks can still be decoded.  \a pos and \a end are
+		 * updated, and any pointers into the old data are no longer valid.
+		 *
+		 * @param lenNeeded
+		 *   Number of bytes the caller needs between \a pos and \a end.
+		 *
+		 * @return true if there are at least \a lenNeeded bytes available, false
+		 *   if the end of the song data is closer than that.
+		 */
+		bool fill(unsigned int lenNeeded);
+
+		stream::input& content;     ///< Input file
+		stream::pos offData;        ///< Offset in the file of the first byte in data
+		stream::len lenLeft;        ///< Song data not yet read into memory
+		std::vector<uint8_t> data;  ///< Current chunk of song data
+		const uint8_t *pos;         ///< Next byte in data to decode
+		const uint8_t *end;         ///< One past the last byte in data
+};
+
 /// Convert caller-supplied OPL data into a Music instance.
 /**
  * @param cb
@@ -69,6 +133,234 @@ class OPLReaderCallback {
 std::unique_ptr<Music> oplDecode(OPLReaderCallback *cb, DelayType delayType,
 	double fnumConversion, const Tempo& initialTempo);
 
+/// Count the reg/val pairs in caller-supplied OPL data, and find its length.
+/**
+ * This reads the same data as oplDecode() but skips creating any events or
+ * patches, for use in MusicType::probe().
+ *
+ * @param cb
+ *   Callback class used to read the actual OPL data bytes from the file.
+ *
+ * @param initialTempo
+ *   Initial tempo of the song.
+ *
+ * @param summary
+ *   On return, eventCount is set to the number of reg/val pairs and msLength
+ *   to the total of all the delays.  The song is treated as a single pattern
+ *   with an unknown number of instruments and an unknown track layout.
+ */
+void oplScan(OPLReaderCallback *cb, const Tempo& initialTempo,
+	MusicSummary *summary);
+
+/// Convert caller-supplied OPL data into a Music instance a little at a time.
+/**
+ * oplDecode() reads every reg/val pair before returning, so nothing can be
+ * played until the whole file has been processed.  This class instead builds
+ * the song one pattern at a time, with each pattern covering the same number
+ * of ticks.  Each call to decodePattern() only reads as much data as is
+ * needed to fill the next pattern, so playback can begin as soon as the first
+ * pattern is ready, with more patterns decoded as playback approaches them.
+ *
+ * Notes and effects carry across from one pattern to the next, so the song
+ * sounds the same as one produced by oplDecode(), except that it is padded
+ * with silence up to the end of the last pattern.
+ *
+ * Patterns that have finished playing can be emptied with discardPatterns(),
+ * so that memory use depends on how far ahead of playback the decoding runs
+ * rather than on the length of the song.
+ */
+class OPLStreamDecoder
+{
+	public:
+		/// Set decoding parameters.
+		/**
+		 * @param cb
+		 *   Callback class used to read the actual OPL data bytes from the file.
+		 *
+		 * @param delayType
+		 *   Where the delay is actioned - before its associated data pair is sent
+		 *   to the OPL chip, or after.
+		 *
+		 * @param fnumConversion
+		 *   Conversion constant to use when converting OPL frequency numbers into
+		 *   Hertz.  Can be one of OPL_FNUM_* or a raw value.
+		 *
+		 * @param initialTempo
+		 *   Initial tempo of the song.
+		 *
+		 * @param music
+		 *   Empty song to populate.  The instrument bank, track list and tempo
+		 *   are set up immediately, and patterns are added by decodePattern().
+		 *   The song can be passed to Playback while it is still being decoded,
+		 *   as long as Playback::songChanged() is called if it needs to seek.
+		 *
+		 * @param ticksPerPattern
+		 *   Length of each pattern, in ticks.  0 puts the whole song in a single
+		 *   pattern, as oplDecode() does, so the first call to decodePattern()
+		 *   will read all the data.
+		 */
+		OPLStreamDecoder(OPLReaderCallback *cb, DelayType delayType,
+			double fnumConversion, const Tempo& initialTempo, Music *music,
+			unsigned long ticksPerPattern);
+
+		~OPLStreamDecoder();
+
+		/// Read enough data to append another pattern to the song.
+		/**
+		 * The callback's readNextPair() function is called until the pattern is
+		 * full or the end of the data is reached.  Any pair that falls after the
+		 * end of the pattern is kept until the next call.
+		 *
+		 * @return true if a pattern was added, false if the whole song has
+		 *   already been decoded.
+		 *
+		 * @throw stream:error
+		 *   If the input data could not be read or converted for some reason.
+		 */
+		bool decodePattern();
+
+		/// Free the events in patterns that have already been played.
+		/**
+		 * The patterns stay in the song so that order numbers do not change, but
+		 * they will be silent if played again.
+		 *
+		 * @param order
+		 *   Index of the first order to keep.  All orders before this one are
+		 *   emptied.
+		 */
+		void discardPatterns(unsigned int order);
+
+	private:
+		OPLReaderCallback *cb;     ///< Callback to use to get more OPL data
+		DelayType delayType;       ///< Location of the delay
+		double fnumConversion;     ///< Conversion value to use in fnum -> Hz calc
+		Music *music;              ///< Song being populated
+		unsigned long ticksPerPattern; ///< Pattern length, or 0 for unlimited
+
+		unsigned long lastDelay[OPL_TRACK_COUNT];   ///< Delay ticks accrued since last event
+		uint8_t oplState[OPL_NUM_CHIPS][256];  ///< Current register values
+		OPLEvent oplev;            ///< Most recent pair read from the callback
+		Tempo lastTempo;           ///< Tempo of the most recent TempoEvent
+		bool opl3;                 ///< Is OPL3 mode currently enabled?
+		unsigned long totalDelay;  ///< Ticks from start of song to current pair
+		unsigned long patternStart; ///< Ticks from start of song to this pattern
+		bool pending;              ///< Is oplev waiting to go in the next pattern?
+		bool endOfData;            ///< Has readNextPair() returned false yet?
+		bool finished;             ///< Has the last pattern been added?
+		PatchIndex patchIndex;     ///< Patches already in music->patches
+		CompactPattern events;     ///< Pattern being decoded, reused each time
+
+		/// Read pairs from the callback and add their events to the pattern.
+		/**
+		 * This stops once the pattern is full or the data runs out, and sets
+		 * \ref finished after the last pattern.
+		 */
+		void decodeEvents(CompactPattern& pattern);
+
+		/// Add the events for the reg/val pair in \ref oplev to the pattern.
+		void processPair(CompactPattern& pattern);
+
+		std::shared_ptr<OPLPatch> getCurrentPatch(int chipIndex, int oplChannel);
+
+		/// Add the given patch to the patchbank.
+		/**
+		 * Uses \ref patchIndex to look for an existing copy, so it takes the same
+		 * time however many patches there are.
+		 *
+		 * @param patches
+		 *   Patchbank to search and possibly append to.
+		 *
+		 * @param curPatch
+		 *   Patch to search for and possibly add if it is not already in the
+		 *   patchbank.
+		 *
+		 * @return Index of this instrument in the patchbank.
+		 */
+		int savePatch(PatchBank& patches, std::shared_ptr<OPLPatch> curPatch);
+
+		void createNoteOn(CompactTrack& trackEvents, PatchBank& patches,
+			unsigned long *lastDelay, unsigned int chipIndex, unsigned int oplChannel,
+			OPLPatch::Rhythm rhythm, unsigned int b0val);
+
+		/// Switch off the note currently playing on the channel.
+		/**
+		 * This also backtracks the most recent events on the channel, and if there
+		 * were any effects with zero delay before the note-off then those events
+		 * are removed, since they will never be heard.
+		 */
+		void createNoteOff(unsigned int track, CompactTrack& trackEvents);
+
+		void createOrUpdatePitchbend(CompactTrack& trackEvents,
+			unsigned long *lastDelay, unsigned int a0val, unsigned int b0val);
+
+		/// Remove all the effects of the given type up until the last delay.
+		/**
+		 * This is used when generating a volume event, to remove any preceding
+		 * volume changes that wouldn't be heard because there are no delays
+		 * between those events and the one about to be produced.
+		 */
+		void removePrecedingEffects(unsigned int track, CompactTrack& trackEvents,
+			EffectEvent::Type type);
+};
+
+/// MusicStream that decodes OPL data with an OPLStreamDecoder.
+/**
+ * This is what the register capture formats return from
+ * MusicType::openStream().  Each pattern holds about a second of the song.
+ */
+class OPLMusicStream: virtual public MusicStream
+{
+	public:
+		/// Function to read anything following the song data, such as tags.
+		/**
+		 * @param content
+		 *   The file being decoded.
+		 *
+		 * @param music
+		 *   Song to add the extra data to.
+		 */
+		typedef std::function<void(stream::input& content, Music *music)>
+			FinishCallback;
+
+		/// Prepare to decode a song.
+		/**
+		 * @param content
+		 *   The file being decoded.  It is kept open until this object is
+		 *   destroyed.
+		 *
+		 * @param cb
+		 *   Callback reading the OPL data from \a content.
+		 *
+		 * @param delayType
+		 *   As for oplDecode().
+		 *
+		 * @param fnumConversion
+		 *   As for oplDecode().
+		 *
+		 * @param initialTempo
+		 *   As for oplDecode().
+		 *
+		 * @param finish
+		 *   Called once, after the last of the data has been decoded.  May be
+		 *   empty if there is nothing after the song data.
+		 */
+		OPLMusicStream(std::unique_ptr<stream::input> content,
+			std::unique_ptr<OPLReaderCallback> cb, DelayType delayType,
+			double fnumConversion, const Tempo& initialTempo, FinishCallback finish);
+
+		// MusicStream
+		virtual std::shared_ptr<const Music> music() const;
+		virtual bool decodePattern();
+		virtual void discardPatterns(unsigned int order);
+
+	private:
+		std::unique_ptr<stream::input> content; ///< File being decoded
+		std::unique_ptr<OPLReaderCallback> cb;  ///< Reads from content
+		std::shared_ptr<Music> song;            ///< Song decoded so far
+		OPLStreamDecoder decoder;               ///< Fills song from cb
+		FinishCallback finish;                  ///< Reads any tags at the end
+};
+
 } // namespace gamemusic
 } // namespace camoto
 
@@ -0,0 +1,55 @@
+/**
+ * @file  diagnostics.cpp
+ * @brief Collect warnings raised during playback without blocking.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <camoto/gamemusic/diagnostics.hpp>
+
+using namespace camoto::gamemusic;
+
+Diagnostics::Diagnostics()
+	:	dropped(0)
+{
+}
+
+void Diagnostics::warning(const char *format, ...)
+{
+	Message msg;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(msg.text, sizeof(msg.text), format, args);
+	va_end(args);
+	if (!this->queue.push(msg)) this->dropped++;
+	return;
+}
+
+bool Diagnostics::getWarning(std::string *message)
+{
+	auto msg = this->queue.front();
+	if (!msg) return false;
+	*message = msg->text;
+	this->queue.pop();
+	return true;
+}
+
+unsigned long Diagnostics::getDropped() const
+{
+	return this->dropped;
+}
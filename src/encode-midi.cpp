@@ -34,7 +34,8 @@ class MIDIEncoder: virtual private MIDIEventCallback
 		/**
 		 * @param output
 		 *   Data stream to write the MIDI data to.  Must remain valid until the
-		 *   class has been destroyed.
+		 *   class has been destroyed.  The data is built up in memory and written
+		 *   in one block at the end of each track.
 		 *
 		 * @param music
 		 *   The instance to convert to MIDI data.  Must remain valid until the
@@ -93,6 +94,7 @@ class MIDIEncoder: virtual private MIDIEventCallback
 
 	protected:
 		stream::output& output;            ///< Target stream for SMF MIDI data
+		std::string buffer;                ///< MIDI data not yet written to output
 		const Music& music;                ///< Song to convert
 		MIDIFlags midiFlags;               ///< One or more MIDIFlags
 		std::function<void()> cbEndOfTrack;///< Callback used at end of each track
@@ -114,6 +116,12 @@ class MIDIEncoder: virtual private MIDIEventCallback
 		 *   MIDI command and channel.
 		 */
 		void writeCommand(uint32_t delay, uint8_t cmd);
+
+		/// Append a variable-length delay to the buffer, as u28midi() writes it.
+		void writeDelay(uint32_t delay);
+
+		/// Write out any buffered data to the output stream.
+		void flush();
 };
 
 void camoto::gamemusic::midiEncode(stream::output& output, const Music& music,
@@ -136,6 +144,7 @@ MIDIEncoder::MIDIEncoder(stream::output& output, const Music& music,
 	for (unsigned int i = 0; i < MIDI_CHANNEL_COUNT; i++) {
 		this->channelsUsed[i] = false;
 	}
+	this->buffer.reserve(4096);
 }
 
 MIDIEncoder::~MIDIEncoder()
@@ -160,6 +169,7 @@ void MIDIEncoder::encode(EventHandler::EventOrder eventOrder, bool *channelsUsed
 	}
 
 	conv.handleAllEvents(eventOrder);
+	this->flush();
 
 	if (channelsUsed) {
 		memcpy(channelsUsed, this->channelsUsed, sizeof(this->channelsUsed));
@@ -169,14 +179,34 @@ void MIDIEncoder::encode(EventHandler::EventOrder eventOrder, bool *channelsUsed
 
 void MIDIEncoder::writeCommand(uint32_t delay, uint8_t cmd)
 {
-	this->output << u28midi(delay);
+	this->writeDelay(delay);
 	assert(cmd < 0xF0); // these commands are not part of the running status
 	if (this->lastCommand == cmd) return;
-	this->output << u8(cmd);
+	this->buffer += (char)cmd;
 	this->lastCommand = cmd;
 	return;
 }
 
+void MIDIEncoder::writeDelay(uint32_t delay)
+{
+	if ((delay >> 28) > 0) throw stream::error("MIDI numbers cannot be wider than 28-bit");
+
+	// Same byte sequence as u28_midi_write, so the output doesn't change
+	if (delay & (0x7F << 21)) this->buffer += (char)(0x80 | (delay >> 21));
+	if (delay & (0x7F << 14)) this->buffer += (char)(0x80 | (delay >> 14));
+	if (delay & (0x7F <<  7)) this->buffer += (char)(0x80 | (delay >>  7));
+	this->buffer += (char)(delay & 0x7F);
+	return;
+}
+
+void MIDIEncoder::flush()
+{
+	if (this->buffer.empty()) return;
+	this->output.write(this->buffer);
+	this->buffer.clear();
+	return;
+}
+
 void MIDIEncoder::midiNoteOff(uint32_t delay, uint8_t channel, uint8_t note,
 	uint8_t velocity)
 {
@@ -195,10 +225,8 @@ void MIDIEncoder::midiNoteOff(uint32_t delay, uint8_t channel, uint8_t note,
 		// Last event wasn't a note-off, or we have to specify a velocity value
 		this->writeCommand(delay, 0x80 | channel);
 	}
-	this->output
-		<< u8(note)
-		<< u8(velocity)
-	;
+	this->buffer += (char)note;
+	this->buffer += (char)velocity;
 	return;
 }
 
@@ -209,10 +237,8 @@ void MIDIEncoder::midiNoteOn(uint32_t delay, uint8_t channel, uint8_t note,
 	assert(velocity < 128);
 	this->channelsUsed[channel] = true;
 	this->writeCommand(delay, 0x90 | channel);
-	this->output
-		<< u8(note)
-		<< u8(velocity)
-	;
+	this->buffer += (char)note;
+	this->buffer += (char)velocity;
 	return;
 }
 
@@ -221,7 +247,7 @@ void MIDIEncoder::midiPatchChange(uint32_t delay, uint8_t channel,
 {
 	this->channelsUsed[channel] = true;
 	this->writeCommand(delay, 0xC0 | channel);
-	this->output << u8(instrument);
+	this->buffer += (char)instrument;
 	return;
 }
 
@@ -230,10 +256,8 @@ void MIDIEncoder::midiController(uint32_t delay, uint8_t channel,
 {
 	this->channelsUsed[channel] = true;
 	this->writeCommand(delay, 0xB0 | channel);
-	this->output
-		<< u8(controller)
-		<< u8(value)
-	;
+	this->buffer += (char)controller;
+	this->buffer += (char)value;
 	return;
 }
 
@@ -244,28 +268,26 @@ void MIDIEncoder::midiPitchbend(uint32_t delay, uint8_t channel, uint16_t bend)
 	uint8_t msb = (bend >> 7) & 0x7F;
 	uint8_t lsb = bend & 0x7F;
 	this->writeCommand(delay, 0xE0 | channel);
-	this->output
-		<< u8(lsb)
-		<< u8(msb)
-	;
+	this->buffer += (char)lsb;
+	this->buffer += (char)msb;
 	return;
 }
 
 void MIDIEncoder::midiSetTempo(uint32_t delay, const Tempo& tempo)
 {
 	unsigned long usPerQuarterNote = tempo.usPerQuarterNote();
-	this->output << u28midi(delay);
-	this->output.write("\xFF\x51\x03", 3);
-	this->output
-		<< u8(usPerQuarterNote >> 16)
-		<< u8(usPerQuarterNote >> 8)
-		<< u8(usPerQuarterNote & 0xFF)
-	;
+	this->writeDelay(delay);
+	this->buffer.append("\xFF\x51\x03", 3);
+	this->buffer += (char)(usPerQuarterNote >> 16);
+	this->buffer += (char)(usPerQuarterNote >> 8);
+	this->buffer += (char)(usPerQuarterNote & 0xFF);
 	return;
 }
 
 void MIDIEncoder::endOfTrack()
 {
+	// The callback may write to the output stream itself
+	this->flush();
 	if (this->cbEndOfTrack) this->cbEndOfTrack();
 	return;
 }
@@ -278,8 +300,8 @@ void MIDIEncoder::endOfPattern()
 
 void MIDIEncoder::endOfSong(uint32_t delay)
 {
-	this->output << u28midi(delay);
+	this->writeDelay(delay);
 	// Write an end-of-song event
-	this->output.write("\xFF\x2F\x00", 3);
+	this->buffer.append("\xFF\x2F\x00", 3);
 	return;
 }
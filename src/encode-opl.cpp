@@ -53,7 +53,7 @@ class OPLEncoder: virtual private OPLWriterCallback
 
 		/// Process the instruments and events, and write out OPL data.
 		/**
-		 * This function will call writeNextPair() repeatedly until all the events
+		 * This function will call writeBatch() repeatedly until all the events
 		 * in the song have been written out.
 		 *
 		 * @throw stream:error
@@ -67,6 +67,7 @@ class OPLEncoder: virtual private OPLWriterCallback
 
 		// OPLWriterCallback
 		virtual void writeNextPair(const OPLEvent *oplEvent);
+		virtual void writeBatch(const OPLEvent *oplEvents, size_t count);
 
 	private:
 		OPLWriterCallback *cb;     ///< Callback to use when writing OPL data
@@ -78,6 +79,20 @@ class OPLEncoder: virtual private OPLWriterCallback
 		uint8_t lastChipIndex;     ///< Last chip index used (only valid if lastReg != 0)
 		uint8_t lastReg;           ///< Last OPL register written to
 		uint8_t lastVal;           ///< Last value written to register (only valid if lastReg != 0)
+		std::vector<OPLEvent> batch; ///< Converted pairs to pass on to cb
+
+		/// Convert a pair from the event converter into one for the callback.
+		/**
+		 * @param oplEvent
+		 *   Pair supplied by EventConverter_OPL.
+		 *
+		 * @param out
+		 *   On return, the pair to pass on to the callback.
+		 *
+		 * @return true if \a out should be passed on, false if there is
+		 *   nothing to write yet.
+		 */
+		bool convertPair(const OPLEvent *oplEvent, OPLEvent *out);
 };
 
 
@@ -90,6 +105,29 @@ void camoto::gamemusic::oplEncode(OPLWriterCallback *cb, const Music& music,
 }
 
 
+OPLWriterCallback_Stream::OPLWriterCallback_Stream(stream::output& content)
+	:	content(content)
+{
+}
+
+void OPLWriterCallback_Stream::writeNextPair(const OPLEvent *oplEvent)
+{
+	this->encodePair(this->content, oplEvent);
+	return;
+}
+
+void OPLWriterCallback_Stream::writeBatch(const OPLEvent *oplEvents,
+	size_t count)
+{
+	this->batch.truncate(0);
+	this->batch.seekp(0, stream::start);
+	for (size_t i = 0; i < count; i++) {
+		this->encodePair(this->batch, &oplEvents[i]);
+	}
+	this->content.write(this->batch.data);
+	return;
+}
+
 OPLEncoder::OPLEncoder(OPLWriterCallback *cb, const Music& music,
 	DelayType delayType, double fnumConversion, OPLWriteFlags flags)
 	:	cb(cb),
@@ -132,41 +170,64 @@ void OPLEncoder::encode()
 }
 
 void OPLEncoder::writeNextPair(const OPLEvent *oplEvent)
+{
+	OPLEvent out;
+	if (this->convertPair(oplEvent, &out)) {
+		this->cb->writeNextPair(&out);
+	}
+	return;
+}
+
+void OPLEncoder::writeBatch(const OPLEvent *oplEvents, size_t count)
+{
+	this->batch.clear();
+	for (size_t i = 0; i < count; i++) {
+		this->batch.emplace_back();
+		if (!this->convertPair(&oplEvents[i], &this->batch.back())) {
+			this->batch.pop_back();
+		}
+	}
+	if (!this->batch.empty()) {
+		this->cb->writeBatch(this->batch.data(), this->batch.size());
+	}
+	return;
+}
+
+bool OPLEncoder::convertPair(const OPLEvent *oplEvent, OPLEvent *out)
 {
 	// There's nothing technically wrong with this, but it typically indicates a
 	// bug so we'll fail if it happens to assist with debugging.
 	assert(oplEvent->valid != 0);
 
-	OPLEvent out;
-	out.valid = 0;
+	out->valid = 0;
 
 	if (oplEvent->valid & OPLEvent::Tempo) {
-		out.valid |= OPLEvent::Tempo;
+		out->valid |= OPLEvent::Tempo;
 		this->lastTempo = oplEvent->tempo;
 	}
-	out.tempo = this->lastTempo;
+	out->tempo = this->lastTempo;
 
 	if (oplEvent->valid & OPLEvent::Delay) {
-		out.valid |= OPLEvent::Delay;
-		out.delay = oplEvent->delay;
+		out->valid |= OPLEvent::Delay;
+		out->delay = oplEvent->delay;
 	}
 
 	if (this->delayType == DelayType::DelayIsPreData) {
 		if (oplEvent->valid & OPLEvent::Regs) {
 			assert(oplEvent->chipIndex < 2);
 
-			out.valid |= OPLEvent::Regs;
-			out.chipIndex = oplEvent->chipIndex;
-			out.reg = oplEvent->reg;
-			out.val = oplEvent->val;
+			out->valid |= OPLEvent::Regs;
+			out->chipIndex = oplEvent->chipIndex;
+			out->reg = oplEvent->reg;
+			out->val = oplEvent->val;
 		}
 
 	} else { // DelayType::DelayIsPostData
 		if (this->lastReg) {
-			out.valid |= OPLEvent::Regs;
-			out.chipIndex = this->lastChipIndex;
-			out.reg = this->lastReg;
-			out.val = this->lastVal;
+			out->valid |= OPLEvent::Regs;
+			out->chipIndex = this->lastChipIndex;
+			out->reg = this->lastReg;
+			out->val = this->lastVal;
 			this->lastReg = 0;
 		}
 		if (oplEvent->valid & OPLEvent::Regs) {
@@ -176,8 +237,5 @@ void OPLEncoder::writeNextPair(const OPLEvent *oplEvent)
 		}
 	}
 
-	if (out.valid) {
-		this->cb->writeNextPair(&out);
-	}
-	return;
+	return out->valid != 0;
 }
@@ -25,6 +25,7 @@
 #include <camoto/gamemusic/musictype.hpp>
 #include <camoto/gamemusic/eventconverter-opl.hpp>
 #include <camoto/stream.hpp>
+#include <camoto/stream_string.hpp>
 
 namespace camoto {
 namespace gamemusic {
@@ -32,6 +33,39 @@ namespace gamemusic {
 void oplEncode(OPLWriterCallback *cb, const Music& music, DelayType delayType,
 	double fnumConversion, OPLWriteFlags flags);
 
+/// Base class for callbacks that write each OPL pair to a stream.
+/**
+ * Derived classes implement encodePair() to write out a single pair.  When a
+ * batch of pairs is supplied, they are all encoded into memory first and then
+ * written to the output stream in one go.
+ */
+class OPLWriterCallback_Stream: virtual public OPLWriterCallback
+{
+	public:
+		OPLWriterCallback_Stream(stream::output& content);
+
+		// OPLWriterCallback
+		virtual void writeNextPair(const OPLEvent *oplEvent);
+		virtual void writeBatch(const OPLEvent *oplEvents, size_t count);
+
+	protected:
+		/// Encode a single reg/val pair.
+		/**
+		 * @param out
+		 *   Stream to write the encoded data to.  This is not necessarily the
+		 *   output file.
+		 *
+		 * @param oplEvent
+		 *   Pair to encode, as passed to writeNextPair().
+		 */
+		virtual void encodePair(stream::output& out, const OPLEvent *oplEvent) = 0;
+
+		stream::output& content; ///< Output file
+
+	private:
+		stream::string batch;    ///< Encoded data for the current batch
+};
+
 } // namespace gamemusic
 } // namespace camoto
 
@@ -18,6 +18,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdarg.h>
+#include <stdio.h>
 #include <iostream>
 #include <math.h>
 #include <camoto/error.hpp>
@@ -39,12 +41,144 @@ CAMOTO_GAMEMUSIC_API OPLWriteFlags camoto::gamemusic::toOPLFlags(MusicType::Writ
 	return of;
 }
 
+void OPLWriterCallback::writeBatch(const OPLEvent *oplEvents, size_t count)
+{
+	for (size_t i = 0; i < count; i++) this->writeNextPair(&oplEvents[i]);
+	return;
+}
+
+OPLVoiceAllocator::OPLVoiceAllocator()
+	:	voiceCount(0)
+{
+	for (unsigned int v = 0; v < MAX_VOICES; v++) {
+		this->voiceTrack[v] = this->voicePrev[v] = this->voiceNext[v] = -1;
+	}
+	this->idle.head = this->idle.tail = -1;
+	this->busy.head = this->busy.tail = -1;
+}
+
+void OPLVoiceAllocator::setVoiceCount(unsigned int count)
+{
+	assert(count <= MAX_VOICES);
+	if (count > this->voiceCount) {
+		// Put the new channels at the front so they are used first.  Go backwards
+		// so the lowest channel ends up at the very front.
+		for (int v = count - 1; v >= (int)this->voiceCount; v--) {
+			this->voiceTrack[v] = -1;
+			this->prepend(&this->idle, v);
+		}
+	} else {
+		for (unsigned int v = count; v < this->voiceCount; v++) {
+			if (this->voiceTrack[v] >= 0) {
+				this->trackVoice[this->voiceTrack[v]] = -1;
+				this->unlink(&this->busy, v);
+			} else {
+				this->unlink(&this->idle, v);
+			}
+		}
+	}
+	this->voiceCount = count;
+	return;
+}
+
+unsigned int OPLVoiceAllocator::getVoiceCount() const
+{
+	return this->voiceCount;
+}
+
+int OPLVoiceAllocator::find(unsigned int track) const
+{
+	if (track >= this->trackVoice.size()) return -1;
+	return this->trackVoice[track];
+}
+
+int OPLVoiceAllocator::noteOn(unsigned int track, int *stolen)
+{
+	if (stolen) *stolen = -1;
+	if (track >= this->trackVoice.size()) this->trackVoice.resize(track + 1, -1);
+
+	int v = this->trackVoice[track];
+	if (v >= 0) {
+		// Track already has a channel, it now has the newest note
+		this->unlink(&this->busy, v);
+		this->append(&this->busy, v);
+		return v;
+	}
+
+	if (this->idle.head >= 0) {
+		// Use the channel that has been idle the longest
+		v = this->idle.head;
+		this->unlink(&this->idle, v);
+	} else if (this->busy.head >= 0) {
+		// Cut off the oldest note
+		v = this->busy.head;
+		this->unlink(&this->busy, v);
+		this->trackVoice[this->voiceTrack[v]] = -1;
+		if (stolen) *stolen = this->voiceTrack[v];
+	} else {
+		return -1; // no channels at all
+	}
+	this->voiceTrack[v] = track;
+	this->trackVoice[track] = v;
+	this->append(&this->busy, v);
+	return v;
+}
+
+void OPLVoiceAllocator::reserveTracks(unsigned int count)
+{
+	if (count > this->trackVoice.size()) this->trackVoice.resize(count, -1);
+	return;
+}
+
+void OPLVoiceAllocator::noteOff(unsigned int track)
+{
+	int v = this->find(track);
+	if (v < 0) return;
+	this->trackVoice[track] = -1;
+	this->voiceTrack[v] = -1;
+	this->unlink(&this->busy, v);
+	this->append(&this->idle, v);
+	return;
+}
+
+void OPLVoiceAllocator::unlink(List *list, int voice)
+{
+	int prev = this->voicePrev[voice];
+	int next = this->voiceNext[voice];
+	if (prev >= 0) this->voiceNext[prev] = next;
+	else list->head = next;
+	if (next >= 0) this->voicePrev[next] = prev;
+	else list->tail = prev;
+	return;
+}
+
+void OPLVoiceAllocator::append(List *list, int voice)
+{
+	this->voicePrev[voice] = list->tail;
+	this->voiceNext[voice] = -1;
+	if (list->tail >= 0) this->voiceNext[list->tail] = voice;
+	else list->head = voice;
+	list->tail = voice;
+	return;
+}
+
+void OPLVoiceAllocator::prepend(List *list, int voice)
+{
+	this->voicePrev[voice] = -1;
+	this->voiceNext[voice] = list->head;
+	if (list->head >= 0) this->voicePrev[list->head] = voice;
+	else list->tail = voice;
+	list->head = voice;
+	return;
+}
+
 EventConverter_OPL::EventConverter_OPL(OPLWriterCallback *cb,
 	std::shared_ptr<const Music> music, double fnumConversion, OPLWriteFlags flags)
 	:	cb(cb),
 		music(music),
 		fnumConversion(fnumConversion),
 		flags(flags),
+		diag(NULL),
 		cachedDelay(0),
 		modeOPL3(false),
 		modeRhythm(false)
@@ -54,6 +188,9 @@ EventConverter_OPL::EventConverter_OPL(OPLWriterCallback *cb,
 	memset(this->oplSet, 0x00, sizeof(this->oplSet));
 	memset(this->oplState, 0x00, sizeof(this->oplState));
 	assert(this->oplSet[0][0] == false);
+	this->queue.reserve(OPL_BATCH_SIZE);
+	if (music) this->voices.reserveTracks(music->trackInfo.size());
+	this->updateVoiceCount();
 }
 
 EventConverter_OPL::~EventConverter_OPL()
@@ -66,6 +203,58 @@ void EventConverter_OPL::setBankMIDI(std::shared_ptr<const PatchBank> bankMIDI)
 	return;
 }
 
+void EventConverter_OPL::setDiagnostics(Diagnostics *diag)
+{
+	this->diag = diag;
+	return;
+}
+
+void EventConverter_OPL::warning(const char *format, ...)
+{
+	char text[Diagnostics::MAX_LENGTH];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	if (this->diag) {
+		this->diag->warning("%s", text);
+	} else {
+		std::cerr << text << std::endl;
+	}
+	return;
+}
+
+void EventConverter_OPL::flush()
+{
+	if (this->queue.empty()) return;
+	this->cb->writeBatch(this->queue.data(), this->queue.size());
+	this->queue.clear();
+	return;
+}
+
+void EventConverter_OPL::saveState(State *state) const
+{
+	state->cachedDelay = this->cachedDelay;
+	memcpy(state->oplSet, this->oplSet, sizeof(this->oplSet));
+	memcpy(state->oplState, this->oplState, sizeof(this->oplState));
+	state->modeOPL3 = this->modeOPL3;
+	state->modeRhythm = this->modeRhythm;
+	state->voices = this->voices;
+	return;
+}
+
+void EventConverter_OPL::restoreState(const State& state)
+{
+	this->cachedDelay = state.cachedDelay;
+	memcpy(this->oplSet, state.oplSet, sizeof(this->oplSet));
+	memcpy(this->oplState, state.oplState, sizeof(this->oplState));
+	this->modeOPL3 = state.modeOPL3;
+	this->modeRhythm = state.modeRhythm;
+	this->voices = state.voices;
+	this->queue.clear();
+	return;
+}
+
 void EventConverter_OPL::handleAllEvents(EventHandler::EventOrder eventOrder)
 {
 	this->EventHandler::handleAllEvents(eventOrder, *this->music, 1);
@@ -75,7 +264,8 @@ void EventConverter_OPL::handleAllEvents(EventHandler::EventOrder eventOrder)
 	oplev.valid = OPLEvent::Delay;
 	oplev.delay = this->cachedDelay;
 	this->cachedDelay = 0;
-	this->cb->writeNextPair(&oplev);
+	this->queuePair(oplev);
+	this->flush();
 	return;
 }
 
@@ -104,7 +294,7 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 	}
 	oplev.valid |= OPLEvent::Tempo;
 	oplev.tempo = ev->tempo;
-	this->cb->writeNextPair(&oplev);
+	this->queuePair(oplev);
 	return true;
 }
 
@@ -124,7 +314,9 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 			<< " but patch bank only has " << this->music->patches->size()
 			<< " instruments."));
 	}
-	auto& patch = this->music->patches->at(ev->instrument);
+	// Take a copy of the pointer, as for MIDI notes it is replaced with the
+	// patch from bankMIDI, which must not end up in the song's own bank.
+	auto patch = this->music->patches->at(ev->instrument);
 	auto& ti = this->music->trackInfo[trackIndex];
 	if (this->bankMIDI) {
 		// We are handling MIDI events
@@ -145,9 +337,9 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 			patch = this->bankMIDI->at(target);
 		} else {
 			// No patch, bank too small
-			std::cout << "Dropping MIDI note, no entry in MIDI bank for "
-				<< (instMIDI->percussion ? "percussion" : "")
-				<< " patch #" << (int)instMIDI->midiPatch << "\n";
+			this->warning("Dropping MIDI note, no entry in MIDI bank for %s"
+				"patch #%d", instMIDI->percussion ? "percussion " : "",
+				(int)instMIDI->midiPatch);
 			return true;
 		}
 	} else {
@@ -165,7 +357,7 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 			(ti.channelType == TrackInfo::ChannelType::OPLPerc)
 			&& (!this->modeRhythm)
 		) {
-			std::cerr << "OPL: Ignoring rhythm channel in non-rhythm mode" << std::endl;
+			this->warning("OPL: Ignoring rhythm channel in non-rhythm mode");
 			return true;
 		}
 
@@ -174,7 +366,7 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 			&& (!this->modeOPL3)
 			&& (ti.channelIndex >= 9)
 		) {
-			std::cerr << "OPL: Ignoring OPL3 channels in OPL2 mode" << std::endl;
+			this->warning("OPL: Ignoring OPL3 channels in OPL2 mode");
 			return true;
 		}
 	}
@@ -183,6 +375,12 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 	// Don't play this note if there's no patch for it
 	if (!inst) return true;
 
+	if (ti.channelType == TrackInfo::ChannelType::MIDI) {
+		// Pick a channel for this note, possibly cutting off an older note.  The
+		// keyoff below will silence the old note if that happens.
+		this->voices.noteOn(trackIndex);
+	}
+
 	unsigned int oplChannel, chipIndex;
 	bool mod, car;
 	this->getOPLChannel(ti, trackIndex, &oplChannel, &chipIndex, &mod, &car);
@@ -288,7 +486,7 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 		bool mod, car;
 		this->getOPLChannel(ti, trackIndex, &oplChannel, &chipIndex, &mod, &car);
 
-		// No free channels
+		// No note playing, or its channel was taken over by another track
 		if (chipIndex == OPL_INVALID_CHIP) return true;
 
 		// Write 0xB0 w/ keyon bit disabled
@@ -296,7 +494,9 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 			(this->oplState[chipIndex][0xB0 | oplChannel] & ~OPLBIT_KEYON)
 		);
 
-		this->clearOPLChannel(trackIndex);
+		if (ti.channelType == TrackInfo::ChannelType::MIDI) {
+			this->voices.noteOff(trackIndex);
+		}
 	}
 	return true;
 }
@@ -325,7 +525,7 @@ bool EventConverter_OPL::handleEvent(unsigned long delay, unsigned int trackInde
 	bool mod, car;
 	this->getOPLChannel(ti, trackIndex, &oplChannel, &chipIndex, &mod, &car);
 
-	// No free channels
+	// No note playing on this MIDI track
 	if (chipIndex == OPL_INVALID_CHIP) return true;
 
 	switch (ev->type) {
@@ -415,6 +615,7 @@ bool EventConverter_OPL::handleEvent(unsigned long delay,
 			) {
 				this->processNextPair(1, 0x05, ev->value ? 0x01 : 0x00);
 				this->modeOPL3 = ev->value;
+				this->updateVoiceCount();
 			}
 			break;
 		case ConfigurationEvent::Type::EnableDeepTremolo: {
@@ -470,13 +671,20 @@ void EventConverter_OPL::processNextPair(uint8_t chipIndex, uint8_t reg,
 	oplev.delay = this->cachedDelay;
 	this->cachedDelay = 0;
 
-	this->cb->writeNextPair(&oplev);
+	this->queuePair(oplev);
 
 	this->oplState[chipIndex][reg] = val;
 	this->oplSet[chipIndex][reg] = true;
 	return;
 }
 
+void EventConverter_OPL::queuePair(const OPLEvent& oplev)
+{
+	this->queue.push_back(oplev);
+	if (this->queue.size() >= OPL_BATCH_SIZE) this->flush();
+	return;
+}
+
 void EventConverter_OPL::writeOpSettings(int chipIndex, int oplChannel,
 	int opNum, const OPLPatch& i, int velocity)
 {
@@ -553,32 +761,7 @@ void EventConverter_OPL::getOPLChannel(const TrackInfo& ti,
 	} else if (ti.channelType == TrackInfo::ChannelType::MIDI) {
 		*mod = true;
 		*car = true;
-		int rawChannel = -1;
-		MIDIChannelMap::iterator i = this->midiChannelMap.find(trackIndex);
-		if (i != this->midiChannelMap.end()) {
-			// Reuse a previous mapping
-			rawChannel = i->second;
-		} else {
-			// Create a new mapping
-			bool channelInUse[OPL_MAX_CHANNELS];
-			for (unsigned int j = 0; j < OPL_MAX_CHANNELS; j++) channelInUse[j] = false;
-			for (MIDIChannelMap::const_iterator
-				j = this->midiChannelMap.begin(); j != this->midiChannelMap.end(); j++
-			) {
-				assert(j->second < (signed int)OPL_MAX_CHANNELS);
-				if (j->second >= 0) channelInUse[j->second] = true;
-			}
-			for (unsigned int j = 0; j < OPL_MAX_CHANNELS; j++) {
-				if (!channelInUse[j]) {
-					// This is the channel to use
-					rawChannel = j;
-					this->midiChannelMap[trackIndex] = rawChannel;
-					break;
-				}
-			}
-			// This might set the map to -1 if there aren't enough free channels
-			if (rawChannel == -1) std::cout << "OPL: All 18 channels are in use for MIDI, dropping a note.\n";
-		}
+		int rawChannel = this->voices.find(trackIndex);
 		if (rawChannel < 0) {
 			*chipIndex = OPL_INVALID_CHIP;
 			*oplChannel = 0;
@@ -595,11 +778,11 @@ void EventConverter_OPL::getOPLChannel(const TrackInfo& ti,
 	return;
 }
 
-void EventConverter_OPL::clearOPLChannel(unsigned int trackIndex)
+void EventConverter_OPL::updateVoiceCount()
 {
-	MIDIChannelMap::iterator i = this->midiChannelMap.find(trackIndex);
-	if (i != this->midiChannelMap.end()) {
-		this->midiChannelMap.erase(i);
-	}
+	// The second chip's channels can only be heard in OPL3 mode
+	unsigned int count = 9;
+	if (this->modeOPL3 && !(this->flags & OPLWriteFlags::OPL2Only)) count = 18;
+	this->voices.setVoiceCount(count);
 	return;
 }
@@ -18,14 +18,20 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include "eventhandler-playback-seek.hpp"
 
 using namespace camoto::gamemusic;
 
+/// Minimum time between checkpoints saved by buildIndex(), in microseconds.
+#define SEEK_CHECKPOINT_INTERVAL 500000
+
 EventHandler_Playback_Seek::EventHandler_Playback_Seek(
 	std::shared_ptr<const Music> music, unsigned long loopCount)
 	: music(music),
-	  loopCount(loopCount)
+	  loopCount(loopCount),
+	  indexing(false),
+	  indexed(false)
 {
 	if (this->loopCount == 0) this->loopCount++;
 }
@@ -55,28 +61,28 @@ bool EventHandler_Playback_Seek::handleEvent(unsigned long delay,
 	this->updateTempo(ev->tempo);
 	this->usTotal += delay * this->usPerTick;
 	this->usPerTick = ev->tempo.usPerTick;
-	return this->usTotal < this->usTarget;
+	return this->eventProcessed();
 }
 
 bool EventHandler_Playback_Seek::handleEvent(unsigned long delay,
 	unsigned int trackIndex, unsigned int patternIndex, const NoteOnEvent *ev)
 {
 	this->usTotal += delay * this->usPerTick;
-	return this->usTotal < this->usTarget;
+	return this->eventProcessed();
 }
 
 bool EventHandler_Playback_Seek::handleEvent(unsigned long delay,
 	unsigned int trackIndex, unsigned int patternIndex, const NoteOffEvent *ev)
 {
 	this->usTotal += delay * this->usPerTick;
-	return this->usTotal < this->usTarget;
+	return this->eventProcessed();
 }
 
 bool EventHandler_Playback_Seek::handleEvent(unsigned long delay,
 	unsigned int trackIndex, unsigned int patternIndex, const EffectEvent *ev)
 {
 	this->usTotal += delay * this->usPerTick;
-	return this->usTotal < this->usTarget;
+	return this->eventProcessed();
 }
 
 bool EventHandler_Playback_Seek::handleEvent(unsigned long delay,
@@ -84,18 +90,20 @@ bool EventHandler_Playback_Seek::handleEvent(unsigned long delay,
 {
 	this->usTotal += delay * this->usPerTick;
 	this->performGoto(ev);
-	return this->usTotal < this->usTarget;
+	return this->eventProcessed();
 }
 
 bool EventHandler_Playback_Seek::handleEvent(unsigned long delay,
 	unsigned int trackIndex, unsigned int patternIndex, const ConfigurationEvent *ev)
 {
 	this->usTotal += delay * this->usPerTick;
-	return this->usTotal < this->usTarget;
+	return this->eventProcessed();
 }
 
 unsigned long EventHandler_Playback_Seek::getTotalLength()
 {
+	if (this->indexed) return this->usLength / 1000;
+
 	this->usTarget = (unsigned long)-1;
 	this->usTotal = 0;
 	this->usPerTick = this->music->initialTempo.usPerTick;
@@ -109,11 +117,54 @@ EventHandler::Position EventHandler_Playback_Seek::seekTo(
 	unsigned long msTarget, Tempo *destTempo)
 {
 	this->usTarget = msTarget * 1000;
-	this->usTotal = 0;
-	this->usPerTick = this->music->initialTempo.usPerTick;
-	assert(this->loopCount > 0); // don't want an infinte loop
-	auto pos = this->handleAllEvents(EventOrder::Order_Row_Track, *this->music,
-		this->loopCount);
+
+	// Find the last checkpoint that was saved before the target was reached
+	auto cp = std::lower_bound(this->checkpoints.begin(), this->checkpoints.end(),
+		this->usTarget, [](const Checkpoint& c, double us) {
+			return c.usTotal < us;
+		}
+	);
+
+	Position pos;
+	if (cp == this->checkpoints.begin()) {
+		// No checkpoint before the target, start from the beginning
+		this->usTotal = 0;
+		this->usPerTick = this->music->initialTempo.usPerTick;
+		assert(this->loopCount > 0); // don't want an infinte loop
+		pos = this->handleAllEvents(EventOrder::Order_Row_Track, *this->music,
+			this->loopCount);
+	} else {
+		cp--;
+		this->usTotal = cp->usTotal;
+		this->usPerTick = cp->usPerTick;
+		pos = this->resumeAllEvents(cp->resume, *this->music, this->loopCount);
+	}
 	*destTempo = this->tempo;
 	return pos;
 }
+
+void EventHandler_Playback_Seek::buildIndex()
+{
+	this->checkpoints.clear();
+	this->indexed = false;
+	this->indexing = true;
+	this->usNextCheckpoint = 0;
+	this->getTotalLength();
+	this->indexing = false;
+	this->usLength = this->usTotal;
+	this->indexed = true;
+	return;
+}
+
+bool EventHandler_Playback_Seek::eventProcessed()
+{
+	if (this->indexing && (this->usTotal >= this->usNextCheckpoint)) {
+		this->checkpoints.emplace_back();
+		auto& cp = this->checkpoints.back();
+		this->saveResumePoint(&cp.resume);
+		cp.usTotal = this->usTotal;
+		cp.usPerTick = this->usPerTick;
+		this->usNextCheckpoint = this->usTotal + SEEK_CHECKPOINT_INTERVAL;
+	}
+	return this->usTotal < this->usTarget;
+}
@@ -93,6 +93,17 @@ class CAMOTO_GAMEMUSIC_API EventHandler_Playback_Seek: virtual public EventHandl
 		 */
 		Position seekTo(unsigned long msTarget, Tempo *destTempo);
 
+		/// Run through the song once, saving checkpoints along the way.
+		/**
+		 * After this has been called, getTotalLength() returns the stored length
+		 * and seekTo() continues from the closest checkpoint before the target,
+		 * rather than starting again from the beginning of the song.
+		 *
+		 * The checkpoints refer directly to the song's events, so this object
+		 * must be discarded if the song is modified.
+		 */
+		void buildIndex();
+
 	protected:
 		std::shared_ptr<const Music> music; ///< Song being examined
 		unsigned long loopCount;            ///< Number of times to play song
@@ -100,6 +111,29 @@ class CAMOTO_GAMEMUSIC_API EventHandler_Playback_Seek: virtual public EventHandl
 		double usTarget;   ///< Target seek time, in microseconds, -1 for no target
 		double usTotal;    ///< Current song length in microseconds
 		double usPerTick;  ///< Current tempo, microseconds per tick
+
+		/// Place seekTo() can continue from.
+		struct Checkpoint
+		{
+			ResumePoint resume; ///< State just after an event was processed
+			double usTotal;     ///< Value of usTotal after the event
+			double usPerTick;   ///< Value of usPerTick after the event
+		};
+
+		/// Checkpoints, in order of increasing usTotal.
+		std::vector<Checkpoint> checkpoints;
+
+		bool indexing;           ///< true if checkpoints are being recorded
+		bool indexed;            ///< true if buildIndex() has completed
+		double usNextCheckpoint; ///< Earliest time to record the next checkpoint
+		double usLength;         ///< Song length, valid once indexed
+
+		/// Common code run at the end of each handleEvent().
+		/**
+		 * @return true to keep processing, false if the seek target has been
+		 *   reached.
+		 */
+		bool eventProcessed();
 };
 
 } // namespace gamemusic
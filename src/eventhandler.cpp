@@ -18,33 +18,31 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <list>
+#include <algorithm>
 #include <camoto/gamemusic/eventhandler.hpp>
 
 using namespace camoto::gamemusic;
 
-struct MergedEvent
+/// Heap ordering of track cursors.
+/**
+ * Events are ordered by time, then with all the note-offs first (to minimise
+ * any unnecessary note polyphony), then by track.  This returns true if \a a
+ * should come after \a b, so that std::push_heap() et al. produce a min-heap.
+ */
+template <class T>
+bool mergeCursorAfter(const T& a, const T& b)
 {
-	MergedEvent(std::shared_ptr<const Event> ev)
-		:	event(ev)
-	{
-	}
-	unsigned long absTime;
-	unsigned int trackIndex;
-	std::shared_ptr<const Event> event;
-};
+	if (a.absTime != b.absTime) return a.absTime > b.absTime;
+	if (a.noteOff != b.noteOff) return b.noteOff;
+	return a.trackIndex > b.trackIndex;
+}
 
-bool trackMergeByTime(const MergedEvent& a, const MergedEvent& b)
+EventHandler::EventHandler()
+	:	isGotoPending(false),
+		mergeTime(0),
+		mergePos(NULL),
+		eventOrder(Pattern_Row_Track)
 {
-	if (a.absTime == b.absTime) {
-		// These events occur at the same time, so try to put all the note-offs
-		// first, to minimise any unnecessary note polyphony
-		auto a_off = dynamic_cast<const NoteOffEvent*>(a.event.get());
-		auto b_off = dynamic_cast<const NoteOffEvent*>(b.event.get());
-		if (a_off && b_off) return false;
-		return a_off;
-	}
-	return a.absTime < b.absTime;
 }
 
 bool EventHandler::actionGoto(Position& pos, EventOrder eventOrder)
@@ -98,6 +96,7 @@ EventHandler::Position EventHandler::handleAllEvents(EventOrder eventOrder,
 {
 	this->isGotoPending = false;
 	this->tempo = music.initialTempo;
+	this->loopEvents.clear();
 
 	Position pos;
 	pos.orderIndex = 0;
@@ -123,42 +122,86 @@ EventHandler::Position EventHandler::handleAllEvents(EventOrder eventOrder,
 	pos.loop = 0;
 	pos.us = 0;
 
+	this->eventOrder = eventOrder;
+	return this->processAllEvents(music, targetLoopCount, pos, false);
+}
+
+void EventHandler::saveResumePoint(ResumePoint *rp) const
+{
+	assert(this->mergePos); // must be called from handleEvent()
+	rp->eventOrder = this->eventOrder;
+	rp->pos = *this->mergePos;
+	rp->isGotoPending = this->isGotoPending;
+	rp->pendingGotoPtr = this->pendingGotoPtr;
+	rp->pendingGoto = this->pendingGoto;
+	rp->tempo = this->tempo;
+	rp->loopEvents = this->loopEvents;
+	rp->mergeHeap = this->mergeHeap;
+	rp->mergeTime = this->mergeTime;
+	return;
+}
+
+EventHandler::Position EventHandler::resumeAllEvents(const ResumePoint& rp,
+	const Music& music, unsigned int targetLoopCount)
+{
+	this->eventOrder = rp.eventOrder;
+	this->isGotoPending = rp.isGotoPending;
+	this->pendingGotoPtr = rp.pendingGotoPtr;
+	this->pendingGoto = rp.pendingGoto;
+	this->tempo = rp.tempo;
+	this->loopEvents = rp.loopEvents;
+	this->mergeHeap = rp.mergeHeap;
+	this->mergeTime = rp.mergeTime;
+	return this->processAllEvents(music, targetLoopCount, rp.pos, true);
+}
+
+EventHandler::Position EventHandler::processAllEvents(const Music& music,
+	unsigned int targetLoopCount, Position pos, bool resume)
+{
+	auto eventOrder = this->eventOrder;
 	bool processing = true;
 	do {
 		assert(pos.orderIndex < music.patternOrder.size());
 		assert(pos.patternIndex < music.patterns.size());
 
-		// Figure out what the next pattern will be.  This might be overridden by
-		// a GotoEvent later.
-		if (!this->actionGoto(pos, eventOrder)) {
+		if (resume) {
+			// Carry on from part way through the pattern, where the next pattern
+			// has already been worked out.
+			processing = this->processMergedEvents(music, &pos);
+			resume = false;
+		} else {
+			// Figure out what the next pattern will be.  This might be overridden
+			// by a GotoEvent later.
+			if (!this->actionGoto(pos, eventOrder)) {
+				switch (eventOrder) {
+					case Pattern_Row_Track:
+					case Pattern_Track_Row:
+						pos.nextPatternIndex = pos.patternIndex + 1;
+						break;
+					case Order_Row_Track:
+					case Order_Track_Row:
+						pos.nextOrderIndex = pos.orderIndex + 1;
+						break;
+				}
+				pos.startRow = 0;
+			}
+
+			// Process the current pattern
+			auto& pattern = music.patterns[pos.patternIndex];
 			switch (eventOrder) {
 				case Pattern_Row_Track:
+					processing = this->processPattern_mergeTracks(music, pattern, &pos);
+					break;
 				case Pattern_Track_Row:
-					pos.nextPatternIndex = pos.patternIndex + 1;
+					processing = this->processPattern_separateTracks(music, pattern, &pos);
 					break;
 				case Order_Row_Track:
+					processing = this->processPattern_mergeTracks(music, pattern, &pos);
+					break;
 				case Order_Track_Row:
-					pos.nextOrderIndex = pos.orderIndex + 1;
+					processing = this->processPattern_separateTracks(music, pattern, &pos);
 					break;
 			}
-			pos.startRow = 0;
-		}
-
-		// Process the current pattern
-		auto& pattern = music.patterns[pos.patternIndex];
-		switch (eventOrder) {
-			case Pattern_Row_Track:
-				processing = this->processPattern_mergeTracks(music, pattern, &pos);
-				break;
-			case Pattern_Track_Row:
-				processing = this->processPattern_separateTracks(music, pattern, &pos);
-				break;
-			case Order_Row_Track:
-				processing = this->processPattern_mergeTracks(music, pattern, &pos);
-				break;
-			case Order_Track_Row:
-				processing = this->processPattern_separateTracks(music, pattern, &pos);
-				break;
 		}
 
 		// Now either all the pattern's events have been processed, or a jump
@@ -215,37 +258,58 @@ EventHandler::Position EventHandler::handleAllEvents(EventOrder eventOrder,
 bool EventHandler::processPattern_mergeTracks(const Music& music,
 	const Pattern& pattern, Position *pos)
 {
-	// Merge all the tracks together into one big track, with all events in
-	// chronological order
-	std::list<MergedEvent> full;
+	// Merge all the tracks together by repeatedly taking the earliest event
+	// from the front of any track.
+	auto& heap = this->mergeHeap;
+	heap.clear();
+	heap.reserve(pattern.size());
 
 	pos->row = pos->startRow;
 	unsigned int trackIndex = 0;
 	// For each track
 	for (auto& pt : pattern) {
-		std::list<MergedEvent> ltrack;
-
-		unsigned long trackTime = 0;
-		// For each event in the track
-		for (auto& te : pt) {
-			// If this assertion is thrown, it's because the format reader or
-			// some processing function got events out of order.  They must be
-			// chronological.
-			trackTime += te.delay;
-			MergedEvent mevent(te.event);
-			mevent.absTime = trackTime;
-			mevent.trackIndex = trackIndex;
-			ltrack.push_back(mevent);
+		if (pt.size()) {
+			MergeCursor cur;
+			cur.next = pt.begin();
+			cur.end = pt.end();
+			cur.absTime = cur.next->delay;
+			cur.trackIndex = trackIndex;
+			cur.noteOff = dynamic_cast<const NoteOffEvent*>(cur.next->event.get());
+			heap.push_back(cur);
 		}
-		// Merge in with master list
-		full.merge(ltrack, trackMergeByTime);
 		trackIndex++;
 	}
+	std::make_heap(heap.begin(), heap.end(), mergeCursorAfter<MergeCursor>);
+	this->mergeTime = 0;
+
+	return this->processMergedEvents(music, pos);
+}
+
+bool EventHandler::processMergedEvents(const Music& music, Position *pos)
+{
+	auto& heap = this->mergeHeap;
+	auto& trackTime = this->mergeTime;
+	this->mergePos = pos;
+
+	// Now run through the events from all tracks in chronological order
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), mergeCursorAfter<MergeCursor>);
+		auto& me = heap.back();
+		auto event = me.next->event.get();
+		unsigned long absTime = me.absTime;
+		unsigned int meTrackIndex = me.trackIndex;
+
+		// Move this track on to its next event, if there is one
+		me.next++;
+		if (me.next == me.end) {
+			heap.pop_back();
+		} else {
+			me.absTime += me.next->delay;
+			me.noteOff = dynamic_cast<const NoteOffEvent*>(me.next->event.get());
+			std::push_heap(heap.begin(), heap.end(), mergeCursorAfter<MergeCursor>);
+		}
 
-	unsigned long trackTime = 0;
-	// Now run through the master list, which has all events sorted
-	for (auto& me : full) {
-		unsigned long deltaTime = me.absTime - trackTime;
+		unsigned long deltaTime = absTime - trackTime;
 
 		unsigned long midDelay = 0;
 		if ((trackTime < pos->startRow) && (trackTime + deltaTime > pos->startRow)) {
@@ -254,19 +318,21 @@ bool EventHandler::processPattern_mergeTracks(const Music& music,
 			midDelay = pos->startRow - (trackTime + deltaTime);
 		}
 
-		trackTime = me.absTime;
+		trackTime = absTime;
 
 		// Skip events until we reach the point where we need to start processing
 		if (trackTime < pos->startRow) continue;
 
 		pos->row += deltaTime;
 		pos->us += (midDelay + deltaTime) * this->tempo.usPerTick;
-		if (!me.event->processEvent(deltaTime, me.trackIndex,
+		if (!event->processEvent(deltaTime, meTrackIndex,
 			pos->patternIndex, this)
 		) {
+			this->mergePos = NULL;
 			return false;
 		}
 	}
+	this->mergePos = NULL;
 	assert(trackTime <= music.ticksPerTrack);
 	this->endOfPattern(music.ticksPerTrack - trackTime);
 	return true;
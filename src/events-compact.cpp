@@ -0,0 +1,295 @@
+/**
+ * @file  events-compact.cpp
+ * @brief Conversion between compact and standard events.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <typeinfo>
+#include <assert.h>
+#include <camoto/util.hpp> // createString()
+#include <camoto/gamemusic/events-compact.hpp>
+#include <camoto/gamemusic/eventhandler.hpp>
+#include <camoto/gamemusic/exceptions.hpp>
+
+using namespace camoto;
+using namespace camoto::gamemusic;
+
+/// Copy the fields of a compact event into a standard event.
+static void copyEvent(const CompactEvent& c, TempoEvent *ev)
+{
+	ev->tempo.beatsPerBar = c.tempo.beatsPerBar;
+	ev->tempo.beatLength = c.tempo.beatLength;
+	ev->tempo.ticksPerBeat = c.tempo.ticksPerBeat;
+	ev->tempo.framesPerTick = c.tempo.framesPerTick;
+	ev->tempo.usPerTick = c.tempo.usPerTick;
+	return;
+}
+
+static void copyEvent(const CompactEvent& c, NoteOnEvent *ev)
+{
+	ev->instrument = c.noteOn.instrument;
+	ev->milliHertz = c.noteOn.milliHertz;
+	ev->velocity = c.noteOn.velocity;
+	return;
+}
+
+static void copyEvent(const CompactEvent& c, NoteOffEvent *ev)
+{
+	return;
+}
+
+static void copyEvent(const CompactEvent& c, EffectEvent *ev)
+{
+	ev->type = c.effect.type;
+	ev->data = c.effect.data;
+	return;
+}
+
+static void copyEvent(const CompactEvent& c, GotoEvent *ev)
+{
+	ev->type = c.jump.type;
+	ev->repeat = c.jump.repeat;
+	ev->targetOrder = c.jump.targetOrder;
+	ev->targetRow = c.jump.targetRow;
+	return;
+}
+
+static void copyEvent(const CompactEvent& c, ConfigurationEvent *ev)
+{
+	ev->configType = c.config.configType;
+	ev->value = c.config.value;
+	return;
+}
+
+/// Pass a temporary copy of a compact event to a handler.
+template <class T>
+static bool dispatchEvent(const CompactEvent& c, unsigned long delay,
+	unsigned int trackIndex, unsigned int patternIndex, EventHandler *handler)
+{
+	T ev;
+	copyEvent(c, &ev);
+	return handler->handleEvent(delay, trackIndex, patternIndex, &ev);
+}
+
+std::string CompactEvent::getContent() const
+{
+	return expandEvent(*this)->getContent();
+}
+
+bool CompactEvent::processEvent(unsigned long delay, unsigned int trackIndex,
+	unsigned int patternIndex, EventHandler *handler) const
+{
+	switch (this->type) {
+		case Type::Tempo:
+			return dispatchEvent<TempoEvent>(*this, delay, trackIndex, patternIndex,
+				handler);
+		case Type::NoteOn:
+			return dispatchEvent<NoteOnEvent>(*this, delay, trackIndex,
+				patternIndex, handler);
+		case Type::NoteOff:
+			return dispatchEvent<NoteOffEvent>(*this, delay, trackIndex,
+				patternIndex, handler);
+		case Type::Effect:
+			return dispatchEvent<EffectEvent>(*this, delay, trackIndex,
+				patternIndex, handler);
+		case Type::Goto:
+			return dispatchEvent<GotoEvent>(*this, delay, trackIndex, patternIndex,
+				handler);
+		case Type::Configuration:
+			return dispatchEvent<ConfigurationEvent>(*this, delay, trackIndex,
+				patternIndex, handler);
+	}
+	return true;
+}
+
+CompactEvent camoto::gamemusic::compactEvent(const Event& ev)
+{
+	// Only the exact types can be stored, as anything derived from them (such
+	// as the events used while splitting tracks) has fields that would be lost.
+	const std::type_info& type = typeid(ev);
+	CompactEvent c;
+	if (type == typeid(NoteOnEvent)) {
+		auto e = dynamic_cast<const NoteOnEvent *>(&ev);
+		c.type = CompactEvent::Type::NoteOn;
+		c.noteOn.instrument = e->instrument;
+		c.noteOn.milliHertz = e->milliHertz;
+		c.noteOn.velocity = e->velocity;
+	} else if (type == typeid(NoteOffEvent)) {
+		c.type = CompactEvent::Type::NoteOff;
+	} else if (type == typeid(EffectEvent)) {
+		auto e = dynamic_cast<const EffectEvent *>(&ev);
+		c.type = CompactEvent::Type::Effect;
+		c.effect.type = e->type;
+		c.effect.data = e->data;
+	} else if (type == typeid(TempoEvent)) {
+		auto e = dynamic_cast<const TempoEvent *>(&ev);
+		c.type = CompactEvent::Type::Tempo;
+		c.tempo.beatsPerBar = e->tempo.beatsPerBar;
+		c.tempo.beatLength = e->tempo.beatLength;
+		c.tempo.ticksPerBeat = e->tempo.ticksPerBeat;
+		c.tempo.framesPerTick = e->tempo.framesPerTick;
+		c.tempo.usPerTick = e->tempo.usPerTick;
+	} else if (type == typeid(GotoEvent)) {
+		auto e = dynamic_cast<const GotoEvent *>(&ev);
+		c.type = CompactEvent::Type::Goto;
+		c.jump.type = e->type;
+		c.jump.repeat = e->repeat;
+		c.jump.targetOrder = e->targetOrder;
+		c.jump.targetRow = e->targetRow;
+	} else if (type == typeid(ConfigurationEvent)) {
+		auto e = dynamic_cast<const ConfigurationEvent *>(&ev);
+		c.type = CompactEvent::Type::Configuration;
+		c.config.configType = e->configType;
+		c.config.value = e->value;
+	} else {
+		throw format_limitation(createString("Unable to store event in compact "
+			"form, unsupported event type: " << ev.getContent()));
+	}
+	return c;
+}
+
+/// Allocate a standard event holding a copy of a compact one.
+template <class T>
+static std::shared_ptr<Event> newEvent(const CompactEvent& c)
+{
+	auto ev = std::make_shared<T>();
+	copyEvent(c, ev.get());
+	return ev;
+}
+
+std::shared_ptr<Event> camoto::gamemusic::expandEvent(const CompactEvent& ev)
+{
+	switch (ev.type) {
+		case CompactEvent::Type::Tempo: return newEvent<TempoEvent>(ev);
+		case CompactEvent::Type::NoteOn: return newEvent<NoteOnEvent>(ev);
+		case CompactEvent::Type::NoteOff: return newEvent<NoteOffEvent>(ev);
+		case CompactEvent::Type::Effect: return newEvent<EffectEvent>(ev);
+		case CompactEvent::Type::Goto: return newEvent<GotoEvent>(ev);
+		case CompactEvent::Type::Configuration:
+			return newEvent<ConfigurationEvent>(ev);
+	}
+	throw format_limitation("Unable to expand compact event of unknown type.");
+}
+
+CompactTrack camoto::gamemusic::compactTrack(const Track& track)
+{
+	CompactTrack ct;
+	ct.reserve(track.size());
+	for (auto& te : track) {
+		CompactTrackEvent cte;
+		cte.delay = te.delay;
+		cte.event = compactEvent(*te.event);
+		ct.push_back(cte);
+	}
+	return ct;
+}
+
+/// Storage for every event in an expanded track, in a single allocation.
+/**
+ * Each list is reserved to its final size before any events are added, so
+ * the events never move once the track's pointers refer to them.
+ */
+struct ExpandedEvents
+{
+	std::vector<TempoEvent> tempo;
+	std::vector<NoteOnEvent> noteOn;
+	std::vector<NoteOffEvent> noteOff;
+	std::vector<EffectEvent> effect;
+	std::vector<GotoEvent> jump;
+	std::vector<ConfigurationEvent> config;
+};
+
+/// Add an event to an ExpandedEvents list, returning a pointer to it.
+/**
+ * The pointer shares ownership of the whole block, so the event stays valid
+ * for as long as the caller holds it.
+ */
+template <class T>
+static std::shared_ptr<Event> addEvent(
+	const std::shared_ptr<ExpandedEvents>& block, std::vector<T>& events,
+	const CompactEvent& c)
+{
+	assert(events.size() < events.capacity());
+	events.emplace_back();
+	copyEvent(c, &events.back());
+	return std::shared_ptr<Event>(block, &events.back());
+}
+
+Track camoto::gamemusic::expandTrack(const CompactTrack& track)
+{
+	Track t;
+	if (track.empty()) return t;
+
+	// Count each type so the lists can be allocated at their final size
+	unsigned long count[(int)CompactEvent::Type::Configuration + 1] = {};
+	for (auto& cte : track) count[(int)cte.event.type]++;
+	auto block = std::make_shared<ExpandedEvents>();
+	block->tempo.reserve(count[(int)CompactEvent::Type::Tempo]);
+	block->noteOn.reserve(count[(int)CompactEvent::Type::NoteOn]);
+	block->noteOff.reserve(count[(int)CompactEvent::Type::NoteOff]);
+	block->effect.reserve(count[(int)CompactEvent::Type::Effect]);
+	block->jump.reserve(count[(int)CompactEvent::Type::Goto]);
+	block->config.reserve(count[(int)CompactEvent::Type::Configuration]);
+
+	t.reserve(track.size());
+	for (auto& cte : track) {
+		TrackEvent te;
+		te.delay = cte.delay;
+		switch (cte.event.type) {
+			case CompactEvent::Type::Tempo:
+				te.event = addEvent(block, block->tempo, cte.event);
+				break;
+			case CompactEvent::Type::NoteOn:
+				te.event = addEvent(block, block->noteOn, cte.event);
+				break;
+			case CompactEvent::Type::NoteOff:
+				te.event = addEvent(block, block->noteOff, cte.event);
+				break;
+			case CompactEvent::Type::Effect:
+				te.event = addEvent(block, block->effect, cte.event);
+				break;
+			case CompactEvent::Type::Goto:
+				te.event = addEvent(block, block->jump, cte.event);
+				break;
+			case CompactEvent::Type::Configuration:
+				te.event = addEvent(block, block->config, cte.event);
+				break;
+		}
+		t.push_back(std::move(te));
+	}
+	return t;
+}
+
+CompactPattern camoto::gamemusic::compactPattern(const Pattern& pattern)
+{
+	CompactPattern cp;
+	cp.reserve(pattern.size());
+	for (auto& t : pattern) {
+		cp.push_back(compactTrack(t));
+	}
+	return cp;
+}
+
+Pattern camoto::gamemusic::expandPattern(const CompactPattern& pattern)
+{
+	Pattern p;
+	p.reserve(pattern.size());
+	for (auto& ct : pattern) {
+		p.push_back(expandTrack(ct));
+	}
+	return p;
+}
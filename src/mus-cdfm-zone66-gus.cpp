@@ -196,6 +196,9 @@ std::unique_ptr<Music> MusicType_CDFM_GUS::read(stream::input& content,
 	// Read instruments
 	music->patches->reserve(numDigInst);
 
+	// Length of each PCM sample, which is loaded after everything else
+	std::vector<unsigned long> lenSample;
+	lenSample.reserve(numDigInst);
 	for (int i = 0; i < numDigInst; i++) {
 		uint8_t flags;
 		auto patch = std::make_shared<PCMPatch>();
@@ -215,7 +218,7 @@ std::unique_ptr<Music> MusicType_CDFM_GUS::read(stream::input& content,
 			patch->loopStart = 0;
 			patch->loopEnd = 0;
 		}
-		patch->data = std::vector<uint8_t>(lenData);
+		lenSample.push_back(lenData);
 		music->patches->push_back(patch);
 	}
 
@@ -358,14 +361,22 @@ std::unique_ptr<Music> MusicType_CDFM_GUS::read(stream::input& content,
 		}
 	}
 
-	// Load the PCM samples
+	// Load the PCM samples.  They are stored one after the other, so they are
+	// read in one go and each patch refers to its own part of the buffer.
 	content.seekg(sampleOffset, stream::start);
+	unsigned long lenAllSamples = 0;
+	for (auto len : lenSample) lenAllSamples += len;
+	PCMData samples;
+	samples.read(content, lenAllSamples);
+
+	// Convert 8-bit GUS samples from signed to unsigned
+	for (auto& s : samples) s += 128;
+
+	unsigned long offset = 0;
 	for (int i = 0; i < numDigInst; i++) {
 		auto patch = static_cast<PCMPatch*>(music->patches->at(i).get());
-		content.read(patch->data.data(), patch->data.size());
-
-		// Convert 8-bit GUS samples from signed to unsigned
-		for (auto& s : patch->data) s += 128;
+		patch->data = samples.slice(offset, lenSample[i]);
+		offset += lenSample[i];
 	}
 
 	return music;
@@ -256,6 +256,9 @@ std::unique_ptr<Music> MusicType_CDFM::read(stream::input& content,
 	// Read instruments
 	music->patches->reserve(numDigInst + numOPLInst);
 
+	// Length of each PCM sample, which is loaded after everything else
+	std::vector<unsigned long> lenSample;
+	lenSample.reserve(numDigInst);
 	for (int i = 0; i < numDigInst; i++) {
 		auto patch = std::make_shared<PCMPatch>();
 		content.seekg(4, stream::cur); // skip address_ptr field
@@ -272,7 +275,7 @@ std::unique_ptr<Music> MusicType_CDFM::read(stream::input& content,
 		if (patch->loopEnd == 0x00FFFFFF) patch->loopEnd = 0; // no loop
 		if (patch->loopStart >= lenData) patch->loopStart = 0;
 		if (patch->loopEnd > lenData) patch->loopEnd = lenData;
-		patch->data = std::vector<uint8_t>(lenData);
+		lenSample.push_back(lenData);
 		music->patches->push_back(patch);
 	}
 
@@ -472,11 +475,18 @@ std::unique_ptr<Music> MusicType_CDFM::read(stream::input& content,
 		patternIndex++;
 	}
 
-	// Load the PCM samples
+	// Load the PCM samples.  They are stored one after the other, so they are
+	// read in one go and each patch refers to its own part of the buffer.
 	content.seekg(sampleOffset, stream::start);
+	unsigned long lenAllSamples = 0;
+	for (auto len : lenSample) lenAllSamples += len;
+	PCMData samples;
+	samples.read(content, lenAllSamples);
+	unsigned long offset = 0;
 	for (int i = 0; i < numDigInst; i++) {
 		auto patch = static_cast<PCMPatch*>(music->patches->at(i).get());
-		content.read(patch->data.data(), patch->data.size());
+		patch->data = samples.slice(offset, lenSample[i]);
+		offset += lenSample[i];
 	}
 
 	return music;
@@ -111,7 +111,21 @@ MusicType::Certainty MusicType_CMF::isInstance(stream::input& content) const
 	return Certainty::DefinitelyYes;
 }
 
-std::unique_ptr<Music> MusicType_CMF::read(stream::input& content, SuppData& suppData) const
+/// Fields from the CMF header needed to read the rest of the file.
+struct CMFHeader
+{
+	uint16_t offInst;
+	uint16_t offMusic;
+	uint16_t ticksPerQuarter;
+	uint16_t ticksPerSecond;
+	uint16_t offTitle;
+	uint16_t offComposer;
+	uint16_t offRemarks;
+	uint16_t numInstruments;
+};
+
+/// Read the CMF header, ignoring any metadata offsets that are past EOF.
+static void readCMFHeader(stream::input& content, CMFHeader *hdr)
 {
 	stream::len lenData = content.size();
 
@@ -120,47 +134,45 @@ std::unique_ptr<Music> MusicType_CMF::read(stream::input& content, SuppData& sup
 	// absolute file offsets, which we thus won't have to adjust.
 	content.seekg(4, stream::start); // skip CTMF header
 
-	uint16_t ver, offInst, ticksPerQuarter, ticksPerSecond;
-	uint16_t offMusic, offTitle, offComposer, offRemarks;
+	uint16_t ver;
 	content
 		>> u16le(ver)
-		>> u16le(offInst)
-		>> u16le(offMusic)
-		>> u16le(ticksPerQuarter)
-		>> u16le(ticksPerSecond)
-		>> u16le(offTitle)
-		>> u16le(offComposer)
-		>> u16le(offRemarks)
+		>> u16le(hdr->offInst)
+		>> u16le(hdr->offMusic)
+		>> u16le(hdr->ticksPerQuarter)
+		>> u16le(hdr->ticksPerSecond)
+		>> u16le(hdr->offTitle)
+		>> u16le(hdr->offComposer)
+		>> u16le(hdr->offRemarks)
 	;
 
 	// Highway Hunter has weird CMF files with invalid metadata offsets (not to
 	// mention chunks of random data including MTrk chunks and Microsoft
 	// copyright messages!)
-	if (offTitle > lenData) {
+	if (hdr->offTitle > lenData) {
 		std::cerr << "Warning: CMF 'title' field starts past EOF, ignoring.\n";
-		offTitle = 0;
+		hdr->offTitle = 0;
 	}
-	if (offComposer > lenData) {
+	if (hdr->offComposer > lenData) {
 		std::cerr << "Warning: CMF 'composer' field starts past EOF, ignoring.\n";
-		offComposer = 0;
+		hdr->offComposer = 0;
 	}
-	if (offRemarks > lenData) {
+	if (hdr->offRemarks > lenData) {
 		std::cerr << "Warning: CMF 'remarks' field starts past EOF, ignoring.\n";
-		offRemarks = 0;
+		hdr->offRemarks = 0;
 	}
 
 	// Skip channel-in-use table as we don't need it
 	content.seekg(16, stream::cur);
 
 	// Rest of header depends on file version
-	uint16_t numInstruments;
 	switch (ver) {
 		case 0x100: {
 			uint8_t temp;
 			content
 				>> u8(temp)
 			;
-			numInstruments = temp;
+			hdr->numInstruments = temp;
 			break;
 		}
 		default: // do this so you can force-open an unknown version
@@ -169,18 +181,41 @@ std::unique_ptr<Music> MusicType_CMF::read(stream::input& content, SuppData& sup
 			// fall through
 		case 0x101:
 			content
-				>> u16le(numInstruments)
+				>> u16le(hdr->numInstruments)
 			;
 			// Skip uint16le tempo value (unknown use)
 			content.seekg(2, stream::cur);
 			break;
 	}
+	return;
+}
+
+/// Read one of the title/composer/remarks fields, if present.
+static void readCMFText(stream::input& content, Attribute& a, const char *name,
+	const char *desc, uint16_t offText)
+{
+	a.changed = false;
+	a.type = Attribute::Type::Text;
+	a.name = name;
+	a.desc = desc;
+	a.textMaxLength = CMF_ATTR_MAXLEN;
+	if (offText) {
+		content.seekg(offText, stream::start);
+		content >> nullTerminated(a.textValue, CMF_ATTR_MAXLEN);
+	}
+	return;
+}
+
+std::unique_ptr<Music> MusicType_CMF::read(stream::input& content, SuppData& suppData) const
+{
+	CMFHeader hdr;
+	readCMFHeader(content, &hdr);
 
 	// Process the MIDI data
-	content.seekg(offMusic, stream::start);
+	content.seekg(hdr.offMusic, stream::start);
 	Tempo initialTempo;
-	initialTempo.hertz(ticksPerSecond);
-	initialTempo.ticksPerQuarterNote(ticksPerQuarter);
+	initialTempo.hertz(hdr.ticksPerSecond);
+	initialTempo.ticksPerQuarterNote(hdr.ticksPerQuarter);
 	std::unique_ptr<Music> music = midiDecode(content, MIDIFlags::UsePatchIndex
 		| MIDIFlags::CMFExtensions, initialTempo);
 
@@ -247,9 +282,9 @@ std::unique_ptr<Music> MusicType_CMF::read(stream::input& content, SuppData& sup
 
 	// Read the instruments
 	auto oplBank = std::make_shared<PatchBank>();
-	oplBank->reserve(numInstruments);
-	content.seekg(offInst, stream::start);
-	for (unsigned int i = 0; i < numInstruments; i++) {
+	oplBank->reserve(hdr.numInstruments);
+	content.seekg(hdr.offInst, stream::start);
+	for (unsigned int i = 0; i < hdr.numInstruments; i++) {
 		auto patch = std::make_shared<OPLPatch>();
 		content >> instrumentSBI(*patch);
 		oplBank->push_back(patch);
@@ -316,7 +351,7 @@ std::unique_ptr<Music> MusicType_CMF::read(stream::input& content, SuppData& sup
 					// oplBank->size() as it will increase as we add default instruments to
 					// the bank, so we use numInstruments which should always be the number of
 					// custom instruments only.
-					if (oplIndex >= numInstruments) {
+					if (oplIndex >= hdr.numInstruments) {
 						// Using one of the generic instruments
 						unsigned int realInst = oplIndex % CMF_NUM_DEFAULT_INSTRUMENTS;
 						if (genericMapping[realInst] <= 0) {
@@ -342,42 +377,12 @@ std::unique_ptr<Music> MusicType_CMF::read(stream::input& content, SuppData& sup
 	music->patches = oplBank;
 
 	// Read metadata
-	{
-		auto& a = music->addAttribute();
-		a.changed = false;
-		a.type = Attribute::Type::Text;
-		a.name = CAMOTO_ATTRIBUTE_TITLE;
-		a.desc = "Song title";
-		a.textMaxLength = CMF_ATTR_MAXLEN;
-		if (offTitle) {
-			content.seekg(offTitle, stream::start);
-			content >> nullTerminated(a.textValue, CMF_ATTR_MAXLEN);
-		}
-	}
-	{
-		auto& a = music->addAttribute();
-		a.changed = false;
-		a.type = Attribute::Type::Text;
-		a.name = CAMOTO_ATTRIBUTE_AUTHOR;
-		a.desc = "Song composer";
-		a.textMaxLength = CMF_ATTR_MAXLEN;
-		if (offComposer) {
-			content.seekg(offComposer, stream::start);
-			content >> nullTerminated(a.textValue, CMF_ATTR_MAXLEN);
-		}
-	}
-	{
-		auto& a = music->addAttribute();
-		a.changed = false;
-		a.type = Attribute::Type::Text;
-		a.name = CAMOTO_ATTRIBUTE_COMMENT;
-		a.desc = "Song remarks";
-		a.textMaxLength = CMF_ATTR_MAXLEN;
-		if (offRemarks) {
-			content.seekg(offRemarks, stream::start);
-			content >> nullTerminated(a.textValue, CMF_ATTR_MAXLEN);
-		}
-	}
+	readCMFText(content, music->addAttribute(), CAMOTO_ATTRIBUTE_TITLE,
+		"Song title", hdr.offTitle);
+	readCMFText(content, music->addAttribute(), CAMOTO_ATTRIBUTE_AUTHOR,
+		"Song composer", hdr.offComposer);
+	readCMFText(content, music->addAttribute(), CAMOTO_ATTRIBUTE_COMMENT,
+		"Song remarks", hdr.offRemarks);
 
 	// Swap operators for required percussive patches
 	oplDenormalisePerc(*music, OPLNormaliseType::CarFromMod);
@@ -385,9 +390,36 @@ std::unique_ptr<Music> MusicType_CMF::read(stream::input& content, SuppData& sup
 	return music;
 }
 
-void MusicType_CMF::write(stream::output& content, SuppData& suppData,
+MusicSummary MusicType_CMF::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	MusicSummary summary;
+	CMFHeader hdr;
+	readCMFHeader(content, &hdr);
+
+	content.seekg(hdr.offMusic, stream::start);
+	Tempo initialTempo;
+	initialTempo.hertz(hdr.ticksPerSecond);
+	initialTempo.ticksPerQuarterNote(hdr.ticksPerQuarter);
+	midiScan(content, MIDIFlags::UsePatchIndex | MIDIFlags::CMFExtensions,
+		initialTempo, &summary);
+
+	summary.attributes.resize(3);
+	readCMFText(content, summary.attributes[0], CAMOTO_ATTRIBUTE_TITLE,
+		"Song title", hdr.offTitle);
+	readCMFText(content, summary.attributes[1], CAMOTO_ATTRIBUTE_AUTHOR,
+		"Song composer", hdr.offComposer);
+	readCMFText(content, summary.attributes[2], CAMOTO_ATTRIBUTE_COMMENT,
+		"Song remarks", hdr.offRemarks);
+	return summary;
+}
+
+void MusicType_CMF::write(stream::output& output, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
+	// Built in memory so the channel-in-use table can be updated at the end
+	stream::string content;
+
 	requirePatches<OPLPatch>(*music.patches);
 	if (music.patches->size() >= MIDI_PATCHES) {
 		throw bad_patch("CMF files have a maximum of 128 instruments.");
@@ -486,9 +518,6 @@ void MusicType_CMF::write(stream::output& content, SuppData& suppData,
 	midiEncode(content, *musicMIDI, midiFlags, channelsUsed,
 		EventHandler::Order_Row_Track, NULL);
 
-	// Set final filesize to this
-	content.truncate_here();
-
 	// Update the channel-in-use table
 	uint8_t channelsInUse[MIDI_CHANNEL_COUNT];
 	for (unsigned int i = 0; i < MIDI_CHANNEL_COUNT; i++) {
@@ -497,6 +526,8 @@ void MusicType_CMF::write(stream::output& content, SuppData& suppData,
 	content.seekp(20, stream::start);
 	content.write((char *)channelsInUse, 16);
 
+	output.write(content.data);
+	if (!(flags & WriteFlags::NoTruncate)) output.truncate_here();
 	return;
 }
 
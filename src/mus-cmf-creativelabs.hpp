@@ -36,6 +36,7 @@ class MusicType_CMF: virtual public MusicType
 		virtual Caps caps() const;
 		virtual Certainty isInstance(stream::input& content) const;
 		virtual std::unique_ptr<Music> read(stream::input& content, SuppData& suppData) const;
+		virtual MusicSummary probe(stream::input& content, SuppData& suppData) const;
 		virtual void write(stream::output& content, SuppData& suppData,
 			const Music& music, WriteFlags flags) const;
 		virtual SuppFilenames getRequiredSupps(stream::input& content,
@@ -19,6 +19,7 @@
  */
 
 #include <camoto/iostream_helpers.hpp>
+#include <camoto/stream_string.hpp>
 #include "decode-opl.hpp"
 #include "encode-opl.hpp"
 #include "metadata-malv.hpp"
@@ -40,96 +41,94 @@ using namespace camoto::gamemusic;
 #define DRO_OPLTYPE_OPL3 1
 
 /// Decode data in a .dro file to provide register/value pairs.
-class OPLReaderCallback_DRO_v1: virtual public OPLReaderCallback
+class OPLReaderCallback_DRO_v1: virtual public OPLReaderCallback_Buffer
 {
 	public:
 		OPLReaderCallback_DRO_v1(stream::input& content)
-			:	content(content),
+			:	OPLReaderCallback_Buffer(content),
 				chipIndex(0)
 		{
+			uint32_t lenData;
 			this->content.seekg(16, stream::start);
-			this->content >> u32le(this->lenData);
+			this->content >> u32le(lenData);
 			// Skip to start of OPL data
 			this->content.seekg(24, stream::start);
+			this->load(lenData);
 		}
 
 		virtual bool readNextPair(OPLEvent *oplEvent)
 		{
 			assert(oplEvent->valid == 0);
 
-			if (this->lenData == 0) return false;
 			oplEvent->delay = 0;
 
-			try {
-				uint8_t code;
 nextCode:
-				if (this->lenData == 0) return false;
-				this->content >> u8(code);
-				this->lenData--;
-				switch (code) {
-					case 0x00: // short delay
-						this->content >> u8(code);
-						this->lenData--;
-						oplEvent->delay += code + 1;
-						oplEvent->valid |= OPLEvent::Delay;
-						goto nextCode;
-					case 0x01: { // long delay
-						uint16_t amt;
-						this->content >> u16le(amt);
-						this->lenData--;
-						oplEvent->delay += amt + 1;
-						oplEvent->valid |= OPLEvent::Delay;
-						goto nextCode;
-					}
-					case 0x02:
-						this->chipIndex = 0;
-						goto nextCode;
-					case 0x03:
-						this->chipIndex = 1;
-						goto nextCode;
-					case 0x04: // escape
-						this->content
-							>> u8(oplEvent->reg)
-							>> u8(oplEvent->val)
-						;
-						this->lenData -= 2;
-						oplEvent->valid |= OPLEvent::Regs;
-						break;
-					default: // normal reg
-						oplEvent->chipIndex = this->chipIndex;
-						oplEvent->reg = code;
-						this->content >> u8(oplEvent->val);
-						this->lenData--;
-						oplEvent->valid |= OPLEvent::Regs;
-						break;
+			// Every code is followed by at most three more bytes
+			if ((this->end - this->pos < 4) && !this->fill(4)) {
+				if (this->pos == this->end) return false;
+				int lenCode;
+				switch (this->pos[0]) {
+					case 0x01: case 0x04: lenCode = 3; break;
+					case 0x02: case 0x03: lenCode = 1; break;
+					default: lenCode = 2; break;
+				}
+				if (this->end - this->pos < lenCode) {
+					// Truncated file
+					this->pos = this->end;
+					return false;
 				}
-			} catch (const stream::incomplete_read&) {
-				return false;
+			}
+			switch (*this->pos++) {
+				case 0x00: // short delay
+					oplEvent->delay += *this->pos++ + 1;
+					oplEvent->valid |= OPLEvent::Delay;
+					goto nextCode;
+				case 0x01: // long delay
+					oplEvent->delay += (this->pos[0] | (this->pos[1] << 8)) + 1;
+					this->pos += 2;
+					oplEvent->valid |= OPLEvent::Delay;
+					goto nextCode;
+				case 0x02:
+					this->chipIndex = 0;
+					goto nextCode;
+				case 0x03:
+					this->chipIndex = 1;
+					goto nextCode;
+				case 0x04: // escape
+					oplEvent->reg = this->pos[0];
+					oplEvent->val = this->pos[1];
+					this->pos += 2;
+					oplEvent->valid |= OPLEvent::Regs;
+					break;
+				default: // normal reg
+					oplEvent->chipIndex = this->chipIndex;
+					oplEvent->reg = this->pos[-1];
+					oplEvent->val = *this->pos++;
+					oplEvent->valid |= OPLEvent::Regs;
+					break;
 			}
 
 			return true;
 		}
 
 	protected:
-		stream::input& content;     ///< Input file
 		unsigned int chipIndex;     ///< Index of the currently selected OPL chip
-		unsigned long lenData;      ///< Length of song data (where song stops and tags start)
 };
 
 
 /// Encode OPL register/value pairs into .dro file data.
-class OPLWriterCallback_DRO_v1: virtual public OPLWriterCallback
+class OPLWriterCallback_DRO_v1: virtual public OPLWriterCallback_Stream
 {
 	public:
 		OPLWriterCallback_DRO_v1(stream::output& content)
-			:	content(content),
+			:	OPLWriterCallback_Stream(content),
 				lastChipIndex(0),
 				msSongLength(0),
 				oplType(DRO_OPLTYPE_OPL2)
 		{
 		}
 
-		virtual void writeNextPair(const OPLEvent *oplEvent)
+		virtual void encodePair(stream::output& out, const OPLEvent *oplEvent)
 		{
 			if (oplEvent->valid & OPLEvent::Delay) {
 				// Convert ticks into a DRO delay value (which is actually milliseconds)
@@ -140,7 +139,7 @@ class OPLWriterCallback_DRO_v1: virtual public OPLWriterCallback
 					if (delay > 256) {
 						uint16_t ld = (delay > 65536) ? 65535 : delay - 1;
 						// Write out a 'long' delay
-						this->content
+						out
 							<< u8(1)
 							<< u16le(ld)
 						;
@@ -149,7 +148,7 @@ class OPLWriterCallback_DRO_v1: virtual public OPLWriterCallback
 						continue;
 					}
 					assert(delay <= 256);
-					this->content
+					out
 						<< u8(0) // delay command
 						<< u8(delay - 1) // delay value
 					;
@@ -161,7 +160,7 @@ class OPLWriterCallback_DRO_v1: virtual public OPLWriterCallback
 			if (oplEvent->valid & OPLEvent::Regs) {
 				if (oplEvent->chipIndex != this->lastChipIndex) {
 					assert(oplEvent->chipIndex < 2);
-					this->content << u8(0x02 + oplEvent->chipIndex);
+					out << u8(0x02 + oplEvent->chipIndex);
 					this->lastChipIndex = oplEvent->chipIndex;
 				}
 				if (oplEvent->chipIndex == 1) {
@@ -175,13 +174,13 @@ class OPLWriterCallback_DRO_v1: virtual public OPLWriterCallback
 				}
 				if (oplEvent->reg < 0x05) {
 					// Need to escape this reg
-					this->content
+					out
 						<< u8(4)
 					;
 					// Now the following byte will be treated as a register
 					// regardless of its value.
 				}
-				this->content
+				out
 					<< u8(oplEvent->reg)
 					<< u8(oplEvent->val)
 				;
@@ -190,7 +189,6 @@ class OPLWriterCallback_DRO_v1: virtual public OPLWriterCallback
 		}
 
 	protected:
-		stream::output& content;    ///< Output file
 		unsigned int lastChipIndex; ///< Index of the currently selected OPL chip
 
 	public:
@@ -260,6 +258,7 @@ std::unique_ptr<Music> MusicType_DRO_v1::read(stream::input& content,
 
 	OPLReaderCallback_DRO_v1 cb(content);
 	auto music = oplDecode(&cb, DelayType::DelayIsPreData, OPL_FNUM_DEFAULT, initialTempo);
+	cb.seekPastData();
 
 	// See if there are any tags present
 	readMalvMetadata(content, music.get());
@@ -267,9 +266,59 @@ std::unique_ptr<Music> MusicType_DRO_v1::read(stream::input& content,
 	return music;
 }
 
-void MusicType_DRO_v1::write(stream::output& content, SuppData& suppData,
+std::unique_ptr<MusicStream> MusicType_DRO_v1::openStream(
+	std::unique_ptr<stream::input> content, SuppData& suppData) const
+{
+	content->seekg(0, stream::start);
+
+	Tempo initialTempo;
+	initialTempo.usPerTick = DRO_CLOCK;
+
+	// The tags come after the song data, so they are read once it has all
+	// been decoded.
+	auto cb = std::make_unique<OPLReaderCallback_DRO_v1>(*content);
+	auto reader = cb.get();
+	return std::make_unique<OPLMusicStream>(std::move(content), std::move(cb),
+		DelayType::DelayIsPreData, OPL_FNUM_DEFAULT, initialTempo,
+		[reader](stream::input& content, Music *music) {
+			reader->seekPastData();
+			readMalvMetadata(content, music);
+		}
+	);
+}
+
+MusicSummary MusicType_DRO_v1::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	uint32_t msSongLength, lenData;
+	content.seekg(12, stream::start);
+	content
+		>> u32le(msSongLength)
+		>> u32le(lenData)
+	;
+
+	MusicSummary summary;
+	summary.patternCount = 1;
+	summary.orderCount = 1;
+	summary.instrumentCount = MusicSummary::Unknown;
+	// Only the length in bytes is stored, and codes vary in size
+	summary.eventCount = MusicSummary::Unknown;
+	summary.msLength = msSongLength;
+
+	content.seekg(24 + (stream::pos)lenData, stream::start);
+	Music tags;
+	readMalvMetadata(content, &tags);
+	summary.attributes = tags.attributes();
+
+	return summary;
+}
+
+void MusicType_DRO_v1::write(stream::output& output, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
+	// Built in memory so the header can be filled in at the end
+	stream::string content;
+
 	content.write("DBRAWOPL\x00\x00\x01\x00", 12);
 
 	// Write out some placeholders, which will be overwritten later
@@ -291,9 +340,6 @@ void MusicType_DRO_v1::write(stream::output& content, SuppData& suppData,
 	// Write out any metadata
 	writeMalvMetadata(content, music.attributes());
 
-	// Set final filesize to this
-	content.truncate_here();
-
 	content.seekp(12, stream::start);
 	content
 		<< u32le(cb.msSongLength) // Song length in milliseconds (one tick == 1ms)
@@ -301,6 +347,8 @@ void MusicType_DRO_v1::write(stream::output& content, SuppData& suppData,
 		<< u32le(cb.oplType)      // Hardware type (0=OPL2, 1=OPL3, 2=dual OPL2)
 	;
 
+	output.write(content.data);
+	if (!(flags & WriteFlags::NoTruncate)) output.truncate_here();
 	return;
 }
 
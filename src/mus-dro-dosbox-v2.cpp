@@ -48,14 +48,15 @@ using namespace camoto::gamemusic;
 #define DRO2_OPLTYPE_OPL3 2
 
 /// Decode data in a .dro file to provide register/value pairs.
-class OPLReaderCallback_DRO_v2: virtual public OPLReaderCallback
+class OPLReaderCallback_DRO_v2: virtual public OPLReaderCallback_Buffer
 {
 	public:
 		OPLReaderCallback_DRO_v2(stream::input& content)
-			:	content(content)
+			:	OPLReaderCallback_Buffer(content)
 		{
+			uint32_t lenData;
 			this->content.seekg(12, stream::start);
-			this->content >> u32le(this->lenData);
+			this->content >> u32le(lenData);
 			this->content.seekg(6, stream::cur);
 			uint8_t compression;
 			this->content
@@ -68,53 +69,51 @@ class OPLReaderCallback_DRO_v2: virtual public OPLReaderCallback
 			if (this->codemapLength > 127) throw stream::error("DRO code map too large");
 			memset(this->codemap, 0xFF, sizeof(this->codemap));
 			this->content.read(this->codemap, this->codemapLength);
-			// Seek pointer is now at start of OPL data
+			// Seek pointer is now at start of OPL data, two bytes per pair
+			this->load((stream::len)lenData * 2);
 		}
 
 		virtual bool readNextPair(OPLEvent *oplEvent)
 		{
 			oplEvent->delay = 0;
-			if (this->lenData == 0) return false;
 
-			try {
-				uint8_t code, arg;
+			uint8_t code, arg;
 nextCode:
-				this->content >> u8(code) >> u8(arg);
-				this->lenData--;
-				if (code == this->codeShortDelay) {
-					oplEvent->delay += arg + 1;
-					oplEvent->valid |= OPLEvent::Delay;
-					goto nextCode;
-				} else if (code == this->codeLongDelay) {
-					oplEvent->delay += (arg + 1) << 8;
-					oplEvent->valid |= OPLEvent::Delay;
-					goto nextCode;
-				}
-
-				// High bit indicates which chip to use
-				oplEvent->chipIndex = code >> 7;
-
-				if ((code & 0x7F) >= this->codemapLength) {
-					std::cerr << "WARNING: DRO file is using codes past the end of the code "
-						"map!" << std::endl;
-					// But continue as we will just use register 0xFF in these cases.
-				}
-				oplEvent->reg = this->codemap[code & 0x7F];
-				oplEvent->val = arg;
-				oplEvent->valid |= OPLEvent::Regs;
-			} catch (const stream::incomplete_read&) {
+			if ((this->end - this->pos < 2) && !this->fill(2)) {
+				// Skip any odd byte left over
+				this->pos = this->end;
 				// oplEvent->delay is populated with any final delay
 				return false;
 			}
+			code = this->pos[0];
+			arg = this->pos[1];
+			this->pos += 2;
+			if (code == this->codeShortDelay) {
+				oplEvent->delay += arg + 1;
+				oplEvent->valid |= OPLEvent::Delay;
+				goto nextCode;
+			} else if (code == this->codeLongDelay) {
+				oplEvent->delay += (arg + 1) << 8;
+				oplEvent->valid |= OPLEvent::Delay;
+				goto nextCode;
+			}
+
+			// High bit indicates which chip to use
+			oplEvent->chipIndex = code >> 7;
+
+			if ((code & 0x7F) >= this->codemapLength) {
+				std::cerr << "WARNING: DRO file is using codes past the end of the code "
+					"map!" << std::endl;
+				// But continue as we will just use register 0xFF in these cases.
+			}
+			oplEvent->reg = this->codemap[code & 0x7F];
+			oplEvent->val = arg;
+			oplEvent->valid |= OPLEvent::Regs;
 
 			return true;
 		}
 
 	protected:
-		stream::input& content;   ///< Input .raw file
-		bool first;                 ///< Is this the first time readNextPair() has been called?
-		unsigned long lenData;      ///< Length of song data (where song stops and tags start)
-
 		uint8_t codeShortDelay;     ///< DRO code value used for a short delay
 		uint8_t codeLongDelay;      ///< DRO code value used for a long delay
 		uint8_t codemapLength;      ///< Number of valid entries in codemap array
@@ -330,6 +329,7 @@ std::unique_ptr<Music> MusicType_DRO_v2::read(stream::input& content,
 	OPLReaderCallback_DRO_v2 cb(content);
 	auto music = oplDecode(&cb, DelayType::DelayIsPreData,
 		OPL_FNUM_DEFAULT, initialTempo);
+	cb.seekPastData();
 
 	// See if there are any tags present
 	readMalvMetadata(content, music.get());
@@ -337,9 +337,60 @@ std::unique_ptr<Music> MusicType_DRO_v2::read(stream::input& content,
 	return music;
 }
 
-void MusicType_DRO_v2::write(stream::output& content, SuppData& suppData,
+std::unique_ptr<MusicStream> MusicType_DRO_v2::openStream(
+	std::unique_ptr<stream::input> content, SuppData& suppData) const
+{
+	content->seekg(0, stream::start);
+
+	Tempo initialTempo;
+	initialTempo.usPerTick = DRO_CLOCK;
+
+	auto cb = std::make_unique<OPLReaderCallback_DRO_v2>(*content);
+	auto reader = cb.get();
+	return std::make_unique<OPLMusicStream>(std::move(content), std::move(cb),
+		DelayType::DelayIsPreData, OPL_FNUM_DEFAULT, initialTempo,
+		[reader](stream::input& content, Music *music) {
+			reader->seekPastData();
+			readMalvMetadata(content, music);
+		}
+	);
+}
+
+MusicSummary MusicType_DRO_v2::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	uint32_t numPairs, msSongLength;
+	uint8_t codemapLength;
+	content.seekg(12, stream::start);
+	content
+		>> u32le(numPairs)
+		>> u32le(msSongLength)
+	;
+	content.seekg(5, stream::cur);
+	content >> u8(codemapLength);
+
+	MusicSummary summary;
+	summary.patternCount = 1;
+	summary.orderCount = 1;
+	summary.instrumentCount = MusicSummary::Unknown;
+	summary.eventCount = numPairs;
+	summary.msLength = msSongLength;
+
+	// Skip over the code map and song data to get to the tags
+	content.seekg(codemapLength + (stream::pos)numPairs * 2, stream::cur);
+	Music tags;
+	readMalvMetadata(content, &tags);
+	summary.attributes = tags.attributes();
+
+	return summary;
+}
+
+void MusicType_DRO_v2::write(stream::output& output, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
+	// Assemble the whole file first, then write it out in one block
+	stream::string content;
+
 	content.write("DBRAWOPL\x02\x00\x00\x00", 12);
 
 	// Call the generic OPL writer.
@@ -351,9 +402,8 @@ void MusicType_DRO_v2::write(stream::output& content, SuppData& suppData,
 	// Write out any metadata
 	writeMalvMetadata(content, music.attributes());
 
-	// Set final filesize to this
-	content.truncate_here();
-
+	output.write(content.data);
+	if (!(flags & WriteFlags::NoTruncate)) output.truncate_here();
 	return;
 }
 
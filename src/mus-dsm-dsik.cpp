@@ -281,8 +281,7 @@ std::unique_ptr<Music> MusicType_DSM::read(stream::input& content,
 			else p->defaultVolume = (volDefault << 2) | (volDefault >> 4);
 
 			// Read the PCM data
-			p->data = std::vector<uint8_t>(lenData);
-			content.read(p->data.data(), p->data.size());
+			p->data.read(content, lenData);
 
 			// Convert from signed 8-bit to unsigned
 			if (flags & 2) {
@@ -507,7 +506,7 @@ void MusicType_DSM::write(stream::output& content, SuppData& suppData,
 	for (auto& i : *music.patches) {
 		iff.begin("INST");
 
-		auto p = dynamic_cast<PCMPatch*>(i.get());
+		auto p = dynamic_cast<const PCMPatch*>(i.get());
 		unsigned int flags = 0;
 		if (p->loopEnd != 0) flags |= 1;
 		unsigned int period = 8363 * 428 / p->sampleRate;
@@ -29,29 +29,28 @@ using namespace camoto::gamemusic;
 #define GOT_DEFAULT_TEMPO 120 ///< Default tempo, in Hertz
 
 /// Decode data in an .imf file to provide register/value pairs.
-class OPLReaderCallback_GOT: virtual public OPLReaderCallback
+class OPLReaderCallback_GOT: virtual public OPLReaderCallback_Buffer
 {
 	public:
 		OPLReaderCallback_GOT(stream::input& content)
-			:	content(content)
+			:	OPLReaderCallback_Buffer(content)
 		{
+			// Read until EOF, the song ends with an all-zero event
+			this->load(content.size() - content.tellg());
 		}
 
 		virtual bool readNextPair(OPLEvent *oplEvent)
 		{
 			assert(oplEvent->valid == 0);
 
-			try {
-				uint8_t delay;
-				this->content
-					>> u8(delay)
-					>> u8(oplEvent->reg)
-					>> u8(oplEvent->val)
-				;
-				oplEvent->delay = delay;
-			} catch (const stream::incomplete_read&) {
+			if ((this->end - this->pos < 3) && !this->fill(3)) {
+				this->pos = this->end;
 				return false;
 			}
+			oplEvent->delay = this->pos[0];
+			oplEvent->reg = this->pos[1];
+			oplEvent->val = this->pos[2];
+			this->pos += 3;
 
 			if (
 				(oplEvent->delay == 0)
@@ -65,22 +64,19 @@ class OPLReaderCallback_GOT: virtual public OPLReaderCallback
 			oplEvent->valid |= OPLEvent::Delay | OPLEvent::Regs;
 			return true;
 		}
-
-	protected:
-		stream::input& content;   ///< Input file
 };
 
 
 /// Encode OPL register/value pairs into .imf file data.
-class OPLWriterCallback_GOT: virtual public OPLWriterCallback
+class OPLWriterCallback_GOT: virtual public OPLWriterCallback_Stream
 {
 	public:
 		OPLWriterCallback_GOT(stream::output& content)
-			:	content(content)
+			:	OPLWriterCallback_Stream(content)
 		{
 		}
 
-		virtual void writeNextPair(const OPLEvent *oplEvent)
+		virtual void encodePair(stream::output& out, const OPLEvent *oplEvent)
 		{
 			// Convert ticks into an IMF delay
 			unsigned long delay;
@@ -92,7 +88,7 @@ class OPLWriterCallback_GOT: virtual public OPLWriterCallback
 			}
 			// Write out super long delays as dummy events to an unused port.
 			while (delay > 0xFF) {
-				this->content
+				out
 					<< u8(0xFF)
 					<< u8(0x00)
 					<< u8(0x00)
@@ -105,14 +101,14 @@ class OPLWriterCallback_GOT: virtual public OPLWriterCallback
 				// OPLWriteFlags::OPL2Only being supplied in the call to oplEncode().
 				assert(oplEvent->chipIndex == 0);
 
-				this->content
+				out
 					<< u8(delay)
 					<< u8(oplEvent->reg)
 					<< u8(oplEvent->val)
 				;
 			} else if (delay) {
 				// There is a delay but no regs (e.g. trailing delay)
-				this->content
+				out
 					<< u8(delay)
 					<< u8(0)
 					<< u8(0)
@@ -120,9 +116,6 @@ class OPLWriterCallback_GOT: virtual public OPLWriterCallback
 			}
 			return;
 		}
-
-	protected:
-		stream::output& content; ///< Output file
 };
 
 
@@ -198,6 +191,35 @@ std::unique_ptr<Music> MusicType_GOT::read(stream::input& content,
 	return music;
 }
 
+std::unique_ptr<MusicStream> MusicType_GOT::openStream(
+	std::unique_ptr<stream::input> content, SuppData& suppData) const
+{
+	content->seekg(2, stream::start);
+
+	Tempo initialTempo;
+	initialTempo.hertz(GOT_DEFAULT_TEMPO);
+
+	auto cb = std::make_unique<OPLReaderCallback_GOT>(*content);
+	return std::make_unique<OPLMusicStream>(std::move(content), std::move(cb),
+		DelayType::DelayIsPostData, OPL_FNUM_DEFAULT, initialTempo, nullptr);
+}
+
+MusicSummary MusicType_GOT::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	content.seekg(2, stream::start);
+
+	Tempo initialTempo;
+	initialTempo.hertz(GOT_DEFAULT_TEMPO);
+
+	// No tags in this format, so the register data is all there is
+	MusicSummary summary;
+	OPLReaderCallback_GOT cb(content);
+	oplScan(&cb, initialTempo, &summary);
+
+	return summary;
+}
+
 void MusicType_GOT::write(stream::output& content, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
@@ -19,6 +19,7 @@
  */
 
 #include <camoto/iostream_helpers.hpp>
+#include <camoto/stream_string.hpp>
 #include "decode-opl.hpp"
 #include "encode-opl.hpp"
 #include "metadata-malv.hpp"
@@ -34,54 +35,47 @@ using namespace camoto;
 using namespace camoto::gamemusic;
 
 /// Decode data in an .imf file to provide register/value pairs.
-class OPLReaderCallback_IMF: virtual public OPLReaderCallback
+class OPLReaderCallback_IMF: virtual public OPLReaderCallback_Buffer
 {
 	public:
-		OPLReaderCallback_IMF(stream::input& content, unsigned int lenData)
-			:	content(content),
-				lenData(lenData)
+		OPLReaderCallback_IMF(stream::input& content, unsigned long lenData)
+			:	OPLReaderCallback_Buffer(content)
 		{
+			this->load(lenData);
 		}
 
 		virtual bool readNextPair(OPLEvent *oplEvent)
 		{
 			assert(oplEvent->valid == 0);
-			if (this->lenData == 0) return false;
-
-			try {
-				this->content
-					>> u8(oplEvent->reg)
-					>> u8(oplEvent->val)
-					>> u16le(oplEvent->delay)
-				;
-			} catch (const stream::incomplete_read&) {
-				this->lenData = 0;
+			if ((this->end - this->pos < 4) && !this->fill(4)) {
+				// Skip any partial event at the end
+				this->pos = this->end;
 				return false;
 			}
 
-			this->lenData -= 4;
+			oplEvent->reg = this->pos[0];
+			oplEvent->val = this->pos[1];
+			oplEvent->delay = this->pos[2] | (this->pos[3] << 8);
+			this->pos += 4;
+
 			oplEvent->chipIndex = 0; // Only one OPL2 supported
 			oplEvent->valid |= OPLEvent::Delay | OPLEvent::Regs;
 			return true;
 		}
-
-	protected:
-		stream::input& content;   ///< Input file
-		unsigned long lenData;    ///< Length of song data (where song stops and tags start)
 };
 
 
 /// Encode OPL register/value pairs into .imf file data.
-class OPLWriterCallback_IMF: virtual public OPLWriterCallback
+class OPLWriterCallback_IMF: virtual public OPLWriterCallback_Stream
 {
 	public:
 		OPLWriterCallback_IMF(stream::output& content, unsigned int speed)
-			:	content(content),
+			:	OPLWriterCallback_Stream(content),
 				speed(speed)
 		{
 		}
 
-		virtual void writeNextPair(const OPLEvent *oplEvent)
+		virtual void encodePair(stream::output& out, const OPLEvent *oplEvent)
 		{
 			// Convert ticks into an IMF delay
 			unsigned long delay;
@@ -91,7 +85,7 @@ class OPLWriterCallback_IMF: virtual public OPLWriterCallback
 
 				// Write out super long delays as dummy events to an unused port.
 				while (delay > 0xFFFF) {
-					this->content
+					out
 						<< u8(0x00)
 						<< u8(0x00)
 						<< u16le(0xFFFF)
@@ -107,14 +101,14 @@ class OPLWriterCallback_IMF: virtual public OPLWriterCallback
 				// OPLWriteFlags::OPL2Only being supplied in the call to oplEncode().
 				assert(oplEvent->chipIndex == 0);
 
-				this->content
+				out
 					<< u8(oplEvent->reg)
 					<< u8(oplEvent->val)
 					<< u16le(delay)
 				;
 			} else if (delay) {
 				// There is a delay but no regs (e.g. trailing delay)
-				this->content
+				out
 					<< u8(0)
 					<< u8(0)
 					<< u16le(delay)
@@ -124,7 +118,6 @@ class OPLWriterCallback_IMF: virtual public OPLWriterCallback
 		}
 
 	protected:
-		stream::output& content; ///< Output file
 		unsigned int speed;      ///< IMF clock rate
 };
 
@@ -242,6 +235,7 @@ std::unique_ptr<Music> MusicType_IMF_Common::read(stream::input& content,
 	OPLReaderCallback_IMF cb(content, lenData);
 	auto music = oplDecode(&cb, DelayType::DelayIsPostData, OPL_FNUM_DEFAULT,
 		initialTempo);
+	cb.seekPastData();
 
 	if (this->imfType == 1) {
 		// See if there are any tags present
@@ -251,9 +245,71 @@ std::unique_ptr<Music> MusicType_IMF_Common::read(stream::input& content,
 	return music;
 }
 
-void MusicType_IMF_Common::write(stream::output& content, SuppData& suppData,
+std::unique_ptr<MusicStream> MusicType_IMF_Common::openStream(
+	std::unique_ptr<stream::input> content, SuppData& suppData) const
+{
+	content->seekg(0, stream::start);
+
+	unsigned int lenData;
+	if (this->imfType == 1) {
+		*content >> u16le(lenData);
+	} else {
+		lenData = content->size();
+	}
+
+	Tempo initialTempo;
+	initialTempo.hertz(this->speed);
+	initialTempo.ticksPerBeat = this->speed / 4;
+
+	auto cb = std::make_unique<OPLReaderCallback_IMF>(*content, lenData);
+	auto reader = cb.get();
+	OPLMusicStream::FinishCallback finish;
+	if (this->imfType == 1) {
+		finish = [reader](stream::input& content, Music *music) {
+			reader->seekPastData();
+			readMalvMetadata(content, music);
+		};
+	}
+	return std::make_unique<OPLMusicStream>(std::move(content), std::move(cb),
+		DelayType::DelayIsPostData, OPL_FNUM_DEFAULT, initialTempo, finish);
+}
+
+MusicSummary MusicType_IMF_Common::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	content.seekg(0, stream::start);
+
+	unsigned int lenData;
+	if (this->imfType == 1) {
+		content >> u16le(lenData);
+	} else {
+		lenData = content.size();
+	}
+
+	Tempo initialTempo;
+	initialTempo.hertz(this->speed);
+	initialTempo.ticksPerBeat = this->speed / 4;
+
+	MusicSummary summary;
+	OPLReaderCallback_IMF cb(content, lenData);
+	oplScan(&cb, initialTempo, &summary);
+
+	if (this->imfType == 1) {
+		cb.seekPastData();
+		Music tags;
+		readMalvMetadata(content, &tags);
+		summary.attributes = tags.attributes();
+	}
+
+	return summary;
+}
+
+void MusicType_IMF_Common::write(stream::output& output, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
+	// Built in memory so the type-1 length field can be filled in at the end
+	stream::string content;
+
 	if (this->imfType == 1) {
 		// Write a placeholder for the song length we'll fill out later when we
 		// know what value to use.
@@ -285,16 +341,12 @@ void MusicType_IMF_Common::write(stream::output& content, SuppData& suppData,
 		// Write out any metadata
 		writeMalvMetadata(content, music.attributes());
 
-		// Set final filesize to this
-		content.truncate_here();
-
 		content.seekp(0, stream::start);
 		content << u16le(size);
-	} else {
-		// Set final filesize to this
-		content.truncate_here();
 	}
 
+	output.write(content.data);
+	if (!(flags & WriteFlags::NoTruncate)) output.truncate_here();
 	return;
 }
 
@@ -34,6 +34,9 @@ class MusicType_IMF_Common: virtual public MusicType
 		virtual Caps caps() const;
 		virtual Certainty isInstance(stream::input& content) const;
 		virtual std::unique_ptr<Music> read(stream::input& content, SuppData& suppData) const;
+		virtual MusicSummary probe(stream::input& content, SuppData& suppData) const;
+		virtual std::unique_ptr<MusicStream> openStream(
+			std::unique_ptr<stream::input> content, SuppData& suppData) const;
 		virtual void write(stream::output& content, SuppData& suppData,
 			const Music& music, WriteFlags flags) const;
 		virtual SuppFilenames getRequiredSupps(stream::input& content,
@@ -19,6 +19,7 @@
  */
 
 #include <camoto/iostream_helpers.hpp>
+#include <camoto/stream_string.hpp>
 #include <camoto/gamemusic/patch-midi.hpp>
 #include "decode-midi.hpp"
 #include "encode-midi.hpp"
@@ -83,8 +84,8 @@ MusicType::Certainty MusicType_MID_Type0::isInstance(stream::input& content)
 	return Certainty::DefinitelyYes;
 }
 
-std::unique_ptr<Music> MusicType_MID_Type0::read(stream::input& content,
-	SuppData& suppData) const
+/// Read the MThd block and MTrk header, leaving content at the MIDI data.
+static void readMIDIHeader(stream::input& content, Tempo *initialTempo)
 {
 	// Skip MThd header.
 	content.seekg(4, stream::start);
@@ -108,17 +109,37 @@ std::unique_ptr<Music> MusicType_MID_Type0::read(stream::input& content,
 
 	/// @todo Clip content to lenData
 
+	initialTempo->ticksPerQuarterNote(ticksPerQuarter);
+	initialTempo->usPerQuarterNote(MIDI_DEF_uS_PER_QUARTER_NOTE);
+	return;
+}
+
+std::unique_ptr<Music> MusicType_MID_Type0::read(stream::input& content,
+	SuppData& suppData) const
+{
 	Tempo initialTempo;
-	initialTempo.ticksPerQuarterNote(ticksPerQuarter);
-	initialTempo.usPerQuarterNote(MIDI_DEF_uS_PER_QUARTER_NOTE);
+	readMIDIHeader(content, &initialTempo);
 	auto music = midiDecode(content, MIDIFlags::Default, initialTempo);
 
 	return music;
 }
 
-void MusicType_MID_Type0::write(stream::output& content, SuppData& suppData,
+MusicSummary MusicType_MID_Type0::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	MusicSummary summary;
+	Tempo initialTempo;
+	readMIDIHeader(content, &initialTempo);
+	midiScan(content, MIDIFlags::Default, initialTempo, &summary);
+	return summary;
+}
+
+void MusicType_MID_Type0::write(stream::output& output, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
+	// Built in memory so the MTrk length can be filled in at the end
+	stream::string content;
+
 	requirePatches<MIDIPatch>(*music.patches);
 
 	content.write(
@@ -147,6 +168,10 @@ void MusicType_MID_Type0::write(stream::output& content, SuppData& suppData,
 
 	content.seekp(18, stream::start);
 	content << u32be(mtrkLen);
+
+	output.write(content.data);
+	if (!(flags & WriteFlags::NoTruncate)) output.truncate_here();
+	return;
 }
 
 SuppFilenames MusicType_MID_Type0::getRequiredSupps(stream::input& content,
@@ -21,6 +21,7 @@
 #include <iostream>
 #include <camoto/util.hpp> // make_unique
 #include <camoto/iostream_helpers.hpp>
+#include <camoto/stream_string.hpp>
 #include <camoto/gamemusic/eventconverter-midi.hpp>
 #include <camoto/gamemusic/patch-midi.hpp>
 #include "track-split.hpp"
@@ -423,9 +424,82 @@ std::unique_ptr<Music> MusicType_MUS::read(stream::input& content,
 	return music;
 }
 
-void MusicType_MUS::write(stream::output& content, SuppData& suppData,
+MusicSummary MusicType_MUS::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	MusicSummary summary;
+	content.seekg(6, stream::start);
+	uint16_t offSong;
+	content >> u16le(offSong);
+	content.seekg(offSong, stream::start);
+
+	// Walk the same events as read(), skipping over their data
+	unsigned long events = 0;
+	unsigned long totalDelay = 0;
+	bool eof = false;
+	while (!eof) {
+		uint8_t code;
+		try {
+			content >> u8(code);
+		} catch (const stream::incomplete_read&) {
+			break;
+		}
+		events++;
+
+		unsigned int event = (code >> 4) & 0x07;
+		bool last = code & 0x80;
+		switch (event) {
+			case 0x1: { // note on
+				uint8_t n;
+				content >> u8(n);
+				if (n & 0x80) content.seekg(1, stream::cur); // volume
+				break;
+			}
+			case 0x0: // note off
+			case 0x2: // pitchbend
+			case 0x3: // system event
+			case 0x7: // unassigned
+				content.seekg(1, stream::cur);
+				break;
+			case 0x4: // controller
+				content.seekg(2, stream::cur);
+				break;
+			case 0x6: // end of song
+				eof = true;
+				break;
+			default:
+				throw stream::error("Unknown mus-dmx event type");
+		}
+
+		if (last) {
+			unsigned long finalDelay = 0;
+			uint8_t delayVal;
+			do {
+				content >> u8(delayVal);
+				finalDelay <<= 7;
+				finalDelay |= delayVal & 0x7F;
+			} while (delayVal & 0x80);
+			totalDelay += finalDelay;
+		}
+	}
+
+	Tempo tempo;
+	tempo.hertz(this->tempo);
+	summary.patternCount = 1;
+	summary.orderCount = 1;
+	// Instruments missing from the header are added as they are used
+	summary.instrumentCount = MusicSummary::Unknown;
+	summary.eventCount = events;
+	summary.msLength = totalDelay * tempo.usPerTick / 1000;
+	return summary;
+}
+
+void MusicType_MUS::write(stream::output& output, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
+	// Built in memory so the song length can be filled in at the end
+	stream::string content;
+
 	requirePatches<MIDIPatch>(*music.patches);
 
 	// Count the number of unique MIDI channels in use
@@ -470,11 +544,9 @@ void MusicType_MUS::write(stream::output& content, SuppData& suppData,
 	stream::pos posEnd = content.tellp();
 	content.seekp(4, stream::start);
 	content << u16le(posEnd - offSong);
-	content.seekp(posEnd, stream::start);
-
-	// Set final filesize to this
-	content.truncate_here();
 
+	output.write(content.data);
+	if (!(flags & WriteFlags::NoTruncate)) output.truncate_here();
 	return;
 }
 
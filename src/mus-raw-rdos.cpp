@@ -32,13 +32,15 @@ using namespace camoto::gamemusic;
 #define RAWCLOCK_TO_uS(x) ((x) / 1.192180)
 
 /// Decode data in a .raw file to provide register/value pairs.
-class OPLReaderCallback_RAW: virtual public OPLReaderCallback
+class OPLReaderCallback_RAW: virtual public OPLReaderCallback_Buffer
 {
 	public:
 		OPLReaderCallback_RAW(stream::input& content)
-			:	content(content),
+			:	OPLReaderCallback_Buffer(content),
 				chipIndex(0)
 		{
+			// Read until EOF, the song ends with a 0xFFFF marker before any tags
+			this->load(content.size() - content.tellg());
 		}
 
 		virtual bool readNextPair(OPLEvent *oplEvent)
@@ -46,76 +48,78 @@ class OPLReaderCallback_RAW: virtual public OPLReaderCallback
 			assert(oplEvent->valid == 0);
 			oplEvent->delay = 0;
 
-			try {
 nextCode:
-				this->content
-					>> u8(oplEvent->val)
-					>> u8(oplEvent->reg)
-				;
-				switch (oplEvent->reg) {
-					case 0x00: // short delay
-						oplEvent->valid |= OPLEvent::Delay;
-						oplEvent->delay += oplEvent->val;
-						goto nextCode;
-					case 0x02: { // control
-						switch (oplEvent->val) {
-							case 0x00: { // clock change
-								uint16_t clock;
-								this->content >> u16le(clock);
-								if (clock == 0) clock = 0xffff;
-								oplEvent->valid |= OPLEvent::Tempo;
-								oplEvent->tempo.usPerTick = RAWCLOCK_TO_uS(clock);
-								break;
+			if ((this->end - this->pos < 2) && !this->fill(2)) {
+				this->pos = this->end;
+				// oplEvent->delay is populated with any final delay
+				return false;
+			}
+			oplEvent->val = this->pos[0];
+			oplEvent->reg = this->pos[1];
+			this->pos += 2;
+			switch (oplEvent->reg) {
+				case 0x00: // short delay
+					oplEvent->valid |= OPLEvent::Delay;
+					oplEvent->delay += oplEvent->val;
+					goto nextCode;
+				case 0x02: { // control
+					switch (oplEvent->val) {
+						case 0x00: { // clock change
+							if ((this->end - this->pos < 2) && !this->fill(2)) {
+								this->pos = this->end;
+								return false;
 							}
-							case 0x01:
-								this->chipIndex = 0;
-								goto nextCode;
-							case 0x02:
-								this->chipIndex = 1;
-								goto nextCode;
+							uint16_t clock = this->pos[0] | (this->pos[1] << 8);
+							this->pos += 2;
+							if (clock == 0) clock = 0xffff;
+							oplEvent->valid |= OPLEvent::Tempo;
+							oplEvent->tempo.usPerTick = RAWCLOCK_TO_uS(clock);
+							break;
 						}
-						break;
+						case 0x01:
+							this->chipIndex = 0;
+							goto nextCode;
+						case 0x02:
+							this->chipIndex = 1;
+							goto nextCode;
 					}
-					case 0xFF:
-						if (oplEvent->val == 0xFF) { // EOF
-							// oplEvent->delay is populated with any final delay
-							return false;
-						}
-						break;
-					default: // normal reg
-						oplEvent->valid |= OPLEvent::Regs;
-						oplEvent->chipIndex = this->chipIndex;
-						break;
+					break;
 				}
-			} catch (const stream::incomplete_read&) {
-				// oplEvent->delay is populated with any final delay
-				return false;
+				case 0xFF:
+					if (oplEvent->val == 0xFF) { // EOF
+						// oplEvent->delay is populated with any final delay
+						return false;
+					}
+					break;
+				default: // normal reg
+					oplEvent->valid |= OPLEvent::Regs;
+					oplEvent->chipIndex = this->chipIndex;
+					break;
 			}
 
 			return true;
 		}
 
 	protected:
-		stream::input& content;  ///< Input file
 		unsigned int chipIndex;  ///< Index of the currently selected OPL chip
 };
 
 
 /// Encode OPL register/value pairs into .raw file data.
-class OPLWriterCallback_RAW: virtual public OPLWriterCallback
+class OPLWriterCallback_RAW: virtual public OPLWriterCallback_Stream
 {
 	public:
 		OPLWriterCallback_RAW(stream::output& content)
-			:	content(content),
+			:	OPLWriterCallback_Stream(content),
 				lastChipIndex(0)
 		{
 		}
 
-		virtual void writeNextPair(const OPLEvent *oplEvent)
+		virtual void encodePair(stream::output& out, const OPLEvent *oplEvent)
 		{
 			if (oplEvent->valid & OPLEvent::Tempo) {
 				uint16_t clock = uS_TO_RAWCLOCK(oplEvent->tempo.usPerTick);
-				this->content
+				out
 					<< u8(0x00) // clock change
 					<< u8(0x02) // control data
 					<< u16le(clock)
@@ -127,7 +131,7 @@ class OPLWriterCallback_RAW: virtual public OPLWriterCallback
 				unsigned long delay = oplEvent->delay;
 				while (delay > 0) {
 					uint8_t d = (delay > 255) ? 255 : delay;
-					this->content
+					out
 						<< u8(d) // delay value
 						<< u8(0) // delay command
 					;
@@ -139,7 +143,7 @@ class OPLWriterCallback_RAW: virtual public OPLWriterCallback
 				// Switch OPL chips if necessary
 				if (oplEvent->chipIndex != this->lastChipIndex) {
 					assert(oplEvent->chipIndex < 2);
-					this->content
+					out
 						<< u8(0x01 + oplEvent->chipIndex) // 0x01 = chip 0, 0x02 = chip 1
 						<< u8(0x02) // control command
 					;
@@ -150,7 +154,7 @@ class OPLWriterCallback_RAW: virtual public OPLWriterCallback
 				// it is we have to drop the pair as there's no way of escaping these
 				// values.
 				if ((oplEvent->reg != 0x00) || (oplEvent->reg != 0x02)) {
-					this->content
+					out
 						<< u8(oplEvent->val)
 						<< u8(oplEvent->reg)
 					;
@@ -163,7 +167,6 @@ class OPLWriterCallback_RAW: virtual public OPLWriterCallback
 		}
 
 	protected:
-		stream::output& content;    ///< Output file
 		unsigned int lastChipIndex; ///< Index of the currently selected OPL chip
 };
 
@@ -223,6 +226,7 @@ std::unique_ptr<Music> MusicType_RAW::read(stream::input& content,
 	OPLReaderCallback_RAW cb(content);
 	auto music = oplDecode(&cb, DelayType::DelayIsPreData, OPL_FNUM_DEFAULT,
 		initialTempo);
+	cb.seekPastData();
 
 	// See if there are any tags present
 	readMalvMetadata(content, music.get());
@@ -230,6 +234,50 @@ std::unique_ptr<Music> MusicType_RAW::read(stream::input& content,
 	return music;
 }
 
+std::unique_ptr<MusicStream> MusicType_RAW::openStream(
+	std::unique_ptr<stream::input> content, SuppData& suppData) const
+{
+	content->seekg(8, stream::start);
+	uint16_t clock;
+	*content >> u16le(clock);
+	if (clock == 0) clock = 0xffff;
+	Tempo initialTempo;
+	initialTempo.usPerTick = RAWCLOCK_TO_uS(clock);
+
+	// Tags follow the end-of-song marker, so can't be found until then
+	auto cb = std::make_unique<OPLReaderCallback_RAW>(*content);
+	auto reader = cb.get();
+	return std::make_unique<OPLMusicStream>(std::move(content), std::move(cb),
+		DelayType::DelayIsPreData, OPL_FNUM_DEFAULT, initialTempo,
+		[reader](stream::input& content, Music *music) {
+			reader->seekPastData();
+			readMalvMetadata(content, music);
+		}
+	);
+}
+
+MusicSummary MusicType_RAW::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	content.seekg(8, stream::start);
+	uint16_t clock;
+	content >> u16le(clock);
+	if (clock == 0) clock = 0xffff;
+	Tempo initialTempo;
+	initialTempo.usPerTick = RAWCLOCK_TO_uS(clock);
+
+	MusicSummary summary;
+	OPLReaderCallback_RAW cb(content);
+	oplScan(&cb, initialTempo, &summary);
+	cb.seekPastData();
+
+	Music tags;
+	readMalvMetadata(content, &tags);
+	summary.attributes = tags.attributes();
+
+	return summary;
+}
+
 void MusicType_RAW::write(stream::output& content, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
@@ -147,6 +147,28 @@ MusicType::Certainty MusicType_S3M::isInstance(stream::input& content) const
 	return Certainty::DefinitelyYes;
 }
 
+/// Convert an S3M channel setting into the matching track layout.
+static TrackInfo channelTrackInfo(uint8_t c)
+{
+	TrackInfo t;
+	if (c < 16) {
+		t.channelType = TrackInfo::ChannelType::PCM;
+		// 0,1,2...8,9,10 -> 0,2,4...1,3,5 [L1,R1,L2,R2,...]
+		t.channelIndex = (c % 8) * 2 + (c >> 3);
+	} else if (c < 25) {
+		t.channelType = TrackInfo::ChannelType::OPL;
+		t.channelIndex = c - 16;
+	} else if (c < 30) {
+		t.channelType = TrackInfo::ChannelType::OPLPerc;
+		/// @todo: Make sure this correctly maps to the right perc instrument
+		t.channelIndex = 4 - (c - 25);
+	} else {
+		t.channelType = TrackInfo::ChannelType::Unused;
+		t.channelIndex = c - 30;
+	}
+	return t;
+}
+
 std::unique_ptr<Music> MusicType_S3M::read(stream::input& content,
 	SuppData& suppData) const
 {
@@ -209,24 +231,12 @@ std::unique_ptr<Music> MusicType_S3M::read(stream::input& content,
 	uint8_t channelSettings[S3M_CHANNEL_COUNT];
 	content.read(channelSettings, S3M_CHANNEL_COUNT);
 	for (unsigned int i = 0; i < S3M_CHANNEL_COUNT; i++) {
-		music->trackInfo.emplace_back();
-		auto& t = music->trackInfo.back();
-		auto& c = channelSettings[i];
-		if (c < 16) {
-			t.channelType = TrackInfo::ChannelType::PCM;
-			// 0,1,2...8,9,10 -> 0,2,4...1,3,5 [L1,R1,L2,R2,...]
-			t.channelIndex = (c % 8) * 2 + (c >> 3);
-		} else if (c < 25) {
-			t.channelType = TrackInfo::ChannelType::OPL;
-			t.channelIndex = c - 16;
-			if (adlibTrack1 < 0) adlibTrack1 = i;
-		} else if (c < 30) {
-			t.channelType = TrackInfo::ChannelType::OPLPerc;
-			/// @todo: Make sure this correctly maps to the right perc instrument
-			t.channelIndex = 4 - (c - 25);
-		} else {
-			t.channelType = TrackInfo::ChannelType::Unused;
-			t.channelIndex = c - 30;
+		music->trackInfo.push_back(channelTrackInfo(channelSettings[i]));
+		if (
+			(adlibTrack1 < 0)
+			&& (music->trackInfo.back().channelType == TrackInfo::ChannelType::OPL)
+		) {
+			adlibTrack1 = i;
 		}
 	}
 
@@ -319,8 +329,7 @@ std::unique_ptr<Music> MusicType_S3M::read(stream::input& content,
 
 				// Read the PCM data
 				content.seekg(ppSample << 4, stream::start);
-				p->data = std::vector<uint8_t>(lenData);
-				content.read(p->data.data(), p->data.size());
+				p->data.read(content, lenData);
 
 				// Convert from little-endian to host byte order if 16-bit
 				if (p->bitDepth == 16) {
@@ -632,6 +641,90 @@ C-4 note
 	return music;
 }
 
+MusicSummary MusicType_S3M::probe(stream::input& content,
+	SuppData& suppData) const
+{
+	MusicSummary summary;
+	content.seekg(0, stream::start);
+	{
+		Attribute a;
+		a.changed = false;
+		a.type = Attribute::Type::Text;
+		a.name = CAMOTO_ATTRIBUTE_TITLE;
+		a.desc = "Song title";
+		a.textMaxLength = S3M_TITLE_LEN;
+		content >> nullPadded(a.textValue, S3M_TITLE_LEN);
+		summary.attributes.push_back(a);
+	}
+
+	uint8_t type;
+	uint16_t orderCount, instrumentCount, patternCount;
+	content.seekg(1, stream::cur); // 0x1A
+	content
+		>> u8(type)
+	;
+	content.seekg(2, stream::cur); // reserved
+	content
+		>> u16le(orderCount)
+		>> u16le(instrumentCount)
+		>> u16le(patternCount)
+	;
+	if (type != 0x10) {
+		throw stream::error(createString("S3M: Unknown type " << (int)type));
+	}
+
+	// Skip the rest of the header up to the channel settings
+	content.seekg(0x40, stream::start);
+	uint8_t channelSettings[S3M_CHANNEL_COUNT];
+	content.read(channelSettings, S3M_CHANNEL_COUNT);
+	for (unsigned int i = 0; i < S3M_CHANNEL_COUNT; i++) {
+		summary.trackInfo.push_back(channelTrackInfo(channelSettings[i]));
+	}
+
+	// Markers and the end-of-song entry aren't included in the order list
+	summary.orderCount = 0;
+	for (unsigned int i = 0; i < orderCount; i++) {
+		uint8_t order;
+		content >> u8(order);
+		if (order < 0xFE) summary.orderCount++;
+	}
+
+	content.seekg(instrumentCount * 2, stream::cur);
+	std::vector<uint16_t> ptrPatterns;
+	ptrPatterns.reserve(patternCount);
+	for (unsigned int i = 0; i < patternCount; i++) {
+		uint16_t ptrPattern;
+		content >> u16le(ptrPattern);
+		ptrPatterns.push_back(ptrPattern);
+	}
+
+	// Count the packed entries in each pattern, skipping over their contents
+	summary.eventCount = 0;
+	for (auto& i : ptrPatterns) {
+		content.seekg((i << 4) + 2, stream::start); // skip length field
+		for (unsigned int row = 0; row < S3M_ROWS_PER_PATTERN; row++) {
+			uint8_t what;
+			content >> u8(what);
+			while (what) {
+				summary.eventCount++;
+				unsigned int len = 0;
+				if (what & 0x20) len += 2; // note, instrument
+				if (what & 0x40) len += 1; // volume
+				if (what & 0x80) len += 2; // command, info
+				content.seekg(len, stream::cur);
+				content >> u8(what);
+			}
+		}
+	}
+
+	summary.patternCount = patternCount;
+	summary.instrumentCount = instrumentCount;
+	// The tempo can change anywhere in the patterns, so the length needs the
+	// whole song decoded.
+	summary.msLength = MusicSummary::Unknown;
+	return summary;
+}
+
 void MusicType_S3M::write(stream::output& content, SuppData& suppData,
 	const Music& music, WriteFlags flags) const
 {
@@ -736,7 +829,7 @@ void MusicType_S3M::write(stream::output& content, SuppData& suppData,
 
 		// Figure out how big this instrument is for the next offset
 		nextPP += 0x50;
-		auto pcmPatch = dynamic_cast<PCMPatch*>(i.get());
+		auto pcmPatch = dynamic_cast<const PCMPatch*>(i.get());
 		if (pcmPatch) {
 			nextPP += pcmPatch->data.size();
 			// Round up to the nearest parapointer boundary
@@ -812,7 +905,7 @@ void MusicType_S3M::write(stream::output& content, SuppData& suppData,
 				<< nullPadded("SCRI", 4)
 			;
 		} else {
-			auto pcmPatch = dynamic_cast<PCMPatch*>(i.get());
+			auto pcmPatch = dynamic_cast<const PCMPatch*>(i.get());
 			if (pcmPatch) {
 				if ((pcmPatch->bitDepth != 8) && (pcmPatch->bitDepth != 16)) {
 					throw format_limitation("This file format can only store 8-bit and "
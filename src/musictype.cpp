@@ -20,6 +20,7 @@
 
 #include <iostream>
 #include <camoto/gamemusic/musictype.hpp>
+#include "eventhandler-playback-seek.hpp"
 
 using namespace camoto;
 using namespace camoto::gamemusic;
@@ -40,3 +41,68 @@ CAMOTO_GAMEMUSIC_API std::ostream& camoto::gamemusic::operator<< (
 #pragma GCC diagnostic pop
 	return s;
 }
+
+/// MusicStream holding a song that has already been fully decoded.
+class MusicStream_Complete: virtual public MusicStream
+{
+	public:
+		MusicStream_Complete(std::shared_ptr<const Music> music)
+			:	song(music)
+		{
+		}
+
+		virtual std::shared_ptr<const Music> music() const
+		{
+			return this->song;
+		}
+
+		virtual bool decodePattern()
+		{
+			return false;
+		}
+
+		virtual void discardPatterns(unsigned int order)
+		{
+			// Keep everything, as nothing could be decoded again
+			return;
+		}
+
+	private:
+		std::shared_ptr<const Music> song;
+};
+
+MusicStream::~MusicStream()
+{
+}
+
+MusicSummary MusicType::probe(stream::input& content, SuppData& suppData) const
+{
+	std::shared_ptr<const Music> music = this->read(content, suppData);
+
+	MusicSummary summary;
+	summary.attributes = music->attributes();
+	summary.trackInfo = music->trackInfo;
+	summary.patternCount = music->patterns.size();
+	summary.orderCount = music->patternOrder.size();
+	summary.instrumentCount = music->patches ? music->patches->size() : 0;
+	summary.eventCount = 0;
+	for (const auto& pattern : music->patterns) {
+		for (const auto& track : pattern) summary.eventCount += track.size();
+	}
+
+	if (music->patternOrder.empty()) {
+		// Instrument banks have no song to play
+		summary.msLength = 0;
+	} else {
+		EventHandler_Playback_Seek seek(music, 1);
+		summary.msLength = seek.getTotalLength();
+	}
+	return summary;
+}
+
+std::unique_ptr<MusicStream> MusicType::openStream(
+	std::unique_ptr<stream::input> content, SuppData& suppData) const
+{
+	std::shared_ptr<const Music> music = this->read(*content, suppData);
+	return std::make_unique<MusicStream_Complete>(music);
+}
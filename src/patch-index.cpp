@@ -0,0 +1,139 @@
+/**
+ * @file  patch-index.cpp
+ * @brief Hash index for finding duplicate patches in a PatchBank.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "patch-index.hpp"
+
+using namespace camoto::gamemusic;
+
+/// Is this bank entry an OPL patch matching the given one?
+static bool patchMatches(const Patch *p, const OPLPatch& patch)
+{
+	auto oplPatch = dynamic_cast<const OPLPatch*>(p);
+	return
+		(oplPatch)
+		&& (*oplPatch == patch)
+		&& (oplPatch->rhythm == patch.rhythm)
+	;
+}
+
+/// Is this bank entry a MIDI patch matching the given one?
+static bool patchMatches(const Patch *p, const MIDIPatch& patch)
+{
+	auto midiPatch = dynamic_cast<const MIDIPatch*>(p);
+	return
+		(midiPatch)
+		&& (midiPatch->midiPatch == patch.midiPatch)
+		&& (midiPatch->percussion == patch.percussion)
+	;
+}
+
+/// Append one operator's settings as they would be written to the OPL.
+static void appendOperator(std::string& k, const OPLOperator& o,
+	bool outputLevel)
+{
+	k += (char)(
+		(o.enableTremolo ? 0x80 : 0)
+		| (o.enableVibrato ? 0x40 : 0)
+		| (o.enableSustain ? 0x20 : 0)
+		| (o.enableKSR ? 0x10 : 0)
+		| (o.freqMult & 0x0F)
+	);
+	k += (char)((o.scaleLevel << 6) | (outputLevel ? (o.outputLevel & 0x3F) : 0));
+	k += (char)((o.attackRate << 4) | (o.decayRate & 0x0F));
+	k += (char)((o.sustainRate << 4) | (o.releaseRate & 0x0F));
+	k += (char)(o.waveSelect & 0x07);
+	return;
+}
+
+PatchIndex::PatchIndex(unsigned int firstPatch)
+	:	firstPatch(firstPatch),
+		nextPatch(firstPatch)
+{
+}
+
+int PatchIndex::find(const PatchBank& patches, const OPLPatch& patch)
+{
+	this->update(patches);
+	auto i = this->index.find(key(patch));
+	if (i == this->index.end()) return -1;
+	if (patchMatches(patches[i->second].get(), patch)) return i->second;
+	// Only happens if a field is out of range and was cut off in the key
+	return this->findLinear(patches, patch);
+}
+
+int PatchIndex::find(const PatchBank& patches, const MIDIPatch& patch)
+{
+	this->update(patches);
+	auto i = this->index.find(key(patch));
+	if (i == this->index.end()) return -1;
+	if (patchMatches(patches[i->second].get(), patch)) return i->second;
+	// The key covers every compared field, but check in case that changes
+	return this->findLinear(patches, patch);
+}
+
+void PatchIndex::update(const PatchBank& patches)
+{
+	for (; this->nextPatch < patches.size(); this->nextPatch++) {
+		auto p = patches[this->nextPatch].get();
+		// emplace() won't replace an existing entry, so the first of any
+		// duplicates already in the bank is the one that will be found.
+		if (auto oplPatch = dynamic_cast<const OPLPatch*>(p)) {
+			this->index.emplace(key(*oplPatch), this->nextPatch);
+		} else if (auto midiPatch = dynamic_cast<const MIDIPatch*>(p)) {
+			this->index.emplace(key(*midiPatch), this->nextPatch);
+		}
+	}
+	return;
+}
+
+template <class T>
+int PatchIndex::findLinear(const PatchBank& patches, const T& patch) const
+{
+	for (unsigned int i = this->firstPatch; i < patches.size(); i++) {
+		if (patchMatches(patches[i].get(), patch)) return i;
+	}
+	return -1;
+}
+
+std::string PatchIndex::key(const OPLPatch& patch)
+{
+	// Only include the fields operator==() compares for this rhythm type
+	bool modOutput =
+		(patch.rhythm == OPLPatch::Rhythm::Unknown)
+		|| (patch.rhythm == OPLPatch::Rhythm::Melodic)
+		|| (patch.rhythm == OPLPatch::Rhythm::BassDrum)
+	;
+	std::string k;
+	k += 'O';
+	k += (char)patch.rhythm;
+	if (!oplCarOnly(patch.rhythm)) appendOperator(k, patch.m, modOutput);
+	if (!oplModOnly(patch.rhythm)) appendOperator(k, patch.c, false);
+	k += (char)(((patch.feedback & 7) << 1) | (patch.connection ? 1 : 0));
+	return k;
+}
+
+std::string PatchIndex::key(const MIDIPatch& patch)
+{
+	std::string k;
+	k += 'M';
+	k += (char)(patch.percussion ? 1 : 0);
+	k += (char)patch.midiPatch;
+	return k;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file  patch-index.hpp
+ * @brief Hash index for finding duplicate patches in a PatchBank.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CAMOTO_GAMEMUSIC_PATCH_INDEX_HPP_
+#define _CAMOTO_GAMEMUSIC_PATCH_INDEX_HPP_
+
+#include <string>
+#include <unordered_map>
+#include <camoto/gamemusic/patchbank.hpp>
+#include <camoto/gamemusic/patch-midi.hpp>
+#include <camoto/gamemusic/patch-opl.hpp>
+
+namespace camoto {
+namespace gamemusic {
+
+/// Find patches in a PatchBank by their settings, without a linear search.
+/**
+ * OPL patches are keyed on their packed register values plus rhythm type,
+ * leaving out the fields operator==() ignores, so two patches that compare
+ * equal and have the same rhythm type will always match.  MIDI patches are
+ * keyed on the patch number and percussion flag.  Other patch types are never
+ * matched.
+ *
+ * The index catches up with any patches appended to the bank since the last
+ * call, so the bank can still be added to directly.  Patches must not be
+ * changed, removed or reordered once they have been indexed.  The same bank
+ * must be passed to every call.
+ */
+class PatchIndex
+{
+	public:
+		/// Create an empty index.
+		/**
+		 * @param firstPatch
+		 *   Index of the first patch in the bank to include.  Any earlier patches
+		 *   are never matched, which allows them to be changed later.
+		 */
+		PatchIndex(unsigned int firstPatch = 0);
+
+		/// Find an OPL patch with the same settings and rhythm type.
+		/**
+		 * @param patches
+		 *   Bank to search.
+		 *
+		 * @param patch
+		 *   Patch to look for.
+		 *
+		 * @return Index into \a patches, or -1 if there is no match.
+		 */
+		int find(const PatchBank& patches, const OPLPatch& patch);
+
+		/// Find a MIDI patch with the same patch number and percussion flag.
+		/**
+		 * @param patches
+		 *   Bank to search.
+		 *
+		 * @param patch
+		 *   Patch to look for.
+		 *
+		 * @return Index into \a patches, or -1 if there is no match.
+		 */
+		int find(const PatchBank& patches, const MIDIPatch& patch);
+
+		/// Find a matching patch, adding it to the end of the bank if not found.
+		/**
+		 * @param patches
+		 *   Bank to search, and to append \a patch to if there is no match.
+		 *
+		 * @param patch
+		 *   Patch to look for.
+		 *
+		 * @return Index into \a patches of the match or the newly added patch.
+		 */
+		template <class T>
+		unsigned int findOrAdd(PatchBank& patches, std::shared_ptr<T> patch)
+		{
+			int index = this->find(patches, *patch);
+			if (index >= 0) return index;
+			patches.push_back(patch);
+			return patches.size() - 1;
+		}
+
+	private:
+		/// Index of the first patch in the bank that can be matched.
+		unsigned int firstPatch;
+
+		/// Index of the next patch in the bank to add to the index.
+		unsigned int nextPatch;
+
+		/// Index into the bank, keyed on the values from key().
+		std::unordered_map<std::string, unsigned int> index;
+
+		/// Add any patches appended to the bank since the last call.
+		void update(const PatchBank& patches);
+
+		/// Search for a patch the slow way, if its key matched a different one.
+		template <class T>
+		int findLinear(const PatchBank& patches, const T& patch) const;
+
+		static std::string key(const OPLPatch& patch);
+		static std::string key(const MIDIPatch& patch);
+};
+
+} // namespace gamemusic
+} // namespace camoto
+
+#endif // _CAMOTO_GAMEMUSIC_PATCH_INDEX_HPP_
@@ -18,13 +18,257 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <assert.h>
+#include <string.h>
 #include <camoto/gamemusic/patch-pcm.hpp>
+#include <camoto/gamemusic/util-pcm.hpp>
 
+using namespace camoto;
 using namespace camoto::gamemusic;
 
+/// Allocate a writable buffer without initialising it.
+static std::shared_ptr<uint8_t> allocateBytes(std::size_t length)
+{
+	return std::shared_ptr<uint8_t>(new uint8_t[length],
+		std::default_delete<uint8_t[]>());
+}
+
+PCMData::PCMData()
+	:	length(0),
+		owned(true)
+{
+}
+
+PCMData::PCMData(std::vector<uint8_t> bytes)
+	:	length(bytes.size()),
+		owned(true)
+{
+	// Keep the vector itself, so its bytes don't have to be copied
+	auto v = std::make_shared<std::vector<uint8_t> >(std::move(bytes));
+	this->bytes = std::shared_ptr<const uint8_t>(v, v->data());
+}
+
+PCMData::PCMData(std::initializer_list<uint8_t> bytes)
+	:	PCMData(std::vector<uint8_t>(bytes))
+{
+}
+
+PCMData::PCMData(std::shared_ptr<const uint8_t> buffer, std::size_t offset,
+	std::size_t length)
+	:	bytes(buffer, buffer.get() + offset),
+		length(length),
+		owned(false)
+{
+}
+
+void PCMData::read(stream::input& content, std::size_t length)
+{
+	auto buffer = allocateBytes(length);
+	content.read(buffer.get(), length);
+	this->bytes = buffer;
+	this->length = length;
+	this->owned = true;
+	return;
+}
+
+PCMData PCMData::slice(std::size_t offset, std::size_t length) const
+{
+	assert(offset + length <= this->length);
+	PCMData part(*this);
+	part.bytes = std::shared_ptr<const uint8_t>(this->bytes,
+		this->bytes.get() + offset);
+	part.length = length;
+	return part;
+}
+
+std::size_t PCMData::size() const
+{
+	return this->length;
+}
+
+bool PCMData::empty() const
+{
+	return this->length == 0;
+}
+
+void PCMData::resize(std::size_t length)
+{
+	if (length == this->length) return;
+	auto buffer = allocateBytes(length);
+	std::size_t keep = std::min(length, this->length);
+	if (keep) memcpy(buffer.get(), this->bytes.get(), keep);
+	memset(buffer.get() + keep, 0, length - keep);
+	this->bytes = buffer;
+	this->length = length;
+	this->owned = true;
+	return;
+}
+
+void PCMData::clear()
+{
+	this->bytes.reset();
+	this->length = 0;
+	this->owned = true;
+	return;
+}
+
+const uint8_t *PCMData::data() const
+{
+	return this->bytes.get();
+}
+
+uint8_t *PCMData::data()
+{
+	this->detach();
+	// Only memory allocated as writable is ever returned here
+	return const_cast<uint8_t *>(this->bytes.get());
+}
+
+const uint8_t& PCMData::operator[] (std::size_t i) const
+{
+	return this->data()[i];
+}
+
+uint8_t& PCMData::operator[] (std::size_t i)
+{
+	return this->data()[i];
+}
+
+const uint8_t *PCMData::begin() const
+{
+	return this->data();
+}
+
+const uint8_t *PCMData::end() const
+{
+	return this->data() + this->length;
+}
+
+uint8_t *PCMData::begin()
+{
+	return this->data();
+}
+
+uint8_t *PCMData::end()
+{
+	return this->data() + this->length;
+}
+
+void PCMData::detach()
+{
+	if (this->owned && (this->bytes.use_count() <= 1)) return;
+	auto buffer = allocateBytes(this->length);
+	if (this->length) memcpy(buffer.get(), this->bytes.get(), this->length);
+	this->bytes = buffer;
+	this->owned = true;
+	return;
+}
+
+PCMDecoded::PCMDecoded(const PCMPatch& patch)
+	:	first(NULL),
+		loop(NULL),
+		end(0),
+		loopStart(0),
+		loopLen(0),
+		srcData(patch.data.data()),
+		srcSize(patch.data.size()),
+		srcBitDepth(patch.bitDepth),
+		srcLoopStart(patch.loopStart),
+		srcLoopEnd(patch.loopEnd)
+{
+	unsigned long numSamples;
+	switch (patch.bitDepth) {
+		case 8: numSamples = patch.data.size(); break;
+		case 16: numSamples = patch.data.size() / 2; break;
+		default: numSamples = 0; break; // unsupported, leave silent
+	}
+
+	// Clip the loop to the data
+	this->end = numSamples;
+	if (patch.loopEnd) {
+		if (patch.loopEnd < this->end) this->end = patch.loopEnd;
+		if (patch.loopStart < this->end) {
+			this->loopStart = patch.loopStart;
+			this->loopLen = this->end - patch.loopStart;
+		} // else loop start beyond end of sample, so play once
+	}
+
+	// First pass, then the loop on its own, each with guard samples either side
+	unsigned long lenFirst = GUARD + this->end + GUARD;
+	unsigned long lenLoop = this->loopLen ? GUARD + this->loopLen + GUARD : 0;
+	this->buffer.assign(lenFirst + lenLoop, 0);
+	int16_t *out = this->buffer.data();
+
+	// Sample i as heard when playing the note, with indices past the end
+	// wrapping back into the loop, and negative ones (only used for the copy of
+	// the loop) counting back from the end of the loop
+	auto at = [&](long i) -> int16_t {
+		if (i < 0) {
+			if (!this->loopLen) return 0;
+			i = this->end - (-i - 1) % this->loopLen - 1;
+		} else if ((unsigned long)i >= this->end) {
+			if (!this->loopLen) return 0;
+			i = this->loopStart + (i - this->end) % this->loopLen;
+		}
+		if (patch.bitDepth == 8) return pcm_u8_to_s16(patch.data[i]);
+		int16_t s;
+		memcpy(&s, &patch.data[i * 2], sizeof(s));
+		return s;
+	};
+
+	// Nothing comes before the first pass, so its leading guard stays silent
+	for (unsigned long i = 0; i < this->end + GUARD; i++) {
+		out[GUARD + i] = at(i);
+	}
+	this->first = out + GUARD;
+
+	if (this->loopLen) {
+		int16_t *outLoop = out + lenFirst;
+		for (long i = -(long)GUARD; i < (long)(this->loopLen + GUARD); i++) {
+			// Index relative to the loop start, so negative values wrap to the end
+			long src = (i < 0) ? i : (long)this->loopStart + i;
+			outLoop[GUARD + i] = at(src);
+		}
+		this->loop = outLoop + GUARD;
+	}
+}
+
+bool PCMDecoded::matches(const PCMPatch& patch) const
+{
+	return
+		(this->srcData == patch.data.data())
+		&& (this->srcSize == patch.data.size())
+		&& (this->srcBitDepth == patch.bitDepth)
+		&& (this->srcLoopStart == patch.loopStart)
+		&& (this->srcLoopEnd == patch.loopEnd)
+	;
+}
+
 PCMPatch::PCMPatch()
 	:	sampleRate(8363),
 		bitDepth(8),
-		numChannels(1)
+		numChannels(1),
+		loopStart(0),
+		loopEnd(0)
+{
+}
+
+std::shared_ptr<const PCMDecoded> PCMPatch::getDecoded() const
+{
+	auto cache = std::atomic_load(&this->decoded);
+	if (cache && cache->matches(*this)) return cache;
+
+	// If two threads get here at once they will both decode the same data, and
+	// whichever is stored last will be kept.
+	cache = std::make_shared<PCMDecoded>(*this);
+	std::atomic_store(&this->decoded, cache);
+	return cache;
+}
+
+void PCMPatch::clearDecoded()
 {
+	std::atomic_store(&this->decoded, std::shared_ptr<const PCMDecoded>());
+	return;
 }
@@ -18,7 +18,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <camoto/util.hpp> // createString()
+#include <camoto/gamemusic/exceptions.hpp>
+#include <camoto/gamemusic/musictype.hpp>
 #include <camoto/gamemusic/playback.hpp>
 #include <camoto/gamemusic/util-pcm.hpp>
 #include "eventhandler-playback-seek.hpp"
@@ -63,6 +67,36 @@ void Playback::OPLHandler::writeNextPair(const OPLEvent *oplEvent)
 	return;
 }
 
+void Playback::OPLHandler::writeBatch(const OPLEvent *oplEvents, size_t count)
+{
+	// Ignore the delays and write all the registers immediately
+	SynthOPL& o = this->midi ? this->playback->oplMIDI : this->playback->opl;
+	o.writeBatch(oplEvents, count);
+	for (const OPLEvent *ev = oplEvents; ev < oplEvents + count; ev++) {
+		if (ev->valid & OPLEvent::Tempo) {
+			this->playback->tempoChange(ev->tempo);
+		}
+	}
+	return;
+}
+
+
+/// Longest block of audio to synthesize in one go, in milliseconds.
+/**
+ * Blocks end early at the next row with an event, so this only limits how
+ * much memory is needed for the mix bus when there are long gaps in the song.
+ */
+static const unsigned long MAX_BLOCK_MS = 50;
+
+/// Most samples in the mix bus at once.
+/**
+ * Blocks can still be longer than MAX_BLOCK_MS when a single row is, so they
+ * are synthesized in chunks of this size to avoid resizing the mix bus.
+ */
+static const unsigned long MAX_CHUNK_SAMPLES = 8192;
+
+/// Number of orders to keep decoded ahead of the one playing, for setStream().
+static const unsigned int STREAM_LOOKAHEAD_ORDERS = 2;
 
 Playback::Playback(unsigned long sampleRate, unsigned int channels,
 	unsigned int bits)
@@ -70,7 +104,19 @@ Playback::Playback(unsigned long sampleRate, unsigned int channels,
 		outputChannels(channels),
 		outputBits(bits),
 		loopCount(1),
+		loadNextOrder(false),
+		cursorPattern(0),
+		cursorRow(0),
+		samplesPerFrame(0),
+		sampleFraction(0),
 		frameBufferPos(0),
+		blockLength(0),
+		blockPos(0),
+		blockSynth(false),
+		blockFrame(0),
+		blockFrames(0),
+		blockFraction(0),
+		tempoScale(1.0),
 		pcm(sampleRate, this),
 		pcmMIDI(sampleRate, this),
 		opl(sampleRate),
@@ -78,6 +124,13 @@ Playback::Playback(unsigned long sampleRate, unsigned int channels,
 		oplHandler(this, false),
 		oplHandlerMIDI(this, true)
 {
+	if ((bits != 16) && (bits != 32)) {
+		throw format_limitation(createString("Unable to produce " << bits
+			<< "-bit audio, only 16-bit and 32-bit output is supported."));
+	}
+	this->frameBuffer.reserve(MAX_CHUNK_SAMPLES);
+	this->queued.loopCount = this->loopCount;
+	this->queued.streaming = false;
 }
 
 Playback::~Playback()
@@ -90,41 +143,137 @@ void Playback::setBankMIDI(std::shared_ptr<const PatchBank> bankMIDI)
 	return;
 }
 
+void Playback::setInterpolation(SynthPCM::Interpolation mode)
+{
+	this->pcm.setInterpolation(mode);
+	this->pcmMIDI.setInterpolation(mode);
+	return;
+}
+
 void Playback::setSong(std::shared_ptr<const Music> music)
 {
-	this->music = music;
+	SongState state;
+	this->prepareSong(music, &state);
+	this->applySong(state);
+	this->queued.music = music;
+	this->queued.streaming = false;
+	this->queued.seekIndex.reset();
+	return;
+}
+
+void Playback::setStream(std::shared_ptr<MusicStream> stream)
+{
+	for (unsigned int i = 0; i < STREAM_LOOKAHEAD_ORDERS; i++) {
+		if (!stream->decodePattern()) break;
+	}
+	SongState state;
+	this->prepareSong(stream->music(), &state);
+	state.stream = stream;
+	this->applySong(state);
+	this->queued.music = this->music;
+	this->queued.streaming = true;
+	this->queued.seekIndex.reset();
+	return;
+}
+
+/// Copy a song's patterns into compact form, ready for nextFrame().
+static void compactPatterns(const Music& music,
+	std::vector<CompactPattern> *events)
+{
+	events->clear();
+	events->reserve(music.patterns.size());
+	for (auto& pattern : music.patterns) {
+		events->push_back(compactPattern(pattern));
+	}
+	return;
+}
+
+/// Find every GotoEvent in a song, sorted by address.
+static void findGotoEvents(const Music& music,
+	std::vector<const GotoEvent *> *gotoEvents)
+{
+	gotoEvents->clear();
+	for (auto& pattern : music.patterns) {
+		for (auto& pt : pattern) {
+			for (auto& te : pt) {
+				auto jump = dynamic_cast<const GotoEvent *>(te.event.get());
+				if (jump) gotoEvents->push_back(jump);
+			}
+		}
+	}
+	std::sort(gotoEvents->begin(), gotoEvents->end());
+	return;
+}
+
+void Playback::prepareSong(std::shared_ptr<const Music> music,
+	Playback::SongState *state)
+{
+	// The converters only keep pointers to the handlers and diagnostics, which
+	// they don't use until applySong() swaps them in on the audio thread.
+	state->music = music;
+	compactPatterns(*music, &state->events);
+	findGotoEvents(*music, &state->gotoEvents);
+	state->gotoCounts.assign(state->gotoEvents.size(), 0);
+	state->trackMuted.assign(music->trackInfo.size(), 0);
+	state->cursors.clear();
+	state->cursors.reserve(music->trackInfo.size());
+
+	state->oplConverter.reset(new EventConverter_OPL(&this->oplHandler, music,
+		OPL_FNUM_DEFAULT, OPLWriteFlags::Default));
+	state->oplConverter->setDiagnostics(&this->diag);
+
+	state->oplConvMIDI.reset(new EventConverter_OPL(&this->oplHandlerMIDI, music,
+		OPL_FNUM_DEFAULT, OPLWriteFlags::Default));
+	state->oplConvMIDI->setBankMIDI(this->bankMIDI);
+	state->oplConvMIDI->setDiagnostics(&this->diag);
+
+	SynthPCM::prepare(music->trackInfo, music->patches, NULL, &state->pcm);
+	SynthPCM::prepare(music->trackInfo, music->patches, this->bankMIDI,
+		&state->pcmMIDI);
+	return;
+}
+
+void Playback::applySong(Playback::SongState& state)
+{
+	this->music.swap(state.music);
+	this->stream.swap(state.stream);
+	this->events.swap(state.events);
+	this->gotoEvents.swap(state.gotoEvents);
+	this->gotoCounts.swap(state.gotoCounts);
+	this->trackMuted.swap(state.trackMuted);
+	this->cursors.swap(state.cursors);
+	this->oplConverter.swap(state.oplConverter);
+	this->oplConvMIDI.swap(state.oplConvMIDI);
+	this->seekIndex.swap(state.seekIndex);
+
+	auto& music = this->music;
 	this->end = false;
 	this->loop = 0;
 	this->order = 0;
 	this->nextOrder = this->order; // incremented to 1 at end of pattern
 	if (music->patternOrder.size() == 0) {
 		this->pattern = 0;
-		std::cerr << "Warning: Song has no pattern order numbers!" << std::endl;
+		this->diag.warning("Warning: Song has no pattern order numbers!");
 	} else {
 		this->pattern = music->patternOrder.at(this->order);
 	}
 	if (music->ticksPerTrack == 0) {
 		// e4l4null.mid - happens when no events are in a song
-		std::cerr << "Warning: Song's ticksPerTrack is zero!" << std::endl;
+		this->diag.warning("Warning: Song's ticksPerTrack is zero!");
 	}
 	this->row = 0;
 	this->nextRow = this->row + 1;
 	this->frame = 0;
+	this->loadNextOrder = false;
+	this->cursors.clear();
+	this->sampleFraction = 0;
 
 	this->tempoChange(music->initialTempo);
 
 	this->opl.reset();
-	this->oplConverter.reset(new EventConverter_OPL(&this->oplHandler, this->music,
-		OPL_FNUM_DEFAULT, OPLWriteFlags::Default));
-
 	this->oplMIDI.reset();
-	this->oplConvMIDI.reset(new EventConverter_OPL(&this->oplHandlerMIDI, this->music,
-		OPL_FNUM_DEFAULT, OPLWriteFlags::Default));
-	this->oplConvMIDI->setBankMIDI(this->bankMIDI);
-
-	this->pcm.reset(this->music->trackInfo, this->music->patches);
-	this->pcmMIDI.reset(this->music->trackInfo, this->music->patches);
-	this->pcmMIDI.setBankMIDI(this->bankMIDI);
+	this->pcm.reset(state.pcm);
+	this->pcmMIDI.reset(state.pcmMIDI);
 
 	// Turn rhythm mode on or off depending on the presence of rhythm tracks
 	bool rhythm = false;
@@ -153,16 +302,63 @@ void Playback::setSong(std::shared_ptr<const Music> music)
 	return;
 }
 
+void Playback::songChanged()
+{
+	compactPatterns(*this->music, &this->events);
+	this->cursors.clear();
+	this->cursors.reserve(this->music->trackInfo.size());
+	this->seekIndex.reset();
+	this->trackMuted.resize(this->music->trackInfo.size(), 0);
+	// Loop counts start again, as the events may have moved
+	this->indexGotoEvents();
+	this->queued.seekIndex.reset();
+	// Decode any PCM patches added to the song so their notes can be played
+	this->pcm.updatePatches();
+	this->pcmMIDI.updatePatches();
+	return;
+}
+
 void Playback::setLoopCount(unsigned int count)
 {
+	if (count != this->loopCount) {
+		// The seek index depends on the number of loops
+		this->seekIndex.reset();
+	}
 	this->loopCount = count;
+	this->queued.loopCount = count;
+	this->queued.seekIndex.reset();
+	return;
+}
+
+void Playback::setTrackMute(unsigned int track, bool mute)
+{
+	if (track >= this->trackMuted.size()) return;
+	if (mute && !this->trackMuted[track]) this->trackNoteOff(track);
+	this->trackMuted[track] = mute ? 1 : 0;
+	return;
+}
+
+void Playback::setTempoScale(double scale)
+{
+	if (scale <= 0) {
+		throw stream::error("Tempo scale must be greater than zero");
+	}
+	double oldScale = this->tempoScale;
+	this->tempoScale = scale;
+	if (this->music) {
+		try {
+			this->updateSamplesPerFrame();
+		} catch (...) {
+			this->tempoScale = oldScale;
+			throw;
+		}
+	}
 	return;
 }
 
 unsigned long Playback::getLength()
 {
-	EventHandler_Playback_Seek seek(this->music, this->loopCount);
-	return seek.getTotalLength();
+	return this->getSeekIndex()->getTotalLength();
 }
 
 void Playback::seekByOrder(unsigned int destOrder)
@@ -170,8 +366,11 @@ void Playback::seekByOrder(unsigned int destOrder)
 	this->row = 0;
 	this->nextRow = this->row + 1;
 	this->frame = 0;
+	this->loadNextOrder = false;
+	this->cursors.clear();
 	this->order = destOrder;
 	this->nextOrder = this->order; // incremented to 1 at end of pattern
+	if (this->stream) this->streamAhead();
 	if (this->music->patternOrder.size() <= this->order) {
 		// order points past end of patterns
 		this->pattern = 0;
@@ -180,6 +379,7 @@ void Playback::seekByOrder(unsigned int destOrder)
 	}
 	this->pattern = this->music->patternOrder[this->order];
 	this->end = false;
+	this->discardBlock();
 	return;
 }
 
@@ -188,14 +388,21 @@ unsigned long Playback::seekByTime(unsigned long ms)
 	this->allNotesOff();
 
 	Tempo newTempo;
-	EventHandler_Playback_Seek seek(this->music, this->loopCount);
-	auto pos = seek.seekTo(ms, &newTempo);
+	auto pos = this->getSeekIndex()->seekTo(ms, &newTempo);
+	this->seekToPosition(pos, newTempo);
+	return pos.us / 1000;
+}
 
+void Playback::seekToPosition(const EventHandler::Position& pos,
+	const Tempo& newTempo)
+{
 	if (this->tempo != newTempo) {
 		this->tempoChange(newTempo);
 	}
 
 	this->frame = 0;
+	this->loadNextOrder = false;
+	this->cursors.clear();
 	this->row = pos.row;
 	this->nextRow = pos.row + 1; // will be pulled within range later if needed
 	this->order = pos.orderIndex;
@@ -203,196 +410,477 @@ unsigned long Playback::seekByTime(unsigned long ms)
 	this->pattern = pos.patternIndex;
 	this->end = this->music->patternOrder.size() <= this->order;
 	this->loop = pos.loop;
-	return pos.us / 1000;
+	this->discardBlock();
+	return;
+}
+
+bool Playback::queueSeekByOrder(unsigned int destOrder)
+{
+	Command cmd;
+	cmd.type = Command::Type::SeekByOrder;
+	cmd.value = destOrder;
+	return this->queueCommand(cmd);
+}
+
+bool Playback::queueSeekByTime(unsigned long ms)
+{
+	if (!this->queued.music || this->queued.streaming) return false;
+	if (!this->queued.seekIndex) {
+		this->queued.seekIndex.reset(new EventHandler_Playback_Seek(
+			this->queued.music, this->queued.loopCount));
+		this->queued.seekIndex->buildIndex();
+	}
+	Command cmd;
+	cmd.type = Command::Type::SeekByTime;
+	cmd.seekPos = this->queued.seekIndex->seekTo(ms, &cmd.seekTempo);
+	return this->queueCommand(cmd);
+}
+
+bool Playback::queueLoopCount(unsigned int count)
+{
+	Command cmd;
+	cmd.type = Command::Type::LoopCount;
+	cmd.value = count;
+	if (!this->queueCommand(cmd)) return false;
+	if (count != this->queued.loopCount) this->queued.seekIndex.reset();
+	this->queued.loopCount = count;
+	return true;
+}
+
+bool Playback::queueSong(std::shared_ptr<const Music> music)
+{
+	Command cmd;
+	cmd.type = Command::Type::Song;
+	cmd.song = std::make_shared<SongState>();
+	this->prepareSong(music, cmd.song.get());
+	if (!this->queueCommand(cmd)) return false;
+	this->queued.music = music;
+	this->queued.streaming = false;
+	this->queued.seekIndex.reset();
+	return true;
+}
+
+bool Playback::queueTrackMute(unsigned int track, bool mute)
+{
+	Command cmd;
+	cmd.type = Command::Type::TrackMute;
+	cmd.value = track;
+	cmd.mute = mute;
+	return this->queueCommand(cmd);
+}
+
+bool Playback::queueTempoScale(double scale)
+{
+	Command cmd;
+	cmd.type = Command::Type::TempoScale;
+	cmd.scale = scale;
+	return this->queueCommand(cmd);
+}
+
+bool Playback::queueCommand(const Command& cmd)
+{
+	return this->commands.push(cmd);
+}
+
+void Playback::processCommands()
+{
+	while (auto cmd = this->commands.front()) {
+		// Nothing here should throw, but if it does the command must still be
+		// removed, otherwise it would be run (and throw) again on every block.
+		try {
+			switch (cmd->type) {
+				case Command::Type::SeekByOrder:
+					this->seekByOrder(cmd->value);
+					break;
+				case Command::Type::SeekByTime:
+					this->allNotesOff();
+					this->seekToPosition(cmd->seekPos, cmd->seekTempo);
+					break;
+				case Command::Type::LoopCount:
+					if (cmd->value != this->loopCount) {
+						// Leave the old seek index in the queue slot, so that it is freed
+						// by the thread queueing the commands rather than this one
+						cmd->oldSeekIndex.swap(this->seekIndex);
+					}
+					this->loopCount = cmd->value;
+					break;
+				case Command::Type::Song:
+					// The old song is swapped into the queue slot in the same way
+					this->applySong(*cmd->song);
+					break;
+				case Command::Type::TrackMute:
+					this->setTrackMute(cmd->value, cmd->mute);
+					break;
+				case Command::Type::TempoScale:
+					// Check the scale first, as setTempoScale() would throw
+					if (
+						(cmd->scale <= 0)
+						|| (this->calcSamplesPerTick(cmd->scale) < 1.0)
+					) {
+						this->diag.warning("Ignoring invalid tempo scale %g", cmd->scale);
+						break;
+					}
+					this->setTempoScale(cmd->scale);
+					break;
+			}
+		} catch (const std::exception& e) {
+			this->diag.warning("Ignoring queued change: %s", e.what());
+		}
+		this->commands.pop();
+	}
+	return;
 }
 
 void Playback::mix(int16_t *output, unsigned long samples, Playback::Position *pos)
+{
+	assert(this->outputBits == 16);
+	this->mixBus(output, samples, pos, pcm_add_bus_s16_block);
+	return;
+}
+
+void Playback::mix(int32_t *output, unsigned long samples, Playback::Position *pos)
+{
+	assert(this->outputBits == 32);
+	this->mixBus(output, samples, pos, pcm_add_bus_s32_block);
+	return;
+}
+
+void Playback::mix(float *output, unsigned long samples, Playback::Position *pos)
+{
+	assert(this->outputBits == 32);
+	this->mixBus(output, samples, pos, pcm_add_bus_f32_block);
+	return;
+}
+
+template <class T>
+void Playback::mixBus(T *output, unsigned long samples, Playback::Position *pos,
+	void (*add)(T *, const int32_t *, unsigned long))
 {
 	assert(this->music);
-	assert(this->frameBuffer.size() > 0);
 
 	while (samples > 0) {
-		if (this->frameBufferPos >= this->frameBuffer.size()) {
-			this->nextFrame();
+		while (this->frameBufferPos >= this->frameBuffer.size()) {
+			if (!this->nextChunk()) {
+				this->processCommands();
+				this->nextFrame();
+			}
 		}
 		unsigned long left = std::min(samples, (unsigned long)(this->frameBuffer.size() - this->frameBufferPos));
 		assert(left > 0); // if fails, infinite loop results
-		int16_t *in = &this->frameBuffer[this->frameBufferPos];
-		int16_t *out_end = output + left;
-		while (output < out_end) {
-			*output = pcm_mix_s16(*output, *in);
-			output++;
-			in++;
-		}
-		//memcpy(output, &this->frameBuffer[this->frameBufferPos], left * sizeof(int16_t));
-		//output += left;
+		add(output, &this->frameBuffer[this->frameBufferPos], left);
+		output += left;
 		samples -= left;
 		this->frameBufferPos += left;
 	}
 
 	// Return the current playback position
-	pos->end = this->end;
-	pos->loop = this->loop;
-	pos->order = this->order;
-	pos->row = this->row;
-	pos->tempo = this->tempo;
+	this->getPosition(pos);
 	return;
 }
 
-void Playback::allNotesOff()
+unsigned long Playback::mixFrame(std::vector<int16_t> *output,
+	Playback::Position *pos)
 {
-	auto& pattern = this->music->patterns.at(this->pattern);
-	unsigned int trackIndex = 0;
-	auto ti = this->music->trackInfo.begin();
-	for (auto& pt : pattern) {
-		auto event = std::make_shared<NoteOffEvent>();
-		if (
-			(ti->channelType == TrackInfo::ChannelType::Any)
-			|| (ti->channelType == TrackInfo::ChannelType::OPL)
-			|| (ti->channelType == TrackInfo::ChannelType::OPLPerc)
-		) {
-			event->processEvent(0, trackIndex, this->pattern, this->oplConverter.get());
-		}
-		if (
-			(ti->channelType == TrackInfo::ChannelType::Any)
-			|| (ti->channelType == TrackInfo::ChannelType::MIDI)
-		) {
-			event->processEvent(0, trackIndex, this->pattern, this->oplConvMIDI.get());
-			event->processEvent(0, trackIndex, this->pattern, &this->pcmMIDI);
-		}
-		if (
-			(ti->channelType == TrackInfo::ChannelType::Any)
-			|| (ti->channelType == TrackInfo::ChannelType::PCM)
-		) {
-			event->processEvent(0, trackIndex, this->pattern, &this->pcm);
+	assert(this->music);
+	assert(this->outputBits == 16);
+
+	while (this->blockPos + this->frameBufferPos >= this->blockLength) {
+		this->processCommands();
+		this->nextFrame(output != NULL);
+	}
+	unsigned long len = this->blockLength - this->blockPos - this->frameBufferPos;
+	if (output) {
+		auto start = output->size();
+		output->resize(start + len, 0);
+		int16_t *out = &(*output)[start];
+		do {
+			unsigned long left = this->frameBuffer.size() - this->frameBufferPos;
+			pcm_add_bus_s16_block(out, &this->frameBuffer[this->frameBufferPos],
+				left);
+			out += left;
+			this->frameBufferPos = this->frameBuffer.size();
+		} while (this->nextChunk());
+	} else {
+		this->discardBlock();
+	}
+
+	this->getPosition(pos);
+	return len;
+}
+
+void Playback::saveSnapshot(Playback::Snapshot *snapshot) const
+{
+	snapshot->music = this->music;
+	snapshot->end = this->end;
+	snapshot->loop = this->loop;
+	snapshot->order = this->order;
+	snapshot->pattern = this->pattern;
+	snapshot->row = this->row;
+	snapshot->frame = this->frame;
+	snapshot->nextRow = this->nextRow;
+	snapshot->nextOrder = this->nextOrder;
+	snapshot->loadNextOrder = this->loadNextOrder;
+	snapshot->tempo = this->tempo;
+	snapshot->sampleFraction = this->sampleFraction;
+	snapshot->gotoCounts = this->gotoCounts;
+	this->oplConverter->saveState(&snapshot->opl);
+	this->oplConvMIDI->saveState(&snapshot->oplMIDI);
+	this->pcm.saveState(&snapshot->pcm);
+	this->pcmMIDI.saveState(&snapshot->pcmMIDI);
+	return;
+}
+
+void Playback::restoreSnapshot(const Playback::Snapshot& snapshot)
+{
+	assert(snapshot.music == this->music);
+
+	this->end = snapshot.end;
+	this->loop = snapshot.loop;
+	this->order = snapshot.order;
+	this->pattern = snapshot.pattern;
+	this->row = snapshot.row;
+	this->frame = snapshot.frame;
+	this->nextRow = snapshot.nextRow;
+	this->nextOrder = snapshot.nextOrder;
+	this->loadNextOrder = snapshot.loadNextOrder;
+	this->gotoCounts = snapshot.gotoCounts;
+	this->cursors.clear();
+	this->tempoChange(snapshot.tempo); // also discards the rest of the block
+	this->sampleFraction = snapshot.sampleFraction;
+
+	this->oplConverter->restoreState(snapshot.opl);
+	this->oplConvMIDI->restoreState(snapshot.oplMIDI);
+
+	// Bring fresh OPL chips up to the same register values.  The OPL3 enable
+	// bit goes first as it changes how the other registers are handled, and
+	// the notes are keyed on last once the instruments are loaded.
+	auto loadRegs = [](SynthOPL& synth, const EventConverter_OPL::State& state) {
+		synth.reset();
+		if (state.oplSet[1][0x05]) synth.write(1, 0x05, state.oplState[1][0x05]);
+		for (unsigned int keyOn = 0; keyOn < 2; keyOn++) {
+			for (unsigned int chip = 0; chip < 2; chip++) {
+				for (unsigned int reg = 0; reg < 256; reg++) {
+					if (!state.oplSet[chip][reg]) continue;
+					if ((chip == 1) && (reg == 0x05)) continue;
+					bool isKeyOn = (reg == 0xBD) || ((reg >= 0xB0) && (reg <= 0xB8));
+					if (isKeyOn != (keyOn == 1)) continue;
+					synth.write(chip, reg, state.oplState[chip][reg]);
+				}
+			}
 		}
-		trackIndex++;
-		ti++;
+	};
+	loadRegs(this->opl, snapshot.opl);
+	loadRegs(this->oplMIDI, snapshot.oplMIDI);
+
+	this->pcm.reset(this->music->trackInfo, this->music->patches);
+	this->pcmMIDI.reset(this->music->trackInfo, this->music->patches);
+	this->pcm.restoreState(snapshot.pcm);
+	this->pcmMIDI.restoreState(snapshot.pcmMIDI);
+	return;
+}
+
+bool Playback::getWarning(std::string *message)
+{
+	return this->diag.getWarning(message);
+}
+
+void Playback::allNotesOff()
+{
+	for (unsigned int t = 0; t < this->music->trackInfo.size(); t++) {
+		this->trackNoteOff(t);
 	}
 	return;
 }
 
-void Playback::nextFrame()
+void Playback::trackNoteOff(unsigned int trackIndex)
 {
-	static bool loadNextOrder = false; // has the order number changed?
+	auto& ti = this->music->trackInfo[trackIndex];
+	NoteOffEvent event;
+	if (
+		(ti.channelType == TrackInfo::ChannelType::Any)
+		|| (ti.channelType == TrackInfo::ChannelType::OPL)
+		|| (ti.channelType == TrackInfo::ChannelType::OPLPerc)
+	) {
+		event.processEvent(0, trackIndex, this->pattern, this->oplConverter.get());
+	}
+	if (
+		(ti.channelType == TrackInfo::ChannelType::Any)
+		|| (ti.channelType == TrackInfo::ChannelType::MIDI)
+	) {
+		event.processEvent(0, trackIndex, this->pattern, this->oplConvMIDI.get());
+		event.processEvent(0, trackIndex, this->pattern, &this->pcmMIDI);
+	}
+	if (
+		(ti.channelType == TrackInfo::ChannelType::Any)
+		|| (ti.channelType == TrackInfo::ChannelType::PCM)
+	) {
+		event.processEvent(0, trackIndex, this->pattern, &this->pcm);
+	}
+	return;
+}
+
+void Playback::nextFrame(bool synthesize)
+{
+	// Number of whole rows after this one to include in the block
+	unsigned int extraRows = 0;
 
 	// Trigger the next event
 	if (!this->end) {
 		if (this->frame == 0) {
-			auto& pattern = this->music->patterns.at(this->pattern);
+			if (this->pattern >= this->events.size()) {
+				// Patterns have been appended to the song without calling
+				// songChanged(), such as by an OPLStreamDecoder
+				this->compactNewPatterns();
+			}
+			auto& pattern = this->events.at(this->pattern);
+			this->seekCursors();
 			unsigned int trackIndex = 0;
 			// For each track
 			auto ti = this->music->trackInfo.begin();
+			auto cur = this->cursors.begin();
 			for (auto& pt : pattern) {
-				unsigned int trackPos = 0; // current track position in ticks
-				// For each event in the track
-				for (auto& te : pt) {
-					trackPos += te.delay;
-					// Right at this event
-					if (trackPos == this->row) {
-						// delay is zero below because we want it to sound immediately (not
-						// that is really matters as the delay is ignored later anyway)
-						if (
-							(ti->channelType == TrackInfo::ChannelType::Any)
-							|| (ti->channelType == TrackInfo::ChannelType::OPL)
-							|| (ti->channelType == TrackInfo::ChannelType::OPLPerc)
-						) {
-							te.event->processEvent(0, trackIndex, this->pattern, this->oplConverter.get());
-						}
-						if (
-							(ti->channelType == TrackInfo::ChannelType::Any)
-							|| (ti->channelType == TrackInfo::ChannelType::MIDI)
-						) {
-							te.event->processEvent(0, trackIndex, this->pattern, this->oplConvMIDI.get());
-							te.event->processEvent(0, trackIndex, this->pattern, &this->pcmMIDI);
-						}
-						if (
-							(ti->channelType == TrackInfo::ChannelType::Any)
-							|| (ti->channelType == TrackInfo::ChannelType::PCM)
-						) {
-							te.event->processEvent(0, trackIndex, this->pattern, &this->pcm);
-						}
-						// Check for any effects that affect playback progress
-						GotoEvent *jump = dynamic_cast<GotoEvent *>(te.event.get());
-						if (jump) {
-
-							// See if we're processed this jump before
-							auto ev = this->loopEvents.find(jump);
-							unsigned int *actualLoops;
-							if (ev == this->loopEvents.end()) {
-								actualLoops = &this->loopEvents[jump];
-								*actualLoops = 0;
-							} else {
-								actualLoops = &ev->second;
-							}
+				// Skip over any events we have jumped past
+				while (
+					(cur->event < pt.size())
+					&& (cur->tick + pt[cur->event].delay < this->row)
+				) {
+					cur->tick += pt[cur->event].delay;
+					cur->event++;
+				}
+				// For each event in the track on the current row
+				while (
+					(cur->event < pt.size())
+					&& (cur->tick + pt[cur->event].delay == this->row)
+				) {
+					auto& te = pt[cur->event];
+					cur->tick += te.delay;
+					cur->event++;
+					if (
+						this->trackMuted[trackIndex]
+						&& (te.event.type == CompactEvent::Type::NoteOn)
+					) {
+						// Track is muted, so don't start any new notes
+						continue;
+					}
+					// delay is zero below because we want it to sound immediately (not
+					// that is really matters as the delay is ignored later anyway)
+					if (
+						(ti->channelType == TrackInfo::ChannelType::Any)
+						|| (ti->channelType == TrackInfo::ChannelType::OPL)
+						|| (ti->channelType == TrackInfo::ChannelType::OPLPerc)
+					) {
+						te.event.processEvent(0, trackIndex, this->pattern, this->oplConverter.get());
+					}
+					if (
+						(ti->channelType == TrackInfo::ChannelType::Any)
+						|| (ti->channelType == TrackInfo::ChannelType::MIDI)
+					) {
+						te.event.processEvent(0, trackIndex, this->pattern, this->oplConvMIDI.get());
+						te.event.processEvent(0, trackIndex, this->pattern, &this->pcmMIDI);
+					}
+					if (
+						(ti->channelType == TrackInfo::ChannelType::Any)
+						|| (ti->channelType == TrackInfo::ChannelType::PCM)
+					) {
+						te.event.processEvent(0, trackIndex, this->pattern, &this->pcm);
+					}
+					// Check for any effects that affect playback progress
+					const GotoEvent *jump = NULL;
+					if (te.event.type == CompactEvent::Type::Goto) {
+						jump = this->songGotoEvent(trackIndex, cur->event - 1);
+					}
+					if (jump) {
+
+						// See how many times we've processed this jump before
+						unsigned int *actualLoops = this->gotoCount(jump);
 
-							auto wantedLoops = jump->repeat + 1;
-							if (*actualLoops < wantedLoops) {
-								// Loop once more
-								(*actualLoops)++;
-
-								switch (jump->type) {
-									case GotoEvent::Type::CurrentPattern:
-										this->nextRow = jump->targetRow;
-										break;
-									case GotoEvent::Type::NextPattern:
-										this->nextOrder++;
-										this->nextRow = jump->targetRow;
-										loadNextOrder = true;
-										break;
-									case GotoEvent::Type::SpecificOrder:
-										this->nextOrder = jump->targetOrder;
-										this->nextRow = jump->targetRow;
-										loadNextOrder = true;
-										break;
-								}
+						auto wantedLoops = jump->repeat + 1;
+						if (*actualLoops < wantedLoops) {
+							// Loop once more
+							(*actualLoops)++;
+
+							switch (jump->type) {
+								case GotoEvent::Type::CurrentPattern:
+									this->nextRow = jump->targetRow;
+									break;
+								case GotoEvent::Type::NextPattern:
+									this->nextOrder++;
+									this->nextRow = jump->targetRow;
+									this->loadNextOrder = true;
+									break;
+								case GotoEvent::Type::SpecificOrder:
+									this->nextOrder = jump->targetOrder;
+									this->nextRow = jump->targetRow;
+									this->loadNextOrder = true;
+									break;
 							}
 						}
-					} else if (trackPos > this->row) {
-						// Not up to this event yet, don't keep looking
-						break;
 					}
 				}
 				trackIndex++;
 				ti++;
+				cur++;
 			}
 		} else {
 			// Update any effects currently in progress
 		}
 	}
 
-	// Silence the framebuffer
-	memset(this->frameBuffer.data(), 0, this->frameBuffer.size() * sizeof(int16_t));
+	// Apply this row's OPL writes (and any tempo change) in one go
+	this->oplConverter->flush();
+	this->oplConvMIDI->flush();
 
-	// Mix the PCM source in to the frame buffer
-	this->pcm.mix(this->frameBuffer.data(), this->frameBuffer.size());
-
-	// Mix the OPL source in to the frame buffer
-	this->opl.mix(this->frameBuffer.data(), this->frameBuffer.size());
+	// Work out how long the block is, now any tempo change has been applied
+	unsigned long maxFrames = std::max(1.0,
+		this->outputSampleRate * MAX_BLOCK_MS / 1000 / this->samplesPerFrame);
+	unsigned long frames;
+	if (this->end) {
+		// Just letting notes fade out
+		frames = maxFrames;
+	} else {
+		frames = this->tempo.framesPerTick - this->frame;
+		if ((this->frame == 0) && (frames < maxFrames)) {
+			extraRows = this->emptyRowsAhead(
+				(maxFrames - frames) / this->tempo.framesPerTick);
+			frames += extraRows * this->tempo.framesPerTick;
+		}
+	}
+	this->blockStart.end = this->end;
+	this->blockStart.loop = this->loop;
+	this->blockStart.order = this->order;
+	this->blockStart.row = this->row;
+	this->blockStart.tempo = this->tempo;
+	this->blockFrame = this->frame;
+	this->blockFrames = frames;
+	this->blockFraction = this->sampleFraction;
 
-	// Mix the MIDI PCM source in to the frame buffer
-	this->pcmMIDI.mix(this->frameBuffer.data(), this->frameBuffer.size());
+	double exactLength = frames * this->samplesPerFrame + this->sampleFraction;
+	unsigned long length = exactLength;
+	this->sampleFraction = exactLength - length;
 
-	// Mix the MIDI OPL source in to the frame buffer
-	this->oplMIDI.mix(this->frameBuffer.data(), this->frameBuffer.size());
+	// Synthesize the first chunk of the block
+	this->blockLength = length * 2; // *2 == stereo
+	this->blockPos = 0;
+	this->blockSynth = synthesize;
+	this->synthesizeChunk();
 
-	// Increment the frame, row, order, etc.
-	this->frameBufferPos = 0;
+	// Move on to the end of the block, and increment the row, order, etc.
 	if (!this->end) {
-		this->frame++;
+		this->frame += frames - extraRows * this->tempo.framesPerTick;
 		if (this->frame >= this->tempo.framesPerTick) {
 			this->frame = 0;
-			this->row = this->nextRow;
-			this->nextRow++;
+			this->row = this->nextRow + extraRows;
+			this->nextRow = this->row + 1;
 			if (this->row >= this->music->ticksPerTrack) {
 				this->row = 0;
 				this->nextRow = 1;
 				this->nextOrder++;
-				loadNextOrder = true;
+				this->loadNextOrder = true;
 			}
-			if (loadNextOrder) {
-				loadNextOrder = false;
+			if (this->loadNextOrder) {
+				this->loadNextOrder = false;
 				this->order = this->nextOrder;
+				if (this->stream) this->streamAhead();
 				if (this->order >= this->music->patternOrder.size()) {
 					if ((this->loopCount == 0) || ((unsigned int)this->loop < this->loopCount - 1)) {
 						if (this->music->loopDest >= 0) {
@@ -404,7 +892,7 @@ void Playback::nextFrame()
 						this->nextOrder = this->order; // incremented at end of pattern
 
 						// Since we're looping, reset all the pattern loop counts
-						this->loopEvents.clear();
+						std::fill(this->gotoCounts.begin(), this->gotoCounts.end(), 0);
 					} else {
 						this->end = true;
 					}
@@ -423,18 +911,214 @@ void Playback::nextFrame()
 	return;
 }
 
+bool Playback::nextChunk()
+{
+	unsigned long next = this->blockPos + this->frameBuffer.size();
+	if (next >= this->blockLength) return false;
+	this->blockPos = next;
+	this->synthesizeChunk();
+	return true;
+}
+
+void Playback::synthesizeChunk()
+{
+	// Silence the mix bus, which never grows past the capacity reserved for it
+	this->frameBuffer.assign(
+		std::min(this->blockLength - this->blockPos, MAX_CHUNK_SAMPLES), 0);
+	this->frameBufferPos = 0;
+
+	if (this->blockSynth) {
+		// Add the PCM source to the frame buffer
+		this->pcm.mix(this->frameBuffer.data(), this->frameBuffer.size());
+
+		// Add the OPL source to the frame buffer
+		this->opl.mix(this->frameBuffer.data(), this->frameBuffer.size());
+
+		// Add the MIDI PCM source to the frame buffer
+		this->pcmMIDI.mix(this->frameBuffer.data(), this->frameBuffer.size());
+
+		// Add the MIDI OPL source to the frame buffer
+		this->oplMIDI.mix(this->frameBuffer.data(), this->frameBuffer.size());
+	} else {
+		// Keep the PCM notes in step so a snapshot taken later is accurate
+		this->pcm.skip(this->frameBuffer.size());
+		this->pcmMIDI.skip(this->frameBuffer.size());
+	}
+	return;
+}
+
+void Playback::discardBlock()
+{
+	this->frameBufferPos = this->frameBuffer.size();
+	this->blockLength = this->blockPos + this->frameBuffer.size();
+	return;
+}
+
+void Playback::streamAhead()
+{
+	while (this->music->patternOrder.size() < this->order + STREAM_LOOKAHEAD_ORDERS) {
+		if (!this->stream->decodePattern()) break;
+		// The song is longer now, so any seek index is out of date
+		this->seekIndex.reset();
+	}
+	this->compactNewPatterns();
+	if (this->loopCount == 1) {
+		this->stream->discardPatterns(this->order);
+		for (unsigned int i = 0; i < this->order; i++) {
+			for (auto& track : this->events.at(this->music->patternOrder.at(i))) {
+				CompactTrack().swap(track);
+			}
+		}
+	}
+	return;
+}
+
+void Playback::compactNewPatterns()
+{
+	auto& patterns = this->music->patterns;
+	while (this->events.size() < patterns.size()) {
+		this->events.push_back(compactPattern(patterns[this->events.size()]));
+	}
+	return;
+}
+
+void Playback::indexGotoEvents()
+{
+	findGotoEvents(*this->music, &this->gotoEvents);
+	this->gotoCounts.assign(this->gotoEvents.size(), 0);
+	return;
+}
+
+unsigned int *Playback::gotoCount(const GotoEvent *jump)
+{
+	auto ev = std::lower_bound(this->gotoEvents.begin(), this->gotoEvents.end(),
+		jump);
+	if ((ev == this->gotoEvents.end()) || (*ev != jump)) {
+		// The song has been changed without calling songChanged()
+		this->indexGotoEvents();
+		ev = std::lower_bound(this->gotoEvents.begin(), this->gotoEvents.end(),
+			jump);
+		if ((ev == this->gotoEvents.end()) || (*ev != jump)) {
+			// The event isn't in the song at all.  Hand back a spare counter
+			// that is already used up, so the jump is ignored instead.
+			assert(false);
+			this->spareGotoCount = std::numeric_limits<unsigned int>::max();
+			return &this->spareGotoCount;
+		}
+	}
+	return &this->gotoCounts[ev - this->gotoEvents.begin()];
+}
+
+const GotoEvent *Playback::songGotoEvent(unsigned int trackIndex,
+	unsigned long eventIndex) const
+{
+	auto& patterns = this->music->patterns;
+	if (this->pattern >= patterns.size()) return NULL;
+	auto& pattern = patterns[this->pattern];
+	if (trackIndex >= pattern.size()) return NULL;
+	auto& track = pattern[trackIndex];
+	if (eventIndex >= track.size()) return NULL;
+	return dynamic_cast<const GotoEvent *>(track[eventIndex].event.get());
+}
+
+void Playback::seekCursors()
+{
+	auto& pattern = this->events.at(this->pattern);
+	bool rewind = (this->cursorPattern != this->pattern)
+		|| (this->row < this->cursorRow)
+		|| (this->cursors.size() != pattern.size());
+	if (!rewind) {
+		// Make sure the song hasn't been shortened underneath us
+		auto cur = this->cursors.begin();
+		for (auto& pt : pattern) {
+			if (cur->event > pt.size()) {
+				rewind = true;
+				break;
+			}
+			cur++;
+		}
+	}
+	if (rewind) {
+		this->cursors.assign(pattern.size(), TrackCursor{0, 0});
+		this->cursorPattern = this->pattern;
+	}
+	this->cursorRow = this->row + 1;
+	return;
+}
+
+void Playback::getPosition(Playback::Position *pos) const
+{
+	if (this->blockPos + this->frameBufferPos < this->blockLength) {
+		// Part way through a block, so count how many frames have been used.
+		// Frame n ends after floor(n * samplesPerFrame + blockFraction) samples.
+		unsigned long used = (this->blockPos + this->frameBufferPos) / 2; // stereo
+		unsigned long frames = ceil(
+			(used + 1 - this->blockFraction) / this->samplesPerFrame) - 1;
+		if (frames < this->blockFrames) {
+			*pos = this->blockStart;
+			if (!pos->end) {
+				pos->row += (this->blockFrame + frames) / pos->tempo.framesPerTick;
+			}
+			return;
+		}
+	}
+	pos->end = this->end;
+	pos->loop = this->loop;
+	pos->order = this->order;
+	pos->row = this->row;
+	pos->tempo = this->tempo;
+	return;
+}
+
+unsigned int Playback::emptyRowsAhead(unsigned int maxRows)
+{
+	// Jumps happen at the end of the current row
+	if (this->loadNextOrder || (this->nextRow != this->row + 1)) return 0;
+
+	// Find the earliest event still to come in the pattern.  The cursors have
+	// already moved past everything up to and including the current row.
+	unsigned long nextEvent = this->music->ticksPerTrack;
+	auto& pattern = this->events.at(this->pattern);
+	auto cur = this->cursors.begin();
+	for (auto& pt : pattern) {
+		if (cur->event < pt.size()) {
+			nextEvent = std::min(nextEvent, cur->tick + pt[cur->event].delay);
+		}
+		cur++;
+	}
+	if (nextEvent <= (unsigned long)this->row + 1) return 0;
+	return std::min((unsigned long)maxRows, nextEvent - this->row - 1);
+}
+
+EventHandler_Playback_Seek *Playback::getSeekIndex()
+{
+	if (!this->seekIndex) {
+		this->seekIndex.reset(
+			new EventHandler_Playback_Seek(this->music, this->loopCount));
+		this->seekIndex->buildIndex();
+	}
+	return this->seekIndex.get();
+}
+
 void Playback::tempoChange(const Tempo& tempo)
 {
-	// Make this thread-safe
 	this->tempo = tempo;
+	this->updateSamplesPerFrame();
+	this->discardBlock();
+	return;
+}
+
+double Playback::calcSamplesPerTick(double scale) const
+{
+	return this->outputSampleRate * this->tempo.usPerTick / US_PER_SEC / scale;
+}
 
-	unsigned long samplesPerTick = this->outputSampleRate
-		* tempo.usPerTick / US_PER_SEC;
-	if (samplesPerTick == 0) {
+void Playback::updateSamplesPerFrame()
+{
+	double samplesPerTick = this->calcSamplesPerTick(this->tempoScale);
+	if (samplesPerTick < 1.0) {
 		throw stream::error("Tempo too high (less than one PCM sample per song tick)");
 	}
-	this->samplesPerFrame = samplesPerTick / tempo.framesPerTick;
-	this->frameBuffer.assign(this->samplesPerFrame * 2, 0); // *2 == stereo
-	this->frameBufferPos = this->frameBuffer.size();
+	this->samplesPerFrame = samplesPerTick / this->tempo.framesPerTick;
 	return;
 }
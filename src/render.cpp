@@ -0,0 +1,451 @@
+/**
+ * @file  render.cpp
+ * @brief Functions for rendering songs to .wav files.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <camoto/iostream_helpers.hpp>
+#include <camoto/stream_file.hpp>
+#include <camoto/util.hpp> // createString()
+#include <camoto/gamemusic/autodetect.hpp>
+#include <camoto/gamemusic/exceptions.hpp>
+#include <camoto/gamemusic/render.hpp>
+
+using namespace camoto;
+using namespace camoto::gamemusic;
+
+/// Number of audio frames to generate at one time
+#define FRAMES_TO_BUFFER 512
+
+/// Number of channels in audio output
+#define NUM_CHANNELS 2
+
+/// Longest piece of a song renderWAVParallel() renders in one go, in seconds
+#define SEGMENT_MAX_SECONDS 10
+
+/// Number of bits per sample in audio output
+#define BIT_DEPTH 16
+
+#define WAVE_FMT_SIZE (2+2+4+4+2+2)
+#define WAVE_HEADER_SIZE (4+4+4+4+4+WAVE_FMT_SIZE+4+4)
+
+/// Write a .wav header with the lengths left blank.
+static void writeHeader(stream::output& wav)
+{
+	wav
+		<< "RIFF"
+		<< u32le(0) // overwritten later
+		<< "WAVEfmt "
+		<< u32le(WAVE_FMT_SIZE)
+		<< u16le(1) // PCM
+		<< u16le(NUM_CHANNELS)
+		<< u32le(RENDER_SAMPLE_RATE)
+		<< u32le(RENDER_SAMPLE_RATE * NUM_CHANNELS * BIT_DEPTH / 8)
+		<< u16le(NUM_CHANNELS * BIT_DEPTH / 8)
+		<< u16le(BIT_DEPTH)
+		<< "data"
+		<< u32le(0) // overwritten later
+	;
+	return;
+}
+
+/// Fill in the lengths in the .wav header once all the data is written.
+static void finishHeader(stream::output& wav)
+{
+	stream::pos lenTotal = wav.tellp();
+
+	wav.seekp(4, stream::start);
+	wav << u32le(lenTotal - 8);
+	wav.seekp(WAVE_HEADER_SIZE - 4, stream::start);
+	wav << u32le(lenTotal - WAVE_HEADER_SIZE);
+	wav.flush();
+	return;
+}
+
+/// Collect any warnings the song has raised during playback.
+/**
+ * @param warnings
+ *   Warnings are appended here, or discarded if this is NULL.
+ */
+static void takeWarnings(Playback& playback, std::vector<std::string> *warnings)
+{
+	std::string message;
+	while (playback.getWarning(&message)) {
+		if (warnings) warnings->push_back(message);
+	}
+	return;
+}
+
+unsigned long camoto::gamemusic::renderWAV(stream::output& wav,
+	std::shared_ptr<const Music> music,
+	std::shared_ptr<const PatchBank> bankMIDI, unsigned int loopCount,
+	unsigned int extraTime, RenderProgressCallback progress,
+	std::vector<std::string> *warnings)
+{
+	if (loopCount == 0) {
+		throw format_limitation("Can't loop forever when rendering to .wav.");
+	}
+
+	Playback playback(RENDER_SAMPLE_RATE, NUM_CHANNELS, BIT_DEPTH);
+	playback.setBankMIDI(bankMIDI);
+	playback.setSong(music);
+	playback.setLoopCount(loopCount);
+	takeWarnings(playback, warnings);
+
+	// Make room for the header, will rewrite later
+	writeHeader(wav);
+
+	const unsigned long lenBuffer = FRAMES_TO_BUFFER * NUM_CHANNELS;
+	std::vector<int16_t> output(lenBuffer);
+	unsigned long long totalSamples = 0;
+
+	auto writeBlock = [&](Playback::Position *pos) {
+		std::fill(output.begin(), output.end(), 0);
+		playback.mix(output.data(), lenBuffer, pos);
+		takeWarnings(playback, warnings);
+
+		// Make sure samples are little-endian
+		for (auto& s : output) s = htole16(s);
+
+		wav.write((uint8_t *)output.data(), lenBuffer * sizeof(int16_t));
+		totalSamples += lenBuffer;
+		if (progress) progress(*pos);
+	};
+
+	Playback::Position pos;
+	pos.end = false;
+	while (!pos.end) writeBlock(&pos);
+
+	if (extraTime) {
+		unsigned long extraSamples = extraTime * RENDER_SAMPLE_RATE * NUM_CHANNELS;
+		while (extraSamples >= lenBuffer) {
+			writeBlock(&pos);
+			extraSamples -= lenBuffer;
+		}
+	}
+
+	finishHeader(wav);
+
+	return totalSamples * 1000 / (RENDER_SAMPLE_RATE * NUM_CHANNELS);
+}
+
+unsigned long camoto::gamemusic::renderWAVParallel(stream::output& wav,
+	std::shared_ptr<const Music> music,
+	std::shared_ptr<const PatchBank> bankMIDI, unsigned int loopCount,
+	unsigned int extraTime, unsigned int threads, unsigned int overlapOrders,
+	std::vector<std::string> *warnings)
+{
+	if (loopCount == 0) {
+		throw format_limitation("Can't loop forever when rendering to .wav.");
+	}
+	if (threads == 0) threads = std::thread::hardware_concurrency();
+	if (threads == 0) threads = 1; // unknown core count
+
+	auto createPlayback = [&]() {
+		auto playback = std::make_unique<Playback>(RENDER_SAMPLE_RATE,
+			NUM_CHANNELS, BIT_DEPTH);
+		playback->setBankMIDI(bankMIDI);
+		playback->setSong(music);
+		playback->setLoopCount(loopCount);
+		return playback;
+	};
+
+	// Each segment is held in memory until it is written, so keep them short
+	const unsigned long long maxSegment =
+		(unsigned long long)SEGMENT_MAX_SECONDS * RENDER_SAMPLE_RATE * NUM_CHANNELS;
+	// Long orders are cut into smaller pieces, so they can still be shared out
+	// between the threads
+	const unsigned long long maxPiece = maxSegment / 4;
+
+	// Play through the song without synthesizing any audio, taking a snapshot
+	// at the start of each order so playback can be resumed from there, and
+	// part way through any order too long to be a single segment.  Only
+	// the warnings from loading the song are kept from this pass, as the
+	// segments below will raise the rest again.
+	struct Boundary {
+		Playback::Snapshot snapshot;
+		unsigned long long offset; ///< in samples from start of song
+	};
+	std::vector<Boundary> boundaries;
+	unsigned long long lenSong = 0;
+	{
+		auto playback = createPlayback();
+		takeWarnings(*playback, warnings);
+		Playback::Position pos;
+		boundaries.emplace_back();
+		playback->saveSnapshot(&boundaries.back().snapshot);
+		boundaries.back().offset = 0;
+		unsigned int lastLoop = 0, lastOrder = 0;
+		do {
+			lenSong += playback->mixFrame(NULL, &pos);
+			takeWarnings(*playback, NULL);
+			if (pos.end) break;
+			if (
+				(pos.loop != lastLoop)
+				|| (pos.order != lastOrder)
+				|| (lenSong - boundaries.back().offset >= maxPiece)
+			) {
+				boundaries.emplace_back();
+				playback->saveSnapshot(&boundaries.back().snapshot);
+				boundaries.back().offset = lenSong;
+				lastLoop = pos.loop;
+				lastOrder = pos.order;
+			}
+		} while (true);
+	}
+	unsigned long long lenTotal = lenSong
+		+ (unsigned long long)extraTime * RENDER_SAMPLE_RATE * NUM_CHANNELS;
+
+	// Split the song into at least a few segments per thread, so a thread that
+	// finishes early can pick up another one.  Segments always start on a
+	// boundary.
+	unsigned long long lenSegment = std::min(lenSong / (threads * 4), maxSegment);
+	if (lenSegment == 0) lenSegment = 1;
+	std::vector<unsigned int> segStart;
+	segStart.push_back(0);
+	for (unsigned int b = 1; b < boundaries.size(); b++) {
+		if (boundaries[b].offset - boundaries[segStart.back()].offset >= lenSegment) {
+			segStart.push_back(b);
+		}
+	}
+
+	struct Segment {
+		std::vector<int16_t> audio;
+		std::vector<std::string> warnings;
+		bool done;
+		std::exception_ptr error;
+	};
+	std::vector<Segment> segments(segStart.size());
+	for (auto& s : segments) s.done = false;
+	std::atomic<unsigned int> nextSegment(0);
+	std::mutex lockSegments;
+	std::condition_variable segmentDone;
+
+	// Workers wait rather than get too far ahead of the segment being written,
+	// so only a few segments are ever in memory at once.
+	const unsigned int maxAhead = threads * 2;
+	unsigned int segmentsWritten = 0;
+	bool abort = false;
+	std::condition_variable segmentWritten;
+
+	auto renderSegment = [&](unsigned int index,
+		std::vector<std::string> *segWarnings)
+	{
+		unsigned int b = segStart[index];
+		unsigned long long start = boundaries[b].offset;
+		unsigned long long end = (index + 1 < segStart.size())
+			? boundaries[segStart[index + 1]].offset : lenTotal;
+
+		// Start a little earlier and throw that audio away, to give notes that
+		// were playing at the start of the segment a chance to settle.
+		unsigned int from = (b > overlapOrders) ? b - overlapOrders : 0;
+		auto playback = createPlayback();
+		playback->restoreSnapshot(boundaries[from].snapshot);
+
+		std::vector<int16_t> audio;
+		audio.reserve(end - start);
+		Playback::Position pos;
+		unsigned long long offset = boundaries[from].offset;
+		while (offset < start) {
+			offset += playback->mixFrame(&audio, &pos);
+			audio.clear();
+			// These belong to the previous segment, which reports them itself
+			takeWarnings(*playback, NULL);
+		}
+		while (offset < end) {
+			offset += playback->mixFrame(&audio, &pos);
+			takeWarnings(*playback, segWarnings);
+		}
+		audio.resize(end - start);
+		return audio;
+	};
+
+	auto worker = [&]() {
+		for (;;) {
+			unsigned int index = nextSegment++;
+			if (index >= segments.size()) break;
+			bool skip;
+			{
+				std::unique_lock<std::mutex> lock(lockSegments);
+				segmentWritten.wait(lock, [&]() {
+					return abort || (index < segmentsWritten + maxAhead);
+				});
+				skip = abort;
+			}
+			std::vector<int16_t> audio;
+			std::vector<std::string> segWarnings;
+			std::exception_ptr error;
+			if (!skip) {
+				try {
+					audio = renderSegment(index, warnings ? &segWarnings : NULL);
+				} catch (...) {
+					error = std::current_exception();
+				}
+			}
+			std::lock_guard<std::mutex> lock(lockSegments);
+			segments[index].audio = std::move(audio);
+			segments[index].warnings = std::move(segWarnings);
+			segments[index].error = error;
+			segments[index].done = true;
+			segmentDone.notify_all();
+		}
+	};
+
+	writeHeader(wav);
+	std::vector<std::thread> pool;
+	for (unsigned int i = 0; i < threads; i++) pool.emplace_back(worker);
+
+	// Write out each segment in order as soon as it is ready
+	std::exception_ptr error;
+	for (auto& seg : segments) {
+		std::vector<int16_t> audio;
+		{
+			std::unique_lock<std::mutex> lock(lockSegments);
+			segmentDone.wait(lock, [&seg]() { return seg.done; });
+			audio = std::move(seg.audio);
+			if (!error) error = seg.error;
+		}
+		// Passed on in song order, whichever thread finished first
+		if (warnings) {
+			warnings->insert(warnings->end(), seg.warnings.begin(),
+				seg.warnings.end());
+		}
+		if (!error) {
+			// Make sure samples are little-endian
+			for (auto& s : audio) s = htole16(s);
+			try {
+				wav.write((uint8_t *)audio.data(), audio.size() * sizeof(int16_t));
+			} catch (...) {
+				error = std::current_exception();
+			}
+		}
+
+		// Let the next segment start, or after an error, skip the rest and wait
+		// for the threads before rethrowing
+		std::lock_guard<std::mutex> lock(lockSegments);
+		segmentsWritten++;
+		if (error) abort = true;
+		segmentWritten.notify_all();
+	}
+	for (auto& t : pool) t.join();
+	if (error) std::rethrow_exception(error);
+
+	finishHeader(wav);
+
+	return lenTotal * 1000 / (RENDER_SAMPLE_RATE * NUM_CHANNELS);
+}
+
+std::shared_ptr<Music> camoto::gamemusic::openMusic(
+	const std::string& filename, const std::string& type)
+{
+	stream::file content(filename, false);
+	MusicManager::handler_t musicType;
+	if (type.empty()) {
+		// List every match, as a definite one may be skipped below if its
+		// supplemental files are missing, and a later one used instead
+		for (const auto& m : detectFormat(content, filename, true)) {
+			auto& i = m.type;
+
+			// Skip the format if it needs supplemental files that aren't there
+			bool suppOK = true;
+			for (const auto& s : i->getRequiredSupps(content, filename)) {
+				try {
+					stream::file test_presence(s.second, false);
+				} catch (const stream::open_error&) {
+					suppOK = false;
+					break;
+				}
+			}
+			if (!suppOK) continue;
+
+			// Matches are sorted, so the first usable one is the best
+			musicType = i;
+			break;
+		}
+		if (!musicType) {
+			throw format_limitation(createString("Unable to automatically "
+				"determine the file type of " << filename));
+		}
+	} else {
+		musicType = MusicManager::byCode(type);
+		if (!musicType) {
+			throw format_limitation(createString("Unknown file type: " << type));
+		}
+	}
+
+	SuppData suppData;
+	for (const auto& s : musicType->getRequiredSupps(content, filename)) {
+		suppData[s.first] = std::make_unique<stream::file>(s.second, false);
+	}
+	return musicType->read(content, suppData);
+}
+
+std::vector<RenderResult> camoto::gamemusic::renderBatch(
+	const std::vector<RenderJob>& jobs, unsigned int threads,
+	RenderJobCallback done)
+{
+	std::vector<RenderResult> results(jobs.size());
+	if (threads == 0) threads = std::thread::hardware_concurrency();
+	if (threads == 0) threads = 1; // unknown core count
+	if (threads > jobs.size()) threads = jobs.size();
+
+	// Index of the next job to start, shared by all the threads
+	std::atomic<unsigned int> nextJob(0);
+	std::mutex lockDone;
+
+	auto worker = [&]() {
+		for (;;) {
+			unsigned int index = nextJob++;
+			if (index >= jobs.size()) break;
+			auto& job = jobs[index];
+			auto& result = results[index];
+
+			auto start = std::chrono::steady_clock::now();
+			try {
+				auto music = openMusic(job.inputFilename, job.inputType);
+				stream::output_file wav(job.outputFilename, true);
+				result.msAudio = renderWAV(wav, music, job.bankMIDI, job.loopCount,
+					job.extraTime, nullptr, &result.warnings);
+				result.success = true;
+			} catch (const std::exception& e) {
+				result.success = false;
+				result.error = e.what();
+				result.msAudio = 0;
+			}
+			result.msElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - start).count();
+
+			if (done) {
+				std::lock_guard<std::mutex> lock(lockDone);
+				done(index, result);
+			}
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned int i = 1; i < threads; i++) pool.emplace_back(worker);
+	worker(); // this thread does its share too
+	for (auto& t : pool) t.join();
+
+	return results;
+}
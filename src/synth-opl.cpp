@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <camoto/gamemusic/eventconverter-opl.hpp>
 #include <camoto/gamemusic/synth-opl.hpp>
 #include <camoto/gamemusic/util-pcm.hpp>
 #include "dbopl.hpp"
@@ -44,26 +45,62 @@ class OPLMixer: public MixerChannel {
 
 		virtual void AddSamples_m32(Bitu samples, Bit32s *buffer)
 		{
-			while (samples) {
-				*this->buf = pcm_mix_s16(*this->buf, pcm_clip_s16(*buffer << VOL_BOOST));
-				this->buf++;
-				*this->buf = pcm_mix_s16(*this->buf, pcm_clip_s16(*buffer << VOL_BOOST));
-				this->buf++;
+			assert(samples <= OPL_FRAME_SIZE);
+			int16_t *out = this->conv;
+			for (Bitu i = 0; i < samples; i++) {
+				*out++ = pcm_clip_s16(*buffer << VOL_BOOST);
+				*out++ = pcm_clip_s16(*buffer << VOL_BOOST);
 				buffer++;
-				samples--;
 			}
+			pcm_mix_s16_block(this->buf, this->conv, samples * 2);
+			this->buf += samples * 2;
 			return;
 		}
 
 		virtual void AddSamples_s32(Bitu frames, Bit32s *buffer)
 		{
+			assert(frames <= OPL_FRAME_SIZE);
 			unsigned long samples = frames * 2;
-			while (samples) {
-				*this->buf = pcm_mix_s16(*this->buf, pcm_clip_s16(*buffer << VOL_BOOST));
-				this->buf++;
-				buffer++;
-				samples--;
+			for (unsigned long i = 0; i < samples; i++) {
+				this->conv[i] = pcm_clip_s16(buffer[i] << VOL_BOOST);
+			}
+			pcm_mix_s16_block(this->buf, this->conv, samples);
+			this->buf += samples;
+			return;
+		}
+
+	protected:
+		/// Clipped 16-bit stereo samples, ready to be mixed into buf
+		int16_t conv[OPL_FRAME_SIZE * 2];
+};
+
+/// Mixer for adding DOSBox OPL data to a 32-bit mix bus.
+class OPLBusMixer: public MixerChannel {
+	public:
+		int32_t *buf;
+
+		OPLBusMixer(int32_t *buf)
+			:	buf(buf)
+		{
+		}
+
+		virtual void AddSamples_m32(Bitu samples, Bit32s *buffer)
+		{
+			for (Bitu i = 0; i < samples; i++) {
+				Bit32s s = *buffer++ << VOL_BOOST;
+				*this->buf++ += s;
+				*this->buf++ += s;
+			}
+			return;
+		}
+
+		virtual void AddSamples_s32(Bitu frames, Bit32s *buffer)
+		{
+			unsigned long samples = frames * 2;
+			for (unsigned long i = 0; i < samples; i++) {
+				this->buf[i] += buffer[i] << VOL_BOOST;
 			}
+			this->buf += samples;
 			return;
 		}
 };
@@ -98,6 +135,16 @@ void SynthOPL::write(unsigned int chip, unsigned int reg, unsigned int val)
 	return;
 }
 
+void SynthOPL::writeBatch(const OPLEvent *oplEvents, size_t count)
+{
+	SynthOPLInternal *priv = (SynthOPLInternal *)this->internal;
+	for (const OPLEvent *ev = oplEvents; ev < oplEvents + count; ev++) {
+		if (!(ev->valid & OPLEvent::Regs)) continue;
+		priv->opl.WriteReg((ev->chipIndex << 8) | ev->reg, ev->val);
+	}
+	return;
+}
+
 void SynthOPL::mix(int16_t *output, unsigned long len)
 {
 	SynthOPLInternal *priv = (SynthOPLInternal *)this->internal;
@@ -111,3 +158,17 @@ void SynthOPL::mix(int16_t *output, unsigned long len)
 	}
 	return;
 }
+
+void SynthOPL::mix(int32_t *output, unsigned long len)
+{
+	SynthOPLInternal *priv = (SynthOPLInternal *)this->internal;
+
+	len /= 2; // stereo
+	OPLBusMixer mix(output);
+	while (len > 0) {
+		unsigned long sampleCount = std::min((unsigned long)OPL_FRAME_SIZE, len);
+		priv->opl.Generate(&mix, sampleCount);
+		len -= sampleCount;
+	}
+	return;
+}
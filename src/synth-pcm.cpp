@@ -19,6 +19,7 @@
  */
 
 #include <algorithm>
+#include <cmath>
 #include <assert.h>
 #include <camoto/util.hpp>
 #include <camoto/gamemusic/synth-pcm.hpp>
@@ -35,9 +36,219 @@ using namespace camoto::gamemusic;
 /// Middle-C frequency in milliHertz
 #define FREQ_MIDDLE_C 261625
 
+/// Number of input samples each windowed-sinc filter is applied to
+#define SINC_TAPS 8
+
+/// Number of bits of the fractional position used to pick a sinc filter
+#define SINC_PHASE_BITS 8
+
+/// Most stereo samples rendered for one note at a time, before mixing
+#define VOICE_BUFFER_SIZE 2048
+
+/// Read samples from one pass through a note in a PCMDecoded.
+struct PassReader
+{
+	const int16_t *data;
+
+	inline int32_t operator()(long i) const
+	{
+		return data[i];
+	}
+};
+
+/// Filter coefficients for every phase of the windowed-sinc interpolator.
+/**
+ * Each phase has SINC_TAPS coefficients, for the input samples from
+ * SINC_TAPS/2-1 before the output position up to SINC_TAPS/2 after it.
+ */
+static const float *sincTable()
+{
+	static const std::vector<float> table = [] {
+		const unsigned int phases = 1 << SINC_PHASE_BITS;
+		std::vector<float> t(phases * SINC_TAPS);
+		for (unsigned int p = 0; p < phases; p++) {
+			double frac = (double)p / phases;
+			double sum = 0;
+			for (unsigned int k = 0; k < SINC_TAPS; k++) {
+				// Distance from the output position to this tap
+				double x = (double)k - (SINC_TAPS / 2 - 1) - frac;
+				double sinc = (x == 0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+				// Blackman window spanning all the taps
+				double n = (x + SINC_TAPS / 2) / SINC_TAPS;
+				double window = 0.42 - 0.5 * cos(2 * M_PI * n)
+					+ 0.08 * cos(4 * M_PI * n);
+				t[p * SINC_TAPS + k] = sinc * window;
+				sum += sinc * window;
+			}
+			// Normalise so a constant input gives the same constant output
+			for (unsigned int k = 0; k < SINC_TAPS; k++) {
+				t[p * SINC_TAPS + k] /= sum;
+			}
+		}
+		return t;
+	}();
+	return table.data();
+}
+
+/// Calculate the output sample at a position between two input samples.
+/**
+ * @c before and @c after are the number of input samples read either side of
+ * the one at or before the output position, not counting that sample.
+ */
+template <SynthPCM::Interpolation I>
+struct Interpolator;
+
+template <>
+struct Interpolator<SynthPCM::Interpolation::Nearest>
+{
+	static const unsigned long before = 0, after = 1;
+
+	template <class R>
+	static inline int32_t get(const R& in, long i, uint32_t frac)
+	{
+		return in(i + (frac >> 31));
+	}
+};
+
+template <>
+struct Interpolator<SynthPCM::Interpolation::Linear>
+{
+	static const unsigned long before = 0, after = 1;
+
+	template <class R>
+	static inline int32_t get(const R& in, long i, uint32_t frac)
+	{
+		int32_t a = in(i);
+		return a + (int32_t)(((int64_t)(in(i + 1) - a) * (frac >> 16)) >> 16);
+	}
+};
+
+template <>
+struct Interpolator<SynthPCM::Interpolation::Cubic>
+{
+	static const unsigned long before = 1, after = 2;
+
+	template <class R>
+	static inline int32_t get(const R& in, long i, uint32_t frac)
+	{
+		float t = frac * (1.0f / 4294967296.0f);
+		float p0 = in(i - 1), p1 = in(i), p2 = in(i + 1), p3 = in(i + 2);
+		return p1 + 0.5f * t * ((p2 - p0)
+			+ t * ((2 * p0 - 5 * p1 + 4 * p2 - p3)
+			+ t * (3 * (p1 - p2) + p3 - p0)));
+	}
+};
+
+template <>
+struct Interpolator<SynthPCM::Interpolation::Sinc>
+{
+	static const unsigned long before = SINC_TAPS / 2 - 1, after = SINC_TAPS / 2;
+
+	template <class R>
+	static inline int32_t get(const R& in, long i, uint32_t frac)
+	{
+		const float *coef = sincTable()
+			+ (frac >> (32 - SINC_PHASE_BITS)) * SINC_TAPS;
+		i -= before;
+		float v = 0;
+		for (unsigned int k = 0; k < SINC_TAPS; k++) v += coef[k] * in(i + k);
+		return v;
+	}
+};
+
+/// Resample a run of samples without checking for the end of the data.
+template <class Interp, class R>
+static inline void renderRun(const R& in, int16_t *out, unsigned long len,
+	uint64_t *pos, uint64_t step, int32_t gain)
+{
+	uint64_t p = *pos;
+	for (unsigned long j = 0; j < len; j++) {
+		int32_t s = (Interp::get(in, p >> 32, (uint32_t)p) * gain) >> 16;
+		*out++ = s;
+		*out++ = s;
+		p += step;
+	}
+	*pos = p;
+	return;
+}
+
+/// Resample a note into a stereo buffer.
+/**
+ * The output is split into runs, one for each pass through the note, so the
+ * position only has to be checked against the loop once per run rather than
+ * once per sample.  The guard samples in PCMDecoded let the filter read past
+ * either end of a pass without any checks.
+ *
+ * @param len
+ *   Number of stereo frames to generate.
+ *
+ * @param pos
+ *   Position in the input, as 32.32 fixed point.  Updated on return.
+ *
+ * @param looped
+ *   True if the note has already gone back to the start of the loop.
+ *   Updated on return.
+ *
+ * @param step
+ *   Amount to advance \a pos for each output frame.
+ *
+ * @param gain
+ *   Volume, as 16.16 fixed point.
+ *
+ * @return Number of frames generated.  This is less than \a len if the end of
+ *   a sample without a loop was reached.
+ */
+template <SynthPCM::Interpolation I>
+static unsigned long renderBlocks(const PCMDecoded& pcm, int16_t *out,
+	unsigned long len, uint64_t *pos, bool *looped, uint64_t step, int32_t gain)
+{
+	typedef Interpolator<I> Interp;
+	static_assert((Interp::before <= PCMDecoded::GUARD)
+		&& (Interp::after <= PCMDecoded::GUARD),
+		"Interpolation filter reads past the PCM guard samples");
+
+	uint64_t p = *pos;
+	unsigned long done = 0;
+	while (done < len) {
+		unsigned long i = p >> 32;
+		if (i >= pcm.end) {
+			if (!pcm.loopLen) break; // note has finished
+			i = pcm.loopStart + (i - pcm.end) % pcm.loopLen;
+			p = ((uint64_t)i << 32) | (uint32_t)p;
+			*looped = true;
+		}
+
+		// Number of output samples before the position reaches the end
+		unsigned long n = len - done;
+		if (step) {
+			uint64_t steps = (((uint64_t)pcm.end << 32) - p + step - 1) / step;
+			if (steps < n) n = steps;
+		}
+
+		// Positions within the loop copy are relative to the loop start
+		uint64_t offset = *looped ? (uint64_t)pcm.loopStart << 32 : 0;
+		PassReader in{*looped ? pcm.loop : pcm.first};
+		uint64_t passPos = p - offset;
+		renderRun<Interp>(in, out, n, &passPos, step, gain);
+		p = passPos + offset;
+
+		out += n * 2;
+		done += n;
+	}
+	*pos = p;
+	return done;
+}
+
+/// Signature of renderBlocks().
+typedef unsigned long (*RenderFunction)(const PCMDecoded& pcm, int16_t *out,
+	unsigned long len, uint64_t *pos, bool *looped, uint64_t step, int32_t gain);
+
 SynthPCM::SynthPCM(unsigned long sampleRate, SynthPCMCallback *cb)
 	:	outputSampleRate(sampleRate),
-		cb(cb)
+		cb(cb),
+		interpolation(Interpolation::Linear),
+		numVoices(0),
+		voiceBuffer(VOICE_BUFFER_SIZE)
 {
 }
 
@@ -48,89 +259,186 @@ SynthPCM::~SynthPCM()
 void SynthPCM::setBankMIDI(std::shared_ptr<const PatchBank> bankMIDI)
 {
 	this->bankMIDI = bankMIDI;
+	this->numVoices = 0;
+	for (auto& v : this->trackVoice) v = -1;
+	this->decodePatches(bankMIDI, &this->decodedMIDI);
+	return;
+}
+
+void SynthPCM::setInterpolation(Interpolation mode)
+{
+	this->interpolation = mode;
 	return;
 }
 
 void SynthPCM::reset(const std::vector<TrackInfo>& trackInfo,
 	std::shared_ptr<const PatchBank> patches)
 {
-	this->trackInfo = trackInfo;
-	this->patches = patches;
+	Setup setup;
+	SynthPCM::prepare(trackInfo, patches, this->bankMIDI, &setup);
+	this->reset(setup);
+	return;
+}
+
+void SynthPCM::prepare(const std::vector<TrackInfo>& trackInfo,
+	std::shared_ptr<const PatchBank> patches,
+	std::shared_ptr<const PatchBank> bankMIDI, SynthPCM::Setup *setup)
+{
+	setup->trackInfo = trackInfo;
+	setup->patches = patches;
+	setup->bankMIDI = bankMIDI;
+
+	// There is only ever one note per track, so this is as many as can play
+	setup->voices.clear();
+	setup->voices.resize(trackInfo.size());
+	setup->trackVoice.assign(trackInfo.size(), -1);
+
+	SynthPCM::decodePatches(patches, &setup->decoded);
+	SynthPCM::decodePatches(bankMIDI, &setup->decodedMIDI);
+	return;
+}
+
+void SynthPCM::reset(SynthPCM::Setup& setup)
+{
+	this->trackInfo.swap(setup.trackInfo);
+	this->patches.swap(setup.patches);
+	this->bankMIDI.swap(setup.bankMIDI);
+	this->decoded.swap(setup.decoded);
+	this->decodedMIDI.swap(setup.decodedMIDI);
+	this->voices.swap(setup.voices);
+	this->trackVoice.swap(setup.trackVoice);
+	this->numVoices = 0;
+	return;
+}
+
+void SynthPCM::updatePatches()
+{
+	SynthPCM::decodeNewPatches(this->patches, &this->decoded);
+	SynthPCM::decodeNewPatches(this->bankMIDI, &this->decodedMIDI);
 	return;
 }
 
 void SynthPCM::mix(int16_t *output, unsigned long len)
 {
-	len /= 2; // stereo
-	// TODO: Lock mutex
-	for (auto
-		i = this->activeSamples.begin(); i != this->activeSamples.end(); /* i++ */
-	) {
-		auto& sample = *i;
-		auto *output_cur = output;
+	for (unsigned int v = 0; v < this->numVoices; /* v++ */) {
 		bool complete = false;
-		auto& data = sample.patch->data;
-		if (data.size() == 0) { i++; continue; }
-		unsigned long lenInput = sample.patch->loopEnd ? sample.patch->loopEnd : data.size();
-		unsigned long numOutputSamples = lenInput * ((double)this->outputSampleRate / (double)sample.sampleRate);
-		for (unsigned long j = 0; j < len; j++) {
-
-			// Check if we have reached the end of the sample
-			if (sample.pos >= numOutputSamples) {
-				// We have, so either loop if the sample supports this or silence it
-				if (sample.patch->loopEnd) {
-					sample.pos = sample.patch->loopStart;
-					if (sample.patch->bitDepth == 16) sample.pos *= 2;
-					sample.pos = sample.pos * this->outputSampleRate / sample.sampleRate;
-					if (sample.pos >= numOutputSamples) {
-						std::cout << "synth-pcm: Silencing instrument with loop start "
-							"beyond end of sample\n";
-						complete = true;
-						break;
-					}
-				} else {
-					complete = true;
-					break;
-				}
-			}
-			unsigned long posInput = lenInput * sample.pos / numOutputSamples;
-			assert(posInput < lenInput);
-			uint8_t *in = &data[posInput];
-
-			int16_t s;
-			if (sample.patch->bitDepth == 8) {
-				// Convert from 8-bit unsigned to 16-bit signed
-				s = pcm_u8_to_s16(*in);
-				sample.pos++;
-			} else if (sample.patch->bitDepth == 16) {
-				s = *((int16_t *)in);
-				sample.pos += 2;
-			} else {
-				std::cerr << "synth-pcm: Unsupported playback bit depth: "
-					<< sample.patch->bitDepth << "\n";
-				complete = true;
-				break;
-			}
-
-			// Volume adjustment
-			assert(sample.vol < 256);
-			s = (s * (int32_t)sample.vol / 255) / VOL_DAMPEN;
+		// Render the note in pieces no larger than voiceBuffer
+		for (unsigned long done = 0; (done < len) && !complete; ) {
+			unsigned long lenVoice = this->renderVoice(this->voices[v],
+				std::min(len - done, (unsigned long)VOICE_BUFFER_SIZE), &complete);
+			// Mix whatever this note produced into the output
+			pcm_mix_s16_block(output + done, this->voiceBuffer.data(), lenVoice);
+			done += lenVoice;
+		}
+		if (complete) {
+			// Another voice is moved into this slot, so process it next
+			this->removeVoice(v);
+		} else {
+			v++;
+		}
+	}
+	return;
+}
 
-			*output_cur = pcm_mix_s16(*output_cur, s);
-			output_cur++;
-			*output_cur = pcm_mix_s16(*output_cur, s);
-			output_cur++;
+void SynthPCM::mix(int32_t *output, unsigned long len)
+{
+	for (unsigned int v = 0; v < this->numVoices; /* v++ */) {
+		bool complete = false;
+		for (unsigned long done = 0; (done < len) && !complete; ) {
+			unsigned long lenVoice = this->renderVoice(this->voices[v],
+				std::min(len - done, (unsigned long)VOICE_BUFFER_SIZE), &complete);
+			// Add whatever this note produced to the mix bus
+			const int16_t *voice = this->voiceBuffer.data();
+			int32_t *bus = output + done;
+			for (unsigned long j = 0; j < lenVoice; j++) bus[j] += voice[j];
+			done += lenVoice;
 		}
 		if (complete) {
-			i = this->activeSamples.erase(i);
+			this->removeVoice(v);
 		} else {
-			i++;
+			v++;
 		}
-		// TODO: Release mutex
 	}
 	return;
 }
 
+void SynthPCM::skip(unsigned long len)
+{
+	len /= 2; // stereo
+	for (unsigned int v = 0; v < this->numVoices; /* v++ */) {
+		Sample& sample = this->voices[v];
+		const PCMDecoded& pcm = *sample.pcm;
+		// Same step as renderVoice(), so the position ends up identical
+		uint64_t step = ((uint64_t)sample.sampleRate << 32) / this->outputSampleRate;
+		uint64_t p = sample.pos + step * len;
+		unsigned long i = p >> 32;
+		if (i >= pcm.end) {
+			if (!pcm.loopLen) {
+				// The note would have finished somewhere in here
+				this->removeVoice(v);
+				continue;
+			}
+			i = pcm.loopStart + (i - pcm.end) % pcm.loopLen;
+			p = ((uint64_t)i << 32) | (uint32_t)p;
+			sample.looped = true;
+		}
+		sample.pos = p;
+		v++;
+	}
+	return;
+}
+
+void SynthPCM::saveState(State *state) const
+{
+	state->voices.assign(this->voices.begin(),
+		this->voices.begin() + this->numVoices);
+	return;
+}
+
+void SynthPCM::restoreState(const State& state)
+{
+	assert(state.voices.size() <= this->voices.size());
+	std::fill(this->trackVoice.begin(), this->trackVoice.end(), -1);
+	this->numVoices = state.voices.size();
+	for (unsigned int v = 0; v < this->numVoices; v++) {
+		this->voices[v] = state.voices[v];
+		this->trackVoice[this->voices[v].track] = v;
+	}
+	return;
+}
+
+unsigned long SynthPCM::renderVoice(Sample& sample, unsigned long len,
+	bool *complete)
+{
+	len /= 2; // stereo
+	assert(len * 2 <= this->voiceBuffer.size());
+
+	// Fold the note and overall volume into one 16.16 multiplier
+	assert(sample.vol < 256);
+	int32_t gain = (sample.vol << 16) / (255 * VOL_DAMPEN);
+	uint64_t step = ((uint64_t)sample.sampleRate << 32) / this->outputSampleRate;
+
+	RenderFunction render;
+	switch (this->interpolation) {
+		case Interpolation::Nearest:
+			render = renderBlocks<Interpolation::Nearest>;
+			break;
+		case Interpolation::Cubic:
+			render = renderBlocks<Interpolation::Cubic>;
+			break;
+		case Interpolation::Sinc:
+			render = renderBlocks<Interpolation::Sinc>;
+			break;
+		default:
+			render = renderBlocks<Interpolation::Linear>;
+			break;
+	}
+	unsigned long lenVoice = render(*sample.pcm, this->voiceBuffer.data(), len,
+		&sample.pos, &sample.looped, step, gain);
+	*complete = lenVoice < len;
+	return lenVoice * 2;
+}
+
 void SynthPCM::endOfTrack(unsigned long delay)
 {
 	return;
@@ -161,7 +469,11 @@ bool SynthPCM::handleEvent(unsigned long delay, unsigned int trackIndex,
 			<< " but patch bank only has " << this->patches->size()
 			<< " instruments."));
 	}
-	auto patch = this->patches->at(ev->instrument);
+	const Patch *patch = (*this->patches)[ev->instrument].get();
+	const PCMDecoded *pcm = NULL;
+	if (ev->instrument < this->decoded.size()) {
+		pcm = this->decoded[ev->instrument].get();
+	}
 
 	auto& ti = this->trackInfo.at(trackIndex);
 	if (this->bankMIDI) {
@@ -173,14 +485,18 @@ bool SynthPCM::handleEvent(unsigned long delay, unsigned int trackIndex,
 			// Not a MIDI track
 			return true;
 		}
-		auto instMIDI = dynamic_cast<MIDIPatch*>(patch.get());
+		auto instMIDI = dynamic_cast<const MIDIPatch*>(patch);
 		if (!instMIDI) return true; // non-MIDI instrument on a MIDI channel, ignore
 		unsigned long target = instMIDI->midiPatch;
 		if (instMIDI->percussion) {
 			target += MIDI_PATCHES;
 		}
 		if (target < this->bankMIDI->size()) {
-			patch = this->bankMIDI->at(target);
+			patch = (*this->bankMIDI)[target].get();
+			pcm = NULL;
+			if (target < this->decodedMIDI.size()) {
+				pcm = this->decodedMIDI[target].get();
+			}
 		} else {
 			// No patch, bank too small
 			return true;
@@ -195,26 +511,36 @@ bool SynthPCM::handleEvent(unsigned long delay, unsigned int trackIndex,
 			return true;
 		}
 	}
-	auto inst = std::dynamic_pointer_cast<PCMPatch>(patch);
+	auto inst = dynamic_cast<const PCMPatch*>(patch);
 
 	// Don't play this note if there's no patch for it
 	if (!inst) return true;
 
-	this->noteOff(trackIndex);
+	// The patch was added to the bank after reset() and hasn't been decoded
+	// by updatePatches() yet.  Decoding it here would allocate memory on the
+	// audio thread, so the note is skipped instead.
+	if (!pcm) return true;
 
-	Sample n;
+	// Reuse the track's voice if it's already playing a note, which cuts it off
+	int v = this->trackVoice[trackIndex];
+	if (v < 0) {
+		v = this->numVoices++;
+		this->trackVoice[trackIndex] = v;
+	}
+
+	Sample& n = this->voices[v];
 	n.track = trackIndex;
 	n.sampleRate = inst->sampleRate * ((double)ev->milliHertz / (double)FREQ_MIDDLE_C);
 	n.patch = inst;
+	n.pcm = pcm;
 	n.pos = 0;
+	n.looped = false;
 	if (ev->velocity < 0) {
 		// Use default velocity
 		n.vol = inst->defaultVolume;
 	} else {
 		n.vol = ev->velocity;
 	}
-
-	this->activeSamples.push_back(n);
 	return true;
 }
 
@@ -228,16 +554,10 @@ bool SynthPCM::handleEvent(unsigned long delay, unsigned int trackIndex,
 bool SynthPCM::handleEvent(unsigned long delay, unsigned int trackIndex,
 	unsigned int patternIndex, const EffectEvent *ev)
 {
-	// TODO: Lock mutex
-	Sample *activeSample = NULL;
-	for (auto& sample : this->activeSamples) {
-		if (sample.track == trackIndex) {
-			activeSample = &sample;
-			break;
-		}
-	}
-	// TODO: Release mutex
-	if (!activeSample) return true; // no note to affect
+	assert(trackIndex < this->trackVoice.size());
+	int v = this->trackVoice[trackIndex];
+	if (v < 0) return true; // no note to affect
+	Sample *activeSample = &this->voices[v];
 
 	switch (ev->type) {
 		case EffectEvent::Type::PitchbendNote:
@@ -265,14 +585,43 @@ bool SynthPCM::handleEvent(unsigned long delay, unsigned int trackIndex,
 
 void SynthPCM::noteOff(unsigned int trackIndex)
 {
-	for (auto i = this->activeSamples.begin(); i != this->activeSamples.end(); /* i++ */
-	) {
-		Sample& sample = *i;
-		if (sample.track == trackIndex) {
-			i = this->activeSamples.erase(i);
-		} else {
-			i++;
-		}
+	assert(trackIndex < this->trackVoice.size());
+	int v = this->trackVoice[trackIndex];
+	if (v >= 0) this->removeVoice(v);
+	return;
+}
+
+void SynthPCM::removeVoice(unsigned int v)
+{
+	assert(v < this->numVoices);
+	this->trackVoice[this->voices[v].track] = -1;
+	unsigned int last = --this->numVoices;
+	if (v != last) {
+		// Move the last voice into the gap
+		this->voices[v] = this->voices[last];
+		this->trackVoice[this->voices[v].track] = v;
+	}
+	return;
+}
+
+void SynthPCM::decodePatches(std::shared_ptr<const PatchBank> bank,
+	std::vector<std::shared_ptr<const PCMDecoded>> *decoded)
+{
+	decoded->clear();
+	SynthPCM::decodeNewPatches(bank, decoded);
+	return;
+}
+
+void SynthPCM::decodeNewPatches(std::shared_ptr<const PatchBank> bank,
+	std::vector<std::shared_ptr<const PCMDecoded>> *decoded)
+{
+	if (!bank) return;
+	// Existing entries are left alone, as notes may be playing from them
+	decoded->resize(std::max(decoded->size(), bank->size()));
+	for (unsigned int i = 0; i < bank->size(); i++) {
+		if ((*decoded)[i]) continue;
+		auto pcmPatch = dynamic_cast<const PCMPatch*>((*bank)[i].get());
+		if (pcmPatch) (*decoded)[i] = pcmPatch->getDecoded();
 	}
 	return;
 }
@@ -73,195 +73,240 @@ bool PolyphonicEffectEvent::processEvent(unsigned long delay,
 	return handler->handleEvent(delay, trackIndex, patternIndex, this);
 }
 
+/// One monophonic voice that notes from a polyphonic track are assigned to.
+struct SplitVoice
+{
+	Track track;               ///< Events given to this voice in the current pattern
+	unsigned long lastTime;    ///< Time of the last event in track
+	unsigned long curNoteFreq; ///< Note currently playing, 0 if none
+	double curBend;            ///< Current pitchbend in semitones
+};
+
+/// A PolyphonicEffectEvent, and when it happened within the pattern.
+typedef std::pair<unsigned long, const PolyphonicEffectEvent *> PolyEffectTime;
+
+/// Add an event to the end of a voice's track.
+static void addToVoice(SplitVoice& voice, unsigned long time,
+	std::shared_ptr<Event> ev)
+{
+	TrackEvent te;
+	te.delay = time - voice.lastTime;
+	te.event = ev;
+	voice.track.push_back(te);
+	voice.lastTime = time;
+	return;
+}
+
+/// Convert a polyphonic effect into a normal one for a single voice.
+static void applyPolyEffect(SplitVoice& voice, unsigned long time,
+	const PolyphonicEffectEvent& ev)
+{
+	switch ((PolyphonicEffectEvent::Type)ev.type) {
+		case PolyphonicEffectEvent::Type::PitchbendChannel:
+			voice.curBend = midiPitchbendToSemitones(ev.data);
+
+			// Create a normal pitchbend if there is a note currently playing
+			if (voice.curNoteFreq) {
+				auto evEffect = std::make_shared<EffectEvent>();
+				evEffect->type = EffectEvent::Type::PitchbendNote;
+				double targetNote = voice.curBend + freqToMIDI(voice.curNoteFreq);
+				evEffect->data = midiToFreq(targetNote);
+				addToVoice(voice, time, evEffect);
+			}
+			break;
+
+		case PolyphonicEffectEvent::Type::VolumeChannel: {
+			// Just convert the event to a normal volume change
+			auto evEffect = std::make_shared<EffectEvent>();
+			evEffect->type = EffectEvent::Type::Volume;
+			evEffect->data = ev.data;
+			addToVoice(voice, time, evEffect);
+			break;
+		}
+	}
+	return;
+}
+
+/// Give an event to a voice, if it is the right one to handle it.
+/**
+ * @return true if the event should also be offered to the next voice.
+ */
+static bool assignEvent(SplitVoice& voice, unsigned long time,
+	const std::shared_ptr<Event>& event)
+{
+	NoteOnEvent *evNoteOn = dynamic_cast<NoteOnEvent *>(event.get());
+	if (evNoteOn) {
+		// If a note is already playing, this one needs another voice
+		if (voice.curNoteFreq) return true;
+
+		// No note is playing, record this one
+		voice.curNoteFreq = evNoteOn->milliHertz;
+		if (voice.curBend != 0) {
+			// Convert the milliHertz value for this note back to a semitone
+			// number, add the pitchbend (in semitones), then convert back
+			// to a frequency.
+			double targetNote = voice.curBend + freqToMIDI(evNoteOn->milliHertz);
+			evNoteOn->milliHertz = midiToFreq(targetNote);
+		}
+		addToVoice(voice, time, event);
+		return false;
+	}
+
+	SpecificNoteOffEvent *evSpecNoteOff =
+		dynamic_cast<SpecificNoteOffEvent *>(event.get());
+	if (evSpecNoteOff) {
+		// Might be a note off for a note on a later voice
+		if (evSpecNoteOff->milliHertz != voice.curNoteFreq) return true;
+
+		// This is a note-off for the current note, replace the specific
+		// note-off event with a normal track-wide note-off.
+		addToVoice(voice, time, std::make_shared<NoteOffEvent>());
+		voice.curNoteFreq = 0;
+		return false;
+	}
+
+	SpecificNoteEffectEvent *evSpecNoteEffect =
+		dynamic_cast<SpecificNoteEffectEvent *>(event.get());
+	if (evSpecNoteEffect) {
+		// Might be an effect for a note on a later voice
+		if (evSpecNoteEffect->milliHertz != voice.curNoteFreq) return true;
+
+		// This is an effect for the current note, replace the specific
+		// effect event with a normal track-wide effect.
+		auto evEffect = std::make_shared<EffectEvent>();
+		*evEffect = *evSpecNoteEffect;
+		addToVoice(voice, time, evEffect);
+		voice.curNoteFreq = 0;
+		return false;
+	}
+
+	NoteOffEvent *evNoteOff = dynamic_cast<NoteOffEvent *>(event.get());
+	if (evNoteOff) {
+		// This is a channel-wide note off, so take note there is no longer
+		// a note playing.
+		voice.curNoteFreq = 0;
+		addToVoice(voice, time, event);
+		return false;
+	}
+
+	PolyphonicEffectEvent *evPolyEffect =
+		dynamic_cast<PolyphonicEffectEvent *>(event.get());
+	if (evPolyEffect) {
+		applyPolyEffect(voice, time, *evPolyEffect);
+		// Pass the polyphonic event on to the other voices in case they have
+		// notes playing too.
+		return true;
+	}
+
+	// Any other event just stays on the first voice
+	addToVoice(voice, time, event);
+	return false;
+}
+
 void camoto::gamemusic::splitPolyphonicTracks(Music& music)
 {
+	unsigned int numTracks = music.trackInfo.size();
+
+	// The voices for each of the original tracks.  These carry on from one
+	// pattern into the next, so that notes held across the end of a pattern
+	// stay on the same voice.
+	std::vector<std::vector<SplitVoice> > voices(numTracks);
+	for (auto& tv : voices) tv.push_back(SplitVoice{Track(), 0, 0, 0});
+
+	// Pitchbend on each original track at the start of the current pattern,
+	// for any new voices.
+	std::vector<double> startBend(numTracks, 0);
+
+	// The split tracks for each voice, for each original track in each pattern
+	std::vector<std::vector<std::vector<Track> > > split(music.patterns.size());
+
 	unsigned int patternIndex = 0;
 	// For each pattern
 	for (auto& pattern : music.patterns) {
-
-		if (patternIndex > 0) {
-			throw format_limitation("splitPolyphonicTracks() can't yet work with multipattern data");
-			// TODO: If this ever comes up, the way trackInfo is handled will need to
-			// be changed so it doesn't get duplicated for every single pattern,
-			// ending up with dozens more instances than we are supposed to have.
-			// Maybe instead, run through each track one by one, across all patterns?
-		}
+		assert(pattern.size() == numTracks);
+		split[patternIndex].resize(numTracks);
 
 		// For each track
-		unsigned long trackIndex = 0;
-		for (auto pt = pattern.begin(); pt != pattern.end(); trackIndex++) {
-			assert(pattern.size() == music.trackInfo.size());
-
-			Track main;
-			Track overflow;
-			bool movedNotes = false; // did we move any notes to the overflow track?
-			unsigned long curNoteFreq = 0;
-			unsigned long delayMain = 0, delayOverflow = 0;
-			double curBend = 0; // current pitchbend in semitones
-			for (auto& te : *pt) {
-				delayMain += te.delay;
-				delayOverflow += te.delay;
-
-				NoteOnEvent *evNoteOn = dynamic_cast<NoteOnEvent *>(te.event.get());
-				if (evNoteOn) {
-					if (curNoteFreq) {
-						// Note is currently playing, move this event to a new channel
-						te.delay = delayOverflow;
-						delayOverflow = 0;
-						overflow.push_back(te);
-						movedNotes = true;
-					} else {
-						// No note is playing, record this one
-						curNoteFreq = evNoteOn->milliHertz;
-						te.delay = delayMain;
-						delayMain = 0;
-
-						if (curBend != 0) {
-							// Convert the milliHertz value for this note back to a semitone
-							// number, add the pitchbend (in semitones), then convert back
-							// to a frequency.
-							double targetNote = curBend + freqToMIDI(evNoteOn->milliHertz);
-							evNoteOn->milliHertz = midiToFreq(targetNote);
-						}
-
-						main.push_back(te);
-					}
-					continue;
-				}
+		for (unsigned int trackIndex = 0; trackIndex < numTracks; trackIndex++) {
+			auto& tv = voices[trackIndex];
+			for (auto& v : tv) {
+				v.track.clear();
+				v.lastTime = 0;
+			}
 
-				SpecificNoteOffEvent *evSpecNoteOff =
-					dynamic_cast<SpecificNoteOffEvent *>(te.event.get());
-				if (evSpecNoteOff) {
-					if (evSpecNoteOff->milliHertz == curNoteFreq) {
-						// This is a note-off for the current note, replace the specific
-						// note-off event with a normal track-wide note-off.
-						te.delay = delayMain;
-						delayMain = 0;
-						NoteOffEvent *evNoteOff = new NoteOffEvent();
-						te.event.reset(evNoteOff);
-						main.push_back(te);
-						curNoteFreq = 0;
-					} else {
-						// Might be a note off for one of the overflow notes, move it
-						te.delay = delayOverflow;
-						delayOverflow = 0;
-						overflow.push_back(te);
-						// movedNotes is only set for note-on events
-					}
-					continue;
-				}
+			// Every polyphonic effect so far, so that new voices start off with the
+			// same volume and pitchbend as the others.
+			std::vector<PolyEffectTime> polyEffects;
 
-				SpecificNoteEffectEvent *evSpecNoteEffect =
-					dynamic_cast<SpecificNoteEffectEvent *>(te.event.get());
-				if (evSpecNoteEffect) {
-					if (evSpecNoteEffect->milliHertz == curNoteFreq) {
-						// This is an effect for the current note, replace the specific
-						// effect event with a normal track-wide effect.
-						te.delay = delayMain;
-						delayMain = 0;
-						EffectEvent *evEffect = new EffectEvent();
-						*evEffect = *evSpecNoteEffect;
-						te.event.reset(evEffect);
-						main.push_back(te);
-						curNoteFreq = 0;
-					} else {
-						// Might be an effect for one of the overflow notes, move it
-						te.delay = delayOverflow;
-						delayOverflow = 0;
-						overflow.push_back(te);
-						// movedNotes is only set for note-on events
-					}
-					continue;
-				}
+			unsigned long time = 0;
+			for (auto& te : pattern[trackIndex]) {
+				time += te.delay;
 
-				NoteOffEvent *evNoteOff =
-					dynamic_cast<NoteOffEvent *>(te.event.get());
-				if (evNoteOff) {
-					// This is a channel-wide note off, so take note there is no longer
-					// a note playing.
-					curNoteFreq = 0;
-
-					// Leave on main channel
-					te.delay = delayMain;
-					delayMain = 0;
-					main.push_back(te);
-					continue;
-				}
+				// Offer the event to each voice in turn until one keeps it
+				unsigned int v = 0;
+				while (assignEvent(tv[v], time, te.event)) {
+					v++;
+					if (v < tv.size()) continue;
 
-				PolyphonicEffectEvent *evPolyEffect =
-					dynamic_cast<PolyphonicEffectEvent *>(te.event.get());
-				if (evPolyEffect) {
-					switch ((PolyphonicEffectEvent::Type)evPolyEffect->type) {
-						case PolyphonicEffectEvent::Type::PitchbendChannel:
-							curBend = midiPitchbendToSemitones(evPolyEffect->data);
-
-							// Create a normal pitchbend if there is a note currently playing
-							if (curNoteFreq) {
-								auto evEffect = std::make_shared<EffectEvent>();
-								evEffect->type = EffectEvent::Type::PitchbendNote;
-								double targetNote = curBend + freqToMIDI(curNoteFreq);
-								evEffect->data = midiToFreq(targetNote);
-
-								TrackEvent teCopy;
-								teCopy.delay = delayMain;
-								teCopy.event = evEffect;
-								delayMain = 0;
-								main.push_back(teCopy);
-							}
-							break;
-
-						case PolyphonicEffectEvent::Type::VolumeChannel:
-							// Just convert the event to a normal volume change
-							auto evEffect = std::make_shared<EffectEvent>();
-							evEffect->type = EffectEvent::Type::Volume;
-							evEffect->data = evPolyEffect->data;
-
-							TrackEvent teCopy;
-							teCopy.delay = delayMain;
-							delayMain = 0;
-							teCopy.event = evEffect;
-							main.push_back(teCopy);
-							break;
+					// Every voice has passed the event on.  Only a note needs a new
+					// voice, anything else (such as a note-off for a note that isn't
+					// playing) is dropped.
+					if (!dynamic_cast<NoteOnEvent *>(te.event.get())) break;
+					tv.push_back(SplitVoice{Track(), 0, 0, startBend[trackIndex]});
+					for (auto& pe : polyEffects) {
+						applyPolyEffect(tv.back(), pe.first, *pe.second);
 					}
-					// Move the polyphonic event onto the overflow channel in case there
-					// are other notes playing.  (If not, no harm done).
-					te.delay = delayOverflow;
-					delayOverflow = 0;
-					overflow.push_back(te);
-
-					// Don't want these events added to the main channel below
-					continue;
 				}
 
-				// Any other event is just left on the main channel
-				te.delay = delayMain;
-				delayMain = 0;
-				main.push_back(te);
+				auto evPolyEffect =
+					dynamic_cast<const PolyphonicEffectEvent *>(te.event.get());
+				if (evPolyEffect) {
+					polyEffects.emplace_back(time, evPolyEffect);
+				}
 			} // for (each event on the track)
 
-			// Remove the track we have just processed, and replace it with the main
-			// one we've just generated.
-			std::swap(*pt, main);
-
-			if (movedNotes) {
-				// Notes were moved to the overflow track, so we need to process that
-				// too.  Insert the overflow track after the current one so that it
-				// will be processed in the next loop iteration.
-				pt = pattern.insert(pt + 1, overflow);
-
-				// Duplicate the TrackInfo structure too
-				assert(trackIndex < music.trackInfo.size());
-				music.trackInfo.insert(music.trackInfo.begin() + trackIndex + 1,
-					music.trackInfo[trackIndex]);
-			} else {
-				// No inserted track, check the next one
-				pt++;
+			// Pitchbend carries on into the next pattern
+			for (auto& pe : polyEffects) {
+				auto type = (PolyphonicEffectEvent::Type)pe.second->type;
+				if (type == PolyphonicEffectEvent::Type::PitchbendChannel) {
+					startBend[trackIndex] = midiPitchbendToSemitones(pe.second->data);
+				}
 			}
 
+			auto& out = split[patternIndex][trackIndex];
+			out.reserve(tv.size());
+			for (auto& v : tv) out.push_back(std::move(v.track));
+
 		} // for (each track in the pattern)
 		patternIndex++;
 	} // for (each pattern)
 
+	// Replace each track with one track per voice, duplicating its TrackInfo.
+	// All patterns need the same tracks, so any voices that weren't needed
+	// until a later pattern get an empty track in the earlier ones.
+	std::vector<TrackInfo> trackInfo;
+	for (unsigned int trackIndex = 0; trackIndex < numTracks; trackIndex++) {
+		trackInfo.insert(trackInfo.end(), voices[trackIndex].size(),
+			music.trackInfo[trackIndex]);
+	}
+	patternIndex = 0;
+	for (auto& pattern : music.patterns) {
+		pattern.clear();
+		pattern.reserve(trackInfo.size());
+		for (unsigned int trackIndex = 0; trackIndex < numTracks; trackIndex++) {
+			auto& out = split[patternIndex][trackIndex];
+			for (unsigned int v = 0; v < voices[trackIndex].size(); v++) {
+				if (v < out.size()) {
+					pattern.push_back(std::move(out[v]));
+				} else {
+					pattern.emplace_back();
+				}
+			}
+		}
+		patternIndex++;
+	}
+	music.trackInfo = std::move(trackInfo);
+
 	// Remember to duplicate pitchbend events on a track if needed by notes
 	// Remove any unused tracks
 	return;
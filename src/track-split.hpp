@@ -69,6 +69,12 @@ struct CAMOTO_GAMEMUSIC_API PolyphonicEffectEvent: virtual public EffectEvent
 /**
  * Run through all tracks in the song and move any polyphonic notes onto
  * separate tracks so that only monophonic tracks exist upon return.
+ *
+ * Each note is given to the first of the track's voices that has no note
+ * playing, in a single pass over the events, and each voice becomes a new
+ * track straight after the original one.  Songs with multiple patterns give
+ * every pattern the same number of voices for each track, and voices carry
+ * on from one pattern into the next in pattern number order.
  */
 void CAMOTO_GAMEMUSIC_API splitPolyphonicTracks(Music& music);
 
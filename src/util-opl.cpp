@@ -23,6 +23,7 @@
 #include <camoto/util.hpp> // make_unique
 #include <camoto/gamemusic/util-opl.hpp>
 #include <camoto/gamemusic/patch-opl.hpp>
+#include "patch-index.hpp"
 
 #define log2(x) (log(x) / 0.30102999566398119521373889472449)
 
@@ -120,7 +121,7 @@ struct Purpose {
 };
 
 void mapInstrument(std::vector<Purpose>& instPurpose, OPLPatch::Rhythm rhythm,
-	unsigned int *inst, std::shared_ptr<PatchBank>& patches)
+	unsigned int *inst, std::shared_ptr<PatchBank>& patches, PatchIndex& copies)
 {
 	auto& p = instPurpose[*inst];
 	unsigned int rhythm_int = (unsigned int)rhythm;
@@ -142,7 +143,14 @@ void mapInstrument(std::vector<Purpose>& instPurpose, OPLPatch::Rhythm rhythm,
 			auto oplPatch = dynamic_cast<OPLPatch*>(patches->at(*inst).get());
 			auto copy = std::make_shared<OPLPatch>(*oplPatch);
 			copy->rhythm = rhythm;
-			// Update the original to map here, but only in this rhythm mode
+			// Update the original to map here, but only in this rhythm mode.  If an
+			// identical copy has already been made for another instrument, share it.
+			int existing = copies.find(*patches, *copy);
+			if (existing >= 0) {
+				*inst = existing;
+				p.map[rhythm_int] = *inst;
+				return;
+			}
 			*inst = patches->size();
 			p.map[rhythm_int] = *inst;
 			patches->push_back(copy);
@@ -173,6 +181,10 @@ void oplDenormalisePerc(Music& music, OPLNormaliseType method)
 		for (unsigned int n = 0; n < 6; n++) p.map[n] = -1;
 		instPurpose.push_back(p);
 	}
+	// Only index the copies made below, as the originals can still have their
+	// rhythm type changed when they are first used.
+	PatchIndex copies(music.patches->size());
+
 	// For each pattern
 	unsigned int patternIndex = 0;
 	for (auto& pattern : music.patterns) {
@@ -198,7 +210,8 @@ void oplDenormalisePerc(Music& music, OPLNormaliseType method)
 					rhythm = (OPLPatch::Rhythm)(ti.channelIndex + 1);
 				}
 				if (rhythm >= OPLPatch::Rhythm::Melodic) {
-					mapInstrument(instPurpose, rhythm, &ev->instrument, music.patches);
+					mapInstrument(instPurpose, rhythm, &ev->instrument, music.patches,
+						copies);
 				}
 			}
 			trackIndex++;
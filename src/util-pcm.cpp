@@ -0,0 +1,232 @@
+/**
+ * @file  util-pcm.cpp
+ * @brief Block PCM mixing and mix bus conversion.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <camoto/gamemusic/util-pcm.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PCM_MIX_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PCM_MIX_NEON
+#include <arm_neon.h>
+#endif
+
+using namespace camoto::gamemusic;
+
+/*
+ * All the vector versions below work the same way as pcm_mix_s16().  The
+ * samples are offset to 0..65535 and the 32-bit product a*b/32768 is
+ * calculated.  When both samples were negative this is the result, otherwise
+ * it is 2*(a+b) - a*b/32768 - 65536.  The result (0..65536) is then moved
+ * back to a signed value, with the saturating pack taking care of clipping
+ * 65536 down to 65535.
+ */
+
+typedef void (*pcm_mix_block_fn)(int16_t *dest, const int16_t *src,
+	unsigned long len);
+
+static void pcm_mix_s16_block_scalar(int16_t *dest, const int16_t *src,
+	unsigned long len)
+{
+	for (unsigned long i = 0; i < len; i++) {
+		dest[i] = pcm_mix_s16(dest[i], src[i]);
+	}
+	return;
+}
+
+#ifdef PCM_MIX_X86
+__attribute__((target("sse2")))
+static void pcm_mix_s16_block_sse2(int16_t *dest, const int16_t *src,
+	unsigned long len)
+{
+	const __m128i bias = _mm_set1_epi16((short)0x8000);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi32(65536);
+	const __m128i centre = _mm_set1_epi32(32768);
+
+	unsigned long i = 0;
+	for (; i + 8 <= len; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(dest + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i au = _mm_xor_si128(a, bias);
+		__m128i bu = _mm_xor_si128(b, bias);
+
+		// a * b / 32768
+		__m128i mulLo = _mm_mullo_epi16(au, bu);
+		__m128i mulHi = _mm_mulhi_epu16(au, bu);
+		__m128i p0 = _mm_srli_epi32(_mm_unpacklo_epi16(mulLo, mulHi), 15);
+		__m128i p1 = _mm_srli_epi32(_mm_unpackhi_epi16(mulLo, mulHi), 15);
+
+		// 2 * (a + b) - a * b / 32768 - 65536
+		__m128i s0 = _mm_add_epi32(_mm_unpacklo_epi16(au, zero),
+			_mm_unpacklo_epi16(bu, zero));
+		__m128i s1 = _mm_add_epi32(_mm_unpackhi_epi16(au, zero),
+			_mm_unpackhi_epi16(bu, zero));
+		s0 = _mm_sub_epi32(_mm_sub_epi32(_mm_slli_epi32(s0, 1), p0), full);
+		s1 = _mm_sub_epi32(_mm_sub_epi32(_mm_slli_epi32(s1, 1), p1), full);
+
+		// Pick the first formula where both samples are negative
+		__m128i neg = _mm_srai_epi16(_mm_and_si128(a, b), 15);
+		__m128i neg0 = _mm_unpacklo_epi16(neg, neg);
+		__m128i neg1 = _mm_unpackhi_epi16(neg, neg);
+		__m128i m0 = _mm_or_si128(_mm_and_si128(neg0, p0),
+			_mm_andnot_si128(neg0, s0));
+		__m128i m1 = _mm_or_si128(_mm_and_si128(neg1, p1),
+			_mm_andnot_si128(neg1, s1));
+
+		__m128i r = _mm_packs_epi32(_mm_sub_epi32(m0, centre),
+			_mm_sub_epi32(m1, centre));
+		_mm_storeu_si128((__m128i *)(dest + i), r);
+	}
+	pcm_mix_s16_block_scalar(dest + i, src + i, len - i);
+	return;
+}
+
+__attribute__((target("avx2")))
+static void pcm_mix_s16_block_avx2(int16_t *dest, const int16_t *src,
+	unsigned long len)
+{
+	const __m256i bias = _mm256_set1_epi16((short)0x8000);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i full = _mm256_set1_epi32(65536);
+	const __m256i centre = _mm256_set1_epi32(32768);
+
+	// The unpack and pack instructions work within each 128-bit half, so the
+	// samples end up back in their original order.
+	unsigned long i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(dest + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i au = _mm256_xor_si256(a, bias);
+		__m256i bu = _mm256_xor_si256(b, bias);
+
+		__m256i mulLo = _mm256_mullo_epi16(au, bu);
+		__m256i mulHi = _mm256_mulhi_epu16(au, bu);
+		__m256i p0 = _mm256_srli_epi32(_mm256_unpacklo_epi16(mulLo, mulHi), 15);
+		__m256i p1 = _mm256_srli_epi32(_mm256_unpackhi_epi16(mulLo, mulHi), 15);
+
+		__m256i s0 = _mm256_add_epi32(_mm256_unpacklo_epi16(au, zero),
+			_mm256_unpacklo_epi16(bu, zero));
+		__m256i s1 = _mm256_add_epi32(_mm256_unpackhi_epi16(au, zero),
+			_mm256_unpackhi_epi16(bu, zero));
+		s0 = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_slli_epi32(s0, 1), p0), full);
+		s1 = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_slli_epi32(s1, 1), p1), full);
+
+		__m256i neg = _mm256_srai_epi16(_mm256_and_si256(a, b), 15);
+		__m256i m0 = _mm256_blendv_epi8(s0, p0, _mm256_unpacklo_epi16(neg, neg));
+		__m256i m1 = _mm256_blendv_epi8(s1, p1, _mm256_unpackhi_epi16(neg, neg));
+
+		__m256i r = _mm256_packs_epi32(_mm256_sub_epi32(m0, centre),
+			_mm256_sub_epi32(m1, centre));
+		_mm256_storeu_si256((__m256i *)(dest + i), r);
+	}
+	pcm_mix_s16_block_sse2(dest + i, src + i, len - i);
+	return;
+}
+#endif // PCM_MIX_X86
+
+#ifdef PCM_MIX_NEON
+static void pcm_mix_s16_block_neon(int16_t *dest, const int16_t *src,
+	unsigned long len)
+{
+	const uint16x8_t bias = vdupq_n_u16(0x8000);
+	const uint32x4_t full = vdupq_n_u32(65536);
+	const int32x4_t centre = vdupq_n_s32(32768);
+
+	unsigned long i = 0;
+	for (; i + 8 <= len; i += 8) {
+		int16x8_t a = vld1q_s16(dest + i);
+		int16x8_t b = vld1q_s16(src + i);
+		uint16x8_t au = veorq_u16(vreinterpretq_u16_s16(a), bias);
+		uint16x8_t bu = veorq_u16(vreinterpretq_u16_s16(b), bias);
+
+		uint32x4_t p0 = vshrq_n_u32(vmull_u16(vget_low_u16(au), vget_low_u16(bu)), 15);
+		uint32x4_t p1 = vshrq_n_u32(vmull_u16(vget_high_u16(au), vget_high_u16(bu)), 15);
+
+		uint32x4_t s0 = vaddl_u16(vget_low_u16(au), vget_low_u16(bu));
+		uint32x4_t s1 = vaddl_u16(vget_high_u16(au), vget_high_u16(bu));
+		s0 = vsubq_u32(vsubq_u32(vshlq_n_u32(s0, 1), p0), full);
+		s1 = vsubq_u32(vsubq_u32(vshlq_n_u32(s1, 1), p1), full);
+
+		int16x8_t neg = vshrq_n_s16(vandq_s16(a, b), 15);
+		uint32x4_t neg0 = vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(neg)));
+		uint32x4_t neg1 = vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(neg)));
+		uint32x4_t m0 = vbslq_u32(neg0, p0, s0);
+		uint32x4_t m1 = vbslq_u32(neg1, p1, s1);
+
+		int16x4_t r0 = vqmovn_s32(vsubq_s32(vreinterpretq_s32_u32(m0), centre));
+		int16x4_t r1 = vqmovn_s32(vsubq_s32(vreinterpretq_s32_u32(m1), centre));
+		vst1q_s16(dest + i, vcombine_s16(r0, r1));
+	}
+	pcm_mix_s16_block_scalar(dest + i, src + i, len - i);
+	return;
+}
+#endif // PCM_MIX_NEON
+
+/// Pick the fastest implementation the CPU supports.
+static pcm_mix_block_fn pcm_mix_s16_block_select()
+{
+#ifdef PCM_MIX_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return pcm_mix_s16_block_avx2;
+	if (__builtin_cpu_supports("sse2")) return pcm_mix_s16_block_sse2;
+#endif
+#ifdef PCM_MIX_NEON
+	return pcm_mix_s16_block_neon;
+#endif
+	return pcm_mix_s16_block_scalar;
+}
+
+void camoto::gamemusic::pcm_mix_s16_block(int16_t *dest, const int16_t *src,
+	unsigned long len)
+{
+	static const pcm_mix_block_fn mix = pcm_mix_s16_block_select();
+	mix(dest, src, len);
+	return;
+}
+
+void camoto::gamemusic::pcm_add_bus_s16_block(int16_t *dest,
+	const int32_t *src, unsigned long len)
+{
+	for (unsigned long i = 0; i < len; i++) {
+		int32_t s = dest[i] + src[i];
+		dest[i] = s > 32767 ? 32767 : (s < -32768 ? -32768 : s);
+	}
+	return;
+}
+
+void camoto::gamemusic::pcm_add_bus_s32_block(int32_t *dest,
+	const int32_t *src, unsigned long len)
+{
+	for (unsigned long i = 0; i < len; i++) {
+		int64_t s = (int64_t)dest[i] + ((int64_t)src[i] << 16);
+		dest[i] = s > INT32_MAX ? INT32_MAX : (s < INT32_MIN ? INT32_MIN : s);
+	}
+	return;
+}
+
+void camoto::gamemusic::pcm_add_bus_f32_block(float *dest,
+	const int32_t *src, unsigned long len)
+{
+	for (unsigned long i = 0; i < len; i++) {
+		dest[i] += src[i] * (1.0f / 32768.0f);
+	}
+	return;
+}
@@ -0,0 +1,119 @@
+/**
+ * @file   test-autodetect.cpp
+ * @brief  Test code for working out which format a file is in.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+
+#include <camoto/stream_string.hpp>
+#include <camoto/gamemusic/autodetect.hpp>
+#include "tests.hpp"
+
+using namespace camoto;
+using namespace camoto::gamemusic;
+
+/// Stream that counts how many times it is read from.
+class string_counted: public stream::string
+{
+	public:
+		string_counted(const std::string& content)
+			:	stream::string(content),
+				reads(0)
+		{
+		}
+
+		virtual stream::len try_read(uint8_t *buffer, stream::len len)
+		{
+			this->reads++;
+			return this->stream::string::try_read(buffer, len);
+		}
+
+		unsigned int reads;
+};
+
+BOOST_AUTO_TEST_SUITE(autodetect)
+
+BOOST_AUTO_TEST_CASE(signature)
+{
+	BOOST_TEST_MESSAGE("Testing autodetection of a file with a signature");
+
+	string_counted content(STRING_WITH_NULLS(
+		"RAWADATA" "\x50\x08"
+		"\x20\xa0" "\x32\xb0" "\x10\x00" "\x12\xb0"
+		"\xff\xff"
+	));
+	auto matches = detectFormat(content, "SONG.RAW");
+	BOOST_REQUIRE(!matches.empty());
+	BOOST_CHECK_EQUAL(matches[0].type->code(), "raw-rdos");
+	BOOST_CHECK_EQUAL(matches[0].certainty, MusicType::Certainty::DefinitelyYes);
+
+	// The file is only read once, whichever formats were probed
+	BOOST_CHECK_EQUAL(content.reads, 1);
+
+	// Stopped at the first definite match, which was tried first
+	BOOST_CHECK_EQUAL(matches.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(ranked)
+{
+	BOOST_TEST_MESSAGE("Testing autodetection results are ranked");
+
+	// Valid Type-0 IMF data, which the other IMF variants may also accept
+	std::string data = STRING_WITH_NULLS(
+		"\x00\x00\x00\x00"
+		"\x20\xff\x00\x00"
+		"\xa0\x44\x00\x00"
+		"\xb0\x32\x10\x00"
+		"\xb0\x12\x00\x00"
+	);
+	for (auto filename : {"song.imf", "song.wlf", "song", ""}) {
+		BOOST_TEST_CHECKPOINT("Detecting " << filename);
+		stream::string content(data);
+		auto matches = detectFormat(content, filename, true);
+		BOOST_REQUIRE(!matches.empty());
+		for (unsigned int i = 1; i < matches.size(); i++) {
+			BOOST_CHECK_GE(matches[i - 1].certainty, matches[i].certainty);
+			BOOST_CHECK(matches[i].certainty != MusicType::Certainty::DefinitelyNo);
+		}
+	}
+
+	// An extension match comes before an equally certain format that doesn't
+	stream::string content(data);
+	auto imf = detectFormat(content, "song.imf", true);
+	auto wlf = detectFormat(content, "SONG.WLF", true);
+	BOOST_REQUIRE_EQUAL(imf.size(), wlf.size());
+	BOOST_REQUIRE_EQUAL(imf[0].certainty, wlf[0].certainty);
+	BOOST_CHECK_EQUAL(imf[0].type->fileExtensions()[0], "imf");
+	BOOST_CHECK_EQUAL(wlf[0].type->fileExtensions()[0], "wlf");
+}
+
+BOOST_AUTO_TEST_CASE(unknown)
+{
+	BOOST_TEST_MESSAGE("Testing autodetection of an unknown file");
+
+	stream::string content(STRING_WITH_NULLS(
+		"\xde\xad\xbe\xef\xde\xad\xbe\xef\xde\xad\xbe"
+	));
+	auto matches = detectFormat(content, "song.dro", true);
+	for (const auto& m : matches) {
+		BOOST_CHECK_MESSAGE(m.certainty != MusicType::Certainty::DefinitelyYes,
+			"Junk detected as " << m.type->code());
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,273 @@
+/**
+ * @file   test-decode-opl.cpp
+ * @brief  Test code for converting OPL register data into events.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+
+#include <camoto/gamemusic.hpp>
+#include <camoto/gamemusic/playback.hpp>
+#include <camoto/stream_string.hpp>
+#include "../src/decode-opl.hpp"
+#include "tests.hpp"
+
+using namespace camoto;
+using namespace camoto::gamemusic;
+
+/// Supply OPL data from a list of reg/val pairs.
+class OPLReaderCallback_List: virtual public OPLReaderCallback
+{
+	public:
+		OPLReaderCallback_List(const std::vector<OPLEvent>& events)
+			:	events(events),
+				next(0),
+				reads(0)
+		{
+		}
+
+		virtual bool readNextPair(OPLEvent *oplEvent)
+		{
+			this->reads++;
+			if (this->next >= this->events.size()) {
+				// Trailing delay
+				oplEvent->valid = OPLEvent::Delay;
+				oplEvent->delay = 25;
+				return false;
+			}
+			auto& ev = this->events[this->next++];
+			oplEvent->valid = ev.valid;
+			oplEvent->delay = ev.delay;
+			oplEvent->chipIndex = ev.chipIndex;
+			oplEvent->reg = ev.reg;
+			oplEvent->val = ev.val;
+			return true;
+		}
+
+		const std::vector<OPLEvent>& events;
+		unsigned int next;  ///< Index of next event to return
+		unsigned int reads; ///< Number of calls to readNextPair()
+};
+
+/// Create some OPL data with notes, pitchbends and volume changes on a few
+/// channels, including a long gap and notes held for a long time.
+static std::vector<OPLEvent> createOPLData()
+{
+	std::vector<OPLEvent> events;
+	auto add = [&events](unsigned long delay, uint8_t reg, uint8_t val) {
+		OPLEvent ev;
+		ev.valid = OPLEvent::Delay | OPLEvent::Regs;
+		ev.delay = delay;
+		ev.chipIndex = 0;
+		ev.reg = reg;
+		ev.val = val;
+		events.push_back(ev);
+	};
+
+	add(0, 0x01, 0x20);
+	for (unsigned int i = 0; i < 60; i++) {
+		unsigned int c = i % 3;
+		unsigned int op = OPLOFFSET_MOD(c);
+		// Instrument, changing a little each time
+		add(0, BASE_CHAR_MULT | op, 0x21);
+		add(0, BASE_CHAR_MULT | (op + 3), 0x01 + (i % 4));
+		add(0, BASE_SCAL_LEVL | op, 0x10);
+		add(0, BASE_SCAL_LEVL | (op + 3), 0x00);
+		add(0, BASE_ATCK_DCAY | op, 0xF2);
+		add(0, BASE_ATCK_DCAY | (op + 3), 0xF3);
+		add(0, BASE_SUST_RLSE | op, 0x77);
+		add(0, BASE_SUST_RLSE | (op + 3), 0x75);
+		add(0, BASE_FEED_CONN | c, 0x04);
+		// Note on
+		add(0, 0xA0 | c, 0x98 + i);
+		add((i * 7) % 11, 0xB0 | c, 0x31);
+		// Volume change and pitchbend while the note is playing
+		add((i % 5) + 1, BASE_SCAL_LEVL | (op + 3), 0x08);
+		add(i == 30 ? 90 : 3, 0xA0 | c, 0xA0 + i);
+		// Note off, some straight away and some later
+		if (i % 4 != 1) add((i * 3) % 7, 0xB0 | c, 0x11);
+	}
+	return events;
+}
+
+/// Render a song one frame at a time, decoding more as needed.
+static std::vector<int16_t> renderStream(std::shared_ptr<const Music> music,
+	OPLStreamDecoder *decoder, unsigned long maxSamples)
+{
+	Playback playback(44100, 2, 16);
+	playback.setSong(music);
+	std::vector<int16_t> audio;
+	Playback::Position pos;
+	pos.order = 0;
+	do {
+		if (decoder) {
+			// Keep one pattern ahead of playback, and drop the ones already played
+			while (music->patternOrder.size() < pos.order + 2) {
+				if (!decoder->decodePattern()) break;
+			}
+			decoder->discardPatterns(pos.order);
+		}
+		playback.mixFrame(&audio, &pos);
+	} while (!pos.end && (audio.size() < maxSamples));
+	// The last block can run past the end of a shorter song
+	if (audio.size() > maxSamples) audio.resize(maxSamples);
+	return audio;
+}
+
+BOOST_AUTO_TEST_SUITE(decode_opl)
+
+BOOST_AUTO_TEST_CASE(stream_matches_full)
+{
+	BOOST_TEST_MESSAGE("Testing streamed OPL decoding sounds the same as full");
+
+	auto events = createOPLData();
+	Tempo tempo;
+	tempo.usPerTick = 1000;
+
+	for (auto delayType : {DelayType::DelayIsPreData, DelayType::DelayIsPostData}) {
+		OPLReaderCallback_List cbFull(events);
+		std::shared_ptr<Music> full = oplDecode(&cbFull, delayType,
+			OPL_FNUM_DEFAULT, tempo);
+		BOOST_REQUIRE_EQUAL(full->patterns.size(), 1);
+		auto expected = renderStream(full, NULL, -1);
+
+		for (unsigned long ticksPerPattern : {1, 7, 64}) {
+			BOOST_TEST_CHECKPOINT("Decoding with " << ticksPerPattern
+				<< " ticks per pattern");
+			OPLReaderCallback_List cb(events);
+			auto music = std::make_shared<Music>();
+			OPLStreamDecoder decoder(&cb, delayType, OPL_FNUM_DEFAULT, tempo,
+				music.get(), ticksPerPattern);
+			BOOST_REQUIRE(decoder.decodePattern());
+
+			// Only the data for the first pattern should have been read
+			BOOST_CHECK_LT(cb.reads, events.size() / 4);
+
+			auto actual = renderStream(music, &decoder, expected.size());
+			BOOST_REQUIRE_EQUAL(actual.size(), expected.size());
+			BOOST_CHECK_MESSAGE(actual == expected, "Streamed audio with "
+				<< ticksPerPattern << " ticks per pattern differs");
+
+			// Everything has now been decoded, padded to a whole pattern
+			BOOST_CHECK(!decoder.decodePattern());
+			BOOST_CHECK_EQUAL(music->patterns.size(),
+				(full->ticksPerTrack + ticksPerPattern - 1) / ticksPerPattern);
+			BOOST_CHECK_EQUAL(music->patches->size(), full->patches->size());
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(playback_stream)
+{
+	BOOST_TEST_MESSAGE("Testing playback of an IMF file as it is decoded");
+
+	// About ten seconds of notes at 560Hz, so the stream has several patterns
+	std::string imf;
+	auto add = [&imf](uint8_t reg, uint8_t val, uint16_t delay) {
+		imf += (char)reg;
+		imf += (char)val;
+		imf += (char)(delay & 0xFF);
+		imf += (char)(delay >> 8);
+	};
+	add(0x20, 0x01, 0);
+	add(0x23, 0x01, 0);
+	add(0x43, 0x00, 0);
+	add(0x60, 0xF4, 0);
+	add(0x63, 0xF4, 0);
+	for (unsigned int i = 0; i < 50; i++) {
+		add(0xA0, 0x60 + i * 3, 0);
+		add(0xB0, 0x31, 80 + (i % 3) * 10);
+		add(0xB0, 0x11, 22);
+	}
+
+	auto type = MusicManager::byCode("imf-idsoftware-type0");
+	BOOST_REQUIRE(type);
+	SuppData suppData;
+
+	stream::string content;
+	content.data = imf;
+	std::shared_ptr<const Music> full = type->read(content, suppData);
+	auto expected = renderStream(full, NULL, -1);
+
+	auto input = std::make_unique<stream::string>();
+	input->data = imf;
+	std::shared_ptr<MusicStream> stream = type->openStream(std::move(input),
+		suppData);
+
+	Playback playback(44100, 2, 16);
+	playback.setStream(stream);
+	auto music = stream->music();
+	BOOST_REQUIRE_GE(music->patterns.size(), 1);
+	BOOST_CHECK_LT(music->patterns.size(), 4);
+
+	std::vector<int16_t> actual;
+	Playback::Position pos;
+	unsigned long maxPatterns = 0;
+	do {
+		playback.mixFrame(&actual, &pos);
+		// Only a couple of patterns past the one playing are ever decoded
+		if (!pos.end) {
+			maxPatterns = std::max(maxPatterns,
+				(unsigned long)music->patterns.size() - pos.order);
+		}
+		BOOST_REQUIRE_LT(actual.size(), expected.size() * 2); // never ended
+	} while (!pos.end);
+
+	BOOST_CHECK_GT(music->patterns.size(), 5);
+	BOOST_CHECK_LE(maxPatterns, 3);
+
+	// Patterns already played have been freed
+	unsigned long events = 0;
+	for (auto& track : music->patterns[0]) events += track.size();
+	BOOST_CHECK_EQUAL(events, 0);
+
+	// The stream is padded to a whole pattern, so compare up to the song's end
+	BOOST_REQUIRE_GE(actual.size(), expected.size());
+	actual.resize(expected.size());
+	BOOST_CHECK_MESSAGE(actual == expected,
+		"Streamed playback sounds different to the fully decoded song");
+}
+
+BOOST_AUTO_TEST_CASE(buffer_chunks)
+{
+	BOOST_TEST_MESSAGE("Testing song data longer than one buffered chunk");
+
+	// Three-byte events, so some are split across the chunks of song data
+	const unsigned long numEvents = 50000;
+	std::string got("\x01\x00", 2);
+	for (unsigned long i = 0; i < numEvents; i++) {
+		got += (char)1; // delay
+		got += (char)(0xA0 + i % 9);
+		got += (char)(i & 0xFF);
+	}
+	got.append(4, '\0');
+
+	auto type = MusicManager::byCode("got");
+	BOOST_REQUIRE(type);
+	SuppData suppData;
+	stream::string content;
+	content.data = got;
+
+	auto summary = type->probe(content, suppData);
+	BOOST_CHECK_EQUAL(summary.eventCount, numEvents);
+
+	// Every pair must reach the decoder, so the song ends on the last delay
+	auto music = type->read(content, suppData);
+	BOOST_CHECK_EQUAL(music->ticksPerTrack, numEvents);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,215 @@
+/**
+ * @file   test-events-compact.cpp
+ * @brief  Test code for compact event storage.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+
+#include <camoto/gamemusic.hpp>
+#include "tests.hpp"
+
+using namespace camoto;
+using namespace camoto::gamemusic;
+
+/// Handler that records the content of every event passed to it.
+class RecordingHandler: virtual public EventHandler
+{
+	public:
+		std::vector<std::string> events;
+
+		virtual void endOfTrack(unsigned long delay)
+		{
+		}
+
+		virtual void endOfPattern(unsigned long delay)
+		{
+		}
+
+		virtual bool handleEvent(unsigned long delay, unsigned int trackIndex,
+			unsigned int patternIndex, const TempoEvent *ev)
+		{
+			return this->record(delay, ev);
+		}
+
+		virtual bool handleEvent(unsigned long delay, unsigned int trackIndex,
+			unsigned int patternIndex, const NoteOnEvent *ev)
+		{
+			return this->record(delay, ev);
+		}
+
+		virtual bool handleEvent(unsigned long delay, unsigned int trackIndex,
+			unsigned int patternIndex, const NoteOffEvent *ev)
+		{
+			return this->record(delay, ev);
+		}
+
+		virtual bool handleEvent(unsigned long delay, unsigned int trackIndex,
+			unsigned int patternIndex, const EffectEvent *ev)
+		{
+			return this->record(delay, ev);
+		}
+
+		virtual bool handleEvent(unsigned long delay, unsigned int trackIndex,
+			unsigned int patternIndex, const GotoEvent *ev)
+		{
+			return this->record(delay, ev);
+		}
+
+		virtual bool handleEvent(unsigned long delay, unsigned int trackIndex,
+			unsigned int patternIndex, const ConfigurationEvent *ev)
+		{
+			return this->record(delay, ev);
+		}
+
+	protected:
+		bool record(unsigned long delay, const Event *ev)
+		{
+			this->events.push_back(createString(delay << ":" << ev->getContent()));
+			return true;
+		}
+};
+
+/// Event with an extra field, like those used while splitting tracks.
+struct DerivedNoteOffEvent: virtual public NoteOffEvent
+{
+	unsigned int milliHertz;
+};
+
+/// Create a track with one of each event type.
+static Track createTrack()
+{
+	Track track;
+	TrackEvent te;
+
+	auto tempo = std::make_shared<TempoEvent>();
+	tempo->tempo.module(3, 150);
+	te.delay = 0;
+	te.event = tempo;
+	track.push_back(te);
+
+	auto noteOn = std::make_shared<NoteOnEvent>();
+	noteOn->instrument = 2;
+	noteOn->milliHertz = 440000;
+	noteOn->velocity = DefaultVelocity;
+	te.delay = 5;
+	te.event = noteOn;
+	track.push_back(te);
+
+	auto effect = std::make_shared<EffectEvent>();
+	effect->type = EffectEvent::Type::Volume;
+	effect->data = 128;
+	te.delay = 1;
+	te.event = effect;
+	track.push_back(te);
+
+	te.delay = 10;
+	te.event = std::make_shared<NoteOffEvent>();
+	track.push_back(te);
+
+	auto config = std::make_shared<ConfigurationEvent>();
+	config->configType = ConfigurationEvent::Type::EnableRhythm;
+	config->value = 1;
+	te.delay = 0;
+	te.event = config;
+	track.push_back(te);
+
+	auto jump = std::make_shared<GotoEvent>();
+	jump->type = GotoEvent::Type::SpecificOrder;
+	jump->repeat = 2;
+	jump->targetOrder = 1;
+	jump->targetRow = 4;
+	te.delay = 3;
+	te.event = jump;
+	track.push_back(te);
+
+	return track;
+}
+
+BOOST_AUTO_TEST_SUITE(events_compact)
+
+BOOST_AUTO_TEST_CASE(roundtrip)
+{
+	BOOST_TEST_MESSAGE("Testing conversion to and from compact events");
+
+	auto track = createTrack();
+	auto compact = compactTrack(track);
+	BOOST_REQUIRE_EQUAL(compact.size(), track.size());
+
+	auto expanded = expandTrack(compact);
+	BOOST_REQUIRE_EQUAL(expanded.size(), track.size());
+	for (unsigned int i = 0; i < track.size(); i++) {
+		BOOST_CHECK_EQUAL(expanded[i].delay, track[i].delay);
+		BOOST_CHECK_EQUAL(expanded[i].event->getContent(),
+			track[i].event->getContent());
+		BOOST_CHECK_EQUAL(compact[i].event.getContent(),
+			track[i].event->getContent());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(dispatch)
+{
+	BOOST_TEST_MESSAGE("Testing compact events reach the same handlers");
+
+	auto track = createTrack();
+	auto compact = compactTrack(track);
+
+	RecordingHandler expected, actual;
+	for (auto& te : track) {
+		te.event->processEvent(te.delay, 0, 0, &expected);
+	}
+	for (auto& cte : compact) {
+		cte.event.processEvent(cte.delay, 0, 0, &actual);
+	}
+	BOOST_CHECK_EQUAL_COLLECTIONS(actual.events.begin(), actual.events.end(),
+		expected.events.begin(), expected.events.end());
+}
+
+BOOST_AUTO_TEST_CASE(expand_shared_block)
+{
+	BOOST_TEST_MESSAGE("Testing expanded events share one allocation per track");
+
+	auto track = createTrack();
+	auto expanded = expandTrack(compactTrack(track));
+	BOOST_REQUIRE_EQUAL(expanded.size(), track.size());
+	BOOST_CHECK_EQUAL(expanded[0].event.use_count(), track.size());
+
+	// An event lasts as long as anything refers to it
+	auto noteOn = std::dynamic_pointer_cast<NoteOnEvent>(expanded[1].event);
+	BOOST_REQUIRE(noteOn);
+	expanded.clear();
+	BOOST_CHECK_EQUAL(noteOn->instrument, 2);
+	BOOST_CHECK_EQUAL(noteOn->milliHertz, 440000);
+}
+
+BOOST_AUTO_TEST_CASE(reject_derived)
+{
+	BOOST_TEST_MESSAGE("Testing derived events are not stored as their base type");
+
+	DerivedNoteOffEvent ev;
+	ev.milliHertz = 440000;
+	BOOST_CHECK_THROW(compactEvent(ev), format_limitation);
+
+	auto track = createTrack();
+	TrackEvent te;
+	te.delay = 0;
+	te.event = std::make_shared<DerivedNoteOffEvent>();
+	track.push_back(te);
+	BOOST_CHECK_THROW(compactTrack(track), format_limitation);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
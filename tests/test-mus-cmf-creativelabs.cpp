@@ -30,6 +30,8 @@ class test_cmf_creativelabs: public test_music
 			this->indexInstrumentOPL = 0;
 			this->indexInstrumentMIDI = -1;
 			this->indexInstrumentPCM = -1;
+			this->writingSequential = true;
+			this->probeEvents = 22;
 
 			{
 				this->attributes.emplace_back();
@@ -30,6 +30,7 @@ class test_dro_dosbox_v1: public test_music
 			this->indexInstrumentOPL = 0;
 			this->indexInstrumentMIDI = -1;
 			this->indexInstrumentPCM = -1;
+			this->writingSequential = true;
 		}
 
 		void addTests()
@@ -30,6 +30,8 @@ class test_dro_dosbox_v2: public test_music
 			this->indexInstrumentOPL = 0;
 			this->indexInstrumentMIDI = -1;
 			this->indexInstrumentPCM = -1;
+			this->writingSequential = true;
+			this->probeEvents = 77;
 		}
 
 		void addTests()
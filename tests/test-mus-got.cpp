@@ -30,6 +30,7 @@ class test_mus_got: public test_music
 			this->indexInstrumentOPL = 0;
 			this->indexInstrumentMIDI = -1;
 			this->indexInstrumentPCM = -1;
+			this->probeEvents = 14;
 		}
 
 		void addTests()
@@ -30,6 +30,8 @@ class test_imf_idsoftware_type1: public test_music
 			this->indexInstrumentOPL = 0;
 			this->indexInstrumentMIDI = -1;
 			this->indexInstrumentPCM = -1;
+			this->writingSequential = true;
+			this->probeEvents = 16;
 			this->skipInstDetect.push_back("wlf-idsoftware-type1");
 		}
 
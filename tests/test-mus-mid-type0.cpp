@@ -30,6 +30,8 @@ class test_mid_type0: public test_music
 			this->indexInstrumentOPL = -1;
 			this->indexInstrumentMIDI = 0;
 			this->indexInstrumentPCM = -1;
+			this->writingSequential = true;
+			this->probeEvents = 5;
 		}
 
 		void addTests()
@@ -30,6 +30,8 @@ class test_mus_dmx: public test_music
 			this->indexInstrumentOPL = -1;
 			this->indexInstrumentMIDI = 0;
 			this->indexInstrumentPCM = -1;
+			this->writingSequential = true;
+			this->probeEvents = 7;
 			this->skipInstDetect.push_back("mus-dmx-raptor");
 		}
 
@@ -30,6 +30,7 @@ class test_raw_rdos: public test_music
 			this->indexInstrumentOPL = 0;
 			this->indexInstrumentMIDI = -1;
 			this->indexInstrumentPCM = -1;
+			this->probeEvents = 64;
 		}
 
 		void addTests()
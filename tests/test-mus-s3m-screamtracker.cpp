@@ -31,6 +31,7 @@ class test_s3m_screamtracker: public test_music
 			this->indexInstrumentOPL = 1;
 			this->indexInstrumentMIDI = -1;
 			this->indexInstrumentPCM = 0;
+			this->probeEvents = 5;
 
 			{
 				this->attributes.emplace_back();
@@ -186,6 +186,8 @@ test_music::test_music()
 	this->dumpEvents = false;
 
 	this->writingSupported = true;
+	this->writingSequential = false;
+	this->probeEvents = MusicSummary::Unknown;
 }
 
 void test_music::addTests()
@@ -195,9 +197,13 @@ void test_music::addTests()
 	ADD_MUSIC_TEST(&test_music::test_isinstance_others);
 	ADD_MUSIC_TEST(&test_music::test_isinstance_empty);
 	ADD_MUSIC_TEST(&test_music::test_read);
+	ADD_MUSIC_TEST(&test_music::test_probe);
 
 	if (this->writingSupported) {
 		ADD_MUSIC_TEST(&test_music::test_write);
+		if (this->writingSequential) {
+			ADD_MUSIC_TEST(&test_music::test_write_sequential);
+		}
 	} else {
 		std::cerr << "WARNING: Format " << this->type
 			<< " does not support writing, skipping write test." << std::endl;
@@ -619,6 +625,48 @@ void test_music::test_read()
 	BOOST_REQUIRE_EQUAL(music->patches->size(), this->numInstruments);
 }
 
+void test_music::test_probe()
+{
+	BOOST_TEST_MESSAGE(this->basename << ": Probe music file");
+
+	auto summary = this->pType->probe(this->base, this->suppData);
+
+	// The base class version reads the whole song, so nothing is Unknown
+	auto expected = this->pType->MusicType::probe(this->base, this->suppData);
+
+	BOOST_CHECK_EQUAL(summary.attributes.size(), expected.attributes.size());
+	for (unsigned int i = 0; i < summary.attributes.size(); i++) {
+		if (i >= expected.attributes.size()) break;
+		BOOST_CHECK_EQUAL(summary.attributes[i].name, expected.attributes[i].name);
+		BOOST_CHECK_EQUAL(summary.attributes[i].textValue,
+			expected.attributes[i].textValue);
+	}
+	if (!summary.trackInfo.empty()) {
+		BOOST_REQUIRE_EQUAL(summary.trackInfo.size(), expected.trackInfo.size());
+		for (unsigned int i = 0; i < summary.trackInfo.size(); i++) {
+			BOOST_CHECK_EQUAL((int)summary.trackInfo[i].channelType,
+				(int)expected.trackInfo[i].channelType);
+			BOOST_CHECK_EQUAL(summary.trackInfo[i].channelIndex,
+				expected.trackInfo[i].channelIndex);
+		}
+	}
+	BOOST_CHECK_EQUAL(summary.patternCount, expected.patternCount);
+	BOOST_CHECK_EQUAL(summary.orderCount, expected.orderCount);
+	if (this->probeEvents != MusicSummary::Unknown) {
+		BOOST_CHECK_EQUAL(summary.eventCount, this->probeEvents);
+	} else if (summary.eventCount != MusicSummary::Unknown) {
+		BOOST_CHECK_EQUAL(summary.eventCount, expected.eventCount);
+	}
+	if (summary.instrumentCount != MusicSummary::Unknown) {
+		BOOST_CHECK_EQUAL(summary.instrumentCount, expected.instrumentCount);
+	}
+	if (summary.msLength != MusicSummary::Unknown) {
+		// Allow for rounding when the decoder converts delays into ticks
+		BOOST_CHECK_LE(summary.msLength, expected.msLength + 1);
+		BOOST_CHECK_GE(summary.msLength + 1, expected.msLength);
+	}
+}
+
 void test_music::test_write()
 {
 	BOOST_TEST_MESSAGE("Write music file");
@@ -636,6 +684,49 @@ void test_music::test_write()
 	BOOST_REQUIRE(this->is_content_equal(this->standard()));
 }
 
+/// Stream that fails if it is seeked or truncated, and counts the writes.
+class string_sequential: public stream::string
+{
+	public:
+		string_sequential()
+			:	writes(0)
+		{
+		}
+
+		virtual stream::len try_write(const uint8_t *buffer, stream::len len)
+		{
+			this->writes++;
+			return this->stream::string::try_write(buffer, len);
+		}
+
+		virtual void seekp(stream::delta off, stream::seek_from from)
+		{
+			throw stream::seek_error("Attempted to seek a sequential stream");
+		}
+
+		virtual void truncate(stream::len size)
+		{
+			throw stream::write_error("Attempted to truncate a sequential stream");
+		}
+
+		unsigned int writes;
+};
+
+void test_music::test_write_sequential()
+{
+	BOOST_TEST_MESSAGE("Write music file without seeking");
+
+	auto music = this->pType->read(this->base, this->suppData);
+
+	string_sequential out;
+	this->pType->write(out, this->suppData, *music,
+		this->writeFlags | MusicType::WriteFlags::NoTruncate);
+
+	BOOST_CHECK_EQUAL(out.writes, 1);
+	this->base.data = out.data;
+	BOOST_REQUIRE(this->is_content_equal(this->standard()));
+}
+
 void test_music::test_attributes()
 {
 	BOOST_TEST_MESSAGE(this->basename << ": Test attributes");
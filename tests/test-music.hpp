@@ -58,8 +58,12 @@ class test_music: public test_main
 		void test_isinstance_others();
 		void test_isinstance_empty();
 		void test_read();
+		/// Compare a cheap probe() against the summary of a full read().
+		void test_probe();
 		/// Write a completely normal file.
 		void test_write();
+		/// Write a normal file to a stream that can't seek.
+		void test_write_sequential();
 		void test_attributes();
 
 	protected:
@@ -279,6 +283,18 @@ class test_music: public test_main
 
 		/// Set to false if the format cannot be written yet (development use only)
 		bool writingSupported;
+
+		/// Set to true if the format is written in a single call, without seeking.
+		bool writingSequential;
+
+		/// Number of events probe() should count in standard().
+		/**
+		 * Formats that override probe() count their own events (register writes,
+		 * MIDI messages, etc.) so set this to the number in standard().  Leave it
+		 * as MusicSummary::Unknown to expect either no count or the same count as
+		 * a full read().
+		 */
+		unsigned long probeEvents;
 };
 
 /// Add a test_music member function to the test suite
@@ -0,0 +1,88 @@
+/**
+ * @file   test-opl-threads.cpp
+ * @brief  Test creating the first OPL synths on several threads at once.
+ *
+ * This is a separate program from the main tests, as the OPL tables are only
+ * created once per process.  Any other test playing a song first would set
+ * them up before the threads start, and the race would never happen.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define BOOST_TEST_MODULE libgamemusic_opl_threads
+#ifndef __WIN32__
+#define BOOST_TEST_DYN_LINK
+#endif
+#include <atomic>
+#include <thread>
+#include <boost/test/unit_test.hpp>
+
+#include <camoto/gamemusic/synth-opl.hpp>
+
+using namespace camoto::gamemusic;
+
+/// Number of samples to render for each note.
+#define NOTE_LEN (441 * 2 * 4)
+
+/// Render a short OPL note with its own synth.
+static std::vector<int16_t> renderOPL(unsigned int block)
+{
+	SynthOPL opl(44100);
+	opl.reset();
+	opl.write(0, 0x20, 0x01);
+	opl.write(0, 0x23, 0x01);
+	opl.write(0, 0x40, 0x10);
+	opl.write(0, 0x43, 0x00);
+	opl.write(0, 0x60, 0xF0);
+	opl.write(0, 0x63, 0xF0);
+	opl.write(0, 0xA0, 0x98);
+	opl.write(0, 0xB0, 0x20 | (block << 2) | 0x01);
+	std::vector<int16_t> output(NOTE_LEN, 0);
+	opl.mix(output.data(), output.size());
+	return output;
+}
+
+BOOST_AUTO_TEST_CASE(parallel_synth_opl)
+{
+	BOOST_TEST_MESSAGE("Testing the first OPL synths created on separate threads");
+
+	// Hold every thread back until they have all started, so the synths are
+	// created as close together as possible.
+	const unsigned int count = 8;
+	std::atomic<unsigned int> ready(0);
+	std::vector<std::vector<int16_t> > actual(count);
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < count; i++) {
+		threads.emplace_back([i, count, &ready, &actual]() {
+			ready++;
+			while (ready < count) std::this_thread::yield();
+			actual[i] = renderOPL(i);
+		});
+	}
+	for (auto& t : threads) t.join();
+
+	// The tables are set up by now, so these are rendered the normal way
+	std::vector<std::vector<int16_t> > expected;
+	for (unsigned int i = 0; i < count; i++) expected.push_back(renderOPL(i));
+
+	for (unsigned int i = 0; i < count; i++) {
+		BOOST_CHECK_MESSAGE(actual[i] == expected[i],
+			"Audio from thread " << i << " differs to audio from a single thread");
+	}
+	// Make sure the notes were audible and different, so the test means something
+	BOOST_CHECK(expected[0] != std::vector<int16_t>(NOTE_LEN, 0));
+	BOOST_CHECK(expected[0] != expected[1]);
+}
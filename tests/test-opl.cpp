@@ -97,3 +97,185 @@ BOOST_AUTO_TEST_CASE(log_volume)
 	BOOST_CHECK_EQUAL(gm::lin_velocity_to_log_volume( 36, 127),  63);
 	BOOST_CHECK_EQUAL(gm::lin_velocity_to_log_volume(255, 127), 127);
 }
+
+/// Record how OPL data arrives from EventConverter_OPL.
+class OPLBatchRecorder: virtual public gm::OPLWriterCallback
+{
+	public:
+		std::vector<gm::OPLEvent> pairs; ///< Every pair received, in order
+		std::vector<size_t> batches;     ///< Size of each writeBatch() call
+
+		virtual void writeNextPair(const gm::OPLEvent *oplEvent)
+		{
+			this->pairs.push_back(*oplEvent);
+			this->batches.push_back(1);
+		}
+
+		virtual void writeBatch(const gm::OPLEvent *oplEvents, size_t count)
+		{
+			this->pairs.insert(this->pairs.end(), oplEvents, oplEvents + count);
+			this->batches.push_back(count);
+		}
+};
+
+BOOST_AUTO_TEST_CASE(write_batch)
+{
+	BOOST_TEST_MESSAGE("Testing OPL data is passed on in batches");
+
+	auto music = std::make_shared<gm::Music>();
+	music->patches = std::make_shared<gm::PatchBank>();
+	auto patch = std::make_shared<gm::OPLPatch>();
+	patch->m.attackRate = 15;
+	patch->c.attackRate = 15;
+	patch->rhythm = gm::OPLPatch::Rhythm::Melodic;
+	music->patches->push_back(patch);
+	gm::TrackInfo ti;
+	ti.channelType = gm::TrackInfo::ChannelType::OPL;
+	ti.channelIndex = 0;
+	music->trackInfo.push_back(ti);
+
+	OPLBatchRecorder rec;
+	gm::EventConverter_OPL conv(&rec, music, gm::OPL_FNUM_DEFAULT,
+		gm::OPLWriteFlags::Default);
+
+	gm::NoteOnEvent noteOn;
+	noteOn.instrument = 0;
+	noteOn.milliHertz = 440000;
+	noteOn.velocity = gm::DefaultVelocity;
+	conv.handleEvent(5, 0, 0, &noteOn);
+	gm::NoteOffEvent noteOff;
+	conv.handleEvent(3, 0, 0, &noteOff);
+
+	// Nothing is written until the queue is flushed
+	BOOST_CHECK(rec.pairs.empty());
+	conv.flush();
+	BOOST_REQUIRE_EQUAL(rec.batches.size(), 1);
+	BOOST_REQUIRE_EQUAL(rec.batches[0], rec.pairs.size());
+	BOOST_REQUIRE_GT(rec.pairs.size(), 3);
+
+	// The delays are kept with the first write after each one
+	BOOST_CHECK_EQUAL(rec.pairs[0].delay, 5);
+	unsigned long totalDelay = 0;
+	for (auto& p : rec.pairs) totalDelay += p.delay;
+	BOOST_CHECK_EQUAL(totalDelay, 5 + 3);
+
+	// The last write is the note-off
+	auto& last = rec.pairs.back();
+	BOOST_CHECK_EQUAL(last.reg, 0xB0);
+	BOOST_CHECK_EQUAL(last.val & OPLBIT_KEYON, 0);
+	BOOST_CHECK_EQUAL(last.delay, 3);
+
+	// Flushing again does nothing
+	conv.flush();
+	BOOST_CHECK_EQUAL(rec.batches.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(voice_allocator)
+{
+	BOOST_TEST_MESSAGE("Testing allocation of OPL channels to MIDI tracks");
+
+	gm::OPLVoiceAllocator voices;
+	voices.setVoiceCount(3);
+	int stolen;
+
+	// Unused channels are handed out in order
+	BOOST_CHECK_EQUAL(voices.noteOn(10, &stolen), 0);
+	BOOST_CHECK_EQUAL(stolen, -1);
+	BOOST_CHECK_EQUAL(voices.noteOn(11), 1);
+	BOOST_CHECK_EQUAL(voices.noteOn(12), 2);
+	BOOST_CHECK_EQUAL(voices.find(11), 1);
+	BOOST_CHECK_EQUAL(voices.find(5), -1);
+
+	// A new note on a busy track keeps its channel
+	BOOST_CHECK_EQUAL(voices.noteOn(10), 0);
+
+	// All busy, so the oldest note (now track 11) is cut off
+	BOOST_CHECK_EQUAL(voices.noteOn(13, &stolen), 1);
+	BOOST_CHECK_EQUAL(stolen, 11);
+	BOOST_CHECK_EQUAL(voices.find(11), -1);
+
+	// Released channels are reused in the order they were released
+	voices.noteOff(12);
+	voices.noteOff(10);
+	voices.noteOff(11); // no longer has a channel, does nothing
+	BOOST_CHECK_EQUAL(voices.noteOn(14, &stolen), 2);
+	BOOST_CHECK_EQUAL(stolen, -1);
+	BOOST_CHECK_EQUAL(voices.noteOn(15), 0);
+
+	// Extra channels are used before any released ones
+	voices.noteOff(14);
+	voices.setVoiceCount(5);
+	BOOST_CHECK_EQUAL(voices.noteOn(16), 3);
+	BOOST_CHECK_EQUAL(voices.noteOn(17), 4);
+	BOOST_CHECK_EQUAL(voices.noteOn(18), 2);
+
+	// Removed channels forget their notes
+	voices.setVoiceCount(2);
+	BOOST_CHECK_EQUAL(voices.find(16), -1);
+	BOOST_CHECK_EQUAL(voices.find(15), 0);
+	BOOST_CHECK_EQUAL(voices.find(13), 1);
+}
+
+BOOST_AUTO_TEST_CASE(midi_voice_stealing)
+{
+	BOOST_TEST_MESSAGE("Testing MIDI notes take over channels when all are busy");
+
+	auto music = std::make_shared<gm::Music>();
+	music->patches = std::make_shared<gm::PatchBank>();
+	auto patchMIDI = std::make_shared<gm::MIDIPatch>();
+	patchMIDI->midiPatch = 0;
+	patchMIDI->percussion = false;
+	music->patches->push_back(patchMIDI);
+	const unsigned int numTracks = 12;
+	for (unsigned int i = 0; i < numTracks; i++) {
+		gm::TrackInfo ti;
+		ti.channelType = gm::TrackInfo::ChannelType::MIDI;
+		ti.channelIndex = i;
+		music->trackInfo.push_back(ti);
+	}
+
+	auto bankMIDI = std::make_shared<gm::PatchBank>();
+	auto patch = std::make_shared<gm::OPLPatch>();
+	patch->rhythm = gm::OPLPatch::Rhythm::Melodic;
+	bankMIDI->push_back(patch);
+
+	OPLBatchRecorder rec;
+	gm::EventConverter_OPL conv(&rec, music, gm::OPL_FNUM_DEFAULT,
+		gm::OPLWriteFlags::Default);
+	conv.setBankMIDI(bankMIDI);
+
+	// Start more notes than there are OPL2 channels, without stopping any
+	gm::NoteOnEvent noteOn;
+	noteOn.instrument = 0;
+	noteOn.milliHertz = 440000;
+	noteOn.velocity = gm::DefaultVelocity;
+	for (unsigned int i = 0; i < numTracks; i++) {
+		conv.handleEvent(1, i, 0, &noteOn);
+	}
+	conv.flush();
+
+	// Every note was played, and only on the first chip
+	unsigned int keyOns = 0;
+	for (auto& p : rec.pairs) {
+		BOOST_REQUIRE_EQUAL(p.chipIndex, 0);
+		if (((p.reg & 0xF0) == 0xB0) && (p.val & OPLBIT_KEYON)) keyOns++;
+	}
+	BOOST_CHECK_EQUAL(keyOns, numTracks);
+
+	// The song's own patch must not have been replaced by the bankMIDI one
+	BOOST_CHECK(music->patches->at(0) == patchMIDI);
+
+	// Stopping a note whose channel was taken over must not stop the new note
+	rec.pairs.clear();
+	gm::NoteOffEvent noteOff;
+	conv.handleEvent(0, 0, 0, &noteOff);
+	conv.flush();
+	BOOST_CHECK(rec.pairs.empty());
+
+	// Stopping the note that took over the channel does
+	conv.handleEvent(0, 9, 0, &noteOff);
+	conv.flush();
+	BOOST_REQUIRE_EQUAL(rec.pairs.size(), 1);
+	BOOST_CHECK_EQUAL(rec.pairs[0].reg, 0xB0);
+	BOOST_CHECK_EQUAL(rec.pairs[0].val & OPLBIT_KEYON, 0);
+}
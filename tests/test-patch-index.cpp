@@ -0,0 +1,146 @@
+/**
+ * @file   test-patch-index.cpp
+ * @brief  Test code for finding duplicate patches.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+
+#include "../src/patch-index.hpp"
+#include "tests.hpp"
+
+using namespace camoto::gamemusic;
+
+static std::shared_ptr<OPLPatch> createPatch(OPLPatch::Rhythm rhythm,
+	unsigned int attack)
+{
+	auto p = std::make_shared<OPLPatch>();
+	p->rhythm = rhythm;
+	p->m.attackRate = attack;
+	p->c.attackRate = attack + 1;
+	p->feedback = 3;
+	return p;
+}
+
+BOOST_AUTO_TEST_SUITE(patch_index)
+
+BOOST_AUTO_TEST_CASE(opl)
+{
+	BOOST_TEST_MESSAGE("Testing lookup of OPL patches");
+
+	PatchBank bank;
+	PatchIndex index;
+
+	auto melodic = createPatch(OPLPatch::Rhythm::Melodic, 2);
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, melodic), 0);
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, createPatch(OPLPatch::Rhythm::Melodic, 4)), 1);
+	BOOST_CHECK_EQUAL(bank.size(), 2);
+
+	// Carrier output level is ignored by operator==, so this is the same patch
+	auto p = createPatch(OPLPatch::Rhythm::Melodic, 2);
+	p->c.outputLevel = 20;
+	BOOST_REQUIRE(*p == *melodic);
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, p), 0);
+
+	// But the modulator output level is not
+	p->m.outputLevel = 20;
+	BOOST_CHECK_EQUAL(index.find(bank, *p), -1);
+
+	// Same settings but a different rhythm type is a different patch
+	auto snare = createPatch(OPLPatch::Rhythm::SnareDrum, 2);
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, snare), 2);
+
+	// The snare only uses the carrier, so the modulator doesn't matter
+	p = createPatch(OPLPatch::Rhythm::SnareDrum, 2);
+	p->m.attackRate = 9;
+	p->m.outputLevel = 10;
+	BOOST_REQUIRE(*p == *snare);
+	BOOST_CHECK_EQUAL(index.find(bank, *p), 2);
+
+	// Patches added to the bank directly are found too
+	auto direct = createPatch(OPLPatch::Rhythm::HiHat, 7);
+	bank.push_back(direct);
+	BOOST_CHECK_EQUAL(index.find(bank, *direct), 3);
+
+	// The first of any duplicates is the one found
+	bank.push_back(createPatch(OPLPatch::Rhythm::Melodic, 2));
+	BOOST_CHECK_EQUAL(index.find(bank, *melodic), 0);
+}
+
+BOOST_AUTO_TEST_CASE(out_of_range)
+{
+	BOOST_TEST_MESSAGE("Testing lookup of OPL patches with invalid values");
+
+	PatchBank bank;
+	PatchIndex index;
+
+	// These only differ in bits that don't fit in the OPL registers
+	auto a = createPatch(OPLPatch::Rhythm::Melodic, 2);
+	auto b = createPatch(OPLPatch::Rhythm::Melodic, 2);
+	b->m.freqMult = 0x10;
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, a), 0);
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, b), 1);
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, b), 1);
+}
+
+BOOST_AUTO_TEST_CASE(midi)
+{
+	BOOST_TEST_MESSAGE("Testing lookup of MIDI patches");
+
+	PatchBank bank;
+	PatchIndex index;
+
+	// Non-MIDI patches are never matched
+	bank.push_back(createPatch(OPLPatch::Rhythm::Melodic, 2));
+
+	auto piano = std::make_shared<MIDIPatch>();
+	piano->midiPatch = 0;
+	piano->percussion = false;
+	auto kick = std::make_shared<MIDIPatch>();
+	kick->midiPatch = 0;
+	kick->percussion = true;
+
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, kick), 1);
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, piano), 2);
+	BOOST_CHECK_EQUAL(index.findOrAdd(bank, std::make_shared<MIDIPatch>(*kick)), 1);
+	BOOST_CHECK_EQUAL(bank.size(), 3);
+
+	// A hit is confirmed against the bank rather than trusted blindly
+	bank[1] = createPatch(OPLPatch::Rhythm::Melodic, 3);
+	BOOST_CHECK_EQUAL(index.find(bank, *kick), -1);
+}
+
+BOOST_AUTO_TEST_CASE(first_patch)
+{
+	BOOST_TEST_MESSAGE("Testing patches before firstPatch are never matched");
+
+	auto kick = std::make_shared<MIDIPatch>();
+	kick->midiPatch = 0;
+	kick->percussion = true;
+
+	PatchBank bank;
+	bank.push_back(kick);
+	bank.push_back(std::make_shared<MIDIPatch>(*kick));
+	PatchIndex index(1);
+	BOOST_CHECK_EQUAL(index.find(bank, *kick), 1);
+
+	// The fallback search must skip the excluded patch too
+	bank[1] = createPatch(OPLPatch::Rhythm::Melodic, 3);
+	BOOST_CHECK_EQUAL(index.find(bank, *kick), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
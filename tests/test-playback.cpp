@@ -0,0 +1,785 @@
+/**
+ * @file   test-playback.cpp
+ * @brief  Test code for the song playback class.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <boost/test/unit_test.hpp>
+
+#include <camoto/gamemusic.hpp>
+#include <camoto/gamemusic/playback.hpp>
+#include <camoto/stream_string.hpp>
+#include "../src/eventhandler-playback-seek.hpp"
+#include "tests.hpp"
+
+using namespace camoto;
+using namespace camoto::gamemusic;
+
+/// Samples in one frame of audio (stereo, 10ms per tick, one frame per tick)
+#define FRAME_LEN (441 * 2)
+
+/// Add an event to the end of a track.
+static void addEvent(Track& track, unsigned long delay,
+	std::shared_ptr<Event> ev)
+{
+	TrackEvent te;
+	te.delay = delay;
+	te.event = ev;
+	track.push_back(te);
+	return;
+}
+
+/// Create a one-track PCM song with a jump back to row 1 on row 3.
+static std::shared_ptr<Music> createSong()
+{
+	auto music = std::make_shared<Music>();
+
+	auto patch = std::make_shared<PCMPatch>();
+	patch->sampleRate = 8000;
+	patch->bitDepth = 8;
+	patch->numChannels = 1;
+	patch->loopStart = 0;
+	patch->loopEnd = 0;
+	patch->defaultVolume = 255;
+	patch->data.resize(4000);
+	for (unsigned int i = 0; i < patch->data.size(); i++) {
+		patch->data[i] = (i * 7) & 0xFF;
+	}
+	music->patches = std::make_shared<PatchBank>();
+	music->patches->push_back(patch);
+
+	music->initialTempo.msPerTick(10);
+	music->initialTempo.framesPerTick = 1;
+	music->ticksPerTrack = 8;
+	music->loopDest = -1;
+	music->patternOrder.push_back(0);
+
+	TrackInfo ti;
+	ti.channelType = TrackInfo::ChannelType::PCM;
+	ti.channelIndex = 0;
+	music->trackInfo.push_back(ti);
+
+	music->patterns.emplace_back();
+	auto& pattern = music->patterns.back();
+	pattern.emplace_back();
+	auto& track = pattern.back();
+
+	auto noteOn = std::make_shared<NoteOnEvent>();
+	noteOn->instrument = 0;
+	noteOn->milliHertz = 261625; // play sample at its native rate
+	noteOn->velocity = DefaultVelocity;
+	addEvent(track, 0, noteOn); // row 0
+	addEvent(track, 2, noteOn); // row 2
+
+	auto jump = std::make_shared<GotoEvent>();
+	jump->type = GotoEvent::Type::CurrentPattern;
+	jump->targetOrder = 0;
+	jump->targetRow = 1;
+	jump->repeat = 0;
+	addEvent(track, 1, jump); // row 3
+
+	addEvent(track, 2, std::make_shared<NoteOffEvent>()); // row 5
+	return music;
+}
+
+/// Create a PCM song with several orders, each playing one note that ends
+/// within the same order.
+static std::shared_ptr<Music> createOrderedSong(unsigned int numOrders)
+{
+	auto music = createSong();
+	music->patterns.clear();
+	for (unsigned int i = 0; i < numOrders; i++) {
+		music->patterns.emplace_back();
+		auto& pattern = music->patterns.back();
+		pattern.emplace_back();
+		auto& track = pattern.back();
+
+		auto noteOn = std::make_shared<NoteOnEvent>();
+		noteOn->instrument = 0;
+		noteOn->milliHertz = 261625 + i * 20000;
+		noteOn->velocity = DefaultVelocity;
+		addEvent(track, 0, noteOn); // row 0
+		addEvent(track, 6, std::make_shared<NoteOffEvent>()); // row 6
+	}
+	music->patternOrder.clear();
+	for (unsigned int i = 0; i < numOrders; i++) {
+		music->patternOrder.push_back(i);
+	}
+	return music;
+}
+
+/// Create a song with one note held from the start to the end of every order.
+/**
+ * @param opl
+ *   true for an OPL note, false for a looping PCM note.
+ */
+static std::shared_ptr<Music> createSustainedSong(unsigned int numOrders,
+	bool opl)
+{
+	auto music = createOrderedSong(numOrders);
+	if (opl) {
+		auto patch = std::make_shared<OPLPatch>();
+		patch->m.attackRate = 15;
+		patch->m.sustainRate = 15;
+		patch->m.enableSustain = true;
+		patch->m.outputLevel = 0x3F;
+		patch->c.attackRate = 15;
+		patch->c.sustainRate = 15;
+		patch->c.enableSustain = true;
+		patch->rhythm = OPLPatch::Rhythm::Melodic;
+		music->patches->at(0) = patch;
+		music->trackInfo[0].channelType = TrackInfo::ChannelType::OPL;
+	} else {
+		auto patch = std::dynamic_pointer_cast<PCMPatch>(music->patches->at(0));
+		patch->loopStart = 1000;
+		patch->loopEnd = 3000;
+	}
+
+	// Only the first order plays anything, and its note is never switched off
+	for (auto& pattern : music->patterns) pattern[0].clear();
+	auto noteOn = std::make_shared<NoteOnEvent>();
+	noteOn->instrument = 0;
+	noteOn->milliHertz = 440000;
+	noteOn->velocity = DefaultVelocity;
+	addEvent(music->patterns[0][0], 0, noteOn);
+	return music;
+}
+
+/// Render the song one frame at a time until it ends.
+static std::vector<std::vector<int16_t> > renderFrames(Playback& playback,
+	std::vector<unsigned long> *rows)
+{
+	std::vector<std::vector<int16_t> > frames;
+	Playback::Position pos;
+	do {
+		frames.emplace_back(FRAME_LEN, 0);
+		playback.mix(frames.back().data(), FRAME_LEN, &pos);
+		if (rows) rows->push_back(pos.row);
+		BOOST_REQUIRE_LT(frames.size(), 100); // song never ended
+	} while (!pos.end);
+	return frames;
+}
+
+BOOST_AUTO_TEST_SUITE(playback)
+
+BOOST_AUTO_TEST_CASE(goto_row)
+{
+	BOOST_TEST_MESSAGE("Testing playback of a jump backwards within a pattern");
+
+	Playback playback(44100, 2, 16);
+	playback.setSong(createSong());
+
+	std::vector<unsigned long> rows;
+	auto frames = renderFrames(playback, &rows);
+
+	// Row that will play next, after each frame
+	std::vector<unsigned long> expected = {1, 2, 3, 1, 2, 3, 4, 5, 6, 7, 0};
+	BOOST_CHECK_EQUAL_COLLECTIONS(rows.begin(), rows.end(),
+		expected.begin(), expected.end());
+
+	// Frames 2 and 5 both play row 2, so the note must have been retriggered
+	BOOST_REQUIRE_EQUAL(frames.size(), expected.size());
+	BOOST_CHECK(frames[2] != frames[3]);
+	BOOST_CHECK(frames[2] == frames[5]);
+}
+
+BOOST_AUTO_TEST_CASE(song_changed)
+{
+	BOOST_TEST_MESSAGE("Testing changes to the song are played after songChanged()");
+
+	auto music = createSong();
+	Playback playback(44100, 2, 16);
+	playback.setSong(music);
+
+	// Replace the jump with an empty event, so the pattern plays straight through
+	auto empty = std::make_shared<ConfigurationEvent>();
+	empty->configType = ConfigurationEvent::Type::EmptyEvent;
+	empty->value = 0;
+	music->patterns[0][0][2].event = empty;
+	playback.songChanged();
+	playback.seekByOrder(0);
+
+	std::vector<unsigned long> rows;
+	renderFrames(playback, &rows);
+	std::vector<unsigned long> expected = {1, 2, 3, 4, 5, 6, 7, 0};
+	BOOST_CHECK_EQUAL_COLLECTIONS(rows.begin(), rows.end(),
+		expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(seek_restart)
+{
+	BOOST_TEST_MESSAGE("Testing playback after seeking back to the start");
+
+	Playback playback(44100, 2, 16);
+	playback.setSong(createSong());
+
+	auto first = renderFrames(playback, NULL);
+	playback.seekByOrder(0);
+	auto second = renderFrames(playback, NULL);
+
+	// Only compare up until the jump, as it has already been used up
+	BOOST_REQUIRE_GE(second.size(), 4);
+	for (unsigned int i = 0; i < 4; i++) {
+		BOOST_CHECK_MESSAGE(first[i] == second[i],
+			"Frame " << i << " differs after seeking to start");
+	}
+}
+
+BOOST_AUTO_TEST_CASE(seek_index)
+{
+	BOOST_TEST_MESSAGE("Testing seeking with an index matches a full search");
+
+	// Slow the song down so the index contains a few checkpoints
+	auto music = createSong();
+	music->initialTempo.msPerTick(250);
+
+	for (unsigned int loops = 1; loops <= 2; loops++) {
+		EventHandler_Playback_Seek indexed(music, loops);
+		indexed.buildIndex();
+
+		EventHandler_Playback_Seek full(music, loops);
+		unsigned long length = full.getTotalLength();
+		BOOST_REQUIRE_EQUAL(indexed.getTotalLength(), length);
+
+		for (unsigned long ms = 0; ms < length + 500; ms += 10) {
+			EventHandler_Playback_Seek seek(music, loops);
+			Tempo tempoFull, tempoIndexed;
+			auto posFull = seek.seekTo(ms, &tempoFull);
+			auto posIndexed = indexed.seekTo(ms, &tempoIndexed);
+			BOOST_TEST_CHECKPOINT("Seeking to " << ms << "ms with loop count "
+				<< loops);
+			BOOST_CHECK_EQUAL(posIndexed.us, posFull.us);
+			BOOST_CHECK_EQUAL(posIndexed.row, posFull.row);
+			BOOST_CHECK_EQUAL(posIndexed.loop, posFull.loop);
+			BOOST_CHECK_EQUAL(posIndexed.orderIndex, posFull.orderIndex);
+			BOOST_CHECK_EQUAL(posIndexed.nextOrderIndex, posFull.nextOrderIndex);
+			BOOST_CHECK(tempoIndexed == tempoFull);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(output_formats)
+{
+	BOOST_TEST_MESSAGE("Testing 16-bit, 32-bit and float output match");
+
+	Playback pb16(44100, 2, 16), pb32(44100, 2, 32), pbFloat(44100, 2, 32);
+	pb16.setSong(createSong());
+	pb32.setSong(createSong());
+	pbFloat.setSong(createSong());
+
+	Playback::Position pos;
+	do {
+		std::vector<int16_t> s16(FRAME_LEN, 0);
+		std::vector<int32_t> s32(FRAME_LEN, 0);
+		std::vector<float> f32(FRAME_LEN, 0.0f);
+		pb16.mix(s16.data(), FRAME_LEN, &pos);
+		pb32.mix(s32.data(), FRAME_LEN, &pos);
+		pbFloat.mix(f32.data(), FRAME_LEN, &pos);
+		for (unsigned int i = 0; i < FRAME_LEN; i++) {
+			BOOST_REQUIRE_EQUAL(s32[i], s16[i] * 65536);
+			BOOST_REQUIRE_EQUAL(f32[i], s16[i] / 32768.0f);
+		}
+	} while (!pos.end);
+
+	BOOST_CHECK_THROW(Playback(44100, 2, 8), format_limitation);
+}
+
+BOOST_AUTO_TEST_CASE(block_timing)
+{
+	BOOST_TEST_MESSAGE("Testing rows without events are mixed in one block");
+
+	// A tick length that isn't a whole number of samples
+	auto music = createOrderedSong(40);
+	music->initialTempo.usPerTick = 5011.3;
+
+	Playback playback(44100, 2, 16);
+	playback.setSong(music);
+
+	std::vector<unsigned long> rows;
+	unsigned long total = 0;
+	Playback::Position pos;
+	do {
+		total += playback.mixFrame(NULL, &pos);
+		rows.push_back(pos.row);
+		BOOST_REQUIRE_LT(rows.size(), 1000); // song never ended
+	} while (!pos.end);
+
+	// Rows 0-5 are one block and rows 6-7 another, in each of the 40 orders
+	BOOST_REQUIRE_EQUAL(rows.size(), 40 * 2);
+	BOOST_CHECK_EQUAL(rows[0], 6);
+	BOOST_CHECK_EQUAL(rows[1], 0);
+
+	// The fractions of a sample must not be lost along the way
+	unsigned long expected = 40 * 8 * 5011.3 * 44100 / US_PER_SEC;
+	long diff = (long)(total / 2) - (long)expected;
+	BOOST_CHECK_LE(std::labs(diff), 1);
+}
+
+BOOST_AUTO_TEST_CASE(spsc_queue)
+{
+	BOOST_TEST_MESSAGE("Testing the lock-free command queue");
+
+	SPSCQueue<unsigned int, 8> queue;
+	BOOST_CHECK(queue.front() == NULL);
+
+	// Fill it a few times over so the indices wrap around
+	unsigned int next = 0, expected = 0;
+	for (unsigned int lap = 0; lap < 5; lap++) {
+		while (queue.push(next)) next++;
+		BOOST_REQUIRE_EQUAL(next - expected, 7); // one slot always left free
+		for (unsigned int i = 0; i < 4 + lap % 2; i++) {
+			auto item = queue.front();
+			BOOST_REQUIRE(item);
+			BOOST_REQUIRE_EQUAL(*item, expected++);
+			queue.pop();
+		}
+	}
+
+	// Now from another thread, checking nothing is lost or reordered
+	SPSCQueue<unsigned int, 16> threaded;
+	const unsigned int count = 200000;
+	std::thread producer([&threaded, count]() {
+		for (unsigned int i = 0; i < count; i++) {
+			while (!threaded.push(i)) std::this_thread::yield();
+		}
+	});
+	unsigned int received = 0;
+	bool inOrder = true;
+	while (received < count) {
+		auto item = threaded.front();
+		if (!item) continue;
+		if (*item != received) inOrder = false;
+		threaded.pop();
+		received++;
+	}
+	producer.join();
+	BOOST_CHECK(inOrder);
+}
+
+BOOST_AUTO_TEST_CASE(queued_commands)
+{
+	BOOST_TEST_MESSAGE("Testing changes queued from another thread");
+
+	auto music = createOrderedSong(4);
+	Playback playback(44100, 2, 16);
+	playback.setSong(music);
+
+	// Changes only apply once a new block starts
+	Playback::Position pos;
+	std::vector<int16_t> audio;
+	playback.mixFrame(&audio, &pos);
+	BOOST_REQUIRE_EQUAL(pos.order, 0);
+	BOOST_REQUIRE(playback.queueSeekByOrder(2));
+	BOOST_CHECK_EQUAL(pos.order, 0);
+	playback.mixFrame(&audio, &pos);
+	BOOST_CHECK_EQUAL(pos.order, 2);
+
+	// A muted track plays nothing, and seeking to the start doesn't unmute it
+	BOOST_REQUIRE(playback.queueTrackMute(0, true));
+	BOOST_REQUIRE(playback.queueSeekByOrder(0));
+	unsigned long nonzero = 0;
+	do {
+		audio.clear();
+		playback.mixFrame(&audio, &pos);
+		for (auto s : audio) if (s) nonzero++;
+	} while (!pos.end);
+	BOOST_CHECK_EQUAL(nonzero, 0);
+
+	// Twice the speed is half the length
+	auto length = [&playback]() {
+		unsigned long total = 0;
+		Playback::Position pos;
+		do {
+			total += playback.mixFrame(NULL, &pos);
+		} while (!pos.end);
+		return total;
+	};
+	BOOST_REQUIRE(playback.queueTrackMute(0, false));
+	BOOST_REQUIRE(playback.queueSeekByOrder(0));
+	unsigned long normal = length();
+	BOOST_REQUIRE(playback.queueTempoScale(2.0));
+	BOOST_REQUIRE(playback.queueSeekByOrder(0));
+	BOOST_CHECK_LE(abs((long)normal / 2 - (long)length()), 2);
+
+	// Swapping the song starts the new one from the beginning
+	BOOST_REQUIRE(playback.queueSong(createOrderedSong(1)));
+	BOOST_REQUIRE(playback.queueLoopCount(2));
+	unsigned int orders = 0;
+	do {
+		playback.mixFrame(NULL, &pos);
+		orders = std::max(orders, pos.order);
+	} while (!pos.end);
+	BOOST_CHECK_EQUAL(orders, 1);
+	BOOST_CHECK_EQUAL(pos.loop, 1);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot)
+{
+	BOOST_TEST_MESSAGE("Testing playback continues from a snapshot");
+
+	auto music = createOrderedSong(4);
+	Playback original(44100, 2, 16);
+	original.setSong(music);
+	original.setLoopCount(2);
+
+	// Play up to the start of the third order, then save the state
+	std::vector<int16_t> audio;
+	Playback::Position pos;
+	do {
+		original.mixFrame(&audio, &pos);
+		BOOST_REQUIRE(!pos.end);
+	} while (pos.order != 2);
+	Playback::Snapshot snapshot;
+	original.saveSnapshot(&snapshot);
+
+	// Continue in a new instance from the snapshot, and in the original
+	Playback restored(44100, 2, 16);
+	restored.setSong(music);
+	restored.setLoopCount(2);
+	restored.restoreSnapshot(snapshot);
+
+	std::vector<int16_t> expected, actual;
+	Playback::Position posRestored;
+	do {
+		original.mixFrame(&expected, &pos);
+		restored.mixFrame(&actual, &posRestored);
+		BOOST_REQUIRE(pos == posRestored);
+		BOOST_REQUIRE_LT(expected.size(), FRAME_LEN * 100); // song never ended
+	} while (!pos.end);
+
+	// The song should have looped once, with the notes in each order the same
+	BOOST_CHECK_EQUAL(pos.loop, 1);
+	BOOST_CHECK(expected == actual);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_playback)
+{
+	BOOST_TEST_MESSAGE("Testing separate Playback instances on separate threads");
+
+	// Boost.Test is not thread-safe, so this avoids renderFrames() and leaves
+	// the checks until the threads have finished
+	auto music = createSong();
+	auto render = [&music]() {
+		Playback playback(44100, 2, 16);
+		playback.setSong(music);
+		std::vector<std::vector<int16_t> > frames;
+		Playback::Position pos;
+		do {
+			frames.emplace_back(FRAME_LEN, 0);
+			playback.mix(frames.back().data(), FRAME_LEN, &pos);
+		} while (!pos.end && (frames.size() < 100));
+		return frames;
+	};
+	auto expected = render();
+
+	const unsigned int count = 8;
+	std::vector<std::vector<std::vector<int16_t> > > actual(count);
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < count; i++) {
+		threads.emplace_back([i, &actual, &render]() {
+			actual[i] = render();
+		});
+	}
+	for (auto& t : threads) t.join();
+
+	for (unsigned int i = 0; i < count; i++) {
+		BOOST_CHECK_MESSAGE(actual[i] == expected,
+			"Song rendered on thread " << i << " differs to a single thread");
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+/// Create an IMF type-0 file playing one OPL note at the given pitch.
+static std::string createIMF(unsigned int fnum)
+{
+	std::string imf;
+	auto add = [&imf](uint8_t reg, uint8_t val, uint16_t delay) {
+		imf += (char)reg;
+		imf += (char)val;
+		imf += (char)(delay & 0xFF);
+		imf += (char)(delay >> 8);
+	};
+	add(0x20, 0x01, 0);
+	add(0x23, 0x01, 0);
+	add(0x40, 0x10, 0);
+	add(0x43, 0x00, 0);
+	add(0x60, 0xF0, 0);
+	add(0x63, 0xF0, 0);
+	add(0xA0, fnum & 0xFF, 0);
+	add(0xB0, 0x30 | ((fnum >> 8) & 0x03), 100);
+	add(0xB0, 0x10, 50);
+	return imf;
+}
+
+BOOST_AUTO_TEST_SUITE(render)
+
+BOOST_AUTO_TEST_CASE(render_wav)
+{
+	BOOST_TEST_MESSAGE("Testing rendering a song to .wav");
+
+	auto music = createSong();
+	stream::string wav;
+	unsigned long ms = renderWAV(wav, music, nullptr, 1, 1);
+
+	// Header fields
+	BOOST_REQUIRE_GT(wav.data.size(), 44);
+	BOOST_CHECK_EQUAL(wav.data.substr(0, 4), "RIFF");
+	BOOST_CHECK_EQUAL(wav.data.substr(8, 8), "WAVEfmt ");
+	BOOST_CHECK_EQUAL(wav.data.substr(36, 4), "data");
+	auto u32 = [&wav](unsigned int offset) {
+		const uint8_t *d = (const uint8_t *)wav.data.data() + offset;
+		return (uint32_t)(d[0] | (d[1] << 8) | (d[2] << 16) | (d[3] << 24));
+	};
+	BOOST_CHECK_EQUAL(u32(4), wav.data.size() - 8);
+	BOOST_CHECK_EQUAL(u32(24), RENDER_SAMPLE_RATE);
+	BOOST_CHECK_EQUAL(u32(40), wav.data.size() - 44);
+
+	// Eight 10ms rows plus one second of extra time, rounded up to a block
+	unsigned long lenData = wav.data.size() - 44;
+	BOOST_CHECK_EQUAL(ms, lenData / 4 * 1000 / RENDER_SAMPLE_RATE);
+	BOOST_CHECK_GE(ms, 1080);
+	BOOST_CHECK_LT(ms, 1120);
+
+	// Looping forever would never finish
+	stream::string wav2;
+	BOOST_CHECK_THROW(renderWAV(wav2, music, nullptr, 0, 0), format_limitation);
+}
+
+BOOST_AUTO_TEST_CASE(render_wav_parallel)
+{
+	BOOST_TEST_MESSAGE("Testing rendering a song to .wav on multiple threads");
+
+	auto music = createOrderedSong(12);
+	stream::string expected;
+	renderWAV(expected, music, nullptr, 2, 0);
+
+	// renderWAV() rounds up to a whole block, so only compare up to the end of
+	// the song.  12 orders, 8 rows each, 10ms per row, looped once.
+	unsigned long lenSong = 2 * 12 * 8 * RENDER_SAMPLE_RATE / 100 * 4;
+	BOOST_REQUIRE_GE(expected.data.size(), 44 + lenSong);
+
+	for (unsigned int threads = 1; threads <= 4; threads++) {
+		BOOST_TEST_CHECKPOINT("Rendering on " << threads << " threads");
+		stream::string actual;
+		unsigned long ms = renderWAVParallel(actual, music, nullptr, 2, 1,
+			threads);
+		BOOST_CHECK_EQUAL(ms, 1920 + 1000);
+		BOOST_REQUIRE_EQUAL(actual.data.size(), 44 + lenSong
+			+ RENDER_SAMPLE_RATE * 4);
+		BOOST_CHECK_EQUAL(actual.data.substr(8, 32), expected.data.substr(8, 32));
+		BOOST_CHECK(actual.data.substr(44, lenSong)
+			== expected.data.substr(44, lenSong));
+	}
+
+	stream::string wav;
+	BOOST_CHECK_THROW(renderWAVParallel(wav, music, nullptr, 0, 0),
+		format_limitation);
+}
+
+BOOST_AUTO_TEST_CASE(render_wav_parallel_sustained)
+{
+	BOOST_TEST_MESSAGE("Testing notes held across the joins of a parallel render");
+
+	// Each order is 80ms, so 3528 stereo samples
+	const unsigned int numOrders = 12;
+	const unsigned long lenOrder = RENDER_SAMPLE_RATE * 8 / 100 * 2;
+	unsigned long lenSong = numOrders * lenOrder;
+
+	// Average loudness of each order
+	auto levels = [lenOrder, numOrders](const std::string& wav) {
+		auto d = (const uint8_t *)wav.data() + 44;
+		std::vector<double> l;
+		for (unsigned int o = 0; o < numOrders; o++) {
+			double sum = 0;
+			for (unsigned long i = o * lenOrder; i < (o + 1) * lenOrder; i++) {
+				sum += std::abs((int16_t)(d[i * 2] | (d[i * 2 + 1] << 8)));
+			}
+			l.push_back(sum / lenOrder);
+		}
+		return l;
+	};
+
+	for (bool opl : {false, true}) {
+		BOOST_TEST_CHECKPOINT("Testing with " << (opl ? "an OPL" : "a PCM")
+			<< " note");
+		auto music = createSustainedSong(numOrders, opl);
+		stream::string expected;
+		renderWAV(expected, music, nullptr, 1, 0);
+		BOOST_REQUIRE_GE(expected.data.size(), 44 + lenSong * 2);
+		auto levelsExpected = levels(expected.data);
+
+		for (unsigned int threads = 2; threads <= 4; threads++) {
+			stream::string actual;
+			renderWAVParallel(actual, music, nullptr, 1, 0, threads, 1);
+			BOOST_REQUIRE_GE(actual.data.size(), 44 + lenSong * 2);
+			if (opl) {
+				// The OPL chips restart their envelopes at each join, so the audio
+				// isn't identical, but the note must not go quiet.
+				auto levelsActual = levels(actual.data);
+				for (unsigned int o = 0; o < numOrders; o++) {
+					BOOST_CHECK_GT(levelsExpected[o], 100);
+					BOOST_CHECK_MESSAGE(
+						std::abs(levelsActual[o] - levelsExpected[o])
+							< levelsExpected[o] / 10,
+						"Order " << o << " on " << threads << " threads has level "
+						<< levelsActual[o] << ", expected " << levelsExpected[o]);
+				}
+			} else {
+				// PCM notes continue from exactly where they were
+				BOOST_CHECK_GT(levelsExpected[numOrders - 1], 100);
+				BOOST_CHECK_MESSAGE(actual.data.substr(44, lenSong * 2)
+					== expected.data.substr(44, lenSong * 2),
+					"Audio on " << threads << " threads differs to a single thread");
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(render_wav_parallel_long_order)
+{
+	BOOST_TEST_MESSAGE("Testing a parallel render of one long order");
+
+	// A single 25 second order, which has to be cut into pieces part way
+	// through to keep the segments short
+	auto music = createSustainedSong(1, false);
+	music->ticksPerTrack = 2500;
+	unsigned long lenSong = 25 * RENDER_SAMPLE_RATE * 4;
+
+	stream::string expected;
+	renderWAV(expected, music, nullptr, 1, 0);
+	BOOST_REQUIRE_GE(expected.data.size(), 44 + lenSong);
+
+	stream::string actual;
+	renderWAVParallel(actual, music, nullptr, 1, 0, 3, 1);
+	BOOST_REQUIRE_EQUAL(actual.data.size(), 44 + lenSong);
+	BOOST_CHECK(actual.data.substr(44, lenSong)
+		== expected.data.substr(44, lenSong));
+}
+
+BOOST_AUTO_TEST_CASE(render_warnings)
+{
+	BOOST_TEST_MESSAGE("Testing warnings are returned from rendering");
+
+	// Every order plays a MIDI note that isn't in the (empty) MIDI bank
+	const unsigned int numOrders = 12;
+	auto music = createOrderedSong(numOrders);
+	auto patch = std::make_shared<MIDIPatch>();
+	patch->midiPatch = 5;
+	patch->percussion = false;
+	music->patches->at(0) = patch;
+	music->trackInfo[0].channelType = TrackInfo::ChannelType::MIDI;
+	auto bankMIDI = std::make_shared<PatchBank>();
+
+	stream::string wav;
+	std::vector<std::string> expected;
+	renderWAV(wav, music, bankMIDI, 1, 0, nullptr, &expected);
+	BOOST_REQUIRE_EQUAL(expected.size(), numOrders);
+	BOOST_CHECK_EQUAL(expected[0],
+		"Dropping MIDI note, no entry in MIDI bank for patch #5");
+
+	// Each warning is reported once, in song order
+	for (unsigned int threads = 1; threads <= 4; threads++) {
+		BOOST_TEST_CHECKPOINT("Rendering on " << threads << " threads");
+		stream::string actual;
+		std::vector<std::string> warnings;
+		renderWAVParallel(actual, music, bankMIDI, 1, 0, threads, 1, &warnings);
+		BOOST_CHECK_EQUAL_COLLECTIONS(warnings.begin(), warnings.end(),
+			expected.begin(), expected.end());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(batch_success)
+{
+	BOOST_TEST_MESSAGE("Testing batch render matches rendering one at a time");
+
+	std::vector<RenderJob> jobs(6);
+	for (unsigned int i = 0; i < jobs.size(); i++) {
+		jobs[i].inputFilename = createString("test-batch-" << i << ".imf");
+		jobs[i].inputType = "imf-idsoftware-type0";
+		jobs[i].outputFilename = createString("test-batch-" << i << ".wav");
+		jobs[i].loopCount = 1;
+		jobs[i].extraTime = 0;
+		std::ofstream imf(jobs[i].inputFilename, std::ios::binary);
+		imf << createIMF(0x150 + i * 0x20);
+	}
+
+	auto results = renderBatch(jobs, 3);
+
+	BOOST_REQUIRE_EQUAL(results.size(), jobs.size());
+	std::vector<std::string> wavs;
+	for (unsigned int i = 0; i < jobs.size(); i++) {
+		BOOST_TEST_CHECKPOINT("Checking job " << i);
+		BOOST_CHECK_MESSAGE(results[i].success, results[i].error);
+
+		std::ifstream in(jobs[i].outputFilename, std::ios::binary);
+		std::string actual((std::istreambuf_iterator<char>(in)),
+			std::istreambuf_iterator<char>());
+
+		stream::string expected;
+		auto music = openMusic(jobs[i].inputFilename, jobs[i].inputType);
+		unsigned long ms = renderWAV(expected, music, nullptr, 1, 0);
+		BOOST_CHECK_EQUAL(results[i].msAudio, ms);
+		BOOST_CHECK(results[i].warnings.empty());
+		BOOST_CHECK(actual == expected.data);
+		wavs.push_back(actual);
+
+		std::remove(jobs[i].inputFilename.c_str());
+		std::remove(jobs[i].outputFilename.c_str());
+	}
+	// Each song has its own pitch, so each job must have written its own file
+	BOOST_REQUIRE_EQUAL(wavs.size(), jobs.size());
+	BOOST_CHECK(wavs[0].size() > 44);
+	BOOST_CHECK(wavs[0] != wavs[1]);
+}
+
+BOOST_AUTO_TEST_CASE(batch_errors)
+{
+	BOOST_TEST_MESSAGE("Testing batch render reports failed jobs");
+
+	std::vector<RenderJob> jobs(5);
+	for (unsigned int i = 0; i < jobs.size(); i++) {
+		jobs[i].inputFilename = createString("/nonexistent/song" << i << ".mid");
+		jobs[i].outputFilename = createString("/nonexistent/song" << i << ".wav");
+		jobs[i].loopCount = 1;
+		jobs[i].extraTime = 0;
+	}
+	// One with an invalid type code too
+	jobs[2].inputType = "invalid-type";
+
+	std::vector<unsigned int> done;
+	auto results = renderBatch(jobs, 3,
+		[&done](unsigned int index, const RenderResult& result) {
+			done.push_back(index);
+		}
+	);
+
+	BOOST_REQUIRE_EQUAL(results.size(), jobs.size());
+	BOOST_REQUIRE_EQUAL(done.size(), jobs.size());
+	std::sort(done.begin(), done.end());
+	for (unsigned int i = 0; i < jobs.size(); i++) {
+		BOOST_CHECK_EQUAL(done[i], i);
+		BOOST_CHECK(!results[i].success);
+		BOOST_CHECK(!results[i].error.empty());
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,381 @@
+/**
+ * @file   test-realtime.cpp
+ * @brief  Make sure playback never allocates memory once a song is loaded.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <new>
+#include <thread>
+#include <stdlib.h>
+#include <boost/test/unit_test.hpp>
+
+#include <camoto/gamemusic.hpp>
+#include <camoto/gamemusic/playback.hpp>
+#include "tests.hpp"
+
+using namespace camoto;
+using namespace camoto::gamemusic;
+
+/// Set to true to count calls to operator new in allocCount.
+/**
+ * This is per thread, so a test can watch the audio thread while another
+ * thread allocates freely.
+ */
+static thread_local bool countAllocs = false;
+
+/// Number of allocations made while countAllocs was true.
+static unsigned long allocCount = 0;
+
+// Replace the global allocation functions for the whole test binary, so that
+// allocations made inside the library are seen as well.
+void *operator new(std::size_t size)
+{
+	if (countAllocs) allocCount++;
+	void *p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](std::size_t size)
+{
+	return ::operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	if (countAllocs) allocCount++;
+	return malloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return ::operator new(size, std::nothrow);
+}
+
+/// Free memory from any of the operator new replacements.
+/**
+ * This is kept out of line, otherwise GCC sees free() being called on the
+ * result of operator new once the operators are inlined, and warns about it.
+ */
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+static void release(void *p) noexcept
+{
+	free(p);
+	return;
+}
+
+void operator delete(void *p) noexcept
+{
+	release(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	release(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	release(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+	release(p);
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept
+{
+	release(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept
+{
+	release(p);
+}
+
+/// Add an event to the end of a track.
+static void addEvent(Track& track, unsigned long delay,
+	std::shared_ptr<Event> ev)
+{
+	TrackEvent te;
+	te.delay = delay;
+	te.event = ev;
+	track.push_back(te);
+	return;
+}
+
+/// Add a note to a track, switching it off again after a few rows.
+static void addNote(Track& track, unsigned long delay, unsigned int instrument,
+	unsigned long length)
+{
+	auto noteOn = std::make_shared<NoteOnEvent>();
+	noteOn->instrument = instrument;
+	noteOn->milliHertz = 440000;
+	noteOn->velocity = 255;
+	addEvent(track, delay, noteOn);
+	addEvent(track, length, std::make_shared<NoteOffEvent>());
+	return;
+}
+
+/// Create a song using every synthesizer, with a tempo change and a jump.
+/**
+ * Track 0 plays OPL, track 1 plays PCM and track 2 plays a MIDI note with a
+ * patch missing from the MIDI bank, so it raises a warning each time.  Row 2
+ * slows the song down enough that one row won't fit in the mix bus, and row 6
+ * jumps back to row 1 once.
+ */
+static std::shared_ptr<Music> createSong()
+{
+	auto music = std::make_shared<Music>();
+	music->patches = std::make_shared<PatchBank>();
+
+	auto opl = std::make_shared<OPLPatch>();
+	opl->m.attackRate = 15;
+	opl->m.sustainRate = 15;
+	opl->c.attackRate = 15;
+	opl->c.sustainRate = 15;
+	opl->c.enableSustain = true;
+	opl->rhythm = OPLPatch::Rhythm::Melodic;
+	music->patches->push_back(opl);
+
+	auto pcm = std::make_shared<PCMPatch>();
+	pcm->sampleRate = 8000;
+	pcm->bitDepth = 8;
+	pcm->numChannels = 1;
+	pcm->defaultVolume = 255;
+	pcm->data.resize(1000);
+	for (unsigned int i = 0; i < pcm->data.size(); i++) {
+		pcm->data[i] = (i * 7) & 0xFF;
+	}
+	pcm->loopStart = 100;
+	pcm->loopEnd = 900;
+	music->patches->push_back(pcm);
+
+	auto midi = std::make_shared<MIDIPatch>();
+	midi->midiPatch = 100;
+	midi->percussion = false;
+	music->patches->push_back(midi);
+
+	music->initialTempo.msPerTick(10);
+	music->initialTempo.framesPerTick = 1;
+	music->ticksPerTrack = 8;
+	music->loopDest = -1;
+	music->patternOrder.push_back(0);
+	music->patternOrder.push_back(0);
+
+	for (auto channelType : {
+		TrackInfo::ChannelType::OPL,
+		TrackInfo::ChannelType::PCM,
+		TrackInfo::ChannelType::MIDI,
+	}) {
+		TrackInfo ti;
+		ti.channelType = channelType;
+		ti.channelIndex = music->trackInfo.size();
+		music->trackInfo.push_back(ti);
+	}
+
+	music->patterns.emplace_back();
+	auto& pattern = music->patterns.back();
+
+	pattern.emplace_back();
+	addNote(pattern.back(), 0, 0, 3);
+	auto tempo = std::make_shared<TempoEvent>();
+	tempo->tempo = music->initialTempo;
+	tempo->tempo.msPerTick(250);
+	addEvent(pattern.back(), 2, tempo);
+	auto jump = std::make_shared<GotoEvent>();
+	jump->type = GotoEvent::Type::CurrentPattern;
+	jump->repeat = 0;
+	jump->targetOrder = 0;
+	jump->targetRow = 1;
+	addEvent(pattern.back(), 4, jump);
+
+	pattern.emplace_back();
+	addNote(pattern.back(), 1, 1, 5);
+
+	pattern.emplace_back();
+	addNote(pattern.back(), 0, 2, 2);
+	return music;
+}
+
+BOOST_AUTO_TEST_SUITE(realtime)
+
+BOOST_AUTO_TEST_CASE(mix_no_alloc)
+{
+	BOOST_TEST_MESSAGE("Testing mix() does not allocate memory");
+
+	auto music = createSong();
+	auto bankMIDI = std::make_shared<PatchBank>();
+	bankMIDI->push_back(music->patches->at(0));
+
+	Playback playback(48000, 2, 16);
+	playback.setBankMIDI(bankMIDI);
+	playback.setSong(music);
+	playback.setLoopCount(2);
+
+	std::vector<int16_t> output(48000 * 2 / 10);
+	Playback::Position pos;
+	unsigned int blocks = 0;
+	unsigned long allocs;
+
+	countAllocs = true;
+	allocCount = 0;
+	do {
+		if (blocks == 3) playback.queueTrackMute(1, true);
+		if (blocks == 4) playback.queueTempoScale(1.5);
+		if (blocks == 8) playback.queueTrackMute(1, false);
+		playback.mix(output.data(), output.size(), &pos);
+		blocks++;
+	} while (!pos.end && (blocks < 1000));
+	countAllocs = false;
+	allocs = allocCount;
+
+	BOOST_REQUIRE(pos.end);
+	BOOST_CHECK_EQUAL(pos.loop, 1);
+	BOOST_CHECK_MESSAGE(allocs == 0, "mix() allocated memory " << allocs
+		<< " times");
+
+	std::string warning;
+	BOOST_REQUIRE(playback.getWarning(&warning));
+	BOOST_CHECK_EQUAL(warning,
+		"Dropping MIDI note, no entry in MIDI bank for patch #100");
+}
+
+BOOST_AUTO_TEST_CASE(mix_no_alloc_after_seek)
+{
+	BOOST_TEST_MESSAGE("Testing mix() does not allocate after seeking by order");
+
+	auto music = createSong();
+	Playback playback(44100, 2, 32);
+	playback.setSong(music);
+
+	std::vector<float> output(1000);
+	Playback::Position pos;
+	unsigned long allocs;
+
+	countAllocs = true;
+	allocCount = 0;
+	playback.mix(output.data(), output.size(), &pos);
+	playback.queueSeekByOrder(1);
+	do {
+		playback.mix(output.data(), output.size(), &pos);
+	} while (!pos.end);
+	countAllocs = false;
+	allocs = allocCount;
+
+	BOOST_CHECK_MESSAGE(allocs == 0, "mix() allocated memory " << allocs
+		<< " times");
+}
+
+BOOST_AUTO_TEST_CASE(queue_invalid_tempo_scale)
+{
+	BOOST_TEST_MESSAGE("Testing an invalid queued tempo scale is skipped");
+
+	auto music = createSong();
+	Playback playback(44100, 2, 16);
+	playback.setSong(music);
+
+	std::vector<int16_t> output(1000);
+	Playback::Position pos;
+
+	// Far too fast to play, so setTempoScale() would throw
+	playback.queueTempoScale(1e9);
+	BOOST_CHECK_NO_THROW(playback.mix(output.data(), output.size(), &pos));
+	BOOST_CHECK_NO_THROW(playback.mix(output.data(), output.size(), &pos));
+
+	std::string warning;
+	BOOST_REQUIRE(playback.getWarning(&warning));
+	BOOST_CHECK_EQUAL(warning, "Ignoring invalid tempo scale 1e+09");
+	BOOST_CHECK(!playback.getWarning(&warning));
+}
+
+BOOST_AUTO_TEST_CASE(queue_from_thread)
+{
+	BOOST_TEST_MESSAGE("Testing a new song and seek queued by another thread "
+		"don't allocate on the audio thread");
+
+	// Longer than the first song with a different starting tempo, so the audio
+	// thread can tell when it has been swapped in
+	auto first = createSong();
+	auto second = createSong();
+	second->initialTempo.msPerTick(20);
+	second->patternOrder.assign(6, 0);
+	second->ticksPerTrack = 16; // room for the jump, which seeking checks
+
+	// Where seeking the second song should end up
+	Playback reference(44100, 2, 16);
+	reference.setSong(second);
+	const unsigned long seekMS = reference.getLength() * 2 / 3;
+	reference.seekByTime(seekMS);
+	Playback::Position seekPos;
+	reference.mixFrame(NULL, &seekPos);
+	BOOST_REQUIRE_GE(seekPos.order, 2);
+
+	Playback playback(44100, 2, 16);
+	playback.setSong(first);
+
+	// 0 = first song, 1 = second song playing, 2 = seek queued
+	std::atomic<int> stage(0);
+	std::atomic<bool> queued(false);
+	std::atomic<bool> done(false);
+	std::thread producer([&]() {
+		queued = playback.queueSong(second);
+		while ((stage != 1) && !done) std::this_thread::yield();
+		queued = queued && playback.queueSeekByTime(seekMS);
+		stage = 2;
+	});
+
+	std::vector<int16_t> output(256);
+	Playback::Position pos;
+	unsigned int blocks = 0;
+	unsigned int orderAfterSeek = 0;
+	unsigned long allocs;
+
+	countAllocs = true;
+	allocCount = 0;
+	do {
+		playback.mix(output.data(), output.size(), &pos);
+		blocks++;
+		if ((stage == 0) && (pos.tempo.usPerTick == 20000)) {
+			BOOST_REQUIRE_EQUAL(pos.order, 0);
+			// Hold the song here until the seek is queued
+			stage = 1;
+			while (stage != 2) std::this_thread::yield();
+		} else if ((stage == 2) && (orderAfterSeek == 0)) {
+			orderAfterSeek = pos.order;
+		}
+		// The first song may finish before the second one is ready
+	} while (((stage != 2) || !pos.end) && (blocks < 100000));
+	countAllocs = false;
+	allocs = allocCount;
+	done = true;
+	producer.join();
+
+	BOOST_REQUIRE(queued);
+	BOOST_REQUIRE_EQUAL(stage, 2);
+	BOOST_REQUIRE(pos.end);
+	// Playing on from order 0 would have reached order 1 first
+	BOOST_CHECK_EQUAL(orderAfterSeek, seekPos.order);
+	BOOST_CHECK_MESSAGE(allocs == 0, "mix() allocated memory " << allocs
+		<< " times");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
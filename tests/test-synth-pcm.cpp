@@ -0,0 +1,390 @@
+/**
+ * @file   test-synth-pcm.cpp
+ * @brief  Test code for the PCM sample synthesiser.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/test/unit_test.hpp>
+
+#include <camoto/gamemusic/synth-pcm.hpp>
+#include "tests.hpp"
+
+using namespace camoto::gamemusic;
+
+/// Middle-C frequency in milliHertz, which plays a sample at its own rate
+#define FREQ_MIDDLE_C 261625
+
+class test_synth_pcm: public SynthPCMCallback
+{
+	public:
+		test_synth_pcm()
+			:	synth(8000, this)
+		{
+			TrackInfo ti;
+			ti.channelType = TrackInfo::ChannelType::PCM;
+			ti.channelIndex = 0;
+			this->trackInfo.push_back(ti);
+
+			this->patch = std::make_shared<PCMPatch>();
+			this->patch->sampleRate = 8000;
+			this->patch->bitDepth = 16;
+			this->patch->numChannels = 1;
+			this->patch->defaultVolume = 255;
+		}
+
+		virtual void tempoChange(const Tempo& tempo)
+		{
+		}
+
+		/// Set the patch's data to the given 16-bit samples.
+		void setData(const std::vector<int16_t>& samples)
+		{
+			this->patch->data.resize(samples.size() * 2);
+			memcpy(this->patch->data.data(), samples.data(),
+				this->patch->data.size());
+			return;
+		}
+
+		/// Play the patch and return the left channel of the first len frames.
+		std::vector<int32_t> play(SynthPCM::Interpolation mode,
+			unsigned long milliHertz, unsigned long len)
+		{
+			auto bank = std::make_shared<PatchBank>();
+			bank->push_back(this->patch);
+			this->synth.reset(this->trackInfo, bank);
+			this->synth.setInterpolation(mode);
+
+			NoteOnEvent ev;
+			ev.instrument = 0;
+			ev.milliHertz = milliHertz;
+			ev.velocity = -1;
+			this->synth.handleEvent(0, 0, 0, &ev);
+
+			// Mix in small blocks to exercise the carry-over between calls
+			std::vector<int32_t> out(len * 2, 0);
+			for (unsigned long i = 0; i < len; i += 7) {
+				unsigned long n = std::min(7UL, len - i);
+				this->synth.mix(out.data() + i * 2, n * 2);
+			}
+			std::vector<int32_t> left;
+			for (unsigned long i = 0; i < len; i++) {
+				BOOST_REQUIRE_EQUAL(out[i * 2], out[i * 2 + 1]);
+				left.push_back(out[i * 2]);
+			}
+			return left;
+		}
+
+		SynthPCM synth;
+		std::vector<TrackInfo> trackInfo;
+		std::shared_ptr<PCMPatch> patch;
+};
+
+BOOST_FIXTURE_TEST_SUITE(synth_pcm, test_synth_pcm)
+
+BOOST_AUTO_TEST_CASE(same_rate)
+{
+	BOOST_TEST_MESSAGE("Testing PCM playback at the sample's own rate");
+
+	std::vector<int16_t> samples;
+	for (int i = 0; i < 50; i++) samples.push_back(i * 400 - 10000);
+	this->setData(samples);
+
+	for (auto mode : {
+		SynthPCM::Interpolation::Nearest,
+		SynthPCM::Interpolation::Linear,
+		SynthPCM::Interpolation::Cubic,
+		SynthPCM::Interpolation::Sinc,
+	}) {
+		BOOST_TEST_CHECKPOINT("Interpolation mode " << (int)mode);
+		auto out = this->play(mode, FREQ_MIDDLE_C, 60);
+		// Every filter passes the input samples straight through when there is
+		// no fractional part to the position
+		for (unsigned int i = 0; i < samples.size(); i++) {
+			BOOST_REQUIRE_EQUAL(out[i], samples[i] / 4);
+		}
+		// Nothing should be read past the end of the data
+		for (unsigned int i = samples.size(); i < out.size(); i++) {
+			BOOST_REQUIRE_EQUAL(out[i], 0);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(interpolate_half_rate)
+{
+	BOOST_TEST_MESSAGE("Testing PCM playback an octave lower");
+
+	std::vector<int16_t> samples = {0, 4000, 8000, 4000, 0, -4000, -8000, -4000};
+	this->setData(samples);
+	this->patch->sampleRate = 4000;
+	auto out = this->play(SynthPCM::Interpolation::Linear, FREQ_MIDDLE_C, 16);
+	for (unsigned int i = 0; i < 15; i++) {
+		// Odd samples fall halfway between two input samples
+		int expected = (samples[i / 2] + samples[(i + 1) / 2]) / 2;
+		BOOST_CHECK_EQUAL(out[i], expected / 4);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(loop)
+{
+	BOOST_TEST_MESSAGE("Testing looped PCM playback");
+
+	std::vector<int16_t> samples;
+	for (int i = 0; i < 20; i++) samples.push_back(i * 100);
+	this->setData(samples);
+	this->patch->loopStart = 5;
+	this->patch->loopEnd = 15;
+
+	auto out = this->play(SynthPCM::Interpolation::Nearest, FREQ_MIDDLE_C, 200);
+	for (unsigned int i = 0; i < out.size(); i++) {
+		unsigned int expected = (i < 15) ? i : 5 + (i - 15) % 10;
+		BOOST_REQUIRE_EQUAL(out[i], samples[expected] / 4);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(loop_sinc_dc)
+{
+	BOOST_TEST_MESSAGE("Testing sinc filter across a loop point");
+
+	// A constant level should stay constant at any pitch, including around the
+	// loop point where the filter reads from both ends of the loop
+	this->setData(std::vector<int16_t>(32, 8000));
+	this->patch->loopStart = 0;
+	this->patch->loopEnd = 32;
+	auto out = this->play(SynthPCM::Interpolation::Sinc, FREQ_MIDDLE_C * 3 / 7,
+		500);
+	for (unsigned int i = 8; i < out.size(); i++) {
+		BOOST_REQUIRE_MESSAGE(abs(out[i] - 2000) <= 2, "Sample " << i
+			<< " was " << out[i] << ", expected 2000");
+	}
+}
+
+BOOST_AUTO_TEST_CASE(decoded_8bit)
+{
+	BOOST_TEST_MESSAGE("Testing decoding of 8-bit PCM data with a loop");
+
+	this->patch->bitDepth = 8;
+	this->patch->data = {0x80, 0x00, 0xFF, 0x40, 0xC0, 0x90};
+	this->patch->loopStart = 2;
+	this->patch->loopEnd = 5;
+
+	auto pcm = this->patch->getDecoded();
+	BOOST_REQUIRE_EQUAL(pcm->end, 5);
+	BOOST_REQUIRE_EQUAL(pcm->loopStart, 2);
+	BOOST_REQUIRE_EQUAL(pcm->loopLen, 3);
+
+	// Silence before the first pass, and the loop start after it
+	std::vector<int16_t> first(pcm->first - PCMDecoded::GUARD,
+		pcm->first + pcm->end + PCMDecoded::GUARD);
+	std::vector<int16_t> expFirst = {
+		0, 0, 0, 0,
+		128, -32768, 32767, -16320, 16576,
+		32767, -16320, 16576, 32767,
+	};
+	BOOST_CHECK_EQUAL_COLLECTIONS(first.begin(), first.end(),
+		expFirst.begin(), expFirst.end());
+
+	// The loop wrapped around on both sides
+	std::vector<int16_t> loop(pcm->loop - PCMDecoded::GUARD,
+		pcm->loop + pcm->loopLen + PCMDecoded::GUARD);
+	std::vector<int16_t> expLoop = {
+		16576, 32767, -16320, 16576,
+		32767, -16320, 16576,
+		32767, -16320, 16576, 32767,
+	};
+	BOOST_CHECK_EQUAL_COLLECTIONS(loop.begin(), loop.end(),
+		expLoop.begin(), expLoop.end());
+}
+
+BOOST_AUTO_TEST_CASE(decoded_shared)
+{
+	BOOST_TEST_MESSAGE("Testing decoded PCM data is shared and kept up to date");
+
+	this->setData({1, 2, 3, 4});
+	auto pcm = this->patch->getDecoded();
+	BOOST_CHECK_EQUAL(this->patch->getDecoded(), pcm);
+
+	// Another synth playing the same patch uses the same data
+	SynthPCM other(8000, this);
+	auto bank = std::make_shared<PatchBank>();
+	bank->push_back(this->patch);
+	other.reset(this->trackInfo, bank);
+	NoteOnEvent ev;
+	ev.instrument = 0;
+	ev.milliHertz = FREQ_MIDDLE_C;
+	ev.velocity = -1;
+	other.handleEvent(0, 0, 0, &ev);
+	BOOST_CHECK_EQUAL(this->patch->getDecoded(), pcm);
+
+	// Changing the loop decodes it again
+	this->patch->loopStart = 1;
+	this->patch->loopEnd = 3;
+	auto looped = this->patch->getDecoded();
+	BOOST_CHECK_NE(looped, pcm);
+	BOOST_CHECK_EQUAL(looped->loopLen, 2);
+
+	// Changing the data in place needs to be flagged
+	this->patch->data[2] = 10;
+	BOOST_CHECK_EQUAL(this->patch->getDecoded(), looped);
+	this->patch->clearDecoded();
+	BOOST_CHECK_EQUAL(this->patch->getDecoded()->first[1], 10);
+}
+
+BOOST_AUTO_TEST_CASE(loop_sinc_offset)
+{
+	BOOST_TEST_MESSAGE("Testing sinc filter across a loop that doesn't start at 0");
+
+	// An attack followed by a constant looped level, which should stay
+	// constant once the attack has passed
+	std::vector<int16_t> samples(40, 8000);
+	for (unsigned int i = 0; i < 8; i++) samples[i] = -20000;
+	this->setData(samples);
+	this->patch->loopStart = 16;
+	this->patch->loopEnd = 40;
+	auto out = this->play(SynthPCM::Interpolation::Sinc, FREQ_MIDDLE_C * 5 / 3,
+		500);
+	for (unsigned int i = 10; i < out.size(); i++) {
+		BOOST_REQUIRE_MESSAGE(abs(out[i] - 2000) <= 2, "Sample " << i
+			<< " was " << out[i] << ", expected 2000");
+	}
+}
+
+BOOST_AUTO_TEST_CASE(voice_pool)
+{
+	BOOST_TEST_MESSAGE("Testing notes on several tracks are tracked separately");
+
+	this->setData(std::vector<int16_t>(100, 4000));
+	this->patch->loopStart = 0;
+	this->patch->loopEnd = 100;
+	this->trackInfo.resize(3, this->trackInfo[0]);
+	auto bank = std::make_shared<PatchBank>();
+	bank->push_back(this->patch);
+	this->synth.reset(this->trackInfo, bank);
+
+	auto level = [this]() {
+		std::vector<int32_t> out(2, 0);
+		this->synth.mix(out.data(), out.size());
+		return out[0];
+	};
+
+	// Different volume on each track so they can be told apart
+	NoteOnEvent on;
+	on.instrument = 0;
+	on.milliHertz = FREQ_MIDDLE_C;
+	for (unsigned int t = 0; t < 3; t++) {
+		on.velocity = 255 >> (t * 2); // 255, 63, 15
+		this->synth.handleEvent(0, t, 0, &on);
+	}
+	BOOST_CHECK_EQUAL(level(), 1000 + 247 + 58);
+
+	// Retriggering a track replaces its note rather than adding another
+	on.velocity = 255;
+	this->synth.handleEvent(0, 1, 0, &on);
+	BOOST_CHECK_EQUAL(level(), 1000 + 1000 + 58);
+
+	// Stopping the first note moves another into its place, which must still
+	// be found by later events on its own track
+	NoteOffEvent off;
+	this->synth.handleEvent(0, 0, 0, &off);
+	this->synth.handleEvent(0, 0, 0, &off);
+	BOOST_CHECK_EQUAL(level(), 1000 + 58);
+
+	EffectEvent vol;
+	vol.type = EffectEvent::Type::Volume;
+	vol.data = 0;
+	this->synth.handleEvent(0, 2, 0, &vol);
+	BOOST_CHECK_EQUAL(level(), 1000);
+
+	this->synth.handleEvent(0, 1, 0, &off);
+	BOOST_CHECK_EQUAL(level(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(late_patch)
+{
+	BOOST_TEST_MESSAGE("Testing a patch added after reset() is only played once decoded");
+
+	this->setData(std::vector<int16_t>(100, 4000));
+	this->patch->loopStart = 0;
+	this->patch->loopEnd = 100;
+	auto bank = std::make_shared<PatchBank>();
+	this->synth.reset(this->trackInfo, bank);
+	bank->push_back(this->patch);
+
+	NoteOnEvent on;
+	on.instrument = 0;
+	on.milliHertz = FREQ_MIDDLE_C;
+	on.velocity = -1;
+
+	// Not decoded yet, so the note is skipped rather than decoded while mixing
+	this->synth.handleEvent(0, 0, 0, &on);
+	std::vector<int32_t> out(2, 0);
+	this->synth.mix(out.data(), out.size());
+	BOOST_CHECK_EQUAL(out[0], 0);
+
+	this->synth.updatePatches();
+	this->synth.handleEvent(0, 0, 0, &on);
+	this->synth.mix(out.data(), out.size());
+	BOOST_CHECK_EQUAL(out[0], 1000);
+}
+
+BOOST_AUTO_TEST_CASE(shared_data)
+{
+	BOOST_TEST_MESSAGE("Testing sample data is shared until it is changed");
+
+	// Read-only memory, with a deleter to see when it is no longer used
+	static const uint8_t bytes[] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+	bool freed = false;
+	this->patch->data = PCMData(std::shared_ptr<const uint8_t>(bytes,
+		[&freed](const uint8_t *) { freed = true; }), 1, 4);
+	this->patch->bitDepth = 8;
+	const PCMData& data = this->patch->data;
+	BOOST_REQUIRE_EQUAL(data.size(), 4);
+	BOOST_CHECK(data.data() == bytes + 1);
+
+	// Copies refer to the same bytes
+	PCMPatch copy(*this->patch);
+	const PCMData& copyData = copy.data;
+	BOOST_CHECK(copyData.data() == bytes + 1);
+	BOOST_CHECK_EQUAL(copy.getDecoded()->first[0], 0x2020 - 32768);
+
+	// Changing a copy gives it its own bytes, without touching the original
+	copy.data[0] = 0x99;
+	BOOST_CHECK(copyData.data() != bytes + 1);
+	BOOST_CHECK_EQUAL(copyData[0], 0x99);
+	BOOST_CHECK_EQUAL(copyData[3], 0x50);
+	BOOST_CHECK_EQUAL(bytes[1], 0x20);
+	BOOST_CHECK(data.data() == bytes + 1);
+	BOOST_CHECK_EQUAL(copy.getDecoded()->first[0], 0x9999 - 32768);
+
+	BOOST_CHECK(!freed);
+	this->patch->data.clear();
+	BOOST_CHECK(freed);
+
+	// Slices of one buffer share it, until one of them is changed
+	PCMData all{1, 2, 3, 4, 5, 6};
+	const PCMData& constAll = all;
+	PCMData second = all.slice(2, 4);
+	const PCMData& constSecond = second;
+	BOOST_REQUIRE_EQUAL(second.size(), 4);
+	BOOST_CHECK(constSecond.data() == constAll.data() + 2);
+	second[0] = 9;
+	BOOST_CHECK(constSecond.data() != constAll.data() + 2);
+	BOOST_CHECK_EQUAL(constSecond[0], 9);
+	BOOST_CHECK_EQUAL(constSecond[1], 4);
+	BOOST_CHECK_EQUAL(constAll[2], 3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
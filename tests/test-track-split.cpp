@@ -18,6 +18,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <tuple>
 #include <boost/test/unit_test.hpp>
 
 #include <camoto/stream_string.hpp>
@@ -366,4 +367,124 @@ BOOST_AUTO_TEST_CASE(split)
 	BOOST_CHECK_EQUAL(music->trackInfo[5].channelIndex, 2);
 }
 
+BOOST_AUTO_TEST_CASE(split_multipattern)
+{
+	BOOST_TEST_MESSAGE("Testing track split across multiple patterns");
+
+	auto music = std::make_unique<Music>();
+	music->patternOrder.push_back(0);
+	music->patternOrder.push_back(1);
+
+	TrackInfo ti;
+	ti.channelType = TrackInfo::ChannelType::MIDI;
+	ti.channelIndex = 0;
+	music->trackInfo.push_back(ti);
+
+	auto add = [](Track& track, unsigned long delay, std::shared_ptr<Event> ev) {
+		TrackEvent te;
+		te.delay = delay;
+		te.event = ev;
+		track.push_back(te);
+	};
+	auto noteOn = [](unsigned int milliHertz) {
+		auto ev = std::make_shared<NoteOnEvent>();
+		ev->milliHertz = milliHertz;
+		ev->instrument = 0;
+		return ev;
+	};
+	auto noteOff = [](unsigned int milliHertz) {
+		auto ev = std::make_shared<SpecificNoteOffEvent>();
+		ev->milliHertz = milliHertz;
+		return ev;
+	};
+
+	// A chord held across the end of the first pattern
+	music->patterns.emplace_back();
+	music->patterns.back().emplace_back();
+	{
+		auto& track = music->patterns.back().back();
+		add(track, 0, noteOn(440000));
+		add(track, 0, noteOn(550000));
+	}
+
+	// Released in the second pattern, followed by a bigger chord
+	music->patterns.emplace_back();
+	music->patterns.back().emplace_back();
+	{
+		auto& track = music->patterns.back().back();
+		add(track, 5, noteOff(550000));
+		add(track, 0, noteOff(440000));
+		auto vol = std::make_shared<PolyphonicEffectEvent>();
+		vol->type = (EffectEvent::Type)PolyphonicEffectEvent::Type::VolumeChannel;
+		vol->data = 100;
+		add(track, 5, vol);
+		add(track, 0, noteOn(660000));
+		add(track, 0, noteOn(770000));
+		add(track, 0, noteOn(880000));
+	}
+
+	splitPolyphonicTracks(*music);
+
+	BOOST_REQUIRE_EQUAL(music->trackInfo.size(), 3);
+	BOOST_REQUIRE_EQUAL(music->patterns[0].size(), 3);
+	BOOST_REQUIRE_EQUAL(music->patterns[1].size(), 3);
+
+	// Check a track against a list of (delay, event type, frequency or data)
+	auto check = [](const Track& track,
+		std::vector<std::tuple<unsigned long, char, unsigned int> > expected)
+	{
+		BOOST_REQUIRE_EQUAL(track.size(), expected.size());
+		for (unsigned int i = 0; i < track.size(); i++) {
+			BOOST_TEST_CHECKPOINT("Event " << i);
+			BOOST_CHECK_EQUAL(track[i].delay, std::get<0>(expected[i]));
+			auto ev = track[i].event.get();
+			switch (std::get<1>(expected[i])) {
+				case 'n': {
+					auto evNoteOn = dynamic_cast<const NoteOnEvent *>(ev);
+					BOOST_REQUIRE(evNoteOn);
+					BOOST_CHECK_EQUAL(evNoteOn->milliHertz, std::get<2>(expected[i]));
+					break;
+				}
+				case 'o':
+					BOOST_CHECK(dynamic_cast<const NoteOffEvent *>(ev));
+					BOOST_CHECK(!dynamic_cast<const SpecificNoteOffEvent *>(ev));
+					break;
+				case 'v': {
+					auto evEffect = dynamic_cast<const EffectEvent *>(ev);
+					BOOST_REQUIRE(evEffect);
+					BOOST_CHECK(!dynamic_cast<const PolyphonicEffectEvent *>(ev));
+					BOOST_CHECK_EQUAL((int)evEffect->type, (int)EffectEvent::Type::Volume);
+					BOOST_CHECK_EQUAL(evEffect->data, std::get<2>(expected[i]));
+					break;
+				}
+			}
+		}
+	};
+
+	check(music->patterns[0][0], {
+		std::make_tuple(0, 'n', 440000),
+	});
+	check(music->patterns[0][1], {
+		std::make_tuple(0, 'n', 550000),
+	});
+	// Third voice isn't needed until the next pattern
+	check(music->patterns[0][2], {});
+
+	check(music->patterns[1][0], {
+		std::make_tuple(5, 'o', 0),
+		std::make_tuple(5, 'v', 100),
+		std::make_tuple(0, 'n', 660000),
+	});
+	check(music->patterns[1][1], {
+		std::make_tuple(5, 'o', 0),
+		std::make_tuple(5, 'v', 100),
+		std::make_tuple(0, 'n', 770000),
+	});
+	// New voice picks up the earlier volume change
+	check(music->patterns[1][2], {
+		std::make_tuple(10, 'v', 100),
+		std::make_tuple(0, 'n', 880000),
+	});
+}
+
 BOOST_AUTO_TEST_SUITE_END()
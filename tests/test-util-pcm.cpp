@@ -0,0 +1,72 @@
+/**
+ * @file   test-util-pcm.cpp
+ * @brief  Test code for PCM utility functions.
+ *
+ * Copyright (C) 2010-2015 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include <camoto/gamemusic/util-pcm.hpp>
+#include "tests.hpp"
+
+using namespace camoto::gamemusic;
+
+BOOST_AUTO_TEST_SUITE(util_pcm)
+
+BOOST_AUTO_TEST_CASE(mix_block)
+{
+	BOOST_TEST_MESSAGE("Testing block mixing matches pcm_mix_s16()");
+
+	// Every possible sample value, mixed with a spread of values including the
+	// extremes either side of zero
+	std::vector<int16_t> src(65536);
+	for (unsigned int i = 0; i < src.size(); i++) src[i] = i - 32768;
+
+	std::vector<int> others = {-32768, -32767, -1, 0, 1, 32766, 32767};
+	for (int b = -32768; b < 32768; b += 255) others.push_back(b);
+
+	for (auto b : others) {
+		std::vector<int16_t> dest(src.size(), b);
+		pcm_mix_s16_block(dest.data(), src.data(), dest.size());
+		for (unsigned int i = 0; i < src.size(); i++) {
+			if (dest[i] != pcm_mix_s16(b, src[i])) {
+				BOOST_REQUIRE_MESSAGE(false, "Mixing " << b << " with " << src[i]
+					<< " gave " << dest[i] << ", expected " << pcm_mix_s16(b, src[i]));
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(mix_block_length)
+{
+	BOOST_TEST_MESSAGE("Testing block mixing of partial blocks");
+
+	// Make sure lengths that aren't a multiple of the vector size are handled,
+	// and that nothing past the end is touched
+	for (unsigned int len = 0; len < 40; len++) {
+		std::vector<int16_t> dest(len + 1, -20000), src(len + 1, 30000);
+		dest[len] = 1234;
+		pcm_mix_s16_block(dest.data(), src.data(), len);
+		for (unsigned int i = 0; i < len; i++) {
+			BOOST_REQUIRE_EQUAL(dest[i], pcm_mix_s16(-20000, 30000));
+		}
+		BOOST_REQUIRE_EQUAL(dest[len], 1234);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()